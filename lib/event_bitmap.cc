@@ -0,0 +1,44 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/event_bitmap.h"
+
+#include <string.h>
+
+#include "rlz/lib/lib_values.h"
+
+namespace rlz_lib {
+
+COMPILE_ASSERT(LAST_ACCESS_POINT <= EventBitmap::kAccessPointCapacity,
+               too_many_access_points_for_event_bitmap);
+COMPILE_ASSERT(LAST_EVENT <= EventBitmap::kEventCapacity,
+               too_many_events_for_event_bitmap);
+
+void EventBitmap::Clear() {
+  memset(words, 0, sizeof(words));
+}
+
+bool EventBitmap::IsEmpty() const {
+  for (int i = 0; i < kWordCount; ++i) {
+    if (words[i])
+      return false;
+  }
+  return true;
+}
+
+void EventBitmap::AppendEventRlzs(std::vector<std::string>* events) const {
+  for (int i = 0; i < kWordCount; ++i) {
+    uint64 word = words[i];
+    for (int bit = i * 64; word; ++bit, word >>= 1) {
+      if (!(word & 1))
+        continue;
+      AccessPoint point = static_cast<AccessPoint>(bit / kEventCapacity);
+      Event event = static_cast<Event>(bit % kEventCapacity);
+      if (IsValidEvent(point, event))
+        events->push_back(GetEventRlz(point, event));
+    }
+  }
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,61 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A fixed-size set of product or stateful events.
+
+#ifndef RLZ_LIB_EVENT_BITMAP_H_
+#define RLZ_LIB_EVENT_BITMAP_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "rlz/lib/rlz_enums.h"
+
+namespace rlz_lib {
+
+// The events of one product, with one bit per (AccessPoint, Event) pair.
+// Adding, clearing and looking up an event are bit operations, without
+// building the event's string form. The struct is POD with a fixed size, so
+// that stores can keep it in files as is. Call Clear() before first use.
+struct EventBitmap {
+  // These leave room for new enum values, so that adding one doesn't change
+  // the size of the bitmap.
+  static const int kAccessPointCapacity = 128;
+  static const int kEventCapacity = 8;
+  static const int kWordCount = kAccessPointCapacity * kEventCapacity / 64;
+
+  // Returns true if |point| and |event| name an event that can be recorded.
+  static bool IsValidEvent(AccessPoint point, Event event) {
+    return point > NO_ACCESS_POINT && point < LAST_ACCESS_POINT &&
+           event > INVALID_EVENT && event < LAST_EVENT;
+  }
+
+  void Clear();
+  bool IsEmpty() const;
+
+  // |point| and |event| must be valid, see IsValidEvent().
+  bool Contains(AccessPoint point, Event event) const {
+    int bit = point * kEventCapacity + event;
+    return (words[bit / 64] & (GG_UINT64_C(1) << (bit % 64))) != 0;
+  }
+  void Add(AccessPoint point, Event event) {
+    int bit = point * kEventCapacity + event;
+    words[bit / 64] |= GG_UINT64_C(1) << (bit % 64);
+  }
+  void Remove(AccessPoint point, Event event) {
+    int bit = point * kEventCapacity + event;
+    words[bit / 64] &= ~(GG_UINT64_C(1) << (bit % 64));
+  }
+
+  // Appends the string form of all events in the set to |events|, ordered by
+  // access point and then by event.
+  void AppendEventRlzs(std::vector<std::string>* events) const;
+
+  uint64 words[kWordCount];
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_EVENT_BITMAP_H_
@@ -0,0 +1,63 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/event_bitmap.h"
+
+#include <string>
+#include <vector>
+
+#include "testing/gtest/include/gtest/gtest.h"
+
+TEST(EventBitmapUnittest, AddAndRemove) {
+  rlz_lib::EventBitmap bitmap;
+  bitmap.Clear();
+  EXPECT_TRUE(bitmap.IsEmpty());
+  EXPECT_FALSE(bitmap.Contains(rlz_lib::IE_DEFAULT_SEARCH,
+                               rlz_lib::SET_TO_GOOGLE));
+
+  bitmap.Add(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE);
+  EXPECT_FALSE(bitmap.IsEmpty());
+  EXPECT_TRUE(bitmap.Contains(rlz_lib::IE_DEFAULT_SEARCH,
+                              rlz_lib::SET_TO_GOOGLE));
+  EXPECT_FALSE(bitmap.Contains(rlz_lib::IE_DEFAULT_SEARCH,
+                               rlz_lib::INSTALL));
+  EXPECT_FALSE(bitmap.Contains(rlz_lib::IE_HOME_PAGE,
+                               rlz_lib::SET_TO_GOOGLE));
+
+  bitmap.Remove(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE);
+  EXPECT_TRUE(bitmap.IsEmpty());
+}
+
+TEST(EventBitmapUnittest, AppendEventRlzs) {
+  rlz_lib::EventBitmap bitmap;
+  bitmap.Clear();
+  bitmap.Add(rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL);
+  bitmap.Add(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE);
+  bitmap.Add(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::INSTALL);
+  bitmap.Add(static_cast<rlz_lib::AccessPoint>(rlz_lib::LAST_ACCESS_POINT - 1),
+             static_cast<rlz_lib::Event>(rlz_lib::LAST_EVENT - 1));
+
+  std::vector<std::string> events;
+  events.push_back("existing");
+  bitmap.AppendEventRlzs(&events);
+  ASSERT_EQ(5u, events.size());
+  EXPECT_EQ("existing", events[0]);
+  EXPECT_EQ("I7I", events[1]);
+  EXPECT_EQ("I7S", events[2]);
+  EXPECT_EQ("W1I", events[3]);
+  EXPECT_EQ("UDA", events[4]);
+}
+
+TEST(EventBitmapUnittest, IsValidEvent) {
+  EXPECT_TRUE(rlz_lib::EventBitmap::IsValidEvent(rlz_lib::IE_DEFAULT_SEARCH,
+                                                 rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::EventBitmap::IsValidEvent(rlz_lib::NO_ACCESS_POINT,
+                                                  rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::EventBitmap::IsValidEvent(rlz_lib::LAST_ACCESS_POINT,
+                                                  rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::EventBitmap::IsValidEvent(rlz_lib::IE_DEFAULT_SEARCH,
+                                                  rlz_lib::INVALID_EVENT));
+  EXPECT_FALSE(rlz_lib::EventBitmap::IsValidEvent(rlz_lib::IE_DEFAULT_SEARCH,
+                                                  rlz_lib::LAST_EVENT));
+}
@@ -13,8 +13,10 @@
 #include "base/utf_string_conversions.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/lib_values.h"
+#include "rlz/lib/lock_stats.h"
 #include "rlz/lib/machine_id.h"
 #include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_lib_locked.h"
 #include "rlz/lib/rlz_value_store.h"
 #include "rlz/lib/string_utils.h"
 
@@ -35,17 +37,52 @@ class InternetHandle {
   ~InternetHandle() { if (handle_) InternetCloseHandle(handle_); }
   operator HINTERNET() const { return handle_; }
   bool operator!() const { return (handle_ == NULL); }
+  void Release() { handle_ = NULL; }
 
  private:
   HINTERNET handle_;
 };
 
+// Sends the request of |http_handle| and appends the response text to
+// |response|.
+bool SendRequest(HINTERNET http_handle, std::string* response) {
+  // Send the HTTP request. Note: Fails if user is working in off-line mode.
+  if (!HttpSendRequest(http_handle, NULL, 0, NULL, 0))
+    return false;
+
+  // Check the response status.
+  DWORD status;
+  DWORD status_size = sizeof(status);
+  if (!HttpQueryInfo(http_handle, HTTP_QUERY_STATUS_CODE |
+                     HTTP_QUERY_FLAG_NUMBER, &status, &status_size, NULL) ||
+      200 != status)
+    return false;
+
+  // Get the response text.
+  scoped_array<char> buffer(new char[rlz_lib::kMaxPingResponseLength]);
+  if (buffer.get() == NULL)
+    return false;
+
+  DWORD bytes_read = 0;
+  while (InternetReadFile(http_handle, buffer.get(),
+                          rlz_lib::kMaxPingResponseLength, &bytes_read) &&
+         bytes_read > 0) {
+    response->append(buffer.get(), bytes_read);
+    bytes_read = 0;
+  };
+
+  return true;
+}
+
 }  // namespace
 
 #else
 
 #include "base/bind.h"
-#include "base/message_loop.h"
+#include "base/compiler_specific.h"
+#include "base/memory/ref_counted.h"
+#include "base/message_loop_proxy.h"
+#include "base/synchronization/waitable_event.h"
 #include "base/time.h"
 #include "googleurl/src/gurl.h"
 #include "net/base/load_flags.h"
@@ -95,11 +132,25 @@ bool FinancialPing::FormRequest(Product product,
 
   request->clear();
 
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzEntryPoint entry_point("FinancialPing::FormRequest");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess);
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
 
+  bool has_events = false;
+  return FormRequestLocked(store, product, access_points, product_signature,
+                           product_brand, product_id, product_lang,
+                           exclude_machine_id, request, &has_events);
+}
+
+bool FinancialPing::FormRequestLocked(RlzValueStore* store, Product product,
+    const AccessPoint* access_points, const char* product_signature,
+    const char* product_brand, const char* product_id,
+    const char* product_lang, bool exclude_machine_id,
+    std::string* request, bool* has_events) {
+  *has_events = false;
+
   if (!access_points) {
     ASSERT_STRING("FinancialPing::FormRequest: access_points is NULL");
     return false;
@@ -136,23 +187,22 @@ bool FinancialPing::FormRequest(Product product,
   // Add the product events.
   char cgi[kMaxCgiLength + 1];
   cgi[0] = 0;
-  bool has_events = GetProductEventsAsCgi(product, cgi, arraysize(cgi));
-  if (has_events)
+  *has_events =
+      GetProductEventsAsCgiLocked(store, product, cgi, arraysize(cgi));
+  if (*has_events)
     base::StringAppendF(request, "&%s", cgi);
 
   // If we don't have any events, we should ping all the AP's on the system
   // that we know about and have a current RLZ value, even if they are not
-  // used by this product.
+  // used by this product. The store lists them all at once.
+  std::vector<std::string> rlzs;
+  GetAccessPointRlzsLocked(store, &rlzs);
   AccessPoint all_points[LAST_ACCESS_POINT];
-  if (!has_events) {
-    char rlz[kMaxRlzLength + 1];
+  if (!*has_events) {
     int idx = 0;
-    for (int ap = NO_ACCESS_POINT + 1; ap < LAST_ACCESS_POINT; ap++) {
-      rlz[0] = 0;
-      AccessPoint point = static_cast<AccessPoint>(ap);
-      if (GetAccessPointRlz(point, rlz, arraysize(rlz)) &&
-          rlz[0] != '\0')
-        all_points[idx++] = point;
+    for (size_t ap = NO_ACCESS_POINT + 1; ap < rlzs.size(); ap++) {
+      if (!rlzs[ap].empty())
+        all_points[idx++] = static_cast<AccessPoint>(ap);
     }
     all_points[idx] = NO_ACCESS_POINT;
   }
@@ -160,11 +210,11 @@ bool FinancialPing::FormRequest(Product product,
   // Add the RLZ's and the DCC if needed. This is the same as get PingParams.
   // This will also include the RLZ Exchange Protocol CGI Argument.
   cgi[0] = 0;
-  if (GetPingParams(product, has_events ? access_points : all_points,
-                    cgi, arraysize(cgi)))
+  if (GetPingParamsForRlzs(rlzs, *has_events ? access_points : all_points,
+                           cgi, arraysize(cgi)))
     base::StringAppendF(request, "&%s", cgi);
 
-  if (has_events && !exclude_machine_id) {
+  if (*has_events && !exclude_machine_id) {
     std::string machine_id;
     if (GetMachineId(&machine_id)) {
       base::StringAppendF(request, "&%s=%s", kMachineIdCgiVariable,
@@ -175,12 +225,54 @@ bool FinancialPing::FormRequest(Product product,
   return true;
 }
 
+FinancialPingCanceler::FinancialPingCanceler()
+    : canceled_(false), handle_(NULL) {
+}
+
+FinancialPingCanceler::~FinancialPingCanceler() {
+}
+
+void FinancialPingCanceler::Cancel() {
+  base::AutoLock lock(lock_);
+  canceled_ = true;
+  if (!handle_)
+    return;
+
+#if defined(RLZ_NETWORK_IMPLEMENTATION_WIN_INET)
+  // Closing the request handle aborts the calls that use it.
+  InternetCloseHandle(handle_);
+  handle_ = NULL;
+#else
+  handle_->Signal();
+#endif
+}
+
+bool FinancialPingCanceler::IsCanceled() {
+  base::AutoLock lock(lock_);
+  return canceled_;
+}
+
+bool FinancialPingCanceler::Begin(WaitHandle handle) {
+  base::AutoLock lock(lock_);
+  if (canceled_)
+    return false;
+  handle_ = handle;
+  return true;
+}
+
+bool FinancialPingCanceler::End() {
+  base::AutoLock lock(lock_);
+  handle_ = NULL;
+  return !canceled_;
+}
+
 #if defined(RLZ_NETWORK_IMPLEMENTATION_CHROME_NET)
 // The URLRequestContextGetter used by FinancialPing::PingServer().
 net::URLRequestContextGetter* g_context;
 
 bool FinancialPing::SetURLRequestContext(
     net::URLRequestContextGetter* context) {
+  ScopedRlzEntryPoint entry_point("SetURLRequestContext");
   ScopedRlzValueStoreLock lock;
   RlzValueStore* store = lock.GetStore();
   if (!store)
@@ -192,29 +284,100 @@ bool FinancialPing::SetURLRequestContext(
 
 namespace {
 
-class FinancialPingUrlFetcherDelegate : public net::URLFetcherDelegate {
+// Fetches a ping on the IO thread of the request context, for PingServer(),
+// which waits for done() on its own thread.
+class FinancialPingFetch
+    : public base::RefCountedThreadSafe<FinancialPingFetch>,
+      public net::URLFetcherDelegate {
  public:
-  FinancialPingUrlFetcherDelegate(MessageLoop* loop) : loop_(loop) { }
-  virtual void OnURLFetchComplete(const net::URLFetcher* source);
+  FinancialPingFetch(const std::string& url,
+                     net::URLRequestContextGetter* context)
+      : url_(url),
+        context_(context),
+        done_(false, false),
+        succeeded_(false) {
+  }
+
+  // Starts the fetch, which signals done() when it finishes.
+  bool Start() {
+    return context_->GetIOMessageLoopProxy()->PostTask(
+        FROM_HERE, base::Bind(&FinancialPingFetch::StartOnIOThread, this));
+  }
+
+  // Stops the fetch if it's still running.
+  void Stop() {
+    context_->GetIOMessageLoopProxy()->PostTask(
+        FROM_HERE, base::Bind(&FinancialPingFetch::StopOnIOThread, this));
+  }
+
+  base::WaitableEvent* done() { return &done_; }
+
+  // Once the fetch signaled done(), appends the response to |response| if
+  // the server answered.
+  bool AppendResponse(std::string* response) const {
+    if (!succeeded_)
+      return false;
+    response->append(response_);
+    return true;
+  }
+
+  // net::URLFetcherDelegate:
+  virtual void OnURLFetchComplete(const net::URLFetcher* source) OVERRIDE {
+    succeeded_ = source->GetResponseCode() == 200 &&
+                 source->GetResponseAsString(&response_);
+    fetcher_.reset();
+    done_.Signal();
+  }
+
  private:
-  MessageLoop* loop_;
-};
+  friend class base::RefCountedThreadSafe<FinancialPingFetch>;
+
+  virtual ~FinancialPingFetch() {}
+
+  void StartOnIOThread() {
+    fetcher_.reset(net::URLFetcher::Create(GURL(url_), net::URLFetcher::GET,
+                                           this));
+    fetcher_->SetLoadFlags(net::LOAD_DISABLE_CACHE |
+                           net::LOAD_DO_NOT_SEND_AUTH_DATA |
+                           net::LOAD_DO_NOT_PROMPT_FOR_LOGIN |
+                           net::LOAD_DO_NOT_SEND_COOKIES |
+                           net::LOAD_DO_NOT_SAVE_COOKIES);
+    fetcher_->SetRequestContext(context_.get());
+    fetcher_->Start();
+  }
 
-void FinancialPingUrlFetcherDelegate::OnURLFetchComplete(
-    const net::URLFetcher* source) {
-  loop_->Quit();
-}
+  void StopOnIOThread() {
+    fetcher_.reset();
+  }
+
+  std::string url_;
+  scoped_refptr<net::URLRequestContextGetter> context_;
+  base::WaitableEvent done_;
+
+  // Only used on the IO thread, and by PingServer() once the fetch signaled
+  // done().
+  scoped_ptr<net::URLFetcher> fetcher_;
+  bool succeeded_;
+  std::string response_;
+
+  DISALLOW_COPY_AND_ASSIGN(FinancialPingFetch);
+};
 
 }  // namespace
 
 #endif
 
-bool FinancialPing::PingServer(const char* request, std::string* response) {
+bool FinancialPing::PingServer(const base::StringPiece& request,
+                               std::string* response) {
+  return PingServer(request, response, NULL);
+}
+
+bool FinancialPing::PingServer(const base::StringPiece& request,
+                               std::string* response,
+                               FinancialPingCanceler* canceler) {
   if (!response)
     return false;
 
-  response->clear();
-
 #if defined(RLZ_NETWORK_IMPLEMENTATION_WIN_INET)
   // Initialize WinInet.
   InternetHandle inet_handle = InternetOpenA(kFinancialPingUserAgent,
@@ -230,9 +393,21 @@ bool FinancialPing::PingServer(const char* request, std::string* response) {
   if (!connection_handle)
     return false;
 
-  // Prepare the HTTP request.
+  // Prepare the HTTP request. HttpOpenRequestA() needs a C string; requests
+  // normally fit on the stack.
+  char request_buffer[kMaxCgiLength + 1];
+  std::string long_request;
+  const char* request_path = request_buffer;
+  if (request.size() < arraysize(request_buffer)) {
+    request.copy(request_buffer, request.size());
+    request_buffer[request.size()] = 0;
+  } else {
+    request.CopyToString(&long_request);
+    request_path = long_request.c_str();
+  }
   InternetHandle http_handle = HttpOpenRequestA(connection_handle,
-      "GET", request, NULL, NULL, kFinancialPingResponseObjects,
+      "GET", request_path, NULL, NULL,
+      kFinancialPingResponseObjects,
       INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_NO_COOKIES, NULL);
   if (!http_handle)
     return false;
@@ -240,76 +415,60 @@ bool FinancialPing::PingServer(const char* request, std::string* response) {
   // Timeouts are probably:
   // INTERNET_OPTION_SEND_TIMEOUT, INTERNET_OPTION_RECEIVE_TIMEOUT
 
-  // Send the HTTP request. Note: Fails if user is working in off-line mode.
-  if (!HttpSendRequest(http_handle, NULL, 0, NULL, 0))
+  if (canceler && !canceler->Begin(http_handle))
     return false;
-
-  // Check the response status.
-  DWORD status;
-  DWORD status_size = sizeof(status);
-  if (!HttpQueryInfo(http_handle, HTTP_QUERY_STATUS_CODE |
-                     HTTP_QUERY_FLAG_NUMBER, &status, &status_size, NULL) ||
-      200 != status)
+  bool result = SendRequest(http_handle, response);
+  if (canceler && !canceler->End()) {
+    // The canceler closed the handle.
+    http_handle.Release();
     return false;
-
-  // Get the response text.
-  scoped_array<char> buffer(new char[kMaxPingResponseLength]);
-  if (buffer.get() == NULL)
-    return false;
-
-  DWORD bytes_read = 0;
-  while (InternetReadFile(http_handle, buffer.get(), kMaxPingResponseLength,
-                          &bytes_read) && bytes_read > 0) {
-    response->append(buffer.get(), bytes_read);
-    bytes_read = 0;
-  };
-
-  return true;
+  }
+  return result;
 #else
-  // Run a blocking event loop to match the win inet implementation.
-  MessageLoop loop;
-  FinancialPingUrlFetcherDelegate delegate(&loop);
-
-  std::string url = base::StringPrintf("http://%s:%d%s",
-                                       kFinancialServer, kFinancialPort,
-                                       request);
-
-  scoped_ptr<net::URLFetcher> fetcher(net::URLFetcher::Create(
-      GURL(url), net::URLFetcher::GET, &delegate));
-
-  fetcher->SetLoadFlags(net::LOAD_DISABLE_CACHE |
-                        net::LOAD_DO_NOT_SEND_AUTH_DATA |
-                        net::LOAD_DO_NOT_PROMPT_FOR_LOGIN |
-                        net::LOAD_DO_NOT_SEND_COOKIES |
-                        net::LOAD_DO_NOT_SAVE_COOKIES);
-
   // Ensure rlz_lib::SetURLRequestContext() has been called before sending
   // pings.
   CHECK(g_context);
-  fetcher->SetRequestContext(g_context);
-
-  const base::TimeDelta kTimeout = base::TimeDelta::FromMinutes(5);
-  loop.PostTask(
-      FROM_HERE,
-      base::Bind(&net::URLFetcher::Start, base::Unretained(fetcher.get())));
-  loop.PostNonNestableDelayedTask(
-      FROM_HERE, MessageLoop::QuitClosure(), kTimeout);
 
-  loop.Run();
+  std::string url = base::StringPrintf("http://%s:%d",
+                                       kFinancialServer, kFinancialPort);
+  request.AppendToString(&url);
 
-  if (fetcher->GetResponseCode() != 200)
+  // The fetch runs on the IO thread of the context, while this thread waits
+  // for it like the win inet implementation does, without a message loop.
+  scoped_refptr<FinancialPingFetch> fetch(
+      new FinancialPingFetch(url, g_context));
+  if (canceler && !canceler->Begin(fetch->done()))
     return false;
+  const base::TimeDelta kTimeout = base::TimeDelta::FromMinutes(5);
+  bool done = fetch->Start() && fetch->done()->TimedWait(kTimeout);
+  if (canceler && !canceler->End())
+    done = false;
+  if (!done) {
+    fetch->Stop();
+    return false;
+  }
 
-  return fetcher->GetResponseAsString(response);
+  return fetch->AppendResponse(response);
 #endif
 }
 
 bool FinancialPing::IsPingTime(Product product, bool no_delay) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzEntryPoint entry_point("FinancialPing::IsPingTime");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess);
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
 
+  // Check if this product has any unreported events. Formatting them as CGI
+  // isn't needed for that.
+  std::vector<std::string> events;
+  bool has_events = store->ReadProductEvents(product, &events) &&
+                    !events.empty();
+  return IsPingTimeLocked(store, product, no_delay, has_events);
+}
+
+bool FinancialPing::IsPingTimeLocked(RlzValueStore* store, Product product,
+                                     bool no_delay, bool has_events) {
   int64 last_ping = 0;
   if (!store->ReadPingTime(product, &last_ping))
     return true;
@@ -321,10 +480,6 @@ bool FinancialPing::IsPingTime(Product product, bool no_delay) {
   if (interval < 0)
     return true;
 
-  // Check if this product has any unreported events.
-  char cgi[kMaxCgiLength + 1];
-  cgi[0] = 0;
-  bool has_events = GetProductEventsAsCgi(product, cgi, arraysize(cgi));
   if (no_delay && has_events)
     return true;
 
@@ -333,17 +488,24 @@ bool FinancialPing::IsPingTime(Product product, bool no_delay) {
 
 
 bool FinancialPing::UpdateLastPingTime(Product product) {
+  ScopedRlzEntryPoint entry_point("FinancialPing::UpdateLastPingTime");
   ScopedRlzValueStoreLock lock;
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
+  return UpdateLastPingTimeLocked(store, product);
+}
+
+bool FinancialPing::UpdateLastPingTimeLocked(RlzValueStore* store,
+                                             Product product) {
   uint64 now = GetSystemTimeAsInt64();
   return store->WritePingTime(product, now);
 }
 
 
 bool FinancialPing::ClearLastPingTime(Product product) {
+  ScopedRlzEntryPoint entry_point("FinancialPing::ClearLastPingTime");
   ScopedRlzValueStoreLock lock;
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
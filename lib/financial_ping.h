@@ -8,9 +8,17 @@
 #define RLZ_LIB_FINANCIAL_PING_H_
 
 #include <string>
+#include "base/basictypes.h"
+#include "base/string_piece.h"
+#include "base/synchronization/lock.h"
 #include "rlz/lib/rlz_enums.h"
+#include "rlz/lib/rlz_lib.h"
 
 #if defined(RLZ_NETWORK_IMPLEMENTATION_CHROME_NET)
+namespace base {
+class WaitableEvent;
+}  // namespace base
+
 namespace net {
 class URLRequestContextGetter;
 }  // namespace net
@@ -18,6 +26,42 @@ class URLRequestContextGetter;
 
 namespace rlz_lib {
 
+class RlzValueStore;
+
+// Lets other threads abort a FinancialPing::PingServer() call, see
+// SendFinancialPingAsync().
+class FinancialPingCanceler {
+ public:
+  FinancialPingCanceler();
+  ~FinancialPingCanceler();
+
+  // Makes the PingServer() call that uses this object return false as soon as
+  // possible, and later ones right away.
+  void Cancel();
+  bool IsCanceled();
+
+ private:
+  friend class FinancialPing;
+
+#if defined(RLZ_NETWORK_IMPLEMENTATION_CHROME_NET)
+  typedef base::WaitableEvent* WaitHandle;
+#else
+  typedef void* WaitHandle;  // HINTERNET
+#endif
+
+  // Called by PingServer() around the wait for the server: Cancel() signals
+  // the event, or closes the request handle, it waits on. Both return false
+  // if the ping was canceled; if End() does, Cancel() closed the handle.
+  bool Begin(WaitHandle handle);
+  bool End();
+
+  base::Lock lock_;
+  bool canceled_;
+  WaitHandle handle_;
+
+  DISALLOW_COPY_AND_ASSIGN(FinancialPingCanceler);
+};
+
 class FinancialPing {
  public:
   // Form the HTTP request to send to the PSO server.
@@ -30,6 +74,19 @@ class FinancialPing {
                           const char* product_lang, bool exclude_machine_id,
                           std::string* request);
 
+  // Like FormRequest(), for callers that hold a ScopedRlzValueStoreLock with
+  // read access to |store|, but appends the request to |request|, which it
+  // leaves alone if it fails. Sets |has_events| to whether the request reports
+  // any product events.
+  static bool FormRequestLocked(RlzValueStore* store, Product product,
+                                const AccessPoint* access_points,
+                                const char* product_signature,
+                                const char* product_brand,
+                                const char* product_id,
+                                const char* product_lang,
+                                bool exclude_machine_id,
+                                std::string* request, bool* has_events);
+
   // Returns whether the time is right to send a ping.
   // If no_delay is true, this should always ping if there are events,
   // or one week has passed since last_ping when there are no new events.
@@ -39,15 +96,38 @@ class FinancialPing {
   // no new events.
   static bool IsPingTime(Product product, bool no_delay);
 
+  // Like IsPingTime(), for callers that hold a ScopedRlzValueStoreLock with
+  // read access to |store| and know whether |product| has events.
+  static bool IsPingTimeLocked(RlzValueStore* store, Product product,
+                               bool no_delay, bool has_events);
+
   // Set the last ping time to be now. Writes to RlzValueStore.
   static bool UpdateLastPingTime(Product product);
 
+  // Like UpdateLastPingTime(), for callers that hold a ScopedRlzValueStoreLock
+  // with write access to |store|.
+  static bool UpdateLastPingTimeLocked(RlzValueStore* store, Product product);
+
   // Clear the last ping time - should be called on uninstall.
   // Writes to RlzValueStore.
   static bool ClearLastPingTime(Product product);
 
-  // Ping the financial server with request. Writes to RlzValueStore.
-  static bool PingServer(const char* request, std::string* response);
+  // Ping the financial server with request, and append the response to
+  // |response|. Writes to RlzValueStore.
+  static bool PingServer(const base::StringPiece& request,
+                         std::string* response);
+
+  // Like PingServer(), but returns false without a response as soon as
+  // |canceler| is canceled, if it's not NULL.
+  static bool PingServer(const base::StringPiece& request,
+                         std::string* response,
+                         FinancialPingCanceler* canceler);
+
+  // The type of the PingServer() overload above, which tests replace with a
+  // stand-in for the server.
+  typedef bool (*PingServerFunction)(const base::StringPiece& request,
+                                     std::string* response,
+                                     FinancialPingCanceler* canceler);
 
 #if defined(RLZ_NETWORK_IMPLEMENTATION_CHROME_NET)
   static bool SetURLRequestContext(net::URLRequestContextGetter* context);
@@ -58,6 +138,26 @@ class FinancialPing {
   ~FinancialPing() {}
 };
 
+namespace testing {
+// Like SendFinancialPingAsync() and SendSequentialFinancialPings(), but send
+// the requests to |server|, a stand-in for the financial server, instead of
+// FinancialPing::PingServer().
+int SendFinancialPingAsyncForTesting(Product product,
+                                     const AccessPoint* access_points,
+                                     const char* product_signature,
+                                     const char* product_brand,
+                                     const char* product_id,
+                                     const char* product_lang,
+                                     bool exclude_machine_id,
+                                     bool skip_time_check,
+                                     base::TaskRunner* task_runner,
+                                     const FinancialPingCallback& callback,
+                                     FinancialPing::PingServerFunction server);
+bool SendSequentialFinancialPingsForTesting(
+    const FinancialPingProduct* products, size_t count, bool skip_time_check,
+    bool* pinged, FinancialPing::PingServerFunction server);
+}  // namespace testing
+
 }  // namespace rlz_lib
 
 
@@ -187,6 +187,29 @@ bool GetEventFromName(const char* name, Event* event) {
   return false;
 }
 
+std::string GetEventRlz(AccessPoint point, Event event) {
+  const char* point_name = GetAccessPointName(point);
+  const char* event_name = GetEventName(event);
+  if (!point_name || !event_name || !point_name[0] || !event_name[0])
+    return std::string();
+
+  std::string event_rlz(point_name);
+  event_rlz += event_name;
+  return event_rlz;
+}
+
+bool ParseEventRlz(const char* event_rlz, AccessPoint* point, Event* event) {
+  // Access point names are two characters, event names are one.
+  if (!event_rlz || strlen(event_rlz) != 3)
+    return false;
+
+  char point_name[3] = { event_rlz[0], event_rlz[1], '\0' };
+  return GetAccessPointFromName(point_name, point) &&
+         *point != NO_ACCESS_POINT &&
+         GetEventFromName(event_rlz + 2, event) &&
+         *event != INVALID_EVENT;
+}
+
 const char* GetProductName(Product product) {
   switch (product) {
   case IE_TOOLBAR:       return "T";
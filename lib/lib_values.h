@@ -7,6 +7,8 @@
 #ifndef RLZ_LIB_LIB_VALUES_H_
 #define RLZ_LIB_LIB_VALUES_H_
 
+#include <string>
+
 #include "base/basictypes.h"
 #include "rlz/lib/rlz_enums.h"
 
@@ -91,6 +93,13 @@ bool GetAccessPointFromName(const char* name, AccessPoint* point);
 const char* GetEventName(Event event);
 bool GetEventFromName(const char* name, Event* event);
 
+// Events are stored and reported as the access point name followed by the
+// event name, for example "I7S". GetEventRlz() returns "" if either name is
+// empty or unknown. ParseEventRlz() returns false if |event_rlz| isn't of that
+// form.
+std::string GetEventRlz(AccessPoint point, Event event);
+bool ParseEventRlz(const char* event_rlz, AccessPoint* point, Event* event);
+
 // The names for products are used only client-side.
 const char* GetProductName(Product product);
 
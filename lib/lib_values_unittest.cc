@@ -59,3 +59,27 @@ TEST(LibValuesUnittest, GetEventFromName) {
   EXPECT_FALSE(rlz_lib::GetEventFromName("F ", &event));
   EXPECT_EQ(rlz_lib::INVALID_EVENT, event);
 }
+
+TEST(LibValuesUnittest, GetEventRlz) {
+  EXPECT_EQ("I7S", rlz_lib::GetEventRlz(rlz_lib::IE_DEFAULT_SEARCH,
+                                        rlz_lib::SET_TO_GOOGLE));
+  EXPECT_EQ("", rlz_lib::GetEventRlz(rlz_lib::NO_ACCESS_POINT,
+                                     rlz_lib::SET_TO_GOOGLE));
+  EXPECT_EQ("", rlz_lib::GetEventRlz(rlz_lib::IE_DEFAULT_SEARCH,
+                                     rlz_lib::INVALID_EVENT));
+}
+
+TEST(LibValuesUnittest, ParseEventRlz) {
+  rlz_lib::AccessPoint point;
+  rlz_lib::Event event;
+  EXPECT_TRUE(rlz_lib::ParseEventRlz("I7S", &point, &event));
+  EXPECT_EQ(rlz_lib::IE_DEFAULT_SEARCH, point);
+  EXPECT_EQ(rlz_lib::SET_TO_GOOGLE, event);
+
+  EXPECT_FALSE(rlz_lib::ParseEventRlz(NULL, &point, &event));
+  EXPECT_FALSE(rlz_lib::ParseEventRlz("", &point, &event));
+  EXPECT_FALSE(rlz_lib::ParseEventRlz("I7", &point, &event));
+  EXPECT_FALSE(rlz_lib::ParseEventRlz("I7S ", &point, &event));
+  EXPECT_FALSE(rlz_lib::ParseEventRlz("i7S", &point, &event));
+  EXPECT_FALSE(rlz_lib::ParseEventRlz("I7s", &point, &event));
+}
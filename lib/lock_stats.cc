@@ -0,0 +1,200 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/lock_stats.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include "base/lazy_instance.h"
+#include "base/process_util.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread_local.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+namespace {
+
+const char kOtherEntryPoint[] = "Other";
+
+base::LazyInstance<base::ThreadLocalPointer<const char> >::Leaky
+    g_entry_point = LAZY_INSTANCE_INITIALIZER;
+
+// The outermost LockStatsTimer of each thread.
+base::LazyInstance<base::ThreadLocalPointer<LockStatsTimer> >::Leaky
+    g_outermost_timer = LAZY_INSTANCE_INITIALIZER;
+
+struct LockStatsTable {
+  LockStatsTable() : holder(NULL), holder_timer(NULL) {
+    memset(&total, 0, sizeof(total));
+  }
+
+  base::Lock lock;
+  LockStats total;
+  std::map<std::string, LockStats> by_entry_point;
+
+  // The entry point and timer of the thread of this process that holds the
+  // store lock, or NULL.
+  const char* holder;
+  const LockStatsTimer* holder_timer;
+};
+
+base::LazyInstance<LockStatsTable>::Leaky g_stats = LAZY_INSTANCE_INITIALIZER;
+
+int HistogramBucket(base::TimeDelta duration) {
+  int64 ms = duration.InMilliseconds();
+  int bucket = 0;
+  while (ms > 0 && bucket < kLockStatsBuckets - 1) {
+    ms >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+int ClampedMicroseconds(base::TimeDelta duration) {
+  return static_cast<int>(std::min<int64>(duration.InMicroseconds(),
+                                          kint32max));
+}
+
+void AddWait(LockStats* stats, base::TimeDelta wait) {
+  ++stats->wait_histogram[HistogramBucket(wait)];
+  stats->total_wait_ms += static_cast<int>(wait.InMilliseconds());
+  stats->max_wait_us = std::max(stats->max_wait_us, ClampedMicroseconds(wait));
+}
+
+void AddHold(LockStats* stats, base::TimeDelta hold) {
+  ++stats->hold_histogram[HistogramBucket(hold)];
+  stats->total_hold_ms += static_cast<int>(hold.InMilliseconds());
+  stats->max_hold_us = std::max(stats->max_hold_us, ClampedMicroseconds(hold));
+}
+
+void SetTimeoutHolder(LockStats* stats, int holder_pid, const char* holder) {
+  stats->last_timeout_holder_pid = holder_pid;
+  strncpy(stats->last_timeout_holder, holder ? holder : "",
+          kMaxEntryPointLength);
+  stats->last_timeout_holder[kMaxEntryPointLength - 1] = 0;
+}
+
+}  // namespace
+
+ScopedRlzEntryPoint::ScopedRlzEntryPoint(const char* name)
+    : outermost_(!g_entry_point.Get().Get()) {
+  if (outermost_)
+    g_entry_point.Get().Set(name);
+}
+
+ScopedRlzEntryPoint::~ScopedRlzEntryPoint() {
+  if (outermost_)
+    g_entry_point.Get().Set(NULL);
+}
+
+// static
+const char* ScopedRlzEntryPoint::Current() {
+  const char* name = g_entry_point.Get().Get();
+  return name ? name : kOtherEntryPoint;
+}
+
+LockStatsTimer::LockStatsTimer()
+    : outermost_(!g_outermost_timer.Get().Get()),
+      entry_point_(ScopedRlzEntryPoint::Current()) {
+  if (outermost_) {
+    g_outermost_timer.Get().Set(this);
+    start_ = base::TimeTicks::Now();
+  }
+}
+
+LockStatsTimer::~LockStatsTimer() {
+  if (!outermost_)
+    return;
+  g_outermost_timer.Get().Set(NULL);
+  if (acquired_.is_null())
+    return;
+
+  base::TimeDelta hold = base::TimeTicks::Now() - acquired_;
+  LockStatsTable& table = g_stats.Get();
+  base::AutoLock auto_lock(table.lock);
+  AddHold(&table.total, hold);
+  AddHold(&table.by_entry_point[entry_point_], hold);
+  // Another thread may have taken the lock since it was released.
+  if (table.holder_timer == this) {
+    table.holder = NULL;
+    table.holder_timer = NULL;
+  }
+}
+
+void LockStatsTimer::Acquired() {
+  if (!outermost_)
+    return;
+  acquired_ = base::TimeTicks::Now();
+  base::TimeDelta wait = acquired_ - start_;
+  LockStatsTable& table = g_stats.Get();
+  base::AutoLock auto_lock(table.lock);
+  LockStats& stats = table.by_entry_point[entry_point_];
+  ++table.total.acquired;
+  ++stats.acquired;
+  AddWait(&table.total, wait);
+  AddWait(&stats, wait);
+  table.holder = entry_point_;
+  table.holder_timer = this;
+}
+
+void LockStatsTimer::Failed(bool busy, int holder_pid, const char* holder) {
+  if (!outermost_)
+    return;
+  base::TimeDelta wait = base::TimeTicks::Now() - start_;
+  LockStatsTable& table = g_stats.Get();
+  base::AutoLock auto_lock(table.lock);
+  LockStats& stats = table.by_entry_point[entry_point_];
+  AddWait(&table.total, wait);
+  AddWait(&stats, wait);
+  if (!busy) {
+    ++table.total.failures;
+    ++stats.failures;
+    return;
+  }
+
+  ++table.total.timeouts;
+  ++stats.timeouts;
+  // If another thread of this process holds the lock, this one timed out
+  // waiting for it rather than for another process.
+  if (!holder_pid && table.holder) {
+    holder_pid = base::GetCurrentProcId();
+    holder = table.holder;
+  }
+  SetTimeoutHolder(&table.total, holder_pid, holder);
+  SetTimeoutHolder(&stats, holder_pid, holder);
+}
+
+bool GetLockStats(const char* entry_point, LockStats* stats) {
+  if (!stats)
+    return false;
+
+  LockStatsTable& table = g_stats.Get();
+  base::AutoLock auto_lock(table.lock);
+  if (!entry_point) {
+    *stats = table.total;
+    return true;
+  }
+
+  std::map<std::string, LockStats>::const_iterator it =
+      table.by_entry_point.find(entry_point);
+  if (it == table.by_entry_point.end())
+    memset(stats, 0, sizeof(*stats));
+  else
+    *stats = it->second;
+  return true;
+}
+
+void ResetLockStats() {
+  LockStatsTable& table = g_stats.Get();
+  base::AutoLock auto_lock(table.lock);
+  memset(&table.total, 0, sizeof(table.total));
+  table.by_entry_point.clear();
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,65 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Collects the LockStats of rlz_lib.h. Public functions name themselves with
+// a ScopedRlzEntryPoint, and the ScopedRlzValueStoreLock implementations time
+// their outermost locks with a LockStatsTimer.
+
+#ifndef RLZ_LIB_LOCK_STATS_H_
+#define RLZ_LIB_LOCK_STATS_H_
+
+#include "base/basictypes.h"
+#include "base/time.h"
+
+namespace rlz_lib {
+
+// Names the public function that the store locks of this thread are taken
+// for. Nested entry points keep the name of the outermost one.
+class ScopedRlzEntryPoint {
+ public:
+  // |name| must outlive this object.
+  explicit ScopedRlzEntryPoint(const char* name);
+  ~ScopedRlzEntryPoint();
+
+  // Returns the name of the outermost entry point of this thread, or "Other".
+  static const char* Current();
+
+ private:
+  bool outermost_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedRlzEntryPoint);
+};
+
+// Times a store lock, from its construction on, for the entry point of this
+// thread. Only the outermost timer of a thread records anything, so nested
+// locks count as part of the outermost one. While it holds the lock, other
+// threads of this process that time out waiting for it report its entry point
+// as the holder.
+class LockStatsTimer {
+ public:
+  LockStatsTimer();
+  // Records the hold time if Acquired() was called.
+  ~LockStatsTimer();
+
+  // Records the wait, and starts the hold time.
+  void Acquired();
+
+  // Records the wait of a lock that didn't get the store. If |busy| is set,
+  // others held the lock until the timeout: |holder_pid| and |holder| are the
+  // process that held it and its entry point, if the lock file knows them,
+  // or 0 and NULL.
+  void Failed(bool busy, int holder_pid, const char* holder);
+
+ private:
+  bool outermost_;
+  const char* entry_point_;
+  base::TimeTicks start_;
+  base::TimeTicks acquired_;
+
+  DISALLOW_COPY_AND_ASSIGN(LockStatsTimer);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_LOCK_STATS_H_
@@ -0,0 +1,388 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/pending_events.h"
+
+#include <algorithm>
+
+#include "base/at_exit.h"
+#include "base/atomicops.h"
+#include "base/bind.h"
+#include "base/lazy_instance.h"
+#include "base/location.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/message_loop_proxy.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread.h"
+#include "base/time.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/lock_stats.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+struct PendingEvent {
+  Product product;
+  AccessPoint point;
+  Event event;
+  bool record;
+  // Whether ApplyPendingEventsLocked() made the change.
+  bool made;
+  PendingEvent* next;
+};
+
+namespace {
+
+// How long the flusher waits after the first event is queued, so that events
+// recorded around the same time are written in one lock scope.
+const int kFlushDelayMS = 50;
+// How long it waits before it tries again if the store couldn't be written.
+// The delay doubles with every failed flush, and after kMaxFlushRetries the
+// events stay queued for the next call that writes events, or an explicit
+// flush.
+const int kFlushRetryDelayMS = 1000;
+const int kMaxFlushRetries = 5;
+
+// The queue is a singly linked list, newest event first, that producers push
+// to with a compare-and-swap. It is only ever emptied as a whole, by
+// ApplyPendingEventsLocked(), and appended to at the old end, by
+// RequeueEventsLocked(), with the store locked for writing. So threads that
+// hold the store lock can walk it without taking it apart.
+base::subtle::AtomicWord g_pending_events = 0;
+
+// Event buffering, see SetEventBuffering().
+base::subtle::Atomic32 g_buffering_enabled = 0;
+
+struct FlusherState {
+  FlusherState()
+      : at_exit_registered(false),
+        flush_scheduled(false),
+        flushing(false),
+        failed_flushes(0),
+        shut_down(false) {}
+
+  // Guards the other members. The store is never locked with it held.
+  base::Lock lock;
+  // Runs the flushes. Started with buffering, or for the first flush.
+  scoped_ptr<base::Thread> thread;
+  bool at_exit_registered;
+  // Whether a flush is posted to |thread|, or running there.
+  bool flush_scheduled;
+  bool flushing;
+  // The number of flushes on |thread| in a row that failed.
+  int failed_flushes;
+  // Set at exit, after which no more flushes are scheduled.
+  bool shut_down;
+};
+
+base::LazyInstance<FlusherState>::Leaky g_flusher = LAZY_INSTANCE_INITIALIZER;
+
+PendingEvent* PendingEventsNewestFirst() {
+  return reinterpret_cast<PendingEvent*>(
+      base::subtle::Acquire_Load(&g_pending_events));
+}
+
+// Reverses the list starting at |events|, so that the oldest event is first.
+PendingEvent* ReverseEvents(PendingEvent* events) {
+  PendingEvent* reversed = NULL;
+  while (events) {
+    PendingEvent* next = events->next;
+    events->next = reversed;
+    reversed = events;
+    events = next;
+  }
+  return reversed;
+}
+
+void ScheduleFlush(int delay_ms);
+
+// Puts |events|, oldest first, back in the queue, older than the events
+// queued since they were taken off it. The store must be locked for writing.
+void RequeueEventsLocked(PendingEvent* events) {
+  if (!events)
+    return;
+
+  PendingEvent* newest = ReverseEvents(events);
+  if (!base::subtle::Release_CompareAndSwap(
+          &g_pending_events, 0,
+          reinterpret_cast<base::subtle::AtomicWord>(newest))) {
+    // Like QueuePendingEvent(), the first event schedules a flush.
+    ScheduleFlush(kFlushRetryDelayMS);
+    return;
+  }
+
+  // Producers only change the head, and only threads that hold the store
+  // lock take events off the queue, so its old end doesn't move.
+  PendingEvent* oldest = PendingEventsNewestFirst();
+  while (oldest->next)
+    oldest = oldest->next;
+  oldest->next = newest;
+}
+
+void FlushAndRetry();
+void StopFlusherAtExit(void* unused);
+
+// Starts the flusher thread if it isn't running. |flusher|.lock must be held.
+bool StartFlusherLocked(FlusherState* flusher) {
+  if (flusher->thread.get())
+    return true;
+
+  scoped_ptr<base::Thread> thread(new base::Thread("rlz_event_flusher"));
+  if (!thread->Start())
+    return false;
+  flusher->thread.swap(thread);
+  if (!flusher->at_exit_registered) {
+    base::AtExitManager::RegisterCallback(&StopFlusherAtExit, NULL);
+    flusher->at_exit_registered = true;
+  }
+  return true;
+}
+
+// Flushes the queue on the flusher thread in |delay_ms| milliseconds, unless
+// a flush is scheduled already. After failed flushes, the retry delay is used
+// instead. |flusher|.lock must be held.
+void ScheduleFlushLocked(FlusherState* flusher, int delay_ms) {
+  if (flusher->flush_scheduled || flusher->flushing || flusher->shut_down ||
+      flusher->failed_flushes > kMaxFlushRetries ||
+      !StartFlusherLocked(flusher)) {
+    return;
+  }
+
+  if (flusher->failed_flushes > 0)
+    delay_ms = kFlushRetryDelayMS << (flusher->failed_flushes - 1);
+  flusher->flush_scheduled = true;
+  flusher->thread->message_loop_proxy()->PostDelayedTask(
+      FROM_HERE, base::Bind(&FlushAndRetry),
+      base::TimeDelta::FromMilliseconds(delay_ms));
+}
+
+void ScheduleFlush(int delay_ms) {
+  FlusherState& flusher = g_flusher.Get();
+  base::AutoLock lock(flusher.lock);
+  ScheduleFlushLocked(&flusher, delay_ms);
+}
+
+// Flushes the queue on the flusher thread, and schedules another flush if
+// events are left, with a growing delay if this one failed.
+void FlushAndRetry() {
+  FlusherState& flusher = g_flusher.Get();
+  {
+    base::AutoLock lock(flusher.lock);
+    flusher.flush_scheduled = false;
+    flusher.flushing = true;
+  }
+
+  bool flushed = FlushPendingEvents();
+
+  base::AutoLock lock(flusher.lock);
+  flusher.flushing = false;
+  flusher.failed_flushes = flushed ? 0 : flusher.failed_flushes + 1;
+  if (HasPendingEvents())
+    ScheduleFlushLocked(&flusher, kFlushDelayMS);
+}
+
+// Stops the flusher thread, which waits for a running flush but drops the
+// scheduled ones.
+void StopFlusher() {
+  FlusherState& flusher = g_flusher.Get();
+  scoped_ptr<base::Thread> stopped_thread;
+  {
+    base::AutoLock lock(flusher.lock);
+    stopped_thread.swap(flusher.thread);
+    flusher.flush_scheduled = false;
+  }
+}
+
+void StopFlusherAtExit(void* unused) {
+  {
+    FlusherState& flusher = g_flusher.Get();
+    base::AutoLock lock(flusher.lock);
+    flusher.shut_down = true;
+    base::subtle::Release_Store(&g_buffering_enabled, 0);
+  }
+  StopFlusher();
+  FlushPendingEvents();
+}
+
+}  // namespace
+
+void QueuePendingEvent(Product product, AccessPoint point, Event event,
+                       bool record) {
+  PendingEvent* pending = new PendingEvent;
+  pending->product = product;
+  pending->point = point;
+  pending->event = event;
+  pending->record = record;
+  pending->made = false;
+
+  base::subtle::AtomicWord head;
+  do {
+    head = base::subtle::NoBarrier_Load(&g_pending_events);
+    pending->next = reinterpret_cast<PendingEvent*>(head);
+  } while (base::subtle::Release_CompareAndSwap(
+               &g_pending_events, head,
+               reinterpret_cast<base::subtle::AtomicWord>(pending)) != head);
+
+  // Later events are written by the flush that this one schedules.
+  if (!head)
+    ScheduleFlush(kFlushDelayMS);
+}
+
+bool HasPendingEvents() {
+  return PendingEventsNewestFirst() != NULL;
+}
+
+AppliedPendingEvents::AppliedPendingEvents() : events_(NULL) {
+}
+
+AppliedPendingEvents::~AppliedPendingEvents() {
+  DCHECK(!events_) << "FinishLocked() not called";
+  while (events_) {
+    PendingEvent* next = events_->next;
+    delete events_;
+    events_ = next;
+  }
+}
+
+void AppliedPendingEvents::FinishLocked(bool written) {
+  if (!events_)
+    return;
+
+  PendingEvent* requeued = NULL;
+  PendingEvent** requeued_end = &requeued;
+  while (events_) {
+    PendingEvent* next = events_->next;
+    if (written && events_->made) {
+      delete events_;
+    } else {
+      events_->made = false;
+      events_->next = NULL;
+      *requeued_end = events_;
+      requeued_end = &events_->next;
+    }
+    events_ = next;
+  }
+  if (requeued) {
+    RequeueEventsLocked(requeued);
+    return;
+  }
+
+  // The store can be written again, so the flusher retries again the next
+  // time it can't.
+  FlusherState& flusher = g_flusher.Get();
+  base::AutoLock lock(flusher.lock);
+  flusher.failed_flushes = 0;
+}
+
+bool ApplyPendingEventsLocked(RlzValueStore* store,
+                              AppliedPendingEvents* applied) {
+  DCHECK(!applied->events_);
+
+  // The store of a supplementary brand is a different store.
+  if (SupplementaryBranding::IsInEffect())
+    return false;
+
+  // Events queued while these are made are newer, they stay queued.
+  base::subtle::AtomicWord head;
+  do {
+    head = base::subtle::Acquire_Load(&g_pending_events);
+  } while (head && base::subtle::Acquire_CompareAndSwap(
+                       &g_pending_events, head, 0) != head);
+
+  bool result = true;
+  applied->events_ = ReverseEvents(reinterpret_cast<PendingEvent*>(head));
+  for (PendingEvent* pending = applied->events_; pending;
+       pending = pending->next) {
+    if (!pending->record) {
+      pending->made = store->ClearProductEventById(
+          pending->product, pending->point, pending->event);
+    } else {
+      // Like RecordProductEvent(), stateful events are not recorded again.
+      pending->made =
+          store->IsStatefulEventById(pending->product, pending->point,
+                                     pending->event) ||
+          store->AddProductEventById(pending->product, pending->point,
+                                     pending->event);
+    }
+    result &= pending->made;
+  }
+  return result;
+}
+
+void MergePendingEventsLocked(RlzValueStore* store, Product product,
+                              std::vector<std::string>* events) {
+  if (SupplementaryBranding::IsInEffect())
+    return;
+
+  // Holding the store lock keeps the events from being applied and deleted.
+  std::vector<const PendingEvent*> pending;
+  for (const PendingEvent* event = PendingEventsNewestFirst(); event;
+       event = event->next) {
+    if (event->product == product)
+      pending.push_back(event);
+  }
+
+  for (size_t i = pending.size(); i-- > 0; ) {
+    const PendingEvent* event = pending[i];
+    std::string event_rlz(GetAccessPointName(event->point));
+    event_rlz += GetEventName(event->event);
+    std::vector<std::string>::iterator it =
+        std::find(events->begin(), events->end(), event_rlz);
+    if (!event->record) {
+      if (it != events->end())
+        events->erase(it);
+    } else if (it == events->end() &&
+               !store->IsStatefulEventById(product, event->point,
+                                           event->event)) {
+      events->push_back(event_rlz);
+    }
+  }
+}
+
+bool IsEventBufferingEnabled() {
+  return base::subtle::Acquire_Load(&g_buffering_enabled) != 0;
+}
+
+bool SetEventBuffering(bool enabled) {
+  FlusherState& flusher = g_flusher.Get();
+  {
+    base::AutoLock lock(flusher.lock);
+    if (enabled && !StartFlusherLocked(&flusher))
+      return false;
+    base::subtle::Release_Store(&g_buffering_enabled, enabled);
+  }
+
+  if (enabled)
+    return true;
+
+  // The scheduled flushes are dropped, so flush here, or later on a new
+  // flusher thread if the store stays locked.
+  StopFlusher();
+  if (FlushPendingEvents())
+    return true;
+  if (HasPendingEvents())
+    ScheduleFlush(kFlushRetryDelayMS);
+  return false;
+}
+
+bool FlushPendingEvents() {
+  if (!HasPendingEvents())
+    return true;
+
+  ScopedRlzEntryPoint entry_point("FlushPendingEvents");
+  ScopedRlzValueStoreLock lock;
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return false;
+
+  AppliedPendingEvents applied;
+  bool result = ApplyPendingEventsLocked(store, &applied);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return result && written;
+}
+
+}  // namespace rlz_lib
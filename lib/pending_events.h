@@ -0,0 +1,77 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Event changes that TryRecordProductEvent() and TryClearProductEvent() could
+// not make because the store was locked, and events that RecordProductEvent()
+// buffers, see SetEventBuffering(). They are kept in a lock-free queue in
+// process memory and made by the next call that locks the store for writing
+// events, by the flusher thread, or by FlushPendingEvents(). The flusher
+// retries a few times with growing delays if the store can't be written, and
+// then leaves the events queued.
+
+#ifndef RLZ_LIB_PENDING_EVENTS_H_
+#define RLZ_LIB_PENDING_EVENTS_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "rlz/lib/rlz_enums.h"
+
+namespace rlz_lib {
+
+class RlzValueStore;
+struct PendingEvent;
+
+// Queues recording (|record| true) or clearing an event, and schedules a
+// flush. Doesn't block. Queued events belong to the default
+// brand, they are never made while a SupplementaryBranding is in effect.
+void QueuePendingEvent(Product product, AccessPoint point, Event event,
+                       bool record);
+
+// Returns true if there are queued events.
+bool HasPendingEvents();
+
+// Event changes that ApplyPendingEventsLocked() took off the queue, kept until
+// the store they were made in is written.
+class AppliedPendingEvents {
+ public:
+  AppliedPendingEvents();
+  ~AppliedPendingEvents();
+
+  // Queues the changes that couldn't be made again, or all of them if
+  // |written| is false, older than the ones queued since, and deletes the
+  // others. The store must still be locked for writing.
+  void FinishLocked(bool written);
+
+ private:
+  friend bool ApplyPendingEventsLocked(RlzValueStore* store,
+                                       AppliedPendingEvents* applied);
+
+  // Oldest first.
+  PendingEvent* events_;
+
+  DISALLOW_COPY_AND_ASSIGN(AppliedPendingEvents);
+};
+
+// Makes the queued event changes in |store|, in the order they were queued,
+// and moves them from the queue to |applied|. |store| must be locked for
+// writing, and |applied|.FinishLocked() must be called with whether |store|
+// was written, before the lock is released. Returns false if a change failed,
+// or if a SupplementaryBranding is in effect; the changes stay queued then,
+// to be retried.
+bool ApplyPendingEventsLocked(RlzValueStore* store,
+                              AppliedPendingEvents* applied);
+
+// Changes |events|, read from |store| for |product|, as the queued events for
+// |product| will change them. |store| must be locked.
+void MergePendingEventsLocked(RlzValueStore* store, Product product,
+                              std::vector<std::string>* events);
+
+// Returns true if RecordProductEvent() should queue events.
+bool IsEventBufferingEnabled();
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_PENDING_EVENTS_H_
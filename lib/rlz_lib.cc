@@ -7,13 +7,29 @@
 
 #include "rlz/lib/rlz_lib.h"
 
+#include <algorithm>
+#include <map>
+
+#include "base/bind.h"
+#include "base/callback.h"
+#include "base/lazy_instance.h"
+#include "base/location.h"
+#include "base/string_piece.h"
 #include "base/string_util.h"
 #include "base/stringprintf.h"
+#include "base/synchronization/lock.h"
+#include "base/task_runner.h"
+#include "base/threading/worker_pool.h"
+#include "base/time.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/crc32.h"
 #include "rlz/lib/financial_ping.h"
 #include "rlz/lib/lib_values.h"
+#include "rlz/lib/lock_stats.h"
+#include "rlz/lib/pending_events.h"
+#include "rlz/lib/rlz_lib_locked.h"
 #include "rlz/lib/rlz_value_store.h"
+#include "rlz/lib/rlz_value_store_cache.h"
 #include "rlz/lib/string_utils.h"
 
 namespace {
@@ -97,75 +113,101 @@ void NormalizeRlz(const char* raw_rlz, char* normalized_rlz) {
   normalized_rlz[index] = 0;
 }
 
+// The whitespace that TrimWhitespaceASCII() trims.
+const char kWhitespaceAscii[] = "\t\n\v\f\r ";
+
+// Copies |text| into |buffer| of |buffer_size| bytes as a C string. Returns
+// false if it doesn't fit.
+bool CopyToBuffer(const base::StringPiece& text, char* buffer,
+                  size_t buffer_size) {
+  if (text.size() >= buffer_size)
+    return false;
+  text.copy(buffer, text.size());
+  buffer[text.size()] = 0;
+  return true;
+}
+
+// Returns the value of a response line field: |text| without leading
+// whitespace, up to the next line break or space.
+base::StringPiece GetFieldValue(const base::StringPiece& text) {
+  size_t begin = text.find_first_not_of(kWhitespaceAscii);
+  if (begin == base::StringPiece::npos)
+    return base::StringPiece();
+  base::StringPiece value = text.substr(begin);
+  return value.substr(0, value.find_first_of("\r\n "));
+}
+
+// Returns true if |line| starts with the field |name| followed by ": ".
+bool IsResponseField(const base::StringPiece& line, const char* name) {
+  return line.starts_with(name) && line.substr(strlen(name)).starts_with(": ");
+}
+
+// Parses an event of a response, an access point and an event name.
+bool GetEventFromResponse(const base::StringPiece& text,
+                          ReturnedEvent* event) {
+  if (text.size() != 3)  // 3 = 2(AP) + 1(E)
+    return false;
+
+  char name[3];
+  CopyToBuffer(text.substr(0, 2), name, arraysize(name));
+  if (!GetAccessPointFromName(name, &event->access_point) ||
+      event->access_point == rlz_lib::NO_ACCESS_POINT) {
+    return false;
+  }
+
+  CopyToBuffer(text.substr(2), name, arraysize(name));
+  return GetEventFromName(name, &event->event_type) &&
+         event->event_type != rlz_lib::INVALID_EVENT;
+}
+
+// Parses the events of the response line field |name|.
 void GetEventsFromResponseString(
-    const std::string& response_line,
-    const std::string& field_header,
+    const base::StringPiece& response_line,
+    const char* name,
     std::vector<ReturnedEvent>* event_array) {
   // Get the string of events.
-  std::string events = response_line.substr(field_header.size());
-  TrimWhitespaceASCII(events, TRIM_LEADING, &events);
-
-  int events_length = events.find_first_of("\r\n ");
-  if (events_length < 0)
-    events_length = events.size();
-  events = events.substr(0, events_length);
+  base::StringPiece events =
+      GetFieldValue(response_line.substr(strlen(name) + 2));
 
   // Break this up into individual events
-  int event_end_index = -1;
-  do {
-    int event_begin = event_end_index + 1;
-    event_end_index = events.find(rlz_lib::kEventsCgiSeparator, event_begin);
-    int event_end = event_end_index;
-    if (event_end < 0)
-      event_end = events_length;
-
-    std::string event_string = events.substr(event_begin,
-                                             event_end - event_begin);
-    if (event_string.size() != 3)  // 3 = 2(AP) + 1(E)
-      continue;
-
-    rlz_lib::AccessPoint point = rlz_lib::NO_ACCESS_POINT;
-    rlz_lib::Event event = rlz_lib::INVALID_EVENT;
-    if (!GetAccessPointFromName(event_string.substr(0, 2).c_str(), &point) ||
-        point == rlz_lib::NO_ACCESS_POINT) {
-      continue;
-    }
-
-    if (!GetEventFromName(event_string.substr(event_string.size() - 1).c_str(),
-                          &event) || event == rlz_lib::INVALID_EVENT) {
-      continue;
+  size_t event_begin = 0;
+  while (event_begin <= events.size()) {
+    size_t event_end = events.find(rlz_lib::kEventsCgiSeparator, event_begin);
+    if (event_end == base::StringPiece::npos)
+      event_end = events.size();
+
+    ReturnedEvent current_event;
+    if (GetEventFromResponse(
+            events.substr(event_begin, event_end - event_begin),
+            &current_event)) {
+      event_array->push_back(current_event);
     }
-
-    ReturnedEvent current_event = {point, event};
-    event_array->push_back(current_event);
-  } while (event_end_index >= 0);
+    event_begin = event_end + 1;
+  }
 }
 
-// Event storage functions.
-bool RecordStatefulEvent(rlz_lib::Product product, rlz_lib::AccessPoint point,
-                         rlz_lib::Event event) {
-  rlz_lib::ScopedRlzValueStoreLock lock;
-  rlz_lib::RlzValueStore* store = lock.GetStore();
-  if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
-    return false;
+// Computes the checksum of |text| like Crc32(const char*, int*), which needs
+// a NUL-terminated copy.
+bool Crc32OfAsciiText(const base::StringPiece& text, int* crc) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (!rlz_lib::IsAscii(text[i]))
+      return false;
+  }
+  *crc = rlz_lib::Crc32(reinterpret_cast<const unsigned char*>(text.data()),
+                        static_cast<int>(text.size()));
+  return true;
+}
 
-  // Write the new event to the value store.
+// Returns true if |point| and |event| have names, which all events that are
+// stored must have.
+bool HasEventName(rlz_lib::AccessPoint point, rlz_lib::Event event) {
   const char* point_name = GetAccessPointName(point);
   const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
-
-  if (!point_name[0] || !event_name[0])
-    return false;
-
-  std::string new_event_value;
-  base::StringAppendF(&new_event_value, "%s%s", point_name, event_name);
-  return store->AddStatefulEvent(product, new_event_value.c_str());
+  return point_name && event_name && point_name[0] && event_name[0];
 }
 
-bool GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
-                                 size_t cgi_size,
-                                 rlz_lib::RlzValueStore* store) {
+bool GetProductEventsAsCgiHelper(const std::vector<std::string>& events,
+                                 char* cgi, size_t cgi_size) {
   // Prepend the CGI param key to the buffer.
   std::string cgi_arg;
   base::StringAppendF(&cgi_arg, "%s=", rlz_lib::kEventsCgiVariable);
@@ -176,11 +218,6 @@ bool GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
   for (index = 0; index < cgi_arg.size(); ++index)
     cgi[index] = cgi_arg[index];
 
-  // Read stored events.
-  std::vector<std::string> events;
-  if (!store->ReadProductEvents(product, &events))
-    return false;
-
   // Append the events to the buffer.
   size_t num_values = 0;
 
@@ -204,6 +241,130 @@ bool GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
   return num_values > 0;
 }
 
+// Formats |events| into |cgi| for GetProductEventsAsCgi(). |cgi| must not be
+// empty.
+bool GetProductEventsAsCgiFromEvents(const std::vector<std::string>& events,
+                                     char* cgi, size_t cgi_size) {
+  size_t size_local = std::min(
+      static_cast<size_t>(rlz_lib::kMaxCgiLength + 1), cgi_size);
+  if (!GetProductEventsAsCgiHelper(events, cgi, size_local)) {
+    ASSERT_STRING("GetProductEventsAsCgi: Possibly insufficient buffer size");
+    cgi[0] = 0;
+    return false;
+  }
+
+  return true;
+}
+
+// Measures how long a lock scope waited for the lock and held it. Must be
+// declared before the ScopedRlzValueStoreLock, so that the hold time includes
+// writing the store when the lock is released.
+class ScopedLockTimer {
+ public:
+  ScopedLockTimer(int* wait_us, int* hold_us)
+      : wait_us_(wait_us), hold_us_(hold_us),
+        start_(base::TimeTicks::Now()) {}
+
+  ~ScopedLockTimer() {
+    base::TimeTicks end = base::TimeTicks::Now();
+    if (acquired_.is_null())
+      acquired_ = end;
+    *wait_us_ = static_cast<int>((acquired_ - start_).InMicroseconds());
+    *hold_us_ = static_cast<int>((end - acquired_).InMicroseconds());
+  }
+
+  // Call once the lock is acquired.
+  void LockAcquired() { acquired_ = base::TimeTicks::Now(); }
+
+ private:
+  int* wait_us_;
+  int* hold_us_;
+  base::TimeTicks start_;
+  base::TimeTicks acquired_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedLockTimer);
+};
+
+// Returns the stripes that a call that changes the events of |product| locks.
+// Queued events can be for any product, so applying them needs the whole
+// store.
+rlz_lib::StoreStripes EventStripes(rlz_lib::Product product) {
+  return rlz_lib::HasPendingEvents() ?
+      rlz_lib::StoreStripes() : rlz_lib::StoreStripes::ForProduct(product);
+}
+
+// RecordProductEventLocked() or ClearProductEventLocked().
+typedef bool (*ChangeProductEventLocked)(rlz_lib::RlzValueStore* store,
+                                         rlz_lib::Product product,
+                                         rlz_lib::AccessPoint point,
+                                         rlz_lib::Event event);
+
+// Makes the changes of RecordProductEvents() or ClearProductEvents() under
+// one lock, and writes them all at once.
+bool ChangeProductEvents(ChangeProductEventLocked change,
+                         rlz_lib::Product product,
+                         const std::pair<rlz_lib::AccessPoint,
+                                         rlz_lib::Event>* events,
+                         size_t count, bool* results) {
+  using rlz_lib::RlzValueStore;
+
+  if (results)
+    std::fill(results, results + count, false);
+  if (!events && count) {
+    ASSERT_STRING("ChangeProductEvents: events is NULL");
+    return false;
+  }
+
+  rlz_lib::ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                                        EventStripes(product));
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return false;
+
+  rlz_lib::AppliedPendingEvents applied;
+  if (lock.stripes().all())
+    rlz_lib::ApplyPendingEventsLocked(store, &applied);
+
+  bool all_changed = true;
+  for (size_t i = 0; i < count; ++i) {
+    bool changed = change(store, product, events[i].first, events[i].second);
+    if (results)
+      results[i] = changed;
+    all_changed &= changed;
+  }
+
+  // None of the changes are made if writing them fails.
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  if (!written) {
+    if (results)
+      std::fill(results, results + count, false);
+    return false;
+  }
+  return all_changed;
+}
+
+// Collects the RLZs of an enumeration by access point, for
+// GetAccessPointRlzsLocked().
+class RlzVectorVisitor : public rlz_lib::RlzValueStore::AccessPointRlzVisitor {
+ public:
+  explicit RlzVectorVisitor(std::vector<std::string>* rlzs) : rlzs_(rlzs) {}
+  virtual ~RlzVectorVisitor() {}
+
+  virtual void Visit(rlz_lib::AccessPoint point, const char* rlz) OVERRIDE {
+    // RLZs that GetAccessPointRlz() couldn't return are left out.
+    if (IsAccessPointSupported(point) &&
+        strlen(rlz) <= static_cast<size_t>(rlz_lib::kMaxRlzLength)) {
+      (*rlzs_)[point] = rlz;
+    }
+  }
+
+ private:
+  std::vector<std::string>* rlzs_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzVectorVisitor);
+};
+
 }  // namespace
 
 namespace rlz_lib {
@@ -222,71 +383,140 @@ bool GetProductEventsAsCgi(Product product, char* cgi, size_t cgi_size) {
 
   cgi[0] = 0;
 
-  ScopedRlzValueStoreLock lock;
+  // Read stored events. Events that didn't change since they were last read
+  // don't need the lock, unless queued events change them.
+  std::vector<std::string> events;
+  if (!HasPendingEvents() &&
+      RlzValueStoreCache::ReadCachedProductEvents(product, &events))
+    return GetProductEventsAsCgiFromEvents(events, cgi, cgi_size);
+
+  ScopedRlzEntryPoint entry_point("GetProductEventsAsCgi");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                               StoreStripes::ForProduct(product));
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
 
-  size_t size_local = std::min(
-      static_cast<size_t>(kMaxCgiLength + 1), cgi_size);
-  bool result = GetProductEventsAsCgiHelper(product, cgi, size_local, store);
+  return GetProductEventsAsCgiLocked(store, product, cgi, cgi_size);
+}
+
+bool GetProductEventsAsCgiLocked(RlzValueStore* store, Product product,
+                                 char* cgi, size_t cgi_size) {
+  cgi[0] = 0;
 
-  if (!result) {
+  std::vector<std::string> events;
+  if (!store->ReadProductEvents(product, &events)) {
     ASSERT_STRING("GetProductEventsAsCgi: Possibly insufficient buffer size");
-    cgi[0] = 0;
     return false;
   }
+  MergePendingEventsLocked(store, product, &events);
 
-  return true;
+  return GetProductEventsAsCgiFromEvents(events, cgi, cgi_size);
 }
 
 bool RecordProductEvent(Product product, AccessPoint point, Event event) {
-  ScopedRlzValueStoreLock lock;
+  if (IsEventBufferingEnabled() && !SupplementaryBranding::IsInEffect()) {
+    if (!HasEventName(point, event))
+      return false;
+    QueuePendingEvent(product, point, event, true);
+    return true;
+  }
+
+  ScopedRlzEntryPoint entry_point("RecordProductEvent");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                               EventStripes(product));
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
-  // Get this event's value.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
+  AppliedPendingEvents applied;
+  if (lock.stripes().all())
+    ApplyPendingEventsLocked(store, &applied);
+  bool result = RecordProductEventLocked(store, product, point, event);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return result && written;
+}
 
-  if (!point_name[0] || !event_name[0])
+bool RecordProductEventLocked(RlzValueStore* store, Product product,
+                              AccessPoint point, Event event) {
+  // Check that this event has a value.
+  if (!HasEventName(point, event))
     return false;
 
-  std::string new_event_value;
-  base::StringAppendF(&new_event_value, "%s%s", point_name, event_name);
-
   // Check whether this event is a stateful event. If so, don't record it.
-  if (store->IsStatefulEvent(product, new_event_value.c_str())) {
+  if (store->IsStatefulEventById(product, point, event)) {
     // For a stateful event we skip recording, this function is also
     // considered successful.
     return true;
   }
 
   // Write the new event to the value store.
-  return store->AddProductEvent(product, new_event_value.c_str());
+  return store->AddProductEventById(product, point, event);
+}
+
+bool RecordStatefulEventLocked(RlzValueStore* store, Product product,
+                               AccessPoint point, Event event) {
+  // Write the new event to the value store.
+  if (!HasEventName(point, event))
+    return false;
+
+  return store->AddStatefulEventById(product, point, event);
 }
 
 bool ClearProductEvent(Product product, AccessPoint point, Event event) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzEntryPoint entry_point("ClearProductEvent");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                               EventStripes(product));
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
-  // Get the event's value store value and delete it.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
+  AppliedPendingEvents applied;
+  if (lock.stripes().all())
+    ApplyPendingEventsLocked(store, &applied);
+  bool result = ClearProductEventLocked(store, product, point, event);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return result && written;
+}
+
+bool RecordProductEvents(Product product,
+                         const std::pair<AccessPoint, Event>* events,
+                         size_t count, bool* results) {
+  if (IsEventBufferingEnabled() && !SupplementaryBranding::IsInEffect()) {
+    bool all_queued = true;
+    for (size_t i = 0; i < count; ++i) {
+      bool queued = events && HasEventName(events[i].first, events[i].second);
+      if (queued)
+        QueuePendingEvent(product, events[i].first, events[i].second, true);
+      if (results)
+        results[i] = queued;
+      all_queued &= queued;
+    }
+    return all_queued;
+  }
 
-  if (!point_name[0] || !event_name[0])
+  ScopedRlzEntryPoint entry_point("RecordProductEvents");
+  return ChangeProductEvents(&RecordProductEventLocked, product, events,
+                             count, results);
+}
+
+bool ClearProductEvents(Product product,
+                        const std::pair<AccessPoint, Event>* events,
+                        size_t count, bool* results) {
+  ScopedRlzEntryPoint entry_point("ClearProductEvents");
+  return ChangeProductEvents(&ClearProductEventLocked, product, events,
+                             count, results);
+}
+
+bool ClearProductEventLocked(RlzValueStore* store, Product product,
+                             AccessPoint point, Event event) {
+  // Check that this event has a value, and delete it.
+  if (!HasEventName(point, event))
     return false;
 
-  std::string event_value;
-  base::StringAppendF(&event_value, "%s%s", point_name, event_name);
-  return store->ClearProductEvent(product, event_value.c_str());
+  return store->ClearProductEventById(product, point, event);
 }
 
 // RLZ storage functions.
@@ -299,23 +529,90 @@ bool GetAccessPointRlz(AccessPoint point, char* rlz, size_t rlz_size) {
 
   rlz[0] = 0;
 
-  ScopedRlzValueStoreLock lock;
+  // RLZs that didn't change since they were last read don't need the lock,
+  // and some stores can be read without it.
+  if (IsAccessPointSupported(point) &&
+      (RlzValueStoreCache::ReadCachedAccessPointRlz(point, rlz, rlz_size) ||
+       ReadAccessPointRlzWithoutLock(point, rlz, rlz_size))) {
+    return true;
+  }
+
+  ScopedRlzEntryPoint entry_point("GetAccessPointRlz");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                               StoreStripes::AccessPoints());
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
 
+  return GetAccessPointRlzLocked(store, point, rlz, rlz_size);
+}
+
+bool GetAccessPointRlzLocked(RlzValueStore* store, AccessPoint point,
+                             char* rlz, size_t rlz_size) {
+  rlz[0] = 0;
+
   if (!IsAccessPointSupported(point))
     return false;
 
   return store->ReadAccessPointRlz(point, rlz, rlz_size);
 }
 
+bool GetAccessPointRlzs(AccessPointRlz* rlzs, size_t rlzs_size,
+                        size_t* count) {
+  if (!count || (!rlzs && rlzs_size)) {
+    ASSERT_STRING("GetAccessPointRlzs: Invalid buffer");
+    return false;
+  }
+
+  *count = 0;
+
+  ScopedRlzEntryPoint entry_point("GetAccessPointRlzs");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                               StoreStripes::AccessPoints());
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
+    return false;
+
+  std::vector<std::string> values;
+  if (!GetAccessPointRlzsLocked(store, &values))
+    return false;
+
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (values[i].empty())
+      continue;
+    if (*count < rlzs_size) {
+      rlzs[*count].point = static_cast<AccessPoint>(i);
+      strncpy(rlzs[*count].rlz, values[i].c_str(), arraysize(rlzs->rlz));
+    }
+    ++*count;
+  }
+  return *count <= rlzs_size;
+}
+
+bool GetAccessPointRlzsLocked(RlzValueStore* store,
+                              std::vector<std::string>* rlzs) {
+  rlzs->assign(LAST_ACCESS_POINT, std::string());
+  RlzVectorVisitor visitor(rlzs);
+  if (store->EnumerateAccessPointRlzs(&visitor))
+    return true;
+
+  rlzs->clear();
+  return false;
+}
+
 bool SetAccessPointRlz(AccessPoint point, const char* new_rlz) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzEntryPoint entry_point("SetAccessPointRlz");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                               StoreStripes::AccessPoints());
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
+  return SetAccessPointRlzLocked(store, point, new_rlz);
+}
+
+bool SetAccessPointRlzLocked(RlzValueStore* store, AccessPoint point,
+                             const char* new_rlz) {
   if (!new_rlz) {
     ASSERT_STRING("SetAccessPointRlz: Invalid buffer");
     return false;
@@ -345,6 +642,115 @@ bool SetAccessPointRlz(AccessPoint point, const char* new_rlz) {
   return store->WriteAccessPointRlz(point, normalized_rlz);
 }
 
+// Non-blocking storage functions.
+
+TryResult TryRecordProductEvent(Product product, AccessPoint point,
+                                Event event) {
+  if (!HasEventName(point, event))
+    return TRY_FAILED;
+
+  ScopedRlzEntryPoint entry_point("TryRecordProductEvent");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                               EventStripes(product), 0);
+  if (lock.busy()) {
+    QueuePendingEvent(product, point, event, true);
+    return TRY_QUEUED;
+  }
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return TRY_FAILED;
+
+  AppliedPendingEvents applied;
+  if (lock.stripes().all())
+    ApplyPendingEventsLocked(store, &applied);
+  bool result = RecordProductEventLocked(store, product, point, event);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return result && written ? TRY_OK : TRY_FAILED;
+}
+
+TryResult TryClearProductEvent(Product product, AccessPoint point,
+                               Event event) {
+  if (!HasEventName(point, event))
+    return TRY_FAILED;
+
+  ScopedRlzEntryPoint entry_point("TryClearProductEvent");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                               EventStripes(product), 0);
+  if (lock.busy()) {
+    QueuePendingEvent(product, point, event, false);
+    return TRY_QUEUED;
+  }
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return TRY_FAILED;
+
+  AppliedPendingEvents applied;
+  if (lock.stripes().all())
+    ApplyPendingEventsLocked(store, &applied);
+  bool result = ClearProductEventLocked(store, product, point, event);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return result && written ? TRY_OK : TRY_FAILED;
+}
+
+TryResult TryGetProductEventsAsCgi(Product product, char* cgi,
+                                   size_t cgi_size) {
+  if (!cgi || cgi_size <= 0) {
+    ASSERT_STRING("TryGetProductEventsAsCgi: Invalid buffer");
+    return TRY_FAILED;
+  }
+
+  cgi[0] = 0;
+
+  std::vector<std::string> events;
+  if (!HasPendingEvents() &&
+      RlzValueStoreCache::ReadCachedProductEvents(product, &events)) {
+    return GetProductEventsAsCgiFromEvents(events, cgi, cgi_size) ?
+        TRY_OK : TRY_FAILED;
+  }
+
+  ScopedRlzEntryPoint entry_point("TryGetProductEventsAsCgi");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                               StoreStripes::ForProduct(product), 0);
+  if (lock.busy())
+    return TRY_BUSY;
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
+    return TRY_FAILED;
+
+  return GetProductEventsAsCgiLocked(store, product, cgi, cgi_size) ?
+      TRY_OK : TRY_FAILED;
+}
+
+TryResult TryGetAccessPointRlz(AccessPoint point, char* rlz,
+                               size_t rlz_size) {
+  if (!rlz || rlz_size <= 0) {
+    ASSERT_STRING("TryGetAccessPointRlz: Invalid buffer");
+    return TRY_FAILED;
+  }
+
+  rlz[0] = 0;
+
+  if (IsAccessPointSupported(point) &&
+      (RlzValueStoreCache::ReadCachedAccessPointRlz(point, rlz, rlz_size) ||
+       ReadAccessPointRlzWithoutLock(point, rlz, rlz_size))) {
+    return TRY_OK;
+  }
+
+  ScopedRlzEntryPoint entry_point("TryGetAccessPointRlz");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                               StoreStripes::AccessPoints(), 0);
+  if (lock.busy())
+    return TRY_BUSY;
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
+    return TRY_FAILED;
+
+  return GetAccessPointRlzLocked(store, point, rlz, rlz_size) ?
+      TRY_OK : TRY_FAILED;
+}
+
 // Financial Server pinging functions.
 
 bool FormFinancialPingRequest(Product product, const AccessPoint* access_points,
@@ -360,99 +766,159 @@ bool FormFinancialPingRequest(Product product, const AccessPoint* access_points,
   request[0] = 0;
 
   std::string request_string;
-  if (!FinancialPing::FormRequest(product, access_points, product_signature,
-                                  product_brand, product_id, product_lang,
-                                  exclude_machine_id, &request_string))
+  if (!FormFinancialPingRequest(product, access_points, product_signature,
+                                product_brand, product_id, product_lang,
+                                exclude_machine_id, &request_string))
     return false;
 
   if (request_string.size() >= request_buffer_size)
     return false;
 
-  strncpy(request, request_string.c_str(), request_buffer_size);
-  request[request_buffer_size - 1] = 0;
+  memcpy(request, request_string.c_str(), request_string.size() + 1);
   return true;
 }
 
+bool FormFinancialPingRequest(Product product, const AccessPoint* access_points,
+                              const char* product_signature,
+                              const char* product_brand,
+                              const char* product_id,
+                              const char* product_lang,
+                              bool exclude_machine_id,
+                              std::string* request) {
+  if (!request) {
+    ASSERT_STRING("FormFinancialPingRequest: request is NULL");
+    return false;
+  }
+
+  ScopedRlzEntryPoint entry_point("FormFinancialPingRequest");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess);
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
+    return false;
+
+  bool has_events = false;
+  return FinancialPing::FormRequestLocked(store, product, access_points,
+                                          product_signature, product_brand,
+                                          product_id, product_lang,
+                                          exclude_machine_id, request,
+                                          &has_events);
+}
+
 bool PingFinancialServer(Product product, const char* request, char* response,
                          size_t response_buffer_size) {
   if (!response || response_buffer_size == 0)
     return false;
   response[0] = 0;
 
-  // Check if the time is right to ping.
-  if (!FinancialPing::IsPingTime(product, false))
-    return false;
-
-  // Send out the ping.
   std::string response_string;
-  if (!FinancialPing::PingServer(request, &response_string))
+  if (!PingFinancialServer(product, request, &response_string))
     return false;
 
   if (response_string.size() >= response_buffer_size)
     return false;
 
-  strncpy(response, response_string.c_str(), response_buffer_size);
-  response[response_buffer_size - 1] = 0;
+  memcpy(response, response_string.c_str(), response_string.size() + 1);
   return true;
 }
 
+bool PingFinancialServer(Product product, const base::StringPiece& request,
+                         std::string* response) {
+  if (!response) {
+    ASSERT_STRING("PingFinancialServer: response is NULL");
+    return false;
+  }
+
+  // Check if the time is right to ping.
+  if (!FinancialPing::IsPingTime(product, false))
+    return false;
+
+  // Send out the ping.
+  return FinancialPing::PingServer(request, response);
+}
+
 bool IsPingResponseValid(const char* response, int* checksum_idx) {
-  if (!response || !response[0])
+  if (!response)
+    return false;
+  return IsPingResponseValid(base::StringPiece(response), checksum_idx);
+}
+
+bool IsPingResponseValid(const base::StringPiece& response,
+                         int* checksum_idx) {
+  if (response.empty())
     return false;
 
   if (checksum_idx)
     *checksum_idx = -1;
 
-  if (strlen(response) > kMaxPingResponseLength) {
+  if (response.size() > kMaxPingResponseLength) {
     ASSERT_STRING("IsPingResponseValid: response is too long to parse.");
     return false;
   }
 
   // Find the checksum line.
-  std::string response_string(response);
-
-  std::string checksum_param("\ncrc32: ");
+  base::StringPiece checksum_param("\ncrc32: ");
   int calculated_crc;
-  int checksum_index = response_string.find(checksum_param);
-  if (checksum_index >= 0) {
+  size_t checksum_index = response.find(checksum_param);
+  if (checksum_index != base::StringPiece::npos) {
     // Calculate checksum of message preceeding checksum line.
     // (+ 1 to include the \n)
-    std::string message(response_string.substr(0, checksum_index + 1));
-    if (!Crc32(message.c_str(), &calculated_crc))
+    if (!Crc32OfAsciiText(response.substr(0, checksum_index + 1),
+                          &calculated_crc))
       return false;
   } else {
     checksum_param = "crc32: ";  // Empty response case.
-    if (!StartsWithASCII(response_string, checksum_param, true))
+    if (!response.starts_with(checksum_param))
       return false;
 
     checksum_index = 0;
-    if (!Crc32("", &calculated_crc))
+    if (!Crc32OfAsciiText(base::StringPiece(), &calculated_crc))
       return false;
   }
 
   // Find the checksum value on the response.
-  int checksum_end = response_string.find("\n", checksum_index + 1);
-  if (checksum_end < 0)
-    checksum_end = response_string.size();
+  size_t checksum_begin = checksum_index + checksum_param.size();
+  size_t checksum_end = response.find('\n', checksum_begin);
+  base::StringPiece checksum =
+      response.substr(checksum_begin, checksum_end - checksum_begin);
 
-  int checksum_begin = checksum_index + checksum_param.size();
-  std::string checksum = response_string.substr(checksum_begin,
-      checksum_end - checksum_begin + 1);
-  TrimWhitespaceASCII(checksum, TRIM_ALL, &checksum);
+  checksum = checksum.substr(0,
+      checksum.find_last_not_of(kWhitespaceAscii) + 1);
+  checksum.remove_prefix(std::min(checksum.find_first_not_of(kWhitespaceAscii),
+                                  checksum.size()));
 
   if (checksum_idx)
-    *checksum_idx = checksum_index;
+    *checksum_idx = static_cast<int>(checksum_index);
 
-  return calculated_crc == HexStringToInteger(checksum.c_str());
+  // HexStringToInteger() needs a C string. A longer value can't be a CRC-32.
+  char checksum_text[32];
+  return CopyToBuffer(checksum, checksum_text, arraysize(checksum_text)) &&
+         calculated_crc == HexStringToInteger(checksum_text);
 }
 
 // Complex helpers built on top of other functions.
 
 bool ParseFinancialPingResponse(Product product, const char* response) {
+  return ParseFinancialPingResponse(product, base::StringPiece(response));
+}
+
+bool ParseFinancialPingResponse(Product product,
+                                const base::StringPiece& response) {
+  ScopedRlzEntryPoint entry_point("ParseFinancialPingResponse");
+  ScopedRlzValueStoreLock lock;
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return false;
+
+  // Queued events are older than the response.
+  AppliedPendingEvents applied;
+  ApplyPendingEventsLocked(store, &applied);
   // Update the last ping time irrespective of success.
-  FinancialPing::UpdateLastPingTime(product);
+  FinancialPing::UpdateLastPingTimeLocked(store, product);
   // Parse the ping response - update RLZs, clear events.
-  return ParsePingResponse(product, response);
+  bool parsed = ParsePingResponseLocked(store, product, response);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return parsed && written;
 }
 
 bool SendFinancialPing(Product product, const AccessPoint* access_points,
@@ -472,36 +938,400 @@ bool SendFinancialPing(Product product, const AccessPoint* access_points,
                        const char* product_id, const char* product_lang,
                        bool exclude_machine_id,
                        const bool skip_time_check) {
-  // Create the financial ping request.
-  std::string request;
-  if (!FinancialPing::FormRequest(product, access_points, product_signature,
-                                  product_brand, product_id, product_lang,
-                                  exclude_machine_id, &request))
-    return false;
+  return SendFinancialPing(product, access_points, product_signature,
+                           product_brand, product_id, product_lang,
+                           exclude_machine_id, skip_time_check, NULL);
+}
 
-  // Check if the time is right to ping.
-  if (!FinancialPing::IsPingTime(product, skip_time_check))
+namespace {
+
+// SendFinancialPing(), which sends the request with |ping_server| and returns
+// false as soon as |canceler| is canceled, if it's not NULL.
+bool SendFinancialPingWithCanceler(Product product,
+                                   const AccessPoint* access_points,
+                                   const char* product_signature,
+                                   const char* product_brand,
+                                   const char* product_id,
+                                   const char* product_lang,
+                                   bool exclude_machine_id,
+                                   bool skip_time_check,
+                                   FinancialPingTimings* timings,
+                                   FinancialPingCanceler* canceler,
+                                   FinancialPing::PingServerFunction
+                                       ping_server) {
+  FinancialPingTimings unused_timings;
+  if (!timings)
+    timings = &unused_timings;
+  memset(timings, 0, sizeof(*timings));
+  ScopedRlzEntryPoint entry_point("SendFinancialPing");
+  if (canceler && canceler->IsCanceled())
     return false;
 
-  // Send out the ping, update the last ping time irrespective of success.
-  FinancialPing::UpdateLastPingTime(product);
+  // The store is only locked before and after the network request, once each.
+  std::string request;
+  {
+    // Create the financial ping request, check if the time is right to ping
+    // and claim the ping, so that other processes don't send it too.
+    ScopedLockTimer timer(&timings->snapshot_lock_wait_us,
+                          &timings->snapshot_lock_hold_us);
+    ScopedRlzValueStoreLock lock;
+    RlzValueStore* store = lock.GetStore();
+    if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+      return false;
+    timer.LockAcquired();
+
+    bool has_events = false;
+    if (!FinancialPing::FormRequestLocked(store, product, access_points,
+                                          product_signature, product_brand,
+                                          product_id, product_lang,
+                                          exclude_machine_id, &request,
+                                          &has_events))
+      return false;
+
+    if (!FinancialPing::IsPingTimeLocked(store, product, skip_time_check,
+                                         has_events))
+      return false;
+
+    // Update the last ping time irrespective of success.
+    FinancialPing::UpdateLastPingTimeLocked(store, product);
+    if (!lock.Commit())
+      return false;
+  }
+
+  // Send out the ping.
+  base::TimeTicks network_start = base::TimeTicks::Now();
   std::string response;
-  if (!FinancialPing::PingServer(request.c_str(), &response))
+  bool got_response = ping_server(request, &response, canceler);
+  timings->network_us = static_cast<int>(
+      (base::TimeTicks::Now() - network_start).InMicroseconds());
+
+  // A canceled ping doesn't apply its response.
+  if (!got_response || (canceler && canceler->IsCanceled()))
     return false;
 
+  ScopedLockTimer timer(&timings->apply_lock_wait_us,
+                        &timings->apply_lock_hold_us);
+  ScopedRlzValueStoreLock lock;
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return false;
+  timer.LockAcquired();
+
+  // Queued events are older than the response.
+  AppliedPendingEvents applied;
+  ApplyPendingEventsLocked(store, &applied);
+
   // Parse the ping response - update RLZs, clear events.
-  return ParsePingResponse(product, response.c_str());
+  bool parsed = ParsePingResponseLocked(store, product, response);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return parsed && written;
+}
+
+// A string argument of SendFinancialPingAsync(), which can be NULL.
+class StringArgument {
+ public:
+  explicit StringArgument(const char* value)
+      : is_null_(!value), value_(value ? value : "") {}
+
+  const char* get() const { return is_null_ ? NULL : value_.c_str(); }
+
+ private:
+  bool is_null_;
+  std::string value_;
+};
+
+// A SendFinancialPingAsync() call. The arguments are copied, since the ping
+// runs after the call returns.
+struct AsyncFinancialPing {
+  AsyncFinancialPing(Product product, const AccessPoint* access_points,
+                     const char* product_signature, const char* product_brand,
+                     const char* product_id, const char* product_lang,
+                     bool exclude_machine_id, bool skip_time_check,
+                     const FinancialPingCallback& callback,
+                     FinancialPing::PingServerFunction ping_server)
+      : product(product),
+        product_signature(product_signature),
+        product_brand(product_brand),
+        product_id(product_id),
+        product_lang(product_lang),
+        exclude_machine_id(exclude_machine_id),
+        skip_time_check(skip_time_check),
+        callback(callback),
+        ping_server(ping_server) {
+    while (*access_points != NO_ACCESS_POINT)
+      this->access_points.push_back(*access_points++);
+    this->access_points.push_back(NO_ACCESS_POINT);
+  }
+
+  Product product;
+  std::vector<AccessPoint> access_points;
+  StringArgument product_signature;
+  StringArgument product_brand;
+  StringArgument product_id;
+  StringArgument product_lang;
+  bool exclude_machine_id;
+  bool skip_time_check;
+  FinancialPingCallback callback;
+  FinancialPing::PingServerFunction ping_server;
+  FinancialPingCanceler canceler;
+};
+
+// The pings that SendFinancialPingAsync() posted and that haven't finished,
+// by id.
+struct AsyncFinancialPings {
+  AsyncFinancialPings() : last_id(0) {}
+
+  // Guards the other members. Pings are canceled with it held.
+  base::Lock lock;
+  int last_id;
+  std::map<int, AsyncFinancialPing*> pings;
+};
+
+base::LazyInstance<AsyncFinancialPings>::Leaky g_async_pings =
+    LAZY_INSTANCE_INITIALIZER;
+
+void RemoveAsyncFinancialPing(int ping_id) {
+  AsyncFinancialPings& async_pings = g_async_pings.Get();
+  base::AutoLock lock(async_pings.lock);
+  async_pings.pings.erase(ping_id);
+}
+
+void RunAsyncFinancialPing(int ping_id, AsyncFinancialPing* ping) {
+  bool result;
+  {
+    ScopedRlzEntryPoint entry_point("SendFinancialPingAsync");
+    result = SendFinancialPingWithCanceler(
+        ping->product, &ping->access_points[0], ping->product_signature.get(),
+        ping->product_brand.get(), ping->product_id.get(),
+        ping->product_lang.get(), ping->exclude_machine_id,
+        ping->skip_time_check, NULL, &ping->canceler, ping->ping_server);
+  }
+
+  // Once the ping is removed, it can't be canceled anymore.
+  RemoveAsyncFinancialPing(ping_id);
+  if (!ping->callback.is_null())
+    ping->callback.Run(result);
+  delete ping;
+}
+
+// SendFinancialPingAsync(), which sends the request with |ping_server|.
+int PostFinancialPing(Product product, const AccessPoint* access_points,
+                      const char* product_signature, const char* product_brand,
+                      const char* product_id, const char* product_lang,
+                      bool exclude_machine_id, bool skip_time_check,
+                      base::TaskRunner* task_runner,
+                      const FinancialPingCallback& callback,
+                      FinancialPing::PingServerFunction ping_server) {
+  if (!access_points) {
+    ASSERT_STRING("SendFinancialPingAsync: access_points is NULL");
+    return 0;
+  }
+
+  if (SupplementaryBranding::IsInEffect())
+    return 0;
+
+  AsyncFinancialPing* ping = new AsyncFinancialPing(
+      product, access_points, product_signature, product_brand, product_id,
+      product_lang, exclude_machine_id, skip_time_check, callback,
+      ping_server);
+  int ping_id;
+  {
+    AsyncFinancialPings& async_pings = g_async_pings.Get();
+    base::AutoLock lock(async_pings.lock);
+    if (++async_pings.last_id <= 0)
+      async_pings.last_id = 1;
+    ping_id = async_pings.last_id;
+    async_pings.pings[ping_id] = ping;
+  }
+
+  base::Closure task = base::Bind(&RunAsyncFinancialPing, ping_id, ping);
+  bool posted = task_runner ? task_runner->PostTask(FROM_HERE, task) :
+      base::WorkerPool::PostTask(FROM_HERE, task, true);
+  if (!posted) {
+    RemoveAsyncFinancialPing(ping_id);
+    delete ping;
+    return 0;
+  }
+  return ping_id;
+}
+
+// SendSequentialFinancialPings(), which sends the requests with
+// |ping_server|.
+bool SendSequentialFinancialPingsWithServer(
+    const FinancialPingProduct* products, size_t count, bool skip_time_check,
+    bool* pinged, FinancialPing::PingServerFunction ping_server) {
+  if (pinged)
+    std::fill(pinged, pinged + count, false);
+  if (!products && count) {
+    ASSERT_STRING("SendSequentialFinancialPings: products is NULL");
+    return false;
+  }
+
+  ScopedRlzEntryPoint entry_point("SendSequentialFinancialPings");
+  // Like SendFinancialPing(), the store is only locked before and after the
+  // network requests, once each for all the products.
+  std::vector<size_t> due;
+  std::vector<std::string> requests;
+  {
+    // Create the requests of the products that are due, and claim their
+    // pings.
+    ScopedRlzValueStoreLock lock;
+    RlzValueStore* store = lock.GetStore();
+    if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+      return false;
+
+    for (size_t i = 0; i < count; ++i) {
+      const FinancialPingProduct& product = products[i];
+      std::string request;
+      bool has_events = false;
+      if (!FinancialPing::FormRequestLocked(store, product.product,
+                                            product.access_points,
+                                            product.product_signature,
+                                            product.product_brand,
+                                            product.product_id,
+                                            product.product_lang,
+                                            product.exclude_machine_id,
+                                            &request, &has_events) ||
+          !FinancialPing::IsPingTimeLocked(store, product.product,
+                                           skip_time_check, has_events))
+        continue;
+
+      // Update the last ping time irrespective of success.
+      FinancialPing::UpdateLastPingTimeLocked(store, product.product);
+      due.push_back(i);
+      requests.push_back(request);
+    }
+
+    if (due.empty() || !lock.Commit())
+      return false;
+  }
+
+  // Send out the pings, one after the other.
+  std::vector<std::string> responses(due.size());
+  std::vector<bool> got_responses(due.size());
+  bool got_any_response = false;
+  for (size_t i = 0; i < due.size(); ++i) {
+    got_responses[i] = ping_server(requests[i], &responses[i], NULL);
+    got_any_response |= got_responses[i];
+  }
+  if (!got_any_response)
+    return false;
+
+  ScopedRlzValueStoreLock lock;
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return false;
+
+  // Queued events are older than the responses.
+  AppliedPendingEvents applied;
+  ApplyPendingEventsLocked(store, &applied);
+
+  // Parse the ping responses - update RLZs, clear events.
+  std::vector<bool> parsed(due.size());
+  for (size_t i = 0; i < due.size(); ++i) {
+    parsed[i] = got_responses[i] &&
+        ParsePingResponseLocked(store, products[due[i]].product,
+                                responses[i]);
+  }
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  if (!written)
+    return false;
+
+  bool parsed_any = false;
+  for (size_t i = 0; i < due.size(); ++i) {
+    if (pinged)
+      pinged[due[i]] = parsed[i];
+    parsed_any |= parsed[i];
+  }
+  return parsed_any;
+}
+
+}  // namespace
+
+bool SendFinancialPing(Product product, const AccessPoint* access_points,
+                       const char* product_signature,
+                       const char* product_brand,
+                       const char* product_id, const char* product_lang,
+                       bool exclude_machine_id,
+                       const bool skip_time_check,
+                       FinancialPingTimings* timings) {
+  return SendFinancialPingWithCanceler(product, access_points,
+                                       product_signature, product_brand,
+                                       product_id, product_lang,
+                                       exclude_machine_id, skip_time_check,
+                                       timings, NULL,
+                                       &FinancialPing::PingServer);
+}
+
+bool SendSequentialFinancialPings(const FinancialPingProduct* products,
+                                  size_t count, bool skip_time_check,
+                                  bool* pinged) {
+  return SendSequentialFinancialPingsWithServer(products, count,
+                                                skip_time_check, pinged,
+                                                &FinancialPing::PingServer);
+}
+
+int SendFinancialPingAsync(Product product, const AccessPoint* access_points,
+                           const char* product_signature,
+                           const char* product_brand,
+                           const char* product_id, const char* product_lang,
+                           bool exclude_machine_id, bool skip_time_check,
+                           base::TaskRunner* task_runner,
+                           const FinancialPingCallback& callback) {
+  return PostFinancialPing(product, access_points, product_signature,
+                           product_brand, product_id, product_lang,
+                           exclude_machine_id, skip_time_check, task_runner,
+                           callback, &FinancialPing::PingServer);
+}
+
+bool CancelFinancialPing(int ping_id) {
+  AsyncFinancialPings& async_pings = g_async_pings.Get();
+  base::AutoLock lock(async_pings.lock);
+  std::map<int, AsyncFinancialPing*>::iterator it =
+      async_pings.pings.find(ping_id);
+  if (it == async_pings.pings.end())
+    return false;
+  it->second->canceler.Cancel();
+  return true;
+}
+
+void CancelAllFinancialPings() {
+  AsyncFinancialPings& async_pings = g_async_pings.Get();
+  base::AutoLock lock(async_pings.lock);
+  for (std::map<int, AsyncFinancialPing*>::iterator it =
+           async_pings.pings.begin();
+       it != async_pings.pings.end(); ++it) {
+    it->second->canceler.Cancel();
+  }
 }
 
 // TODO: Use something like RSA to make sure the response is
 // from a Google server.
 bool ParsePingResponse(Product product, const char* response) {
+  return ParsePingResponse(product, base::StringPiece(response));
+}
+
+bool ParsePingResponse(Product product, const base::StringPiece& response) {
+  ScopedRlzEntryPoint entry_point("ParsePingResponse");
   rlz_lib::ScopedRlzValueStoreLock lock;
   rlz_lib::RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
     return false;
 
-  std::string response_string(response);
+  // Queued events are older than the response.
+  AppliedPendingEvents applied;
+  ApplyPendingEventsLocked(store, &applied);
+  // The changes below are written all at once.
+  bool parsed = ParsePingResponseLocked(store, product, response);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return parsed && written;
+}
+
+bool ParsePingResponseLocked(RlzValueStore* store, Product product,
+                             const base::StringPiece& response) {
   int response_length = -1;
   if (!IsPingResponseValid(response, &response_length))
     return false;
@@ -509,80 +1339,75 @@ bool ParsePingResponse(Product product, const char* response) {
   if (0 == response_length)
     return true;  // Empty response - no parsing.
 
-  std::string events_variable;
-  std::string stateful_events_variable;
-  base::SStringPrintf(&events_variable, "%s: ", kEventsCgiVariable);
-  base::SStringPrintf(&stateful_events_variable, "%s: ",
-                      kStatefulEventsCgiVariable);
-
-  int rlz_cgi_length = strlen(kRlzCgiVariable);
+  size_t rlz_cgi_length = strlen(kRlzCgiVariable);
 
   // Split response lines. Expected response format is lines of the form:
   // rlzW1: 1R1_____en__252
-  int line_end_index = -1;
-  do {
-    int line_begin = line_end_index + 1;
-    line_end_index = response_string.find("\n", line_begin);
-
-    int line_end = line_end_index;
-    if (line_end < 0)
-      line_end = response_length;
+  size_t line_begin = 0;
+  while (line_begin < response.size()) {
+    size_t line_end = response.find('\n', line_begin);
+    size_t next_line_begin = line_end + 1;
+    if (line_end == base::StringPiece::npos) {
+      line_end = static_cast<size_t>(response_length);
+      next_line_begin = response.size();
+    }
+    base::StringPiece response_line;
+    if (line_end > line_begin)
+      response_line = response.substr(line_begin, line_end - line_begin);
+    line_begin = next_line_begin;
 
-    if (line_end <= line_begin)
+    if (response_line.empty())
       continue;  // Empty line.
 
-    std::string response_line;
-    response_line = response_string.substr(line_begin, line_end - line_begin);
-
-    if (StartsWithASCII(response_line, kRlzCgiVariable, true)) {  // An RLZ.
-      int separator_index = -1;
-      if ((separator_index = response_line.find(": ")) < 0)
+    if (response_line.starts_with(kRlzCgiVariable)) {  // An RLZ.
+      size_t separator_index = response_line.find(": ");
+      if (separator_index == base::StringPiece::npos)
         continue;  // Not a valid key-value pair.
 
       // Get the access point.
-      std::string point_name =
-        response_line.substr(3, separator_index - rlz_cgi_length);
+      char point_name[kMaxRlzLength + 1];
       AccessPoint point = NO_ACCESS_POINT;
-      if (!GetAccessPointFromName(point_name.c_str(), &point) ||
+      if (!CopyToBuffer(response_line.substr(rlz_cgi_length,
+                                             separator_index - rlz_cgi_length),
+                        point_name, arraysize(point_name)) ||
+          !GetAccessPointFromName(point_name, &point) ||
           point == NO_ACCESS_POINT)
         continue;  // Not a valid access point.
 
       // Get the new RLZ.
-      std::string rlz_value(response_line.substr(separator_index + 2));
-      TrimWhitespaceASCII(rlz_value, TRIM_LEADING, &rlz_value);
-
-      int rlz_length = rlz_value.find_first_of("\r\n ");
-      if (rlz_length < 0)
-        rlz_length = rlz_value.size();
-
-      if (rlz_length > kMaxRlzLength)
+      base::StringPiece rlz =
+          GetFieldValue(response_line.substr(separator_index + 2));
+      char rlz_value[kMaxRlzLength + 1];
+      if (!CopyToBuffer(rlz, rlz_value, arraysize(rlz_value)))
         continue;  // Too long.
 
       if (IsAccessPointSupported(point))
-        SetAccessPointRlz(point, rlz_value.substr(0, rlz_length).c_str());
-    } else if (StartsWithASCII(response_line, events_variable, true)) {
+        SetAccessPointRlzLocked(store, point, rlz_value);
+    } else if (IsResponseField(response_line, kEventsCgiVariable)) {
       // Clear events which server parsed.
       std::vector<ReturnedEvent> event_array;
-      GetEventsFromResponseString(response_line, events_variable, &event_array);
+      GetEventsFromResponseString(response_line, kEventsCgiVariable,
+                                  &event_array);
       for (size_t i = 0; i < event_array.size(); ++i) {
-        ClearProductEvent(product, event_array[i].access_point,
-                          event_array[i].event_type);
+        ClearProductEventLocked(store, product, event_array[i].access_point,
+                                event_array[i].event_type);
       }
-    } else if (StartsWithASCII(response_line, stateful_events_variable, true)) {
+    } else if (IsResponseField(response_line, kStatefulEventsCgiVariable)) {
       // Record any stateful events the server send over.
       std::vector<ReturnedEvent> event_array;
-      GetEventsFromResponseString(response_line, stateful_events_variable,
+      GetEventsFromResponseString(response_line, kStatefulEventsCgiVariable,
                                   &event_array);
       for (size_t i = 0; i < event_array.size(); ++i) {
-        RecordStatefulEvent(product, event_array[i].access_point,
-                            event_array[i].event_type);
+        RecordStatefulEventLocked(store, product,
+                                  event_array[i].access_point,
+                                  event_array[i].event_type);
       }
     }
-  } while (line_end_index >= 0);
+  }
 
 #if defined(OS_WIN)
   // Update the DCC in registry if needed.
-  SetMachineDealCodeFromPingResponse(response);
+  SetMachineDealCodeFromPingResponse(response.as_string().c_str());
 #endif
 
   return true;
@@ -602,42 +1427,60 @@ bool GetPingParams(Product product, const AccessPoint* access_points,
     return false;
   }
 
+  ScopedRlzEntryPoint entry_point("GetPingParams");
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                               StoreStripes::AccessPoints());
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
+    return false;
+
+  return GetPingParamsLocked(store, product, access_points, cgi, cgi_size);
+}
+
+bool GetPingParamsLocked(RlzValueStore* store, Product product,
+                         const AccessPoint* access_points,
+                         char* cgi, size_t cgi_size) {
+  // If the store can't list the RLZs, none are reported.
+  std::vector<std::string> rlzs;
+  GetAccessPointRlzsLocked(store, &rlzs);
+  return GetPingParamsForRlzs(rlzs, access_points, cgi, cgi_size);
+}
+
+bool GetPingParamsForRlzs(const std::vector<std::string>& rlzs,
+                          const AccessPoint* access_points,
+                          char* cgi, size_t cgi_size) {
+  cgi[0] = 0;
+
   // Add the RLZ Exchange Protocol version.
   std::string cgi_string(kProtocolCgiArgument);
 
   // Copy the &rlz= over.
   base::StringAppendF(&cgi_string, "&%s=", kRlzCgiVariable);
 
-  {
-    // Now add each of the RLZ's. Keep the lock during all GetAccessPointRlz()
-    // calls below.
-    ScopedRlzValueStoreLock lock;
-    RlzValueStore* store = lock.GetStore();
-    if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
-      return false;
-    bool first_rlz = true;  // comma before every RLZ but the first.
-    for (int i = 0; access_points[i] != NO_ACCESS_POINT; i++) {
-      char rlz[kMaxRlzLength + 1];
-      if (GetAccessPointRlz(access_points[i], rlz, arraysize(rlz))) {
-        const char* access_point = GetAccessPointName(access_points[i]);
-        if (!access_point)
-          continue;
-
-        base::StringAppendF(&cgi_string, "%s%s%s%s",
-                            first_rlz ? "" : kRlzCgiSeparator,
-                            access_point, kRlzCgiIndicator, rlz);
-        first_rlz = false;
-      }
-    }
+  // Now add each of the RLZ's.
+  bool first_rlz = true;  // comma before every RLZ but the first.
+  for (int i = 0; access_points[i] != NO_ACCESS_POINT; i++) {
+    // Supported access points without an RLZ are reported with an empty one.
+    size_t point = access_points[i];
+    if (point >= rlzs.size() || !IsAccessPointSupported(access_points[i]))
+      continue;
+    const char* access_point = GetAccessPointName(access_points[i]);
+    if (!access_point)
+      continue;
+
+    base::StringAppendF(&cgi_string, "%s%s%s%s",
+                        first_rlz ? "" : kRlzCgiSeparator,
+                        access_point, kRlzCgiIndicator, rlzs[point].c_str());
+    first_rlz = false;
+  }
 
 #if defined(OS_WIN)
-    // Report the DCC too if not empty. DCCs are windows-only.
-    char dcc[kMaxDccLength + 1];
-    dcc[0] = 0;
-    if (GetMachineDealCode(dcc, arraysize(dcc)) && dcc[0])
-      base::StringAppendF(&cgi_string, "&%s=%s", kDccCgiVariable, dcc);
+  // Report the DCC too if not empty. DCCs are windows-only.
+  char dcc[kMaxDccLength + 1];
+  dcc[0] = 0;
+  if (GetMachineDealCode(dcc, arraysize(dcc)) && dcc[0])
+    base::StringAppendF(&cgi_string, "&%s=%s", kDccCgiVariable, dcc);
 #endif
-  }
 
   if (cgi_string.size() >= cgi_size)
     return false;
@@ -648,4 +1491,33 @@ bool GetPingParams(Product product, const AccessPoint* access_points,
   return true;
 }
 
+namespace testing {
+
+int SendFinancialPingAsyncForTesting(Product product,
+                                     const AccessPoint* access_points,
+                                     const char* product_signature,
+                                     const char* product_brand,
+                                     const char* product_id,
+                                     const char* product_lang,
+                                     bool exclude_machine_id,
+                                     bool skip_time_check,
+                                     base::TaskRunner* task_runner,
+                                     const FinancialPingCallback& callback,
+                                     FinancialPing::PingServerFunction server) {
+  return PostFinancialPing(product, access_points, product_signature,
+                           product_brand, product_id, product_lang,
+                           exclude_machine_id, skip_time_check, task_runner,
+                           callback, server);
+}
+
+bool SendSequentialFinancialPingsForTesting(
+    const FinancialPingProduct* products, size_t count, bool skip_time_check,
+    bool* pinged, FinancialPing::PingServerFunction server) {
+  return SendSequentialFinancialPingsWithServer(products, count,
+                                                skip_time_check, pinged,
+                                                server);
+}
+
+}  // namespace testing
+
 }  // namespace rlz_lib
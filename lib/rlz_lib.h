@@ -14,7 +14,9 @@
 
 #include <stdio.h>
 #include <string>
+#include <utility>
 
+#include "base/callback_forward.h"
 #include "build/build_config.h"
 
 #include "rlz/lib/rlz_enums.h"
@@ -50,6 +52,11 @@ class URLRequestContextGetter;
 }  // namespace net
 #endif
 
+namespace base {
+class StringPiece;
+class TaskRunner;
+}  // namespace base
+
 namespace rlz_lib {
 
 class ScopedRlzValueStoreLock;
@@ -67,7 +74,8 @@ const int kMaxPingResponseLength = 0x4000;  // 16K
 #if defined(RLZ_NETWORK_IMPLEMENTATION_CHROME_NET)
 // Set the URLRequestContextGetter used by SendFinancialPing(). The IO message
 // loop returned by this context will be used for the IO done by
-// SendFinancialPing().
+// SendFinancialPing(), which waits for it, so pings must not be sent on that
+// thread.
 bool RLZ_LIB_API SetURLRequestContext(net::URLRequestContextGetter* context);
 #endif
 
@@ -94,6 +102,18 @@ bool RLZ_LIB_API RecordProductEvent(Product product, AccessPoint point,
 bool RLZ_LIB_API ClearProductEvent(Product product, AccessPoint point,
                                    Event event_id);
 
+// Records or clears |count| events of this product, like the functions above,
+// under one lock and with one write of the store. If |results| isn't NULL, it
+// must have room for |count| values and is set to whether each change was
+// made. Returns true if all were.
+// Access: HKCU write.
+bool RLZ_LIB_API RecordProductEvents(
+    Product product, const std::pair<AccessPoint, Event>* events,
+    size_t count, bool* results);
+bool RLZ_LIB_API ClearProductEvents(
+    Product product, const std::pair<AccessPoint, Event>* events,
+    size_t count, bool* results);
+
 // Clear all reported events and recorded stateful events of this product.
 // This should be called on complete uninstallation of the product.
 // Access: HKCU write.
@@ -121,6 +141,20 @@ void RLZ_LIB_API ClearProductState(Product product,
 bool RLZ_LIB_API GetAccessPointRlz(AccessPoint point, char* rlz,
                                    size_t rlz_size);
 
+// An access point and its RLZ, as returned by GetAccessPointRlzs().
+struct AccessPointRlz {
+  AccessPoint point;
+  char rlz[kMaxRlzLength + 1];
+};
+
+// Copies the access points that have an RLZ, in the order of their values,
+// into |rlzs|, reading the store once. Sets |count| to how many there are.
+// Returns false if they don't all fit into the |rlzs_size| entries of |rlzs|,
+// which then has the first |rlzs_size| of them.
+// Access: HKCU read.
+bool RLZ_LIB_API GetAccessPointRlzs(AccessPointRlz* rlzs, size_t rlzs_size,
+                                    size_t* count);
+
 // Set the RLZ for the access-point. Fails and asserts if called when the access
 // point is not set to Google.
 // new_rlz should come from a server-response. Client applications should not
@@ -128,6 +162,68 @@ bool RLZ_LIB_API GetAccessPointRlz(AccessPoint point, char* rlz,
 // Access: HKCU write.
 bool RLZ_LIB_API SetAccessPointRlz(AccessPoint point, const char* new_rlz);
 
+// Non-blocking storage functions.
+// The functions above wait for other threads and processes that use the store,
+// for up to 5 seconds. These don't wait: if the store is locked, they return
+// TRY_BUSY or, for changes, queue the change and return TRY_QUEUED.
+//
+// Queued changes are made by a background thread once the store is unlocked,
+// or earlier by the next call in this process that writes events to the
+// store, or by FlushPendingEvents(). The thread gives up after a few retries
+// with growing delays if the store stays locked or can't be written; the
+// changes stay queued then. Until they are made, functions that read events
+// in this process see them, other processes don't. They are kept in process
+// memory, so call FlushPendingEvents() before the process exits.
+// Queued changes are for the default brand; they are not made while a
+// SupplementaryBranding is in effect.
+
+enum TryResult {
+  TRY_OK,      // The call succeeded.
+  TRY_QUEUED,  // The store was locked, the change was queued.
+  TRY_BUSY,    // The store was locked, nothing was done.
+  TRY_FAILED,  // The call failed, like the blocking function returning false.
+};
+
+// Like RecordProductEvent(), but queues the event if the store is locked.
+// Access: HKCU write.
+TryResult RLZ_LIB_API TryRecordProductEvent(Product product, AccessPoint point,
+                                            Event event_id);
+
+// Like ClearProductEvent(), but queues the change if the store is locked.
+// Access: HKCU write.
+TryResult RLZ_LIB_API TryClearProductEvent(Product product, AccessPoint point,
+                                           Event event_id);
+
+// Like GetProductEventsAsCgi(), but returns TRY_BUSY if the store is locked.
+// Access: HKCU read.
+TryResult RLZ_LIB_API TryGetProductEventsAsCgi(Product product,
+                                               char* unescaped_cgi,
+                                               size_t unescaped_cgi_size);
+
+// Like GetAccessPointRlz(), but returns TRY_BUSY if the store is locked.
+// Access: HKCU read.
+TryResult RLZ_LIB_API TryGetAccessPointRlz(AccessPoint point, char* rlz,
+                                           size_t rlz_size);
+
+// Writes the queued event changes to the store, waiting for the lock like
+// RecordProductEvent(). Changes that couldn't be made or written stay queued.
+// Returns true if all of them were written, or if there were none.
+// Access: HKCU write.
+bool RLZ_LIB_API FlushPendingEvents();
+
+// Buffered event recording.
+// When enabled, RecordProductEvent() doesn't lock the store. It queues the
+// event like TryRecordProductEvent() and returns true, and a background thread
+// writes the events queued within 50 ms in one lock scope. Functions that read
+// events see the queued ones. Events recorded while a SupplementaryBranding is
+// in effect are written right away.
+//
+// Disabling buffering stops the thread and flushes the queue; this is also
+// done at exit, which needs a base::AtExitManager. Don't call this with the
+// store locked. Returns false if the thread can't be started or the queue
+// can't be flushed.
+bool RLZ_LIB_API SetEventBuffering(bool enabled);
+
 // Financial Server pinging functions.
 // These functions deal with pinging the RLZ financial server and parsing and
 // acting upon the response. Clients should SendFinancialPing() to avoid needing
@@ -190,6 +286,24 @@ bool RLZ_LIB_API PingFinancialServer(Product product,
 bool RLZ_LIB_API IsPingResponseValid(const char* response,
                                      int* checksum_idx);
 
+// Versions of the three functions above for callers that use std::strings.
+// They append the request or response to |request| or |response| instead of
+// copying it through a buffer, and take the request or response as a
+// StringPiece, which needn't be NUL-terminated.
+bool RLZ_LIB_API FormFinancialPingRequest(Product product,
+                                          const AccessPoint* access_points,
+                                          const char* product_signature,
+                                          const char* product_brand,
+                                          const char* product_id,
+                                          const char* product_lang,
+                                          bool exclude_machine_id,
+                                          std::string* request);
+bool RLZ_LIB_API PingFinancialServer(Product product,
+                                     const base::StringPiece& request,
+                                     std::string* response);
+bool RLZ_LIB_API IsPingResponseValid(const base::StringPiece& response,
+                                     int* checksum_idx);
+
 
 // Complex helpers built on top of other functions.
 
@@ -199,6 +313,8 @@ bool RLZ_LIB_API IsPingResponseValid(const char* response,
 // Access: HKCU write.
 bool RLZ_LIB_API ParseFinancialPingResponse(Product product,
                                             const char* response);
+bool RLZ_LIB_API ParseFinancialPingResponse(Product product,
+                                            const base::StringPiece& response);
 
 // Send the ping with RLZs and events to the PSO server.
 // This ping method should be called daily. (More frequent calls will fail).
@@ -238,10 +354,112 @@ bool RLZ_LIB_API SendFinancialPing(Product product,
                                    bool exclude_machine_id,
                                    const bool skip_time_check);
 
+// How long the stages of a SendFinancialPing() call took, in microseconds.
+// Stages that didn't run are 0. Other processes only wait for the store lock
+// while it is held, so the hold times are what the ping costs them.
+struct FinancialPingTimings {
+  // Forming the request, checking whether it's time to ping and updating the
+  // last ping time, under one write lock. The hold time includes writing the
+  // store.
+  int snapshot_lock_wait_us;
+  int snapshot_lock_hold_us;
+  // Sending the ping and waiting for the response, without the lock.
+  int network_us;
+  // Applying the response, under one write lock. The hold time includes
+  // writing the store.
+  int apply_lock_wait_us;
+  int apply_lock_hold_us;
+};
+
+// Like SendFinancialPing() above, and also fills in |timings| if it's not
+// NULL.
+bool RLZ_LIB_API SendFinancialPing(Product product,
+                                   const AccessPoint* access_points,
+                                   const char* product_signature,
+                                   const char* product_brand,
+                                   const char* product_id,
+                                   const char* product_lang,
+                                   bool exclude_machine_id,
+                                   const bool skip_time_check,
+                                   FinancialPingTimings* timings);
+
+// Asynchronous financial pings.
+// SendFinancialPing() blocks the calling thread until the server answers, for
+// up to several minutes if it doesn't. These run the same ping on another
+// thread instead, and can be canceled, so that a process that shuts down
+// doesn't wait for a stalled ping.
+
+// Called with the result of a SendFinancialPingAsync() call, which is false
+// if the ping was canceled.
+typedef base::Callback<void(bool)> FinancialPingCallback;
+
+// Like SendFinancialPing() above, but returns right away. The ping, including
+// reading the store and applying the response, runs on |task_runner|, or on a
+// worker pool thread if it's NULL, and then runs |callback| there, unless it's
+// null. When pings use chrome's network stack, |task_runner| must not run its
+// tasks on the IO thread of the context given to SetURLRequestContext().
+//
+// Returns an id for CancelFinancialPing(), or 0 if the ping couldn't be
+// posted or a SupplementaryBranding is in effect: it holds the store lock on
+// this thread, so the ping couldn't run.
+int RLZ_LIB_API SendFinancialPingAsync(Product product,
+                                       const AccessPoint* access_points,
+                                       const char* product_signature,
+                                       const char* product_brand,
+                                       const char* product_id,
+                                       const char* product_lang,
+                                       bool exclude_machine_id,
+                                       bool skip_time_check,
+                                       base::TaskRunner* task_runner,
+                                       const FinancialPingCallback& callback);
+
+// Cancels a SendFinancialPingAsync() ping. A ping that hasn't started doesn't
+// touch the store; one that waits for the server stops waiting and doesn't
+// apply a response. Its callback still runs.
+// Returns false if the ping already finished.
+bool RLZ_LIB_API CancelFinancialPing(int ping_id);
+
+// Cancels all SendFinancialPingAsync() pings that haven't finished, like
+// CancelFinancialPing().
+void RLZ_LIB_API CancelAllFinancialPings();
+
+// Sequential financial pings of several products under shared locks.
+// Products that each call SendFinancialPing() each lock the store twice and
+// write it twice. SendSequentialFinancialPings() does that once for all of
+// them. The pings are still sent one after the other as separate requests,
+// since the financial server only understands the request of a single
+// product.
+
+// A product of SendSequentialFinancialPings(), with the arguments of its
+// SendFinancialPing() call.
+struct FinancialPingProduct {
+  Product product;
+  const AccessPoint* access_points;
+  const char* product_signature;
+  const char* product_brand;
+  const char* product_id;
+  const char* product_lang;
+  bool exclude_machine_id;
+};
+
+// Like SendFinancialPing() for each of the |count| |products|, but forms the
+// requests of the products that are due and updates their last ping times
+// under one lock, sends the requests one after the other, and applies the
+// responses under one lock.
+//
+// Sets |pinged|[i], if |pinged| is not NULL, to whether the ping of
+// |products|[i] was sent and its response applied. Returns true if any was.
+// Access: HKCU write.
+bool RLZ_LIB_API SendSequentialFinancialPings(
+    const FinancialPingProduct* products, size_t count, bool skip_time_check,
+    bool* pinged);
+
 // Parses RLZ related ping response information from the server.
 // Updates stored RLZ values and clears stored events accordingly.
 // Access: HKCU write.
 bool RLZ_LIB_API ParsePingResponse(Product product, const char* response);
+bool RLZ_LIB_API ParsePingResponse(Product product,
+                                   const base::StringPiece& response);
 
 
 // Copies the events associated with the product and the RLZ's for each access
@@ -254,6 +472,51 @@ bool RLZ_LIB_API GetPingParams(Product product,
                                const AccessPoint* access_points,
                                char* unescaped_cgi, size_t unescaped_cgi_size);
 
+// Store lock statistics.
+// Every public function that uses the store takes the store lock, waiting for
+// other threads and processes that hold it. These count, per function, how
+// long this process waited for the lock and held it. Nested locks are part of
+// the function's lock scope and are not counted separately; functions called
+// by other ones count for the caller, so SendFinancialPing() includes the locks
+// of the functions it calls.
+
+// Bucket 0 of the LockStats histograms counts durations under 1 ms, bucket i
+// durations from 2^(i-1) ms to under 2^i ms, and the last bucket all longer
+// ones.
+const int kLockStatsBuckets = 16;
+// The maximum length of a function name in LockStats, including the NUL.
+const int kMaxEntryPointLength = 48;
+
+struct LockStats {
+  // Lock scopes that got the store, that gave up because others held the
+  // lock until the timeout, and that failed otherwise.
+  int acquired;
+  int timeouts;
+  int failures;
+  // How long lock scopes waited for the lock, whatever the outcome, and held
+  // it, by duration.
+  int wait_histogram[kLockStatsBuckets];
+  int hold_histogram[kLockStatsBuckets];
+  int total_wait_ms;
+  int total_hold_ms;
+  int max_wait_us;
+  int max_hold_us;
+  // Who held the lock at the last timeout: the process ID, or 0 if unknown,
+  // and the public function the lock was taken for, or "" if unknown. Other
+  // processes are only known on linux.
+  int last_timeout_holder_pid;
+  char last_timeout_holder[kMaxEntryPointLength];
+};
+
+// Fills in |stats| for the lock scopes of the public function |entry_point|,
+// for example "RecordProductEvent", or of all functions if it is NULL. Locks
+// taken outside of the public functions count as "Other". Counts lock scopes
+// since this process started or ResetLockStats() was called.
+bool RLZ_LIB_API GetLockStats(const char* entry_point, LockStats* stats);
+
+// Sets all lock statistics to zero.
+void RLZ_LIB_API ResetLockStats();
+
 #if defined(OS_WIN)
 // OEM Deal confirmation storage functions. OEM Deals are windows-only.
 
@@ -290,6 +553,34 @@ bool RLZ_LIB_API SetMachineDealCodeFromPingResponse(const char* response);
 
 #endif
 
+#if defined(OS_LINUX)
+// How writes to the RLZ store are made durable. The store is written to the
+// page cache when the lock is released; these modes also fsync() it.
+enum StoreSyncMode {
+  // Leave the write-back to the kernel. This is the default.
+  STORE_SYNC_NONE,
+  // fsync() the store after each write, before the lock is released.
+  STORE_SYNC_EACH_COMMIT,
+  // fsync() the store after the lock is released. One process syncs at a
+  // time; writers whose changes reach the store while it does share the next
+  // fsync().
+  STORE_SYNC_GROUP_COMMIT,
+};
+
+// Sets how the store is made durable. In STORE_SYNC_GROUP_COMMIT mode, a
+// writer whose changes aren't synced yet first waits |max_commit_delay_ms|
+// for more writers to join it, before it queues up for the sync. So a write
+// can be delayed by up to that long plus the fsync() of the group before it.
+// Should be called before any other function of this library.
+void RLZ_LIB_API SetStoreSyncMode(StoreSyncMode mode, int max_commit_delay_ms);
+
+// Makes this process use the rlz broker when one serves the store, see
+// linux/lib/rlz_broker_linux.h. Lock scopes then run in the broker process
+// instead of locking and loading the store files in this one. Without a
+// running broker, the files are used like before. Off by default.
+void RLZ_LIB_API SetRlzBrokerEnabled(bool enabled);
+#endif
+
 // Segment RLZ persistence based on branding information.
 // All information for a given product is persisted under keys with the either
 // product's name or its access point's name.  This assumes that only
@@ -324,8 +615,14 @@ class SupplementaryBranding {
   SupplementaryBranding(const char* brand);
   ~SupplementaryBranding();
 
+  // Returns the brand in effect, or an empty string. Only call this with the
+  // store locked, the brand changes under the lock.
   static const std::string& GetBrand();
 
+  // Returns true if a supplementary brand is in effect. Unlike GetBrand(),
+  // this can be called without the store lock.
+  static bool IsInEffect();
+
  private:
   ScopedRlzValueStoreLock* lock_;
 };
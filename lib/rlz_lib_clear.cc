@@ -10,18 +10,32 @@
 
 #include "rlz/lib/rlz_lib.h"
 
+#include "base/atomicops.h"
 #include "base/lazy_instance.h"
 #include "rlz/lib/assert.h"
+#include "rlz/lib/lock_stats.h"
+#include "rlz/lib/pending_events.h"
+#include "rlz/lib/rlz_lib_locked.h"
 #include "rlz/lib/rlz_value_store.h"
 
 namespace rlz_lib {
 
 bool ClearAllProductEvents(Product product) {
+  ScopedRlzEntryPoint entry_point("ClearAllProductEvents");
   rlz_lib::ScopedRlzValueStoreLock lock;
   rlz_lib::RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
     return false;
 
+  AppliedPendingEvents applied;
+  ApplyPendingEventsLocked(store, &applied);
+  bool result = ClearAllProductEventsLocked(store, product);
+  bool written = lock.Commit();
+  applied.FinishLocked(written);
+  return result && written;
+}
+
+bool ClearAllProductEventsLocked(RlzValueStore* store, Product product) {
   bool result;
   result = store->ClearAllProductEvents(product);
   result &= store->ClearAllStatefulEvents(product);
@@ -29,13 +43,16 @@ bool ClearAllProductEvents(Product product) {
 }
 
 void ClearProductState(Product product, const AccessPoint* access_points) {
+  ScopedRlzEntryPoint entry_point("ClearProductState");
   rlz_lib::ScopedRlzValueStoreLock lock;
   rlz_lib::RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
     return;
 
-  // Delete all product specific state.
-  VERIFY(ClearAllProductEvents(product));
+  // Delete all product specific state, including queued events.
+  AppliedPendingEvents applied;
+  ApplyPendingEventsLocked(store, &applied);
+  VERIFY(ClearAllProductEventsLocked(store, product));
   VERIFY(store->ClearPingTime(product));
 
   // Delete all RLZ's for access points being uninstalled.
@@ -46,9 +63,13 @@ void ClearProductState(Product product, const AccessPoint* access_points) {
   }
 
   store->CollectGarbage();
+  applied.FinishLocked(lock.Commit());
 }
 
 static base::LazyInstance<std::string>::Leaky g_supplemental_branding;
+// Set while |g_supplemental_branding| isn't empty. Unlike the string, it can
+// be read without the store lock.
+static base::subtle::Atomic32 g_supplemental_branding_in_effect = 0;
 
 SupplementaryBranding::SupplementaryBranding(const char* brand)
     : lock_(new ScopedRlzValueStoreLock) {
@@ -66,11 +87,14 @@ SupplementaryBranding::SupplementaryBranding(const char* brand)
   }
 
   g_supplemental_branding.Get() = brand;
+  base::subtle::Release_Store(&g_supplemental_branding_in_effect, 1);
 }
 
 SupplementaryBranding::~SupplementaryBranding() {
-  if (lock_->GetStore())
+  if (lock_->GetStore()) {
+    base::subtle::Release_Store(&g_supplemental_branding_in_effect, 0);
     g_supplemental_branding.Get().clear();
+  }
   delete lock_;
 }
 
@@ -79,4 +103,9 @@ const std::string& SupplementaryBranding::GetBrand() {
   return g_supplemental_branding.Get();
 }
 
+// static
+bool SupplementaryBranding::IsInEffect() {
+  return base::subtle::Acquire_Load(&g_supplemental_branding_in_effect) != 0;
+}
+
 }  // namespace rlz_lib
@@ -0,0 +1,65 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Versions of the rlz_lib functions for callers that already hold a
+// ScopedRlzValueStoreLock. Composite functions call these, so that a public
+// call takes the lock and checks access to the store once, instead of once
+// per nested call.
+//
+// |store| is the store of the caller's lock. Callers must have checked that it
+// has read access, or write access for the functions that write. Buffers must
+// be non-NULL and non-empty.
+
+#ifndef RLZ_LIB_RLZ_LIB_LOCKED_H_
+#define RLZ_LIB_RLZ_LIB_LOCKED_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/string_piece.h"
+#include "rlz/lib/rlz_enums.h"
+
+namespace rlz_lib {
+
+class RlzValueStore;
+
+// Event storage functions.
+bool RecordProductEventLocked(RlzValueStore* store, Product product,
+                              AccessPoint point, Event event);
+bool RecordStatefulEventLocked(RlzValueStore* store, Product product,
+                               AccessPoint point, Event event);
+bool ClearProductEventLocked(RlzValueStore* store, Product product,
+                             AccessPoint point, Event event);
+bool GetProductEventsAsCgiLocked(RlzValueStore* store, Product product,
+                                 char* cgi, size_t cgi_size);
+
+// Defined in rlz_lib_clear.cc.
+bool ClearAllProductEventsLocked(RlzValueStore* store, Product product);
+
+// RLZ storage functions.
+bool GetAccessPointRlzLocked(RlzValueStore* store, AccessPoint point,
+                             char* rlz, size_t rlz_size);
+bool SetAccessPointRlzLocked(RlzValueStore* store, AccessPoint point,
+                             const char* new_rlz);
+// Sets |rlzs| to the RLZ of every access point, indexed by AccessPoint, with
+// "" for those that have none or aren't supported. Leaves |rlzs| empty if the
+// store can't list them.
+bool GetAccessPointRlzsLocked(RlzValueStore* store,
+                              std::vector<std::string>* rlzs);
+
+// Financial server pinging functions.
+bool GetPingParamsLocked(RlzValueStore* store, Product product,
+                         const AccessPoint* access_points,
+                         char* cgi, size_t cgi_size);
+// Like GetPingParamsLocked(), with |rlzs| from GetAccessPointRlzsLocked().
+bool GetPingParamsForRlzs(const std::vector<std::string>& rlzs,
+                          const AccessPoint* access_points,
+                          char* cgi, size_t cgi_size);
+bool ParsePingResponseLocked(RlzValueStore* store, Product product,
+                             const base::StringPiece& response);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_RLZ_LIB_LOCKED_H_
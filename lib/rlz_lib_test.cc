@@ -13,12 +13,30 @@
 // The "GGLA" brand is used to test the normal code flow of the code, and the
 // "TEST" brand is used to test the supplementary brand code code flow.
 
+#include <algorithm>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/file_util.h"
 #include "base/logging.h"
+#include "base/memory/ref_counted.h"
 #include "base/memory/scoped_ptr.h"
+#include "base/string_piece.h"
+#include "base/stringprintf.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/task_runner.h"
+#include "base/threading/platform_thread.h"
+#include "base/threading/simple_thread.h"
+#include "base/time.h"
 #include "testing/gmock/include/gmock/gmock.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
+#include "rlz/lib/crc32.h"
+#include "rlz/lib/financial_ping.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/pending_events.h"
 #include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
 #include "rlz/test/rlz_test_helpers.h"
 
 #if defined(OS_WIN)
@@ -26,6 +44,15 @@
 #include "rlz/win/lib/machine_deal.h"
 #endif
 
+#if defined(OS_LINUX)
+#include <sys/stat.h>
+#endif
+
+#if defined(OS_LINUX)
+#include <malloc.h>
+#include <pthread.h>
+#endif
+
 #if defined(RLZ_NETWORK_IMPLEMENTATION_CHROME_NET)
 #include "base/mac/scoped_nsautorelease_pool.h"
 #include "base/threading/thread.h"
@@ -33,6 +60,63 @@
 #endif
 
 
+#if defined(OS_LINUX) && defined(__GLIBC__)
+#if !__GLIBC_PREREQ(2, 34)
+#define HAS_ALLOCATION_COUNTER
+#endif
+#endif
+
+#if defined(HAS_ALLOCATION_COUNTER)
+extern "C" void* __libc_malloc(size_t size);
+
+// Counts the heap allocations of at least |min_size| bytes that the thread
+// that creates it makes while it exists, for the tests that check how many a
+// call makes. Only one can exist at a time.
+class ScopedAllocationCounter {
+ public:
+  explicit ScopedAllocationCounter(size_t min_size)
+      : min_size_(min_size), count_(0), old_hook_(__malloc_hook) {
+    CHECK(!current_);
+    thread_ = pthread_self();
+    current_ = this;
+    __malloc_hook = &CountingMalloc;
+  }
+
+  ~ScopedAllocationCounter() {
+    __malloc_hook = old_hook_;
+    current_ = NULL;
+  }
+
+  int count() const { return count_; }
+
+ private:
+  typedef void* (*MallocHook)(size_t size, const void* caller);
+
+  static void* CountingMalloc(size_t size, const void* caller) {
+    // Only the counting thread can see its counter go away.
+    ScopedAllocationCounter* counter = NULL;
+    if (pthread_equal(thread_, pthread_self()))
+      counter = current_;
+    if (counter && size >= counter->min_size_)
+      ++counter->count_;
+    MallocHook old_hook = counter ? counter->old_hook_ : NULL;
+    return old_hook ? old_hook(size, caller) : __libc_malloc(size);
+  }
+
+  static pthread_t thread_;
+  static ScopedAllocationCounter* current_;
+
+  size_t min_size_;
+  int count_;
+  MallocHook old_hook_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedAllocationCounter);
+};
+
+pthread_t ScopedAllocationCounter::thread_;
+ScopedAllocationCounter* ScopedAllocationCounter::current_ = NULL;
+#endif
+
 class MachineDealCodeHelper
 #if defined(OS_WIN)
     : public rlz_lib::MachineDealCode
@@ -118,6 +202,45 @@ TEST_F(RlzLibTest, ClearProductEvent) {
 }
 
 
+TEST_F(RlzLibTest, RecordProductEvents) {
+  char cgi_50[50];
+  const std::pair<rlz_lib::AccessPoint, rlz_lib::Event> kEvents[] = {
+    std::make_pair(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE),
+    std::make_pair(rlz_lib::IE_HOME_PAGE, rlz_lib::INVALID_EVENT),
+    std::make_pair(rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL),
+  };
+  bool results[arraysize(kEvents)];
+
+  // The invalid event fails, the others are recorded.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_FALSE(rlz_lib::RecordProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+                                            kEvents, arraysize(kEvents),
+                                            results));
+  EXPECT_TRUE(results[0]);
+  EXPECT_FALSE(results[1]);
+  EXPECT_TRUE(results[2]);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S,W1I", cgi_50);
+
+  // Without the invalid event, clearing them all succeeds.
+  const std::pair<rlz_lib::AccessPoint, rlz_lib::Event> kValidEvents[] = {
+    kEvents[0], kEvents[2],
+  };
+  EXPECT_TRUE(rlz_lib::ClearProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+                                          kValidEvents,
+                                          arraysize(kValidEvents), results));
+  EXPECT_TRUE(results[0]);
+  EXPECT_TRUE(results[1]);
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              cgi_50, 50));
+  EXPECT_STREQ("", cgi_50);
+
+  // An empty batch has nothing to fail.
+  EXPECT_TRUE(rlz_lib::RecordProductEvents(rlz_lib::TOOLBAR_NOTIFIER, NULL, 0,
+                                           NULL));
+}
+
 TEST_F(RlzLibTest, GetProductEventsAsCgi) {
   char cgi_50[50];
   char cgi_1[1];
@@ -153,6 +276,93 @@ TEST_F(RlzLibTest, ClearAllAllProductEvents) {
   EXPECT_STREQ("", cgi_50);
 }
 
+TEST_F(RlzLibTest, BufferedRecordProductEvent) {
+  char cgi_50[50];
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(true));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+
+  // Whether or not the flusher wrote them yet, reads see them.
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S,W1I", cgi_50);
+
+  // Clearing an event isn't buffered, and makes the queued changes first.
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::GD_DESKBAND, rlz_lib::INSTALL));
+
+  // Disabling buffering writes the queue to the store.
+  EXPECT_TRUE(rlz_lib::SetEventBuffering(false));
+  {
+    rlz_lib::ScopedRlzValueStoreLock lock(
+        rlz_lib::RlzValueStore::kReadAccess);
+    ASSERT_TRUE(lock.GetStore());
+    std::vector<std::string> events;
+    EXPECT_TRUE(lock.GetStore()->ReadProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+                                                   &events));
+    std::sort(events.begin(), events.end());
+    ASSERT_EQ(2u, events.size());
+    EXPECT_EQ("D1I", events[0]);
+    EXPECT_EQ("I7S", events[1]);
+  }
+}
+
+class EventRecorder : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit EventRecorder(int count) : count_(count) {}
+
+  virtual void Run() OVERRIDE {
+    const rlz_lib::AccessPoint kPoints[] = {
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::IE_HOME_PAGE,
+      rlz_lib::IETB_SEARCH_BOX, rlz_lib::GD_DESKBAND,
+    };
+    for (int i = 0; i < count_; ++i) {
+      EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+          kPoints[i % arraysize(kPoints)], rlz_lib::INSTALL));
+    }
+  }
+
+ private:
+  int count_;
+};
+
+// Records events from 1 to 64 threads at once, with and without buffering,
+// and prints how many RecordProductEvent() calls per second they complete.
+// Run with --gtest_also_run_disabled_tests.
+TEST_F(RlzLibTest, DISABLED_BenchmarkRecordingThreads) {
+  const int kThreads[] = { 1, 2, 4, 8, 16, 32, 64 };
+  const int kEventsPerThread = 50;
+
+  printf("threads   direct/s   buffered/s\n");
+  for (size_t t = 0; t < arraysize(kThreads); ++t) {
+    double rates[2];
+    for (int buffered = 0; buffered < 2; ++buffered) {
+      EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+      ASSERT_TRUE(rlz_lib::SetEventBuffering(buffered != 0));
+
+      EventRecorder recorder(kEventsPerThread);
+      base::DelegateSimpleThreadPool pool("rlz_recorder", kThreads[t]);
+      pool.AddWork(&recorder, kThreads[t]);
+      base::TimeTicks start = base::TimeTicks::Now();
+      pool.Start();
+      pool.JoinAll();
+      // Buffered events only count once they are in the store.
+      EXPECT_TRUE(rlz_lib::SetEventBuffering(false));
+      base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+
+      rates[buffered] =
+          kThreads[t] * kEventsPerThread / elapsed.InSecondsF();
+    }
+    printf("%7d %10.0f %12.0f\n", kThreads[t], rates[0], rates[1]);
+  }
+}
+
 TEST_F(RlzLibTest, SetAccessPointRlz) {
   char rlz_50[50];
   EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, ""));
@@ -177,6 +387,32 @@ TEST_F(RlzLibTest, GetAccessPointRlz) {
   EXPECT_STREQ("IeTbRlz", rlz_50);
 }
 
+TEST_F(RlzLibTest, GetAccessPointRlzs) {
+  size_t count = 1;
+  rlz_lib::AccessPointRlz rlzs[3];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlzs(rlzs, arraysize(rlzs), &count));
+  EXPECT_EQ(0u, count);
+
+  // Access points without an RLZ are left out, the others come in order.
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, ""));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_DEFAULT_SEARCH,
+                                         "IeSearchRlz"));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlzs(rlzs, arraysize(rlzs), &count));
+  ASSERT_EQ(2u, count);
+  EXPECT_EQ(rlz_lib::IE_DEFAULT_SEARCH, rlzs[0].point);
+  EXPECT_STREQ("IeSearchRlz", rlzs[0].rlz);
+  EXPECT_EQ(rlz_lib::IETB_SEARCH_BOX, rlzs[1].point);
+  EXPECT_STREQ("IeTbRlz", rlzs[1].rlz);
+
+  // Too small an array gets the first ones, and the count of all.
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlzs(rlzs, 1, &count));
+  EXPECT_EQ(2u, count);
+  EXPECT_EQ(rlz_lib::IE_DEFAULT_SEARCH, rlzs[0].point);
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlzs(NULL, 0, &count));
+  EXPECT_EQ(2u, count);
+}
+
 TEST_F(RlzLibTest, GetPingParams) {
   MachineDealCodeHelper::Clear();
 
@@ -297,6 +533,75 @@ TEST_F(RlzLibTest, IsPingResponseValid) {
     EXPECT_TRUE(rlz_lib::IsPingResponseValid(kGoodPingResponses[i], NULL));
 }
 
+#if defined(HAS_ALLOCATION_COUNTER)
+// The std::string versions of the ping functions don't copy the request or
+// response through temporaries.
+TEST_F(RlzLibTest, PingStringOverloadsDontCopy) {
+  const std::string kPingResponse(
+    "rlzT4: 1T4_____en__252\r\n"
+    "events: I7S,W1I\r\n"
+    "stateful-events: W1I\r\n"
+    "rlz\r\n"
+    "dcc: dcc_value\r\n"
+    "crc32: D6EE729");
+
+  int checksum_idx = -1;
+  {
+    ScopedAllocationCounter allocations(0);
+    EXPECT_TRUE(rlz_lib::IsPingResponseValid(kPingResponse, &checksum_idx));
+    EXPECT_EQ(0, allocations.count());
+  }
+  {
+    ScopedAllocationCounter allocations(0);
+    EXPECT_TRUE(rlz_lib::IsPingResponseValid(kPingResponse.c_str(), NULL));
+    EXPECT_EQ(0, allocations.count());
+  }
+  EXPECT_EQ(static_cast<int>(kPingResponse.find("\ncrc32")), checksum_idx);
+
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // Reading the store allocates, but only forming a request into a buffer
+  // allocates as much as the request takes, for the string it's formed in.
+  // Both are called once first, so that lazily created state doesn't count.
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+
+  char request_buffer[rlz_lib::kMaxCgiLength + 1];
+  std::string request;
+  request.reserve(arraysize(request_buffer));
+  EXPECT_TRUE(rlz_lib::FormFinancialPingRequest(rlz_lib::TOOLBAR_NOTIFIER,
+      points, "swg", "GGLA", "SwgProductId1234", "en-UK", false,
+      request_buffer, arraysize(request_buffer)));
+  EXPECT_TRUE(rlz_lib::FormFinancialPingRequest(rlz_lib::TOOLBAR_NOTIFIER,
+      points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, &request));
+  size_t request_size = request.size();
+
+  {
+    ScopedAllocationCounter allocations(request_size + 1);
+    EXPECT_TRUE(rlz_lib::FormFinancialPingRequest(rlz_lib::TOOLBAR_NOTIFIER,
+        points, "swg", "GGLA", "SwgProductId1234", "en-UK", false,
+        request_buffer, arraysize(request_buffer)));
+    EXPECT_EQ(1, allocations.count());
+  }
+
+  request.clear();
+  {
+    ScopedAllocationCounter allocations(request_size + 1);
+    EXPECT_TRUE(rlz_lib::FormFinancialPingRequest(rlz_lib::TOOLBAR_NOTIFIER,
+        points, "swg", "GGLA", "SwgProductId1234", "en-UK", false,
+        &request));
+    EXPECT_EQ(0, allocations.count());
+  }
+
+  EXPECT_STREQ(request_buffer, request.c_str());
+}
+#endif
+
 TEST_F(RlzLibTest, ParsePingResponse) {
   const char* kPingResponse =
     "version: 3.0.914.7250\r\n"
@@ -472,6 +777,350 @@ TEST_F(RlzLibTest, SendFinancialPing) {
       /*skip_time_check=*/true);
 }
 
+TEST_F(RlzLibTest, SendFinancialPingWhenNotDue) {
+  // Pinged just now, without events since.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::FinancialPing::UpdateLastPingTime(
+      rlz_lib::TOOLBAR_NOTIFIER));
+
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+
+#if defined(OS_LINUX)
+  int flush_count = rlz_lib::testing::GetStoreFlushCount();
+#endif
+  rlz_lib::FinancialPingTimings timings;
+  timings.network_us = -1;
+  EXPECT_FALSE(rlz_lib::SendFinancialPing(rlz_lib::TOOLBAR_NOTIFIER, points,
+      "swg", "GGLA", "SwgProductId1234", "en-UK", false, false, &timings));
+
+  // The request was formed under the snapshot lock, and nothing was written.
+  EXPECT_LE(0, timings.snapshot_lock_wait_us);
+  EXPECT_LE(0, timings.snapshot_lock_hold_us);
+  EXPECT_EQ(0, timings.network_us);
+  EXPECT_EQ(0, timings.apply_lock_wait_us);
+  EXPECT_EQ(0, timings.apply_lock_hold_us);
+#if defined(OS_LINUX)
+  EXPECT_EQ(flush_count, rlz_lib::testing::GetStoreFlushCount());
+#endif
+}
+
+// Runs the tasks posted to it when the test asks it to, on the test thread.
+class ManualTaskRunner : public base::TaskRunner {
+ public:
+  ManualTaskRunner() {}
+
+  virtual bool PostDelayedTask(const tracked_objects::Location& from_here,
+                               const base::Closure& task,
+                               base::TimeDelta delay) OVERRIDE {
+    tasks_.push_back(task);
+    return true;
+  }
+
+  virtual bool RunsTasksOnCurrentThread() const OVERRIDE {
+    return true;
+  }
+
+  size_t task_count() const { return tasks_.size(); }
+
+  void RunTasks() {
+    std::vector<base::Closure> tasks;
+    tasks.swap(tasks_);
+    for (size_t i = 0; i < tasks.size(); ++i)
+      tasks[i].Run();
+  }
+
+ private:
+  virtual ~ManualTaskRunner() {}
+
+  std::vector<base::Closure> tasks_;
+
+  DISALLOW_COPY_AND_ASSIGN(ManualTaskRunner);
+};
+
+void CountFinancialPingResult(int* calls, bool* last_result, bool result) {
+  ++*calls;
+  *last_result = result;
+}
+
+TEST_F(RlzLibTest, SendFinancialPingAsync) {
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  scoped_refptr<ManualTaskRunner> runner(new ManualTaskRunner);
+  int calls = 0;
+  bool result = true;
+  rlz_lib::FinancialPingCallback callback =
+      base::Bind(&CountFinancialPingResult, &calls, &result);
+
+  // The supplementary brand holds the store lock on this thread.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty()) {
+    EXPECT_EQ(0, rlz_lib::SendFinancialPingAsync(rlz_lib::TOOLBAR_NOTIFIER,
+        points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, false,
+        runner.get(), callback));
+    EXPECT_EQ(0u, runner->task_count());
+    return;
+  }
+
+  // A ping that isn't due runs on the runner without reaching the server.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::FinancialPing::UpdateLastPingTime(
+      rlz_lib::TOOLBAR_NOTIFIER));
+  int ping_id = rlz_lib::SendFinancialPingAsync(rlz_lib::TOOLBAR_NOTIFIER,
+      points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, false,
+      runner.get(), callback);
+  EXPECT_NE(0, ping_id);
+  EXPECT_EQ(1u, runner->task_count());
+  EXPECT_EQ(0, calls);
+  runner->RunTasks();
+  EXPECT_EQ(1, calls);
+  EXPECT_FALSE(result);
+  EXPECT_FALSE(rlz_lib::CancelFinancialPing(ping_id));
+
+  // Canceled pings that haven't started don't touch the store, even when
+  // they're due.
+  EXPECT_TRUE(rlz_lib::FinancialPing::ClearLastPingTime(
+      rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  int first_id = rlz_lib::SendFinancialPingAsync(rlz_lib::TOOLBAR_NOTIFIER,
+      points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, true,
+      runner.get(), callback);
+  int second_id = rlz_lib::SendFinancialPingAsync(rlz_lib::TOOLBAR_NOTIFIER,
+      points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, true,
+      runner.get(), callback);
+  EXPECT_NE(first_id, second_id);
+  EXPECT_TRUE(rlz_lib::CancelFinancialPing(first_id));
+  rlz_lib::CancelAllFinancialPings();
+  runner->RunTasks();
+  EXPECT_EQ(3, calls);
+  EXPECT_FALSE(result);
+  EXPECT_FALSE(rlz_lib::CancelFinancialPing(second_id));
+
+  EXPECT_TRUE(rlz_lib::FinancialPing::IsPingTime(rlz_lib::TOOLBAR_NOTIFIER,
+                                                 false));
+  char cgi[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S", cgi);
+}
+
+// The requests that AcknowledgeEvents() answered.
+std::vector<std::string>* g_stand_in_requests = NULL;
+
+// A stand-in for the financial server, which acknowledges the events that
+// each request reports: the events field "events=<events>" of a request is
+// answered with "events: <events>".
+bool AcknowledgeEvents(const base::StringPiece& request,
+                       std::string* response,
+                       rlz_lib::FinancialPingCanceler* canceler) {
+  g_stand_in_requests->push_back(request.as_string());
+
+  std::string body;
+  size_t field_begin = request.find('?') + 1;
+  while (field_begin < request.size()) {
+    size_t field_end = std::min(request.find('&', field_begin),
+                                request.size());
+    base::StringPiece field =
+        request.substr(field_begin, field_end - field_begin);
+    size_t equals = field.find('=');
+    if (equals != base::StringPiece::npos &&
+        field.substr(0, equals) == rlz_lib::kEventsCgiVariable) {
+      field.substr(0, equals).AppendToString(&body);
+      body += ": ";
+      field.substr(equals + 1).AppendToString(&body);
+      body += "\r\n";
+    }
+    field_begin = field_end + 1;
+  }
+
+  int crc = rlz_lib::Crc32(reinterpret_cast<const unsigned char*>(body.data()),
+                           static_cast<int>(body.size()));
+  base::StringAppendF(response, "%scrc32: %X", body.c_str(),
+                      static_cast<unsigned int>(crc));
+  return true;
+}
+
+TEST_F(RlzLibTest, SendSequentialFinancialPingsSharesLocks) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  std::vector<std::string> requests;
+  g_stand_in_requests = &requests;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  const rlz_lib::FinancialPingProduct kProducts[] = {
+    {rlz_lib::TOOLBAR_NOTIFIER, points, "swg", "GGLA", "SwgProductId1234",
+     "en-UK", false},
+    {rlz_lib::DESKTOP, points, "gd", "GGLA", NULL, "en-UK", false},
+    {rlz_lib::PACK, points, "pk", "GGLA", NULL, "en-UK", false},
+    {rlz_lib::CHROME, points, "chrome", "GGLA", NULL, "en-UK", false},
+  };
+  const std::pair<rlz_lib::AccessPoint, rlz_lib::Event> kEvents[] = {
+    std::make_pair(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE),
+    std::make_pair(rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL),
+    std::make_pair(rlz_lib::IETB_SEARCH_BOX, rlz_lib::FIRST_SEARCH),
+  };
+
+  // CHROME pinged just now and has no events, so it isn't due.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::CHROME));
+  EXPECT_TRUE(rlz_lib::FinancialPing::UpdateLastPingTime(rlz_lib::CHROME));
+  std::vector<std::string> expected_requests;
+  for (size_t i = 0; i < arraysize(kEvents); ++i) {
+    const rlz_lib::FinancialPingProduct& product = kProducts[i];
+    EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product.product));
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(product.product,
+        kEvents[i].first, kEvents[i].second));
+    std::string request;
+    EXPECT_TRUE(rlz_lib::FormFinancialPingRequest(product.product,
+        product.access_points, product.product_signature,
+        product.product_brand, product.product_id, product.product_lang,
+        product.exclude_machine_id, &request));
+    expected_requests.push_back(request);
+  }
+
+  rlz_lib::ResetLockStats();
+  bool pinged[arraysize(kProducts)];
+  EXPECT_TRUE(rlz_lib::testing::SendSequentialFinancialPingsForTesting(
+      kProducts, arraysize(kProducts), true, pinged, &AcknowledgeEvents));
+
+  // Each due product sent the request that SendFinancialPing() sends, but
+  // the store was only locked before and after all of them.
+  EXPECT_EQ(expected_requests, requests);
+  rlz_lib::LockStats stats;
+  EXPECT_TRUE(rlz_lib::GetLockStats("SendSequentialFinancialPings", &stats));
+  EXPECT_EQ(2, stats.acquired);
+
+  // Every product got the response to its events.
+  for (size_t i = 0; i < arraysize(kProducts); ++i) {
+    EXPECT_EQ(i < arraysize(kEvents), pinged[i]) << i;
+    char cgi[50];
+    rlz_lib::GetProductEventsAsCgi(kProducts[i].product, cgi,
+                                   arraysize(cgi));
+    EXPECT_STREQ("", cgi) << i;
+  }
+
+  g_stand_in_requests = NULL;
+}
+
+// Signaled when AnswerOnceCanceled() is called.
+base::WaitableEvent* g_stand_in_called = NULL;
+
+// A stand-in for the financial server that holds the ping until it is
+// canceled, and then acknowledges its events anyway.
+bool AnswerOnceCanceled(const base::StringPiece& request,
+                        std::string* response,
+                        rlz_lib::FinancialPingCanceler* canceler) {
+  g_stand_in_called->Signal();
+  while (!canceler->IsCanceled())
+    base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(1));
+  return AcknowledgeEvents(request, response, canceler);
+}
+
+void SignalFinancialPingResult(base::WaitableEvent* done, bool* result,
+                               bool ping_result) {
+  *result = ping_result;
+  done->Signal();
+}
+
+TEST_F(RlzLibTest, CancelFinancialPingWhileServerWaits) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  std::vector<std::string> requests;
+  g_stand_in_requests = &requests;
+  base::WaitableEvent stand_in_called(false, false);
+  g_stand_in_called = &stand_in_called;
+
+  EXPECT_TRUE(rlz_lib::FinancialPing::ClearLastPingTime(
+      rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+
+  // The ping runs on a worker thread, and is canceled while the server holds
+  // it.
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  base::WaitableEvent done(false, false);
+  bool result = true;
+  int ping_id = rlz_lib::testing::SendFinancialPingAsyncForTesting(
+      rlz_lib::TOOLBAR_NOTIFIER, points, "swg", "GGLA", "SwgProductId1234",
+      "en-UK", false, true, NULL,
+      base::Bind(&SignalFinancialPingResult, &done, &result),
+      &AnswerOnceCanceled);
+  ASSERT_NE(0, ping_id);
+  stand_in_called.Wait();
+  EXPECT_TRUE(rlz_lib::CancelFinancialPing(ping_id));
+  done.Wait();
+  EXPECT_FALSE(result);
+  EXPECT_EQ(1u, requests.size());
+
+  // The response that came after all wasn't applied.
+  char cgi[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S", cgi);
+
+  g_stand_in_called = NULL;
+  g_stand_in_requests = NULL;
+}
+
+TEST_F(RlzLibTest, LockStatsCountEntryPoints) {
+  EXPECT_TRUE(rlz_lib::FinancialPing::UpdateLastPingTime(
+      rlz_lib::TOOLBAR_NOTIFIER));
+  rlz_lib::ResetLockStats();
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  {
+    rlz_lib::ScopedRlzValueStoreLock lock;
+    rlz_lib::ScopedRlzValueStoreLock nested_lock;
+    EXPECT_TRUE(nested_lock.GetStore());
+  }
+
+  // The functions that SendFinancialPing() calls count for it.
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  EXPECT_FALSE(rlz_lib::SendFinancialPing(rlz_lib::TOOLBAR_NOTIFIER, points,
+      "swg", "GGLA", "SwgProductId1234", "en-UK", false, false));
+
+  const char* kEntryPoints[] = {
+    "RecordProductEvent", "ClearProductEvent", "Other", "SendFinancialPing",
+  };
+  for (size_t i = 0; i < arraysize(kEntryPoints); ++i) {
+    rlz_lib::LockStats stats;
+    EXPECT_TRUE(rlz_lib::GetLockStats(kEntryPoints[i], &stats));
+    EXPECT_EQ(1, stats.acquired) << kEntryPoints[i];
+    EXPECT_EQ(0, stats.timeouts);
+    EXPECT_EQ(0, stats.failures);
+    int waits = 0;
+    int holds = 0;
+    for (int bucket = 0; bucket < rlz_lib::kLockStatsBuckets; ++bucket) {
+      waits += stats.wait_histogram[bucket];
+      holds += stats.hold_histogram[bucket];
+    }
+    EXPECT_EQ(1, waits);
+    EXPECT_EQ(1, holds);
+    EXPECT_LE(0, stats.max_hold_us);
+  }
+
+  rlz_lib::LockStats stats;
+  EXPECT_TRUE(rlz_lib::GetLockStats("FinancialPing::IsPingTime", &stats));
+  EXPECT_EQ(0, stats.acquired);
+  EXPECT_TRUE(rlz_lib::GetLockStats(NULL, &stats));
+  EXPECT_EQ(4, stats.acquired);
+
+  rlz_lib::ResetLockStats();
+  EXPECT_TRUE(rlz_lib::GetLockStats(NULL, &stats));
+  EXPECT_EQ(0, stats.acquired);
+  EXPECT_EQ(0, stats.hold_histogram[0]);
+}
+
 TEST_F(RlzLibTest, ClearProductState) {
   MachineDealCodeHelper::Clear();
 
@@ -786,7 +1435,63 @@ TEST_F(RlzLibTest, BrandingWithStatefulEvents) {
   EXPECT_STREQ("events=I7S", value);
 }
 
-#if defined(OS_MACOSX)
+#if defined(OS_POSIX)
+// ParsePingResponse() sets RLZs and clears and records events under one lock,
+// and should write the store only once.
+TEST_F(RlzLibTest, ParsePingResponseWritesStoreOnce) {
+  // With a SupplementaryBranding on the stack, the store is written when the
+  // branding goes out of scope.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const char* kPingResponse =
+    "rlzT4: 1T4_____en__252\r\n"
+    "events: I7S,W1I\r\n"
+    "stateful-events: W1I\r\n"
+    "rlz\r\n"
+    "dcc: dcc_value\r\n"
+    "crc32: D6EE729";
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+
+  int flush_count = rlz_lib::testing::GetStoreFlushCount();
+  EXPECT_TRUE(rlz_lib::ParsePingResponse(rlz_lib::TOOLBAR_NOTIFIER,
+                                         kPingResponse));
+  EXPECT_EQ(flush_count + 1, rlz_lib::testing::GetStoreFlushCount());
+
+  char value[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, value, 50));
+  EXPECT_STREQ("1T4_____en__252", value);
+#if defined(OS_LINUX)
+  // Reading doesn't write the store on linux.
+  EXPECT_EQ(flush_count + 1, rlz_lib::testing::GetStoreFlushCount());
+#endif
+}
+
+// The events of a batch are written to the store at once.
+TEST_F(RlzLibTest, RecordProductEventsWritesStoreOnce) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const std::pair<rlz_lib::AccessPoint, rlz_lib::Event> kEvents[] = {
+    std::make_pair(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE),
+    std::make_pair(rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL),
+  };
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  int flush_count = rlz_lib::testing::GetStoreFlushCount();
+  EXPECT_TRUE(rlz_lib::RecordProductEvents(rlz_lib::TOOLBAR_NOTIFIER, kEvents,
+                                           arraysize(kEvents), NULL));
+  EXPECT_EQ(flush_count + 1, rlz_lib::testing::GetStoreFlushCount());
+
+  flush_count = rlz_lib::testing::GetStoreFlushCount();
+  EXPECT_TRUE(rlz_lib::ClearProductEvents(rlz_lib::TOOLBAR_NOTIFIER, kEvents,
+                                          arraysize(kEvents), NULL));
+  EXPECT_EQ(flush_count + 1, rlz_lib::testing::GetStoreFlushCount());
+}
+
 class ReadonlyRlzDirectoryTest : public RlzLibTestNoMachineState {
  protected:
   virtual void SetUp() OVERRIDE;
@@ -822,3 +1527,81 @@ TEST_F(ReadonlyRlzDirectoryTest, SupplementaryBrandingDoesNotCrash) {
       rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::INSTALL));
 }
 #endif
+
+#if defined(OS_LINUX) && defined(RLZ_STORE_IMPLEMENTATION_JSON)
+class RlzLinuxStoreTest : public RlzLibTestNoMachineState {
+ protected:
+  // Returns the inode of the store file |name|, which changes whenever the
+  // file is written since writes go through a temporary file and a rename.
+  ino_t GetStoreInode(const char* name) {
+    struct stat info;
+    if (stat(temp_dir_.path().Append("RlzStore").Append(name).value().c_str(),
+             &info) != 0) {
+      return 0;
+    }
+    return info.st_ino;
+  }
+
+  std::string ProductStoreFile(rlz_lib::Product product) {
+    return std::string("product_") + rlz_lib::GetProductName(product) +
+        ".json";
+  }
+};
+
+TEST_F(RlzLinuxStoreTest, ReadsDoNotRewriteStore) {
+  // With a SupplementaryBranding on the stack, the store object was created
+  // before the test changed the rlz directory, see ReadonlyRlzDirectoryTest.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  ino_t inode = GetStoreInode("accessPoints.json");
+  EXPECT_NE(0u, inode);
+
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              rlz_50, 50));
+  EXPECT_EQ(inode, GetStoreInode("accessPoints.json"));
+
+  // Recording an event only writes the product's file.
+  std::string product_file(ProductStoreFile(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_EQ(0u, GetStoreInode(product_file.c_str()));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_NE(0u, GetStoreInode(product_file.c_str()));
+  EXPECT_EQ(inode, GetStoreInode("accessPoints.json"));
+}
+
+TEST_F(RlzLinuxStoreTest, QueuedEventsStayQueuedIfWriteFails) {
+  // See ReadsDoNotRewriteStore.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // A directory where the product's file goes makes writing it fail.
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  FilePath product_file = temp_dir_.path().Append("RlzStore").Append(
+      ProductStoreFile(rlz_lib::TOOLBAR_NOTIFIER));
+  ASSERT_TRUE(file_util::CreateDirectory(product_file));
+
+  rlz_lib::QueuePendingEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                             rlz_lib::IE_DEFAULT_SEARCH,
+                             rlz_lib::SET_TO_GOOGLE, true);
+  EXPECT_FALSE(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  {
+    // Events are only taken off the queue under the lock.
+    rlz_lib::ScopedRlzValueStoreLock lock;
+    EXPECT_TRUE(rlz_lib::HasPendingEvents());
+  }
+
+  // Once the store can be written, the event is.
+  ASSERT_TRUE(file_util::Delete(product_file, false));
+  EXPECT_TRUE(rlz_lib::FlushPendingEvents());
+  char cgi_50[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S", cgi_50);
+}
+#endif
@@ -0,0 +1,42 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/rlz_value_store.h"
+
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+bool RlzValueStore::EnumerateAccessPointRlzs(AccessPointRlzVisitor* visitor) {
+  for (int i = NO_ACCESS_POINT + 1; i < LAST_ACCESS_POINT; ++i) {
+    AccessPoint point = static_cast<AccessPoint>(i);
+    char rlz[kMaxRlzLength + 1];
+    if (ReadAccessPointRlz(point, rlz, arraysize(rlz)) && rlz[0])
+      visitor->Visit(point, rlz);
+  }
+  return true;
+}
+
+bool RlzValueStore::AddProductEventById(Product product, AccessPoint point,
+                                        Event event) {
+  return AddProductEvent(product, GetEventRlz(point, event).c_str());
+}
+
+bool RlzValueStore::ClearProductEventById(Product product, AccessPoint point,
+                                          Event event) {
+  return ClearProductEvent(product, GetEventRlz(point, event).c_str());
+}
+
+bool RlzValueStore::AddStatefulEventById(Product product, AccessPoint point,
+                                         Event event) {
+  return AddStatefulEvent(product, GetEventRlz(point, event).c_str());
+}
+
+bool RlzValueStore::IsStatefulEventById(Product product, AccessPoint point,
+                                        Event event) {
+  return IsStatefulEvent(product, GetEventRlz(point, event).c_str());
+}
+
+}  // namespace rlz_lib
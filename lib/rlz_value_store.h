@@ -7,6 +7,7 @@
 
 #include "base/basictypes.h"
 #include "base/memory/scoped_ptr.h"
+#include "rlz/lib/lock_stats.h"
 #include "rlz/lib/rlz_enums.h"
 
 #if defined(OS_WIN)
@@ -17,6 +18,31 @@
 #include "base/mac/scoped_nsautorelease_pool.h"
 #endif
 
+// On linux, define one of
+// + RLZ_STORE_IMPLEMENTATION_JSON: Keeps the store in small JSON files, one
+//   per brand and product, that are read and written as a whole
+//   (RlzValueStoreLinux).
+// + RLZ_STORE_IMPLEMENTATION_MMAP: Keeps the store in a fixed-layout binary
+//   file that is mapped into memory and accessed in place (RlzValueStoreMmap).
+// + RLZ_STORE_IMPLEMENTATION_JOURNAL: Keeps the store in an append-only log
+//   that is compacted when it grows too large (RlzValueStoreJournal).
+// + RLZ_STORE_IMPLEMENTATION_SQLITE: Keeps the store in a SQLite database in
+//   WAL mode (RlzValueStoreSqlite).
+#if defined(OS_LINUX)
+#if defined(RLZ_STORE_IMPLEMENTATION_JSON) + \
+    defined(RLZ_STORE_IMPLEMENTATION_MMAP) + \
+    defined(RLZ_STORE_IMPLEMENTATION_JOURNAL) + \
+    defined(RLZ_STORE_IMPLEMENTATION_SQLITE) > 1
+#error Exactly one RLZ_STORE_IMPLEMENTATION_* should be defined.
+#endif
+#if !defined(RLZ_STORE_IMPLEMENTATION_JSON) && \
+    !defined(RLZ_STORE_IMPLEMENTATION_MMAP) && \
+    !defined(RLZ_STORE_IMPLEMENTATION_JOURNAL) && \
+    !defined(RLZ_STORE_IMPLEMENTATION_SQLITE)
+#define RLZ_STORE_IMPLEMENTATION_JSON
+#endif
+#endif  // defined(OS_LINUX)
+
 
 #include <string>
 #include <vector>
@@ -26,7 +52,9 @@ class FilePath;
 namespace rlz_lib {
 
 // Abstracts away rlz's key value store. On windows, this usually writes to
-// the registry. On mac, it writes to an NSDefaults object.
+// the registry. On mac, it writes to an NSDefaults object. On linux, it writes
+// to files in the user's data directory, in the format of the backend that
+// RLZ_STORE_IMPLEMENTATION_* selects (see above).
 class RlzValueStore {
  public:
   virtual ~RlzValueStore() {}
@@ -47,6 +75,21 @@ class RlzValueStore {
                                   size_t rlz_size) = 0;
   virtual bool ClearAccessPointRlz(AccessPoint access_point) = 0;
 
+  // Receives the RLZs of EnumerateAccessPointRlzs().
+  class AccessPointRlzVisitor {
+   public:
+    virtual void Visit(AccessPoint access_point, const char* rlz) = 0;
+
+   protected:
+    virtual ~AccessPointRlzVisitor() {}
+  };
+
+  // Calls |visitor| for each access point with a non-empty RLZ, in arbitrary
+  // order. The default reads every access point with ReadAccessPointRlz() and
+  // skips those that can't be read; stores that can list their RLZs override
+  // it. Returns false if the RLZs couldn't be read at all.
+  virtual bool EnumerateAccessPointRlzs(AccessPointRlzVisitor* visitor);
+
   // Product events.
   // Stores |event_rlz| for product |product| as product event.
   virtual bool AddProductEvent(Product product, const char* event_rlz) = 0;
@@ -66,12 +109,58 @@ class RlzValueStore {
   // Removes all stored stateful events for |product|.
   virtual bool ClearAllStatefulEvents(Product product) = 0;
 
+  // The same operations for events given as enum values, as recorded by
+  // rlz_lib. The defaults build the event's string form and call the methods
+  // above; stores that keep events as an EventBitmap override them to skip
+  // that. |point| and |event| must have non-empty names.
+  virtual bool AddProductEventById(Product product, AccessPoint point,
+                                   Event event);
+  virtual bool ClearProductEventById(Product product, AccessPoint point,
+                                     Event event);
+  virtual bool AddStatefulEventById(Product product, AccessPoint point,
+                                    Event event);
+  virtual bool IsStatefulEventById(Product product, AccessPoint point,
+                                   Event event);
+
   // Tells the value store to clean up unimportant internal data structures, for
   // example empty registry folders, that might remain after clearing other
   // data. Best-effort.
   virtual void CollectGarbage() = 0;
 };
 
+// The parts of the store that a ScopedRlzValueStoreLock can be limited to:
+// the access point RLZs, and the ping time and events of each product.
+class StoreStripes {
+ public:
+  // The whole store.
+  StoreStripes() : mask_(kAllMask) {}
+
+  // The RLZs of all access points.
+  static StoreStripes AccessPoints() { return StoreStripes(1); }
+
+  // The ping time and events of |product|.
+  static StoreStripes ForProduct(Product product) {
+    return product > 0 && product < 32 ?
+        StoreStripes(1u << product) : StoreStripes();
+  }
+
+  StoreStripes operator|(const StoreStripes& other) const {
+    return StoreStripes(mask_ | other.mask_);
+  }
+
+  bool all() const { return mask_ == kAllMask; }
+
+  // Bit 0 is the access point stripe, bit n the stripe of product n.
+  uint32 mask() const { return mask_; }
+
+ private:
+  static const uint32 kAllMask = 0xffffffff;
+
+  explicit StoreStripes(uint32 mask) : mask_(mask) {}
+
+  uint32 mask_;
+};
+
 // All methods of RlzValueStore must stays consistent even when accessed from
 // multiple threads in multiple processes. To enforce this through the type
 // system, the only way to access the RlzValueStore is through a
@@ -84,9 +173,44 @@ class RlzValueStore {
 //   if (!store)
 //     return some_error_code;
 //   ...
+//
+// Locks taken while another one is held share its store, so the outermost lock
+// also acts as a transaction: on linux and mac, all writes made under it are
+// written to disk together when it is released, or when Commit() is called.
+//
+// Code that only reads can take the lock with RlzValueStore::kReadAccess. On
+// linux, processes then share it with other readers and only wait for
+// writers. The mode of the outermost lock counts: a lock for writing can't be
+// taken while a lock for reading is held, its GetStore() returns NULL.
+//
+// Code that only uses some StoreStripes can lock just those. On linux, with
+// the JSON store, which keeps them in separate files, processes then only
+// wait for lock scopes that use the same stripes, or the whole store. Threads
+// of a process still take turns. Again the outermost lock counts: a nested
+// lock for stripes it doesn't hold gets no store. Other platforms and stores
+// lock the whole store.
 class ScopedRlzValueStoreLock {
  public:
+  // Takes the lock for writing.
   ScopedRlzValueStoreLock();
+
+  // Takes the lock for |access|. The store of a lock for reading must not be
+  // written to. Platforms without shared locks take the lock for writing.
+  explicit ScopedRlzValueStoreLock(RlzValueStore::AccessType access);
+
+  // Takes the lock for |access| like above, but waits for at most
+  // |timeout_ms| milliseconds for other threads and processes to release it,
+  // and not at all if it is 0.
+  ScopedRlzValueStoreLock(RlzValueStore::AccessType access, int timeout_ms);
+
+  // Like the two above, but only locks |stripes|. Code under the lock must
+  // not use other parts of the store.
+  ScopedRlzValueStoreLock(RlzValueStore::AccessType access,
+                          StoreStripes stripes);
+  ScopedRlzValueStoreLock(RlzValueStore::AccessType access,
+                          StoreStripes stripes,
+                          int timeout_ms);
+
   ~ScopedRlzValueStoreLock();
 
   // Returns a RlzValueStore protected by a cross-process lock, or NULL if the
@@ -94,21 +218,74 @@ class ScopedRlzValueStoreLock {
   // the lifetime of this ScopedRlzValueStoreLock object.
   RlzValueStore* GetStore();
 
+  // Writes the changes made under this lock to disk now instead of when the
+  // lock is released, and returns false if that failed. A nested lock leaves
+  // this to the outermost one and only returns whether it has a store.
+  bool Commit();
+
+  // Returns true if GetStore() returns NULL because other threads or
+  // processes held the lock until the timeout ran out, rather than because of
+  // an error.
+  bool busy() const { return busy_; }
+
+  // Returns the stripes this lock was taken for. The outermost lock may hold
+  // more.
+  StoreStripes stripes() const { return stripes_; }
+
  private:
+#if defined(OS_POSIX)
+  // Shared by the constructors. A negative |timeout_ms| waits for other
+  // threads for as long as it takes and for other processes for 5 seconds.
+  void Acquire(RlzValueStore::AccessType access, int timeout_ms);
+
+  // False if another thread held the in-process lock until the timeout, so
+  // that there is nothing to release.
+  bool locked_;
+#elif defined(OS_WIN)
+  // Shared by the constructors. Sets the store up if |lock_| was acquired.
+  void SetUpStore();
+#endif
+
+  // Constructed first, so that it times the whole wait.
+  LockStatsTimer stats_timer_;
+  bool busy_;
+  StoreStripes stripes_;
   scoped_ptr<RlzValueStore> store_;
 #if defined(OS_WIN)
   LibMutex lock_;
-#else
+#elif defined(OS_MACOSX)
   base::mac::ScopedNSAutoreleasePool autorelease_pool_;
 #endif
 };
 
-#if defined(OS_MACOSX)
+// Reads the store generation, a counter shared by all processes that is
+// incremented whenever the outermost ScopedRlzValueStoreLock of a scope that
+// wrote to the store is released. Values read from the store stay current for
+// as long as the generation doesn't change. Doesn't need the lock. Returns
+// false if the generation isn't available, for example because the platform
+// doesn't keep one.
+bool ReadStoreGeneration(uint32* generation);
+
+// Reads the RLZ of |point| for the default brand without waiting for the
+// ScopedRlzValueStoreLock, if the store supports that. Returns false if it
+// doesn't, or if the RLZ couldn't be read that way or doesn't fit into |rlz|;
+// callers then read it through the lock, which also reports errors.
+bool ReadAccessPointRlzWithoutLock(AccessPoint point,
+                                   char* rlz,
+                                   size_t rlz_size);
+
+#if defined(OS_POSIX)
 namespace testing {
 // Prefix |directory| to the path where the RLZ data file lives, for tests.
+// On linux, the data file is stored directly in |directory|.
 void SetRlzStoreDirectory(const FilePath& directory);
+
+// Returns the number of times the store was written to disk by the outermost
+// ScopedRlzValueStoreLock or its Commit(), for tests that check that writes
+// are batched.
+int GetStoreFlushCount();
 }  // namespace testing
-#endif  // defined(OS_MACOSX)
+#endif  // defined(OS_POSIX)
 
 
 }  // namespace rlz_lib
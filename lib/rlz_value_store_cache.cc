@@ -0,0 +1,446 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/rlz_value_store_cache.h"
+
+#include <string.h>
+
+#include <map>
+
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
+#include "rlz/lib/event_bitmap.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+namespace {
+
+struct CachedPingTime {
+  bool result;
+  int64 time;
+};
+
+// The cached values of one supplementary brand. Only values that were read or
+// written since the cache was last dropped are present; a missing RLZ is
+// cached as "".
+struct BrandCache {
+  std::map<AccessPoint, std::string> rlzs;
+  std::map<Product, CachedPingTime> ping_times;
+  std::map<Product, std::vector<std::string> > product_events;
+  // Keyed by StatefulEventKey().
+  std::map<int, bool> stateful_events;
+};
+
+struct CacheState {
+  CacheState() : valid(false), in_scope(false), generation(0) {}
+
+  // Returns true if lock-free readers may use the cached values, given the
+  // current store |generation|. While a lock scope is active, its writes are
+  // not committed yet and the brand of the scope isn't known to other
+  // threads, so readers wait for the lock instead.
+  bool IsCurrent(uint32 current_generation) const {
+    return valid && !in_scope && generation == current_generation;
+  }
+
+  // Protects all members.
+  base::Lock lock;
+
+  // Set if the cached values match the store at |generation|.
+  bool valid;
+  // Set while an RlzValueStoreCache exists.
+  bool in_scope;
+  uint32 generation;
+
+  // By supplementary brand, "" is the default brand.
+  std::map<std::string, BrandCache> brands;
+};
+
+base::LazyInstance<CacheState>::Leaky g_cache = LAZY_INSTANCE_INITIALIZER;
+
+int StatefulEventKey(Product product, AccessPoint point, Event event) {
+  return (product * EventBitmap::kAccessPointCapacity + point) *
+      EventBitmap::kEventCapacity + event;
+}
+
+// Returns the values of the brand of the current lock scope. |g_cache|'s
+// lock must be held.
+BrandCache& CurrentBrand() {
+  return g_cache.Get().brands[SupplementaryBranding::GetBrand()];
+}
+
+// Caches the RLZs of an enumeration before passing them on.
+class CachingRlzVisitor : public RlzValueStore::AccessPointRlzVisitor {
+ public:
+  explicit CachingRlzVisitor(RlzValueStore::AccessPointRlzVisitor* visitor)
+      : visitor_(visitor) {}
+  virtual ~CachingRlzVisitor() {}
+
+  virtual void Visit(AccessPoint access_point, const char* rlz) OVERRIDE {
+    {
+      base::AutoLock lock(g_cache.Get().lock);
+      CurrentBrand().rlzs[access_point] = rlz;
+    }
+    visitor_->Visit(access_point, rlz);
+  }
+
+ private:
+  RlzValueStore::AccessPointRlzVisitor* visitor_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachingRlzVisitor);
+};
+
+}  // namespace
+
+RlzValueStoreCache::RlzValueStoreCache(RlzValueStore* store,
+                                       uint32 generation)
+    : store_(store), dirty_(false) {
+  CacheState& cache = g_cache.Get();
+  base::AutoLock lock(cache.lock);
+  if (!cache.valid || cache.generation != generation) {
+    cache.brands.clear();
+    cache.generation = generation;
+    cache.valid = true;
+  }
+  cache.in_scope = true;
+}
+
+RlzValueStoreCache::~RlzValueStoreCache() {
+  CacheState& cache = g_cache.Get();
+  base::AutoLock lock(cache.lock);
+  cache.in_scope = false;
+}
+
+bool RlzValueStoreCache::HasAccess(AccessType type) {
+  return store_->HasAccess(type);
+}
+
+bool RlzValueStoreCache::WritePingTime(Product product, int64 time) {
+  dirty_ = true;
+  bool result = store_->WritePingTime(product, time);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  BrandCache& brand = CurrentBrand();
+  if (result) {
+    CachedPingTime& ping_time = brand.ping_times[product];
+    ping_time.result = true;
+    ping_time.time = time;
+  } else {
+    brand.ping_times.erase(product);
+  }
+  return result;
+}
+
+bool RlzValueStoreCache::ReadPingTime(Product product, int64* time) {
+  {
+    base::AutoLock lock(g_cache.Get().lock);
+    BrandCache& brand = CurrentBrand();
+    std::map<Product, CachedPingTime>::const_iterator it =
+        brand.ping_times.find(product);
+    if (it != brand.ping_times.end()) {
+      if (it->second.result)
+        *time = it->second.time;
+      return it->second.result;
+    }
+  }
+
+  CachedPingTime ping_time = { false, 0 };
+  ping_time.result = store_->ReadPingTime(product, &ping_time.time);
+  if (ping_time.result)
+    *time = ping_time.time;
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().ping_times[product] = ping_time;
+  return ping_time.result;
+}
+
+bool RlzValueStoreCache::ClearPingTime(Product product) {
+  dirty_ = true;
+  bool result = store_->ClearPingTime(product);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().ping_times.erase(product);
+  return result;
+}
+
+bool RlzValueStoreCache::WriteAccessPointRlz(AccessPoint access_point,
+                                             const char* new_rlz) {
+  dirty_ = true;
+  bool result = store_->WriteAccessPointRlz(access_point, new_rlz);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  BrandCache& brand = CurrentBrand();
+  if (result)
+    brand.rlzs[access_point] = new_rlz;
+  else
+    brand.rlzs.erase(access_point);
+  return result;
+}
+
+bool RlzValueStoreCache::ReadAccessPointRlz(AccessPoint access_point,
+                                            char* rlz,
+                                            size_t rlz_size) {
+  {
+    base::AutoLock lock(g_cache.Get().lock);
+    BrandCache& brand = CurrentBrand();
+    std::map<AccessPoint, std::string>::const_iterator it =
+        brand.rlzs.find(access_point);
+    // If the buffer is too small, let the store report the error.
+    if (it != brand.rlzs.end() && it->second.size() < rlz_size) {
+      memcpy(rlz, it->second.c_str(), it->second.size() + 1);
+      return true;
+    }
+  }
+
+  if (!store_->ReadAccessPointRlz(access_point, rlz, rlz_size))
+    return false;
+
+  if (rlz_size > 0) {
+    base::AutoLock lock(g_cache.Get().lock);
+    CurrentBrand().rlzs[access_point] = rlz;
+  }
+  return true;
+}
+
+bool RlzValueStoreCache::ClearAccessPointRlz(AccessPoint access_point) {
+  dirty_ = true;
+  bool result = store_->ClearAccessPointRlz(access_point);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  BrandCache& brand = CurrentBrand();
+  if (result)
+    brand.rlzs[access_point] = std::string();
+  else
+    brand.rlzs.erase(access_point);
+  return result;
+}
+
+bool RlzValueStoreCache::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  // Only the store knows which access points have no RLZ.
+  CachingRlzVisitor caching_visitor(visitor);
+  return store_->EnumerateAccessPointRlzs(&caching_visitor);
+}
+
+bool RlzValueStoreCache::AddProductEvent(Product product,
+                                         const char* event_rlz) {
+  dirty_ = true;
+  bool result = store_->AddProductEvent(product, event_rlz);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().product_events.erase(product);
+  return result;
+}
+
+bool RlzValueStoreCache::ReadProductEvents(Product product,
+                                           std::vector<std::string>* events) {
+  {
+    base::AutoLock lock(g_cache.Get().lock);
+    BrandCache& brand = CurrentBrand();
+    std::map<Product, std::vector<std::string> >::const_iterator it =
+        brand.product_events.find(product);
+    if (it != brand.product_events.end()) {
+      events->insert(events->end(), it->second.begin(), it->second.end());
+      return true;
+    }
+  }
+
+  std::vector<std::string> product_events;
+  if (!store_->ReadProductEvents(product, &product_events))
+    return false;
+  events->insert(events->end(), product_events.begin(), product_events.end());
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().product_events[product].swap(product_events);
+  return true;
+}
+
+bool RlzValueStoreCache::ClearProductEvent(Product product,
+                                           const char* event_rlz) {
+  dirty_ = true;
+  bool result = store_->ClearProductEvent(product, event_rlz);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().product_events.erase(product);
+  return result;
+}
+
+bool RlzValueStoreCache::ClearAllProductEvents(Product product) {
+  dirty_ = true;
+  bool result = store_->ClearAllProductEvents(product);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().product_events.erase(product);
+  return result;
+}
+
+bool RlzValueStoreCache::AddStatefulEvent(Product product,
+                                          const char* event_rlz) {
+  AccessPoint point;
+  Event event;
+  if (ParseEventRlz(event_rlz, &point, &event))
+    return AddStatefulEventById(product, point, event);
+
+  dirty_ = true;
+  return store_->AddStatefulEvent(product, event_rlz);
+}
+
+bool RlzValueStoreCache::IsStatefulEvent(Product product,
+                                         const char* event_rlz) {
+  AccessPoint point;
+  Event event;
+  if (ParseEventRlz(event_rlz, &point, &event))
+    return IsStatefulEventById(product, point, event);
+
+  return store_->IsStatefulEvent(product, event_rlz);
+}
+
+bool RlzValueStoreCache::ClearAllStatefulEvents(Product product) {
+  dirty_ = true;
+  bool result = store_->ClearAllStatefulEvents(product);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  std::map<int, bool>& stateful_events = CurrentBrand().stateful_events;
+  stateful_events.erase(
+      stateful_events.lower_bound(
+          StatefulEventKey(product, NO_ACCESS_POINT, INVALID_EVENT)),
+      stateful_events.lower_bound(
+          StatefulEventKey(static_cast<Product>(product + 1),
+                           NO_ACCESS_POINT, INVALID_EVENT)));
+  return result;
+}
+
+bool RlzValueStoreCache::AddProductEventById(Product product,
+                                             AccessPoint point,
+                                             Event event) {
+  dirty_ = true;
+  bool result = store_->AddProductEventById(product, point, event);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().product_events.erase(product);
+  return result;
+}
+
+bool RlzValueStoreCache::ClearProductEventById(Product product,
+                                               AccessPoint point,
+                                               Event event) {
+  dirty_ = true;
+  bool result = store_->ClearProductEventById(product, point, event);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().product_events.erase(product);
+  return result;
+}
+
+bool RlzValueStoreCache::AddStatefulEventById(Product product,
+                                              AccessPoint point,
+                                              Event event) {
+  dirty_ = true;
+  bool result = store_->AddStatefulEventById(product, point, event);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  std::map<int, bool>& stateful_events = CurrentBrand().stateful_events;
+  if (result)
+    stateful_events[StatefulEventKey(product, point, event)] = true;
+  else
+    stateful_events.erase(StatefulEventKey(product, point, event));
+  return result;
+}
+
+bool RlzValueStoreCache::IsStatefulEventById(Product product,
+                                             AccessPoint point,
+                                             Event event) {
+  if (!EventBitmap::IsValidEvent(point, event))
+    return store_->IsStatefulEventById(product, point, event);
+
+  int key = StatefulEventKey(product, point, event);
+  {
+    base::AutoLock lock(g_cache.Get().lock);
+    BrandCache& brand = CurrentBrand();
+    std::map<int, bool>::const_iterator it = brand.stateful_events.find(key);
+    if (it != brand.stateful_events.end())
+      return it->second;
+  }
+
+  bool result = store_->IsStatefulEventById(product, point, event);
+
+  base::AutoLock lock(g_cache.Get().lock);
+  CurrentBrand().stateful_events[key] = result;
+  return result;
+}
+
+void RlzValueStoreCache::CollectGarbage() {
+  dirty_ = true;
+  store_->CollectGarbage();
+}
+
+void RlzValueStoreCache::Commit(uint32 generation) {
+  CacheState& cache = g_cache.Get();
+  base::AutoLock lock(cache.lock);
+  cache.generation = generation;
+  dirty_ = false;
+}
+
+// static
+bool RlzValueStoreCache::ReadCachedAccessPointRlz(AccessPoint point,
+                                                  char* rlz,
+                                                  size_t rlz_size) {
+  uint32 generation;
+  if (!ReadStoreGeneration(&generation))
+    return false;
+
+  CacheState& cache = g_cache.Get();
+  base::AutoLock lock(cache.lock);
+  if (!cache.IsCurrent(generation))
+    return false;
+
+  // Outside of lock scopes, the supplementary brand is always the default.
+  std::map<std::string, BrandCache>::const_iterator brand =
+      cache.brands.find(std::string());
+  if (brand == cache.brands.end())
+    return false;
+  std::map<AccessPoint, std::string>::const_iterator it =
+      brand->second.rlzs.find(point);
+  if (it == brand->second.rlzs.end() || it->second.size() >= rlz_size)
+    return false;
+
+  memcpy(rlz, it->second.c_str(), it->second.size() + 1);
+  return true;
+}
+
+// static
+bool RlzValueStoreCache::ReadCachedProductEvents(
+    Product product, std::vector<std::string>* events) {
+  uint32 generation;
+  if (!ReadStoreGeneration(&generation))
+    return false;
+
+  CacheState& cache = g_cache.Get();
+  base::AutoLock lock(cache.lock);
+  if (!cache.IsCurrent(generation))
+    return false;
+
+  std::map<std::string, BrandCache>::const_iterator brand =
+      cache.brands.find(std::string());
+  if (brand == cache.brands.end())
+    return false;
+  std::map<Product, std::vector<std::string> >::const_iterator it =
+      brand->second.product_events.find(product);
+  if (it == brand->second.product_events.end())
+    return false;
+
+  events->insert(events->end(), it->second.begin(), it->second.end());
+  return true;
+}
+
+// static
+void RlzValueStoreCache::Invalidate() {
+  CacheState& cache = g_cache.Get();
+  base::AutoLock lock(cache.lock);
+  cache.brands.clear();
+  cache.valid = false;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,104 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LIB_RLZ_VALUE_STORE_CACHE_H_
+#define RLZ_LIB_RLZ_VALUE_STORE_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/compiler_specific.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+// Keeps the RLZs, ping times and events read from and written to a store in
+// process memory, across ScopedRlzValueStoreLock scopes. The cached values are
+// tagged with the store generation they were read at, see
+// ReadStoreGeneration(). As long as the generation doesn't change, the static
+// ReadCached*() functions return them without taking the cross-process lock
+// or touching the store.
+//
+// An RlzValueStoreCache wraps the store of one outermost lock scope; all
+// methods forward to it and update the cache. The cache is shared by all
+// threads of the process.
+class RlzValueStoreCache : public RlzValueStore {
+ public:
+  // |store| must outlive this object. |generation| is the store generation,
+  // read with the cross-process lock held. Values cached at an older
+  // generation are dropped.
+  RlzValueStoreCache(RlzValueStore* store, uint32 generation);
+  virtual ~RlzValueStoreCache();
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual bool AddProductEventById(Product product, AccessPoint point,
+                                   Event event) OVERRIDE;
+  virtual bool ClearProductEventById(Product product, AccessPoint point,
+                                     Event event) OVERRIDE;
+  virtual bool AddStatefulEventById(Product product, AccessPoint point,
+                                    Event event) OVERRIDE;
+  virtual bool IsStatefulEventById(Product product, AccessPoint point,
+                                   Event event) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Returns true if anything was written through this object. The owner must
+  // then commit the store, bump the store generation and call Commit().
+  bool dirty() const { return dirty_; }
+
+  // Tags the cached values with |generation|, the store generation after the
+  // writes made through this object were committed. If committing the store
+  // or bumping the generation failed, call Invalidate() instead.
+  void Commit(uint32 generation);
+
+  // Copy a cached value into |rlz| or |events|, without taking the lock.
+  // Return false if the value isn't cached or the store generation changed
+  // since it was, in which case callers read it through the store.
+  static bool ReadCachedAccessPointRlz(AccessPoint point,
+                                       char* rlz,
+                                       size_t rlz_size);
+  static bool ReadCachedProductEvents(Product product,
+                                      std::vector<std::string>* events);
+
+  // Drops all cached values.
+  static void Invalidate();
+
+ private:
+  RlzValueStore* store_;
+  bool dirty_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreCache);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_RLZ_VALUE_STORE_CACHE_H_
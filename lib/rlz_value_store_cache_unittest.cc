@@ -0,0 +1,259 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/rlz_value_store_cache.h"
+
+#include <string.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// An in-memory store that counts how often it is read.
+class FakeRlzValueStore : public RlzValueStore {
+ public:
+  FakeRlzValueStore() : reads_(0) {}
+
+  virtual bool HasAccess(AccessType type) OVERRIDE { return true; }
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE {
+    ping_times_[product] = time;
+    return true;
+  }
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE {
+    ++reads_;
+    if (ping_times_.find(product) == ping_times_.end())
+      return false;
+    *time = ping_times_[product];
+    return true;
+  }
+  virtual bool ClearPingTime(Product product) OVERRIDE {
+    ping_times_.erase(product);
+    return true;
+  }
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE {
+    rlzs_[access_point] = new_rlz;
+    return true;
+  }
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE {
+    ++reads_;
+    std::string value = rlzs_[access_point];
+    if (value.size() >= rlz_size)
+      return false;
+    strcpy(rlz, value.c_str());
+    return true;
+  }
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE {
+    rlzs_.erase(access_point);
+    return true;
+  }
+
+  virtual bool AddProductEvent(Product product,
+                               const char* event_rlz) OVERRIDE {
+    events_[product].insert(event_rlz);
+    return true;
+  }
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE {
+    ++reads_;
+    events->insert(events->end(), events_[product].begin(),
+                   events_[product].end());
+    return true;
+  }
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE {
+    events_[product].erase(event_rlz);
+    return true;
+  }
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE {
+    events_.erase(product);
+    return true;
+  }
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE {
+    stateful_events_[product].insert(event_rlz);
+    return true;
+  }
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE {
+    ++reads_;
+    return stateful_events_[product].count(event_rlz) != 0;
+  }
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE {
+    stateful_events_.erase(product);
+    return true;
+  }
+
+  virtual void CollectGarbage() OVERRIDE {}
+
+  int reads() const { return reads_; }
+
+ private:
+  std::map<Product, int64> ping_times_;
+  std::map<AccessPoint, std::string> rlzs_;
+  std::map<Product, std::set<std::string> > events_;
+  std::map<Product, std::set<std::string> > stateful_events_;
+  int reads_;
+};
+
+}  // namespace
+
+// The cache is process-wide, so start and end each test with an empty one.
+// With a SupplementaryBranding on the stack, a lock scope and its cache are
+// already open, so the tests below only run in the first pass.
+class RlzValueStoreCacheTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    RlzLibTestNoMachineState::SetUp();
+    RlzValueStoreCache::Invalidate();
+  }
+
+  virtual void TearDown() OVERRIDE {
+    RlzValueStoreCache::Invalidate();
+    RlzLibTestNoMachineState::TearDown();
+  }
+
+  FakeRlzValueStore store_;
+};
+
+TEST_F(RlzValueStoreCacheTest, ReadsAreCachedWhileGenerationIsUnchanged) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  store_.WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz");
+  store_.WritePingTime(TOOLBAR_NOTIFIER, 1234);
+  store_.AddStatefulEvent(TOOLBAR_NOTIFIER, "I7F");
+
+  char rlz_50[50];
+  int64 ping_time = 0;
+  {
+    RlzValueStoreCache cache(&store_, 1);
+    EXPECT_TRUE(cache.ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+    EXPECT_TRUE(cache.ReadPingTime(TOOLBAR_NOTIFIER, &ping_time));
+    EXPECT_TRUE(cache.IsStatefulEventById(TOOLBAR_NOTIFIER,
+                                          IE_DEFAULT_SEARCH, FIRST_SEARCH));
+    EXPECT_FALSE(cache.IsStatefulEvent(TOOLBAR_NOTIFIER, "I7S"));
+    EXPECT_FALSE(cache.dirty());
+  }
+  EXPECT_EQ(4, store_.reads());
+
+  {
+    RlzValueStoreCache cache(&store_, 1);
+    EXPECT_TRUE(cache.ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+    EXPECT_STREQ("IeTbRlz", rlz_50);
+    EXPECT_TRUE(cache.ReadPingTime(TOOLBAR_NOTIFIER, &ping_time));
+    EXPECT_EQ(1234, ping_time);
+    EXPECT_TRUE(cache.IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+    EXPECT_FALSE(cache.IsStatefulEventById(TOOLBAR_NOTIFIER,
+                                           IE_DEFAULT_SEARCH, SET_TO_GOOGLE));
+  }
+  EXPECT_EQ(4, store_.reads());
+
+  // Another process wrote to the store.
+  {
+    RlzValueStoreCache cache(&store_, 2);
+    EXPECT_TRUE(cache.ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+  }
+  EXPECT_EQ(5, store_.reads());
+}
+
+TEST_F(RlzValueStoreCacheTest, WritesUpdateCache) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  {
+    RlzValueStoreCache cache(&store_, 1);
+    EXPECT_TRUE(cache.WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+    EXPECT_TRUE(cache.AddStatefulEventById(TOOLBAR_NOTIFIER,
+                                           IE_DEFAULT_SEARCH, FIRST_SEARCH));
+    EXPECT_TRUE(cache.dirty());
+    cache.Commit(2);
+  }
+
+  char rlz_50[50];
+  std::vector<std::string> events;
+  {
+    RlzValueStoreCache cache(&store_, 2);
+    EXPECT_TRUE(cache.ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+    EXPECT_STREQ("IeTbRlz", rlz_50);
+    EXPECT_TRUE(cache.IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+    EXPECT_EQ(0, store_.reads());
+
+    EXPECT_TRUE(cache.ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+    EXPECT_EQ(0u, events.size());
+    EXPECT_EQ(1, store_.reads());
+
+    // Changing the events drops the cached ones.
+    EXPECT_TRUE(cache.AddProductEventById(TOOLBAR_NOTIFIER,
+                                          IE_DEFAULT_SEARCH, SET_TO_GOOGLE));
+    EXPECT_TRUE(cache.ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+    ASSERT_EQ(1u, events.size());
+    EXPECT_EQ("I7S", events[0]);
+    EXPECT_EQ(2, store_.reads());
+
+    EXPECT_TRUE(cache.ClearAllStatefulEvents(TOOLBAR_NOTIFIER));
+    EXPECT_FALSE(cache.IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+    EXPECT_EQ(3, store_.reads());
+  }
+}
+
+#if defined(OS_LINUX)
+TEST_F(RlzValueStoreCacheTest, LockFreeReads) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  char rlz_50[50];
+  EXPECT_FALSE(RlzValueStoreCache::ReadCachedAccessPointRlz(IETB_SEARCH_BOX,
+                                                            rlz_50, 50));
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(RlzValueStoreCache::ReadCachedAccessPointRlz(IETB_SEARCH_BOX,
+                                                           rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+
+  // Values that don't fit are left to the store, which reports the error.
+  char rlz_5[5];
+  EXPECT_FALSE(RlzValueStoreCache::ReadCachedAccessPointRlz(IETB_SEARCH_BOX,
+                                                            rlz_5, 5));
+
+  // Another process bumps the generation after writing to the store.
+  uint32 generation = 0;
+  ASSERT_TRUE(ReadStoreGeneration(&generation));
+  ++generation;
+  ASSERT_EQ(static_cast<int>(sizeof(generation)),
+            file_util::WriteFile(temp_dir_.path().Append("generation"),
+                                 reinterpret_cast<const char*>(&generation),
+                                 sizeof(generation)));
+  EXPECT_FALSE(RlzValueStoreCache::ReadCachedAccessPointRlz(IETB_SEARCH_BOX,
+                                                            rlz_50, 50));
+
+  // The next read through the store fills the cache again. Inside a lock
+  // scope, reads always go through the store.
+  {
+    ScopedRlzValueStoreLock lock;
+    EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+    EXPECT_STREQ("IeTbRlz", rlz_50);
+  }
+  EXPECT_TRUE(RlzValueStoreCache::ReadCachedAccessPointRlz(IETB_SEARCH_BOX,
+                                                           rlz_50, 50));
+}
+#endif  // defined(OS_LINUX)
+
+}  // namespace rlz_lib
@@ -0,0 +1,47 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Main function for the rlz broker, which serves the store of the user's rlz
+// directory to processes that called SetRlzBrokerEnabled(). See
+// linux/lib/rlz_broker_linux.h. Runs until it gets SIGTERM or SIGINT.
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "base/at_exit.h"
+#include "base/command_line.h"
+#include "rlz/linux/lib/rlz_broker_linux.h"
+
+namespace {
+
+rlz_lib::RlzBroker* g_broker = NULL;
+
+void StopBroker(int signal) {
+  g_broker->Stop();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  CommandLine::Init(argc, argv);
+
+  rlz_lib::RlzBroker broker;
+  if (!broker.Listen()) {
+    fprintf(stderr, "rlz_broker: another broker is running, or the socket "
+                    "can't be created\n");
+    return 1;
+  }
+
+  g_broker = &broker;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &StopBroker;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+
+  broker.Run();
+  return 0;
+}
@@ -0,0 +1,848 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_broker_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "base/atomicops.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/logging.h"
+#include "base/pickle.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lock_stats.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// Requests and replies are small, anything bigger comes from a broken peer.
+const uint32 kMaxMessageSize = 64 * 1024;
+// How long a client waits for the reply to a store call, and the broker for
+// the rest of a request once it started arriving.
+const int kIoTimeoutMs = 5000;
+// How long the broker keeps the store lock while clients keep asking for it.
+const int kMaxHoldMs = 100;
+// How long after its deadline a client waits for the broker to answer whether
+// it started the lock scope. The broker answers busy itself once the deadline
+// passed, so this only covers the round trip, even for a timeout of 0.
+const int kBeginReplyMs = 100;
+
+volatile base::subtle::Atomic32 g_broker_enabled = 0;
+
+int RemainingMs(base::TimeTicks deadline) {
+  int64 remaining = (deadline - base::TimeTicks::Now()).InMilliseconds();
+  return static_cast<int>(std::max<int64>(0, std::min<int64>(remaining,
+                                                             kint32max)));
+}
+
+// Reads |size| bytes into |buffer|, waiting for them until |deadline|.
+bool ReadFully(int fd, char* buffer, size_t size, base::TimeTicks deadline) {
+  while (size > 0) {
+    struct pollfd poll_fd = { fd, POLLIN, 0 };
+    if (HANDLE_EINTR(poll(&poll_fd, 1, RemainingMs(deadline))) != 1)
+      return false;
+    ssize_t count = HANDLE_EINTR(read(fd, buffer, size));
+    if (count <= 0)
+      return false;
+    buffer += count;
+    size -= count;
+  }
+  return true;
+}
+
+bool WriteMessage(int fd, const Pickle& message) {
+  uint32 size = message.size();
+  std::string buffer(reinterpret_cast<const char*>(&size), sizeof(size));
+  buffer.append(static_cast<const char*>(message.data()), message.size());
+
+  const char* data = buffer.data();
+  size_t left = buffer.size();
+  while (left > 0) {
+    // A peer that went away must not kill this process with SIGPIPE.
+    ssize_t count = HANDLE_EINTR(send(fd, data, left, MSG_NOSIGNAL));
+    if (count <= 0)
+      return false;
+    data += count;
+    left -= count;
+  }
+  return true;
+}
+
+bool ReadMessage(int fd, base::TimeTicks deadline, std::string* message) {
+  uint32 size = 0;
+  if (!ReadFully(fd, reinterpret_cast<char*>(&size), sizeof(size), deadline) ||
+      size == 0 || size > kMaxMessageSize) {
+    return false;
+  }
+  message->resize(size);
+  return ReadFully(fd, &(*message)[0], size, deadline);
+}
+
+// Reads the result that a reply starts with.
+bool ReadResult(PickleIterator* iter) {
+  bool result = false;
+  return iter->ReadBool(&result) && result;
+}
+
+bool GetBrokerAddress(struct sockaddr_un* address) {
+  std::string path = RlzBrokerSocketFilename().value();
+  if (path.size() >= sizeof(address->sun_path))
+    return false;
+
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  strncpy(address->sun_path, path.c_str(), sizeof(address->sun_path) - 1);
+  return true;
+}
+
+bool IsValidProduct(int product) {
+  return product >= IE_TOOLBAR && product <= PARTNER;
+}
+
+bool IsValidAccessPoint(int point) {
+  return point >= NO_ACCESS_POINT && point < LAST_ACCESS_POINT;
+}
+
+// Writes the RLZs of an enumeration to a reply, after their count.
+class PickleRlzVisitor : public RlzValueStore::AccessPointRlzVisitor {
+ public:
+  PickleRlzVisitor() {}
+  virtual ~PickleRlzVisitor() {}
+
+  virtual void Visit(AccessPoint access_point, const char* rlz) OVERRIDE {
+    rlzs_.push_back(std::make_pair(access_point, std::string(rlz)));
+  }
+
+  void WriteTo(Pickle* reply) const {
+    reply->WriteInt(static_cast<int>(rlzs_.size()));
+    for (size_t i = 0; i < rlzs_.size(); ++i) {
+      reply->WriteInt(rlzs_[i].first);
+      reply->WriteString(rlzs_[i].second);
+    }
+  }
+
+ private:
+  std::vector<std::pair<AccessPoint, std::string> > rlzs_;
+
+  DISALLOW_COPY_AND_ASSIGN(PickleRlzVisitor);
+};
+
+}  // namespace
+
+void SetRlzBrokerEnabled(bool enabled) {
+  base::subtle::Release_Store(&g_broker_enabled, enabled);
+}
+
+bool IsRlzBrokerEnabled() {
+  return base::subtle::Acquire_Load(&g_broker_enabled) != 0;
+}
+
+// RlzBrokerClient
+
+RlzBrokerClient::RlzBrokerClient() : fd_(-1), pid_(0) {
+}
+
+RlzBrokerClient::~RlzBrokerClient() {
+  Disconnect();
+}
+
+bool RlzBrokerClient::Begin(RlzValueStore::AccessType access,
+                            const std::string& brand,
+                            base::TimeTicks deadline,
+                            bool* busy) {
+  if (fd_ != -1 && pid_ != getpid()) {
+    // The connection of the parent process; this one needs its own.
+    ignore_result(HANDLE_EINTR(close(fd_)));
+    fd_ = -1;
+  }
+  if (fd_ == -1 && !Connect())
+    return false;
+
+  Pickle request;
+  request.WriteInt(BROKER_BEGIN);
+  request.WriteInt(access);
+  request.WriteInt64(deadline.ToInternalValue());
+  request.WriteString(brand);
+  base::TimeTicks reply_deadline =
+      deadline + base::TimeDelta::FromMilliseconds(kBeginReplyMs);
+  std::string reply;
+  if (!WriteMessage(fd_, request) ||
+      !ReadMessage(fd_, reply_deadline, &reply)) {
+    // The broker is still running the scope of another client, and might
+    // start this one later, so the connection can't be used anymore.
+    // Disconnecting ends the scope.
+    *busy = base::TimeTicks::Now() >= reply_deadline;
+    Disconnect();
+    return false;
+  }
+
+  Pickle reply_pickle(reply.data(), reply.size());
+  PickleIterator iter(reply_pickle);
+  bool started = false;
+  if (!iter.ReadBool(&started) || !iter.ReadBool(busy) || !started)
+    return false;
+
+  brand_ = brand;
+  return true;
+}
+
+bool RlzBrokerClient::SetBrand(const std::string& brand) {
+  if (brand == brand_)
+    return true;
+
+  Pickle request;
+  request.WriteInt(BROKER_SET_BRAND);
+  request.WriteString(brand);
+  if (!CallForResult(request))
+    return false;
+
+  brand_ = brand;
+  return true;
+}
+
+bool RlzBrokerClient::Commit() {
+  Pickle request;
+  request.WriteInt(BROKER_COMMIT);
+  return CallForResult(request);
+}
+
+bool RlzBrokerClient::End() {
+  Pickle request;
+  request.WriteInt(BROKER_END);
+  return CallForResult(request);
+}
+
+bool RlzBrokerClient::Call(const Pickle& request, std::string* reply) {
+  if (fd_ == -1)
+    return false;
+
+  base::TimeTicks deadline = base::TimeTicks::Now() +
+      base::TimeDelta::FromMilliseconds(kIoTimeoutMs);
+  if (WriteMessage(fd_, request) && ReadMessage(fd_, deadline, reply))
+    return true;
+
+  Disconnect();
+  return false;
+}
+
+bool RlzBrokerClient::CallForResult(const Pickle& request) {
+  std::string reply;
+  if (!Call(request, &reply))
+    return false;
+
+  Pickle reply_pickle(reply.data(), reply.size());
+  PickleIterator iter(reply_pickle);
+  return ReadResult(&iter);
+}
+
+bool RlzBrokerClient::Connect() {
+  // Without a broker, this fails right away, so every outermost lock scope
+  // looks for one.
+  struct sockaddr_un address;
+  int fd = -1;
+  if (GetBrokerAddress(&address))
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd != -1 &&
+      (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+       HANDLE_EINTR(connect(fd, reinterpret_cast<struct sockaddr*>(&address),
+                            sizeof(address))) != 0)) {
+    ignore_result(HANDLE_EINTR(close(fd)));
+    fd = -1;
+  }
+
+  if (fd == -1)
+    return false;
+
+  fd_ = fd;
+  pid_ = getpid();
+  return true;
+}
+
+void RlzBrokerClient::Disconnect() {
+  if (fd_ != -1)
+    ignore_result(HANDLE_EINTR(close(fd_)));
+  fd_ = -1;
+}
+
+// RlzValueStoreBrokerProxy
+
+RlzValueStoreBrokerProxy::RlzValueStoreBrokerProxy(RlzBrokerClient* client)
+    : client_(client) {
+}
+
+RlzValueStoreBrokerProxy::~RlzValueStoreBrokerProxy() {
+}
+
+bool RlzValueStoreBrokerProxy::HasAccess(AccessType type) {
+  Pickle request;
+  request.WriteInt(BROKER_HAS_ACCESS);
+  request.WriteInt(type);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::WritePingTime(Product product, int64 time) {
+  Pickle request;
+  request.WriteInt(BROKER_WRITE_PING_TIME);
+  request.WriteInt(product);
+  request.WriteInt64(time);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::ReadPingTime(Product product, int64* time) {
+  Pickle request;
+  request.WriteInt(BROKER_READ_PING_TIME);
+  request.WriteInt(product);
+  std::string reply;
+  if (!client_->Call(request, &reply))
+    return false;
+
+  Pickle reply_pickle(reply.data(), reply.size());
+  PickleIterator iter(reply_pickle);
+  return ReadResult(&iter) && iter.ReadInt64(time);
+}
+
+bool RlzValueStoreBrokerProxy::ClearPingTime(Product product) {
+  Pickle request;
+  request.WriteInt(BROKER_CLEAR_PING_TIME);
+  request.WriteInt(product);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::WriteAccessPointRlz(AccessPoint access_point,
+                                                   const char* new_rlz) {
+  Pickle request;
+  request.WriteInt(BROKER_WRITE_ACCESS_POINT_RLZ);
+  request.WriteInt(access_point);
+  request.WriteString(new_rlz);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::ReadAccessPointRlz(AccessPoint access_point,
+                                                  char* rlz,
+                                                  size_t rlz_size) {
+  rlz[0] = 0;
+  Pickle request;
+  request.WriteInt(BROKER_READ_ACCESS_POINT_RLZ);
+  request.WriteInt(access_point);
+  std::string reply;
+  if (!client_->Call(request, &reply))
+    return false;
+
+  Pickle reply_pickle(reply.data(), reply.size());
+  PickleIterator iter(reply_pickle);
+  std::string value;
+  if (!ReadResult(&iter) || !iter.ReadString(&value))
+    return false;
+  if (value.size() >= rlz_size) {
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strcpy(rlz, value.c_str());
+  return true;
+}
+
+bool RlzValueStoreBrokerProxy::ClearAccessPointRlz(AccessPoint access_point) {
+  Pickle request;
+  request.WriteInt(BROKER_CLEAR_ACCESS_POINT_RLZ);
+  request.WriteInt(access_point);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  Pickle request;
+  request.WriteInt(BROKER_ENUMERATE_ACCESS_POINT_RLZS);
+  std::string reply;
+  if (!client_->Call(request, &reply))
+    return false;
+
+  Pickle reply_pickle(reply.data(), reply.size());
+  PickleIterator iter(reply_pickle);
+  int count = 0;
+  if (!ReadResult(&iter) || !iter.ReadInt(&count))
+    return false;
+  for (int i = 0; i < count; ++i) {
+    int point;
+    std::string rlz;
+    if (!iter.ReadInt(&point) || !IsValidAccessPoint(point) ||
+        !iter.ReadString(&rlz))
+      return false;
+    visitor->Visit(static_cast<AccessPoint>(point), rlz.c_str());
+  }
+  return true;
+}
+
+bool RlzValueStoreBrokerProxy::AddProductEvent(Product product,
+                                               const char* event_rlz) {
+  Pickle request;
+  request.WriteInt(BROKER_ADD_PRODUCT_EVENT);
+  request.WriteInt(product);
+  request.WriteString(event_rlz);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::ReadProductEvents(
+    Product product,
+    std::vector<std::string>* events) {
+  Pickle request;
+  request.WriteInt(BROKER_READ_PRODUCT_EVENTS);
+  request.WriteInt(product);
+  std::string reply;
+  if (!client_->Call(request, &reply))
+    return false;
+
+  Pickle reply_pickle(reply.data(), reply.size());
+  PickleIterator iter(reply_pickle);
+  int count = 0;
+  if (!ReadResult(&iter) || !iter.ReadInt(&count))
+    return false;
+  for (int i = 0; i < count; ++i) {
+    std::string event;
+    if (!iter.ReadString(&event))
+      return false;
+    events->push_back(event);
+  }
+  return true;
+}
+
+bool RlzValueStoreBrokerProxy::ClearProductEvent(Product product,
+                                                 const char* event_rlz) {
+  Pickle request;
+  request.WriteInt(BROKER_CLEAR_PRODUCT_EVENT);
+  request.WriteInt(product);
+  request.WriteString(event_rlz);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::ClearAllProductEvents(Product product) {
+  Pickle request;
+  request.WriteInt(BROKER_CLEAR_ALL_PRODUCT_EVENTS);
+  request.WriteInt(product);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::AddStatefulEvent(Product product,
+                                                const char* event_rlz) {
+  Pickle request;
+  request.WriteInt(BROKER_ADD_STATEFUL_EVENT);
+  request.WriteInt(product);
+  request.WriteString(event_rlz);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::IsStatefulEvent(Product product,
+                                               const char* event_rlz) {
+  Pickle request;
+  request.WriteInt(BROKER_IS_STATEFUL_EVENT);
+  request.WriteInt(product);
+  request.WriteString(event_rlz);
+  return client_->CallForResult(request);
+}
+
+bool RlzValueStoreBrokerProxy::ClearAllStatefulEvents(Product product) {
+  Pickle request;
+  request.WriteInt(BROKER_CLEAR_ALL_STATEFUL_EVENTS);
+  request.WriteInt(product);
+  return client_->CallForResult(request);
+}
+
+void RlzValueStoreBrokerProxy::CollectGarbage() {
+  Pickle request;
+  request.WriteInt(BROKER_COLLECT_GARBAGE);
+  ignore_result(client_->CallForResult(request));
+}
+
+// RlzBroker
+
+RlzBroker::RlzBroker()
+    : listen_fd_(-1), broker_lock_fd_(-1), owner_(-1), owner_shared_(false) {
+  stop_pipe_[0] = -1;
+  stop_pipe_[1] = -1;
+}
+
+RlzBroker::~RlzBroker() {
+  while (!clients_.empty())
+    CloseClient(clients_.back());
+  lock_.reset();
+
+  if (listen_fd_ != -1) {
+    unlink(RlzBrokerSocketFilename().value().c_str());
+    ignore_result(HANDLE_EINTR(close(listen_fd_)));
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (stop_pipe_[i] != -1)
+      ignore_result(HANDLE_EINTR(close(stop_pipe_[i])));
+  }
+  // Closing the file releases the fcntl() lock.
+  if (broker_lock_fd_ != -1)
+    ignore_result(HANDLE_EINTR(close(broker_lock_fd_)));
+}
+
+bool RlzBroker::Listen() {
+  // The broker's own lock scopes use the files.
+  SetRlzBrokerEnabled(false);
+
+  broker_lock_fd_ = HANDLE_EINTR(open(RlzBrokerLockFilename().value().c_str(),
+                                      O_RDWR | O_CREAT, 0600));
+  if (broker_lock_fd_ == -1)
+    return false;
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (HANDLE_EINTR(fcntl(broker_lock_fd_, F_SETLK, &lock)) != 0)
+    return false;
+
+  struct sockaddr_un address;
+  if (!GetBrokerAddress(&address) || pipe(stop_pipe_) != 0)
+    return false;
+
+  // A broker that crashed left its socket behind.
+  unlink(address.sun_path);
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ == -1)
+    return false;
+
+  // Only the user's processes can connect, like only they can open the store.
+  mode_t old_umask = umask(0077);
+  bool bound = bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&address),
+                    sizeof(address)) == 0;
+  umask(old_umask);
+  if (!bound || listen(listen_fd_, SOMAXCONN) != 0) {
+    ignore_result(HANDLE_EINTR(close(listen_fd_)));
+    listen_fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void RlzBroker::Run() {
+  // Waiters in client processes that time out see this in the lock file.
+  ScopedRlzEntryPoint entry_point("RlzBroker");
+  size_t first_client = 0;
+  for (;;) {
+    std::vector<struct pollfd> poll_fds;
+    struct pollfd stop_fd = { stop_pipe_[0], POLLIN, 0 };
+    struct pollfd listen_fd = { listen_fd_, POLLIN, 0 };
+    poll_fds.push_back(stop_fd);
+    poll_fds.push_back(listen_fd);
+    if (owner_ != -1) {
+      // Other clients wait until the running scope ends.
+      struct pollfd owner_fd = { owner_, POLLIN, 0 };
+      poll_fds.push_back(owner_fd);
+    } else {
+      // Take turns at starting scopes.
+      for (size_t i = 0; i < clients_.size(); ++i) {
+        struct pollfd client_fd =
+            { clients_[(first_client + i) % clients_.size()], POLLIN, 0 };
+        poll_fds.push_back(client_fd);
+      }
+      ++first_client;
+    }
+
+    // Between scopes, only keep the store lock while clients are waiting.
+    int timeout_ms = -1;
+    if (owner_ == -1 && lock_.get()) {
+      if ((base::TimeTicks::Now() - lock_acquired_).InMilliseconds() >=
+          kMaxHoldMs) {
+        lock_.reset();
+      } else {
+        timeout_ms = 0;
+      }
+    }
+
+    int ready = HANDLE_EINTR(poll(&poll_fds[0], poll_fds.size(), timeout_ms));
+    if (ready < 0)
+      break;
+    if (ready == 0) {
+      lock_.reset();
+      continue;
+    }
+    if (poll_fds[0].revents)
+      break;
+    if (poll_fds[1].revents & POLLIN)
+      Accept();
+
+    for (size_t i = 2; i < poll_fds.size(); ++i) {
+      int fd = poll_fds[i].fd;
+      // Once a client started a scope, the others wait for the next round.
+      if (!poll_fds[i].revents || (owner_ != -1 && fd != owner_))
+        continue;
+      if (!HandleRequest(fd))
+        CloseClient(fd);
+    }
+  }
+}
+
+void RlzBroker::Stop() {
+  char c = 0;
+  ignore_result(HANDLE_EINTR(write(stop_pipe_[1], &c, 1)));
+}
+
+void RlzBroker::Accept() {
+  int fd = HANDLE_EINTR(accept(listen_fd_, NULL, NULL));
+  if (fd == -1)
+    return;
+
+  // The socket's permissions should already keep other users out.
+  struct ucred credentials;
+  socklen_t size = sizeof(credentials);
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+      getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0 ||
+      credentials.uid != geteuid()) {
+    ignore_result(HANDLE_EINTR(close(fd)));
+    return;
+  }
+  clients_.push_back(fd);
+}
+
+bool RlzBroker::HandleRequest(int fd) {
+  base::TimeTicks deadline = base::TimeTicks::Now() +
+      base::TimeDelta::FromMilliseconds(kIoTimeoutMs);
+  std::string message;
+  if (!ReadMessage(fd, deadline, &message))
+    return false;
+
+  Pickle request(message.data(), message.size());
+  PickleIterator iter(request);
+  int type = 0;
+  if (!iter.ReadInt(&type))
+    return false;
+
+  Pickle reply;
+  if (type == BROKER_BEGIN) {
+    int access = 0;
+    int64 client_deadline = 0;
+    std::string brand;
+    if (owner_ != -1 || !iter.ReadInt(&access) ||
+        !iter.ReadInt64(&client_deadline) || !iter.ReadString(&brand)) {
+      return false;
+    }
+    if (!lock_.get()) {
+      // The broker writes, so it always takes the lock for writing. It waits
+      // for other processes as long as the client does; TimeTicks are the
+      // same in all processes.
+      lock_.reset(new ScopedRlzValueStoreLock(
+          RlzValueStore::kWriteAccess,
+          RemainingMs(base::TimeTicks::FromInternalValue(client_deadline))));
+      lock_acquired_ = base::TimeTicks::Now();
+    }
+    bool started = lock_->GetStore() != NULL && SetBrand(brand);
+    bool busy = false;
+    if (started) {
+      owner_ = fd;
+      owner_shared_ = access == RlzValueStore::kReadAccess;
+    } else {
+      busy = lock_->busy();
+      branding_.reset();
+      lock_.reset();
+    }
+    reply.WriteBool(started);
+    reply.WriteBool(busy);
+  } else if (fd != owner_) {
+    // Store calls need a scope.
+    return false;
+  } else if (type == BROKER_COMMIT) {
+    reply.WriteBool(owner_shared_ || lock_->Commit());
+  } else if (type == BROKER_END) {
+    reply.WriteBool(EndScope());
+  } else if (type == BROKER_SET_BRAND) {
+    std::string brand;
+    if (!iter.ReadString(&brand))
+      return false;
+    reply.WriteBool(SetBrand(brand));
+  } else if (!CallStore(type, &iter, &reply)) {
+    return false;
+  }
+  return WriteMessage(fd, reply);
+}
+
+bool RlzBroker::CallStore(int type, PickleIterator* iter, Pickle* reply) {
+  RlzValueStore* store = lock_->GetStore();
+  // Like the store of a lock for reading, a scope for reading can't write.
+  bool can_write = !owner_shared_;
+
+  int access = 0;
+  int value = 0;
+  int64 time = 0;
+  std::string string_value;
+  switch (type) {
+    case BROKER_HAS_ACCESS:
+      if (!iter->ReadInt(&access))
+        return false;
+      reply->WriteBool(
+          (access == RlzValueStore::kReadAccess || can_write) &&
+          store->HasAccess(static_cast<RlzValueStore::AccessType>(access)));
+      return true;
+
+    case BROKER_WRITE_PING_TIME:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value) ||
+          !iter->ReadInt64(&time))
+        return false;
+      reply->WriteBool(can_write &&
+                       store->WritePingTime(static_cast<Product>(value), time));
+      return true;
+
+    case BROKER_READ_PING_TIME: {
+      if (!iter->ReadInt(&value) || !IsValidProduct(value))
+        return false;
+      bool result = store->ReadPingTime(static_cast<Product>(value), &time);
+      reply->WriteBool(result);
+      reply->WriteInt64(time);
+      return true;
+    }
+
+    case BROKER_CLEAR_PING_TIME:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value))
+        return false;
+      reply->WriteBool(can_write &&
+                       store->ClearPingTime(static_cast<Product>(value)));
+      return true;
+
+    case BROKER_WRITE_ACCESS_POINT_RLZ:
+      if (!iter->ReadInt(&value) || !IsValidAccessPoint(value) ||
+          !iter->ReadString(&string_value))
+        return false;
+      reply->WriteBool(can_write && store->WriteAccessPointRlz(
+          static_cast<AccessPoint>(value), string_value.c_str()));
+      return true;
+
+    case BROKER_READ_ACCESS_POINT_RLZ: {
+      if (!iter->ReadInt(&value) || !IsValidAccessPoint(value))
+        return false;
+      char rlz[kMaxRlzLength + 1];
+      bool result = store->ReadAccessPointRlz(static_cast<AccessPoint>(value),
+                                              rlz, arraysize(rlz));
+      reply->WriteBool(result);
+      reply->WriteString(result ? rlz : "");
+      return true;
+    }
+
+    case BROKER_CLEAR_ACCESS_POINT_RLZ:
+      if (!iter->ReadInt(&value) || !IsValidAccessPoint(value))
+        return false;
+      reply->WriteBool(can_write && store->ClearAccessPointRlz(
+          static_cast<AccessPoint>(value)));
+      return true;
+
+    case BROKER_ADD_PRODUCT_EVENT:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value) ||
+          !iter->ReadString(&string_value))
+        return false;
+      reply->WriteBool(can_write && store->AddProductEvent(
+          static_cast<Product>(value), string_value.c_str()));
+      return true;
+
+    case BROKER_READ_PRODUCT_EVENTS: {
+      if (!iter->ReadInt(&value) || !IsValidProduct(value))
+        return false;
+      std::vector<std::string> events;
+      bool result = store->ReadProductEvents(static_cast<Product>(value),
+                                             &events);
+      reply->WriteBool(result);
+      reply->WriteInt(static_cast<int>(events.size()));
+      for (size_t i = 0; i < events.size(); ++i)
+        reply->WriteString(events[i]);
+      return true;
+    }
+
+    case BROKER_CLEAR_PRODUCT_EVENT:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value) ||
+          !iter->ReadString(&string_value))
+        return false;
+      reply->WriteBool(can_write && store->ClearProductEvent(
+          static_cast<Product>(value), string_value.c_str()));
+      return true;
+
+    case BROKER_CLEAR_ALL_PRODUCT_EVENTS:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value))
+        return false;
+      reply->WriteBool(can_write && store->ClearAllProductEvents(
+          static_cast<Product>(value)));
+      return true;
+
+    case BROKER_ADD_STATEFUL_EVENT:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value) ||
+          !iter->ReadString(&string_value))
+        return false;
+      reply->WriteBool(can_write && store->AddStatefulEvent(
+          static_cast<Product>(value), string_value.c_str()));
+      return true;
+
+    case BROKER_IS_STATEFUL_EVENT:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value) ||
+          !iter->ReadString(&string_value))
+        return false;
+      reply->WriteBool(store->IsStatefulEvent(static_cast<Product>(value),
+                                              string_value.c_str()));
+      return true;
+
+    case BROKER_CLEAR_ALL_STATEFUL_EVENTS:
+      if (!iter->ReadInt(&value) || !IsValidProduct(value))
+        return false;
+      reply->WriteBool(can_write && store->ClearAllStatefulEvents(
+          static_cast<Product>(value)));
+      return true;
+
+    case BROKER_COLLECT_GARBAGE:
+      if (can_write)
+        store->CollectGarbage();
+      reply->WriteBool(can_write);
+      return true;
+
+    case BROKER_ENUMERATE_ACCESS_POINT_RLZS: {
+      PickleRlzVisitor visitor;
+      bool result = store->EnumerateAccessPointRlzs(&visitor);
+      reply->WriteBool(result);
+      visitor.WriteTo(reply);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RlzBroker::SetBrand(const std::string& brand) {
+  // The stores and their cache use the brand of this process, which a
+  // SupplementaryBranding sets under the broker's lock.
+  if (brand == SupplementaryBranding::GetBrand())
+    return true;
+
+  branding_.reset();
+  if (!brand.empty())
+    branding_.reset(new SupplementaryBranding(brand.c_str()));
+  return brand == SupplementaryBranding::GetBrand();
+}
+
+bool RlzBroker::EndScope() {
+  bool result = owner_shared_ || lock_->Commit();
+  branding_.reset();
+  owner_ = -1;
+  owner_shared_ = false;
+  return result;
+}
+
+void RlzBroker::CloseClient(int fd) {
+  if (fd == owner_)
+    VERIFY(EndScope());
+  clients_.erase(std::remove(clients_.begin(), clients_.end(), fd),
+                 clients_.end());
+  ignore_result(HANDLE_EINTR(close(fd)));
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,227 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The rlz broker is an optional process that keeps the store of an rlz
+// directory open and serves it to the other processes that use the directory,
+// over a Unix domain socket in it. On hosts where one user runs many sessions,
+// processes then don't each lock, load and write the store files: the broker
+// locks them once for a run of lock scopes of different clients, and keeps the
+// store in memory in between.
+//
+// Client processes opt in with SetRlzBrokerEnabled(). Their outermost
+// ScopedRlzValueStoreLock then asks the broker for the store, and GetStore()
+// returns an RlzValueStoreBrokerProxy. Without a running broker, they use the
+// files directly. The broker takes the same cross-process lock as those
+// clients, so both kinds can use a directory at the same time.
+//
+// Messages are a 32 bit length followed by a Pickle: a request is an
+// RlzBrokerRequest followed by the arguments of the call, a reply is the
+// bool result followed by the values the call returns.
+
+#ifndef RLZ_LINUX_LIB_RLZ_BROKER_LINUX_H_
+#define RLZ_LINUX_LIB_RLZ_BROKER_LINUX_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/compiler_specific.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_value_store.h"
+
+class FilePath;
+class Pickle;
+class PickleIterator;
+
+namespace rlz_lib {
+
+class SupplementaryBranding;
+
+enum RlzBrokerRequest {
+  // Starts a lock scope, once the broker has no other one running. Takes the
+  // access type, the TimeTicks until which the client waits for the store
+  // lock, and the supplementary brand. The reply says whether the lock was
+  // busy if the scope didn't start.
+  BROKER_BEGIN = 1,
+  // Writes the changes of the lock scope, see ScopedRlzValueStoreLock.
+  BROKER_COMMIT,
+  // Ends the lock scope, writing its changes.
+  BROKER_END,
+  // Makes the rest of the lock scope use the store of another supplementary
+  // brand. Takes the brand.
+  BROKER_SET_BRAND,
+
+  // RlzValueStore calls, with the same arguments.
+  BROKER_HAS_ACCESS,
+  BROKER_WRITE_PING_TIME,
+  BROKER_READ_PING_TIME,
+  BROKER_CLEAR_PING_TIME,
+  BROKER_WRITE_ACCESS_POINT_RLZ,
+  BROKER_READ_ACCESS_POINT_RLZ,
+  BROKER_CLEAR_ACCESS_POINT_RLZ,
+  BROKER_ADD_PRODUCT_EVENT,
+  BROKER_READ_PRODUCT_EVENTS,
+  BROKER_CLEAR_PRODUCT_EVENT,
+  BROKER_CLEAR_ALL_PRODUCT_EVENTS,
+  BROKER_ADD_STATEFUL_EVENT,
+  BROKER_IS_STATEFUL_EVENT,
+  BROKER_CLEAR_ALL_STATEFUL_EVENTS,
+  BROKER_COLLECT_GARBAGE,
+  BROKER_ENUMERATE_ACCESS_POINT_RLZS,
+};
+
+// The connection of a client process to the broker. Only used with the
+// in-process store lock held.
+class RlzBrokerClient {
+ public:
+  RlzBrokerClient();
+  ~RlzBrokerClient();
+
+  // Starts a lock scope for |access| to the store of |brand|, connecting to
+  // the broker first if needed. Returns false if there is no broker or it
+  // can't serve the store, or if the store lock was busy until |deadline|,
+  // which sets |busy|.
+  bool Begin(RlzValueStore::AccessType access, const std::string& brand,
+             base::TimeTicks deadline, bool* busy);
+
+  // Makes the rest of the lock scope use the store of |brand|. A
+  // SupplementaryBranding sets its brand after its lock began the scope.
+  bool SetBrand(const std::string& brand);
+
+  // Writes the changes made in the lock scope so far.
+  bool Commit();
+
+  // Ends the lock scope, writing its changes unless it was for reading.
+  bool End();
+
+  // Sends |request| and reads the reply into |reply|. Returns false if the
+  // broker went away.
+  bool Call(const Pickle& request, std::string* reply);
+
+  // Sends |request| and returns the result the reply starts with.
+  bool CallForResult(const Pickle& request);
+
+ private:
+  bool Connect();
+  void Disconnect();
+
+  int fd_;
+  // The process that connected |fd_|; forked children connect again.
+  pid_t pid_;
+  // The supplementary brand of the lock scope.
+  std::string brand_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzBrokerClient);
+};
+
+// The store of a lock scope that the broker runs. Every call is a request to
+// the broker.
+class RlzValueStoreBrokerProxy : public RlzValueStore {
+ public:
+  // |client| must have begun a lock scope and outlive this object.
+  explicit RlzValueStoreBrokerProxy(RlzBrokerClient* client);
+  virtual ~RlzValueStoreBrokerProxy();
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+ private:
+  RlzBrokerClient* client_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreBrokerProxy);
+};
+
+// The broker. It runs the lock scopes of its clients one at a time, in the
+// order they asked for them. It holds the cross-process store lock while it
+// runs scopes back to back and releases it when it runs out of clients that
+// wait, or after kMaxHoldMs, so that processes that use the files directly get
+// their turn. A client that disconnects in the middle of its scope ends it;
+// the changes it made so far are written like the others.
+class RlzBroker {
+ public:
+  RlzBroker();
+  ~RlzBroker();
+
+  // Creates the socket. Returns false if another broker serves the directory.
+  bool Listen();
+
+  // Serves clients until Stop() is called.
+  void Run();
+
+  // Makes Run() return. Can be called from other threads and signal handlers.
+  void Stop();
+
+ private:
+  // Accepts a client and adds it to |clients_|.
+  void Accept();
+  // Reads a request of |fd| and replies to it. Returns false if the client
+  // went away or sent something invalid.
+  bool HandleRequest(int fd);
+  // Runs the store call |type| with the arguments that |iter| reads, and
+  // writes the result to |reply|.
+  bool CallStore(int type, PickleIterator* iter, Pickle* reply);
+  // Makes the lock scope use the store of |brand|.
+  bool SetBrand(const std::string& brand);
+  // Ends the lock scope of |owner_|.
+  bool EndScope();
+  void CloseClient(int fd);
+
+  int listen_fd_;
+  // fcntl() locked for the lifetime of the broker, so that only one serves a
+  // directory.
+  int broker_lock_fd_;
+  int stop_pipe_[2];
+  std::vector<int> clients_;
+
+  // The client whose lock scope runs, or -1.
+  int owner_;
+  bool owner_shared_;
+
+  scoped_ptr<ScopedRlzValueStoreLock> lock_;
+  base::TimeTicks lock_acquired_;
+  // The supplementary brand of the running scope, if it has one.
+  scoped_ptr<SupplementaryBranding> branding_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzBroker);
+};
+
+// Returns true if SetRlzBrokerEnabled() enabled the broker for this process.
+bool IsRlzBrokerEnabled();
+
+// The paths of the broker socket and of the file that only one broker can
+// lock. Defined in rlz_value_store_lock_linux.cc.
+FilePath RlzBrokerSocketFilename();
+FilePath RlzBrokerLockFilename();
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_BROKER_LINUX_H_
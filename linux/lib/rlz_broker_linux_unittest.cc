@@ -0,0 +1,398 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for the rlz broker. The broker runs in a forked process, like the
+// rlz_broker executable would.
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/linux/lib/rlz_broker_linux.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace rlz_lib {
+
+namespace {
+
+RlzBroker* g_broker = NULL;
+
+void StopBroker(int signal) {
+  g_broker->Stop();
+}
+
+}  // namespace
+
+// In the second pass, the supplementary brand of the test run holds the store
+// lock, which the forked broker and children would inherit. So these tests
+// only run in the first pass, and set their own brands.
+class RlzBrokerTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void TearDown() OVERRIDE {
+    SetRlzBrokerEnabled(false);
+    RlzLibTestNoMachineState::TearDown();
+  }
+
+  // Forks a broker for the test directory. Returns once it listens, or -1 if
+  // it couldn't.
+  pid_t ForkBroker() {
+    int ready[2];
+    if (pipe(ready) != 0)
+      return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(ready[0]);
+      RlzBroker broker;
+      char c = broker.Listen();
+      if (c) {
+        g_broker = &broker;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &StopBroker;
+        sigaction(SIGTERM, &action, NULL);
+      }
+      if (write(ready[1], &c, 1) != 1 || !c)
+        _exit(1);
+      broker.Run();
+      _exit(0);
+    }
+
+    close(ready[1]);
+    char c = 0;
+    bool ok = pid != -1 && read(ready[0], &c, 1) == 1 && c;
+    close(ready[0]);
+    if (!ok && pid != -1) {
+      WaitForChild(pid);
+      pid = -1;
+    }
+    return pid;
+  }
+
+  bool StopBrokerProcess(pid_t pid) {
+    return kill(pid, SIGTERM) == 0 && WaitForChild(pid);
+  }
+
+  bool WaitForChild(pid_t pid) {
+    int status = 0;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+  }
+};
+
+TEST_F(RlzBrokerTest, WithoutBrokerUsesFiles) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  SetRlzBrokerEnabled(true);
+  int flush_count = testing::GetStoreFlushCount();
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_EQ(flush_count + 1, testing::GetStoreFlushCount());
+
+  char rlz[50];
+  EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("IeTbRlz", rlz);
+}
+
+TEST_F(RlzBrokerTest, ClientsUseBroker) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  pid_t broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+  SetRlzBrokerEnabled(true);
+
+  // Nothing is written by this process.
+  int flush_count = testing::GetStoreFlushCount();
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                 SET_TO_GOOGLE));
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess);
+    ASSERT_TRUE(lock.GetStore());
+    char rlz[50];
+    EXPECT_TRUE(lock.GetStore()->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz,
+                                                    arraysize(rlz)));
+    EXPECT_STREQ("IeTbRlz", rlz);
+  }
+  AccessPointRlz rlzs[2];
+  size_t count = 0;
+  EXPECT_TRUE(GetAccessPointRlzs(rlzs, arraysize(rlzs), &count));
+  ASSERT_EQ(1u, count);
+  EXPECT_EQ(IETB_SEARCH_BOX, rlzs[0].point);
+  EXPECT_STREQ("IeTbRlz", rlzs[0].rlz);
+  char cgi[50];
+  EXPECT_TRUE(GetProductEventsAsCgi(TOOLBAR_NOTIFIER, cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S", cgi);
+  EXPECT_EQ(flush_count, testing::GetStoreFlushCount());
+
+  // Forked children connect on their own.
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    bool ok = RecordProductEvent(TOOLBAR_NOTIFIER, IE_HOME_PAGE, INSTALL);
+    _exit(ok && testing::GetStoreFlushCount() == flush_count ? 0 : 1);
+  }
+  EXPECT_TRUE(WaitForChild(pid));
+
+  // The broker wrote everything to the files.
+  EXPECT_TRUE(StopBrokerProcess(broker));
+  SetRlzBrokerEnabled(false);
+  char rlz[50];
+  EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("IeTbRlz", rlz);
+  EXPECT_TRUE(GetProductEventsAsCgi(TOOLBAR_NOTIFIER, cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S,W1I", cgi);
+}
+
+TEST_F(RlzBrokerTest, BrandedClientsUseBroker) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  pid_t broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+  SetRlzBrokerEnabled(true);
+
+  int flush_count = testing::GetStoreFlushCount();
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  {
+    SupplementaryBranding branding("TEST");
+    EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "BrandedRlz"));
+    char rlz[50];
+    EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+    EXPECT_STREQ("BrandedRlz", rlz);
+  }
+  char rlz[50];
+  EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("IeTbRlz", rlz);
+  EXPECT_EQ(flush_count, testing::GetStoreFlushCount());
+
+  // The broker wrote each brand's value to its own store.
+  EXPECT_TRUE(StopBrokerProcess(broker));
+  SetRlzBrokerEnabled(false);
+  EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("IeTbRlz", rlz);
+  {
+    SupplementaryBranding branding("TEST");
+    EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+    EXPECT_STREQ("BrandedRlz", rlz);
+  }
+}
+
+TEST_F(RlzBrokerTest, BrokerAndFilesShareTheStore) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  pid_t broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+
+  // This process uses the files, its child the broker, turn by turn.
+  for (int i = 0; i < 3; ++i) {
+    std::string rlz_value = "Rlz";
+    rlz_value += '0' + i;
+    EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, rlz_value.c_str()));
+
+    pid_t pid = fork();
+    ASSERT_NE(-1, pid);
+    if (pid == 0) {
+      SetRlzBrokerEnabled(true);
+      int flush_count = testing::GetStoreFlushCount();
+      char rlz[50];
+      bool ok = GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)) &&
+                rlz_value == rlz &&
+                SetAccessPointRlz(IETB_SEARCH_BOX, "Brokered") &&
+                testing::GetStoreFlushCount() == flush_count;
+      _exit(ok ? 0 : 1);
+    }
+    EXPECT_TRUE(WaitForChild(pid));
+
+    char rlz[50];
+    EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+    EXPECT_STREQ("Brokered", rlz);
+  }
+
+  EXPECT_TRUE(StopBrokerProcess(broker));
+}
+
+TEST_F(RlzBrokerTest, OneBrokerPerDirectory) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  pid_t broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+  EXPECT_EQ(-1, ForkBroker());
+  EXPECT_TRUE(StopBrokerProcess(broker));
+
+  // The socket left behind doesn't keep the next one from starting.
+  broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+  EXPECT_TRUE(StopBrokerProcess(broker));
+}
+
+TEST_F(RlzBrokerTest, ClientsFallBackWhenBrokerStops) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  pid_t broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+  SetRlzBrokerEnabled(true);
+
+  int flush_count = testing::GetStoreFlushCount();
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_EQ(flush_count, testing::GetStoreFlushCount());
+
+  EXPECT_TRUE(StopBrokerProcess(broker));
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "NewRlz"));
+  EXPECT_EQ(flush_count + 1, testing::GetStoreFlushCount());
+
+  char rlz[50];
+  EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("NewRlz", rlz);
+}
+
+TEST_F(RlzBrokerTest, LocksThatDontWaitUseBroker) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  pid_t broker = ForkBroker();
+  ASSERT_NE(-1, broker);
+  SetRlzBrokerEnabled(true);
+
+  int flush_count = testing::GetStoreFlushCount();
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess, 0);
+    ASSERT_TRUE(lock.GetStore());
+    EXPECT_TRUE(lock.GetStore()->WriteAccessPointRlz(IETB_SEARCH_BOX,
+                                                     "IeTbRlz"));
+  }
+  EXPECT_EQ(flush_count, testing::GetStoreFlushCount());
+
+  // While a process that uses the files holds the lock, the broker says that
+  // it is busy.
+  int locked[2];
+  int release[2];
+  ASSERT_EQ(0, pipe(locked));
+  ASSERT_EQ(0, pipe(release));
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    SetRlzBrokerEnabled(false);
+    bool ok = false;
+    {
+      ScopedRlzValueStoreLock lock;
+      char c = 0;
+      ok = lock.GetStore() && write(locked[1], &c, 1) == 1 &&
+           read(release[0], &c, 1) == 1;
+    }
+    _exit(ok ? 0 : 1);
+  }
+  char c = 0;
+  ASSERT_EQ(1, read(locked[0], &c, 1));
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess, 0);
+    EXPECT_FALSE(lock.GetStore());
+    EXPECT_TRUE(lock.busy());
+  }
+  ASSERT_EQ(1, write(release[1], &c, 1));
+  EXPECT_TRUE(WaitForChild(pid));
+  close(locked[0]);
+  close(locked[1]);
+  close(release[0]);
+  close(release[1]);
+
+  // The connection is still used after that answer.
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess, 0);
+    ASSERT_TRUE(lock.GetStore());
+    char rlz[50];
+    EXPECT_TRUE(lock.GetStore()->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz,
+                                                    arraysize(rlz)));
+    EXPECT_STREQ("IeTbRlz", rlz);
+  }
+  EXPECT_EQ(flush_count, testing::GetStoreFlushCount());
+
+  EXPECT_TRUE(StopBrokerProcess(broker));
+}
+
+// Measures how many calls per second N client processes get through with the
+// files and with a broker. Run with --gtest_also_run_disabled_tests.
+TEST_F(RlzBrokerTest, DISABLED_BenchmarkAgainstFiles) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const int kClients[] = { 1, 4, 16, 64 };
+  const int kRunMs = 2000;
+  const AccessPoint kPoints[] = { IETB_SEARCH_BOX, NO_ACCESS_POINT };
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  printf("clients    files/s   broker/s\n");
+  for (size_t c = 0; c < arraysize(kClients); ++c) {
+    double rates[2];
+    for (int brokered = 0; brokered < 2; ++brokered) {
+      pid_t broker = -1;
+      if (brokered) {
+        broker = ForkBroker();
+        ASSERT_NE(-1, broker);
+      }
+
+      // Each child writes the number of calls it completed to the pipe.
+      int results[2];
+      ASSERT_EQ(0, pipe(results));
+      base::TimeTicks end =
+          base::TimeTicks::Now() + base::TimeDelta::FromMilliseconds(kRunMs);
+
+      std::vector<pid_t> pids;
+      for (int i = 0; i < kClients[c]; ++i) {
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+          SetRlzBrokerEnabled(brokered != 0);
+          int count = 0;
+          while (base::TimeTicks::Now() < end) {
+            char cgi[100];
+            if (RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                   INSTALL) &&
+                GetPingParams(TOOLBAR_NOTIFIER, kPoints, cgi, arraysize(cgi)) &&
+                ClearProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                  INSTALL)) {
+              count += 3;
+            }
+          }
+          _exit(write(results[1], &count, sizeof(count)) == sizeof(count) ?
+                0 : 1);
+        }
+        pids.push_back(pid);
+      }
+
+      int calls = 0;
+      for (size_t i = 0; i < pids.size(); ++i) {
+        EXPECT_TRUE(WaitForChild(pids[i]));
+        int count = 0;
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(count)),
+                  read(results[0], &count, sizeof(count)));
+        calls += count;
+      }
+      close(results[0]);
+      close(results[1]);
+      if (brokered) {
+        EXPECT_TRUE(StopBrokerProcess(broker));
+      }
+      rates[brokered] = calls * 1000.0 / kRunMs;
+    }
+    printf("%7d %10.0f %10.0f\n", kClients[c], rates[0], rates[1]);
+  }
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,195 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_store_sync_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/atomicops.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+namespace {
+
+StoreSyncMode g_sync_mode = STORE_SYNC_NONE;
+int g_max_commit_delay_ms = 0;
+
+// GroupSyncStoreFiles() runs without the in-process lock, so this is
+// incremented atomically.
+volatile base::subtle::Atomic32 g_store_sync_count = 0;
+
+// Flushes |path| to disk. Files that were removed since the directory was
+// listed, such as the temporary files of a store rewrite, are skipped, and so
+// is anything that is neither a regular file nor a directory: open() fails on
+// sockets, and there is nothing to flush for them.
+bool SyncPath(const FilePath& path) {
+  struct stat info;
+  if (lstat(path.value().c_str(), &info) != 0)
+    return errno == ENOENT;
+  if (!S_ISREG(info.st_mode) && !S_ISDIR(info.st_mode))
+    return true;
+
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+  if (fd == -1)
+    return errno == ENOENT;
+
+  bool result = HANDLE_EINTR(fsync(fd)) == 0;
+  if (HANDLE_EINTR(close(fd)) != 0)
+    result = false;
+  return result;
+}
+
+// Returns true if the sync that covered |synced| also covered |generation|,
+// given that the store is at |current| now. Generations wrap around. If the
+// generation file was recreated since, |synced| is ahead of |current| and
+// doesn't count.
+bool IsCovered(uint32 synced, uint32 generation, uint32 current) {
+  return static_cast<int32>(synced - generation) >= 0 &&
+         static_cast<int32>(current - synced) >= 0;
+}
+
+bool ReadSyncedGenerationFromFd(int fd, uint32* generation) {
+  return HANDLE_EINTR(pread(fd, generation, sizeof(*generation), 0)) ==
+      static_cast<ssize_t>(sizeof(*generation));
+}
+
+// Flushes the files in |directory| and its subdirectories.
+bool SyncDirectoryTree(const FilePath& directory) {
+  bool result = true;
+  file_util::FileEnumerator files(directory, false,
+                                  file_util::FileEnumerator::FILES);
+  for (FilePath path = files.Next(); !path.empty(); path = files.Next())
+    result &= SyncPath(path);
+
+  file_util::FileEnumerator directories(directory, false,
+                                        file_util::FileEnumerator::DIRECTORIES);
+  for (FilePath path = directories.Next(); !path.empty();
+       path = directories.Next()) {
+    result &= SyncDirectoryTree(path);
+  }
+
+  // The directory last, so that it records the renames of the files above.
+  result &= SyncPath(directory);
+  return result;
+}
+
+}  // namespace
+
+void SetStoreSyncMode(StoreSyncMode mode, int max_commit_delay_ms) {
+  g_sync_mode = mode;
+  g_max_commit_delay_ms = max_commit_delay_ms > 0 ? max_commit_delay_ms : 0;
+}
+
+StoreSyncMode GetStoreSyncMode() {
+  return g_sync_mode;
+}
+
+int GetMaxCommitDelayMs() {
+  return g_max_commit_delay_ms;
+}
+
+bool SyncStoreFiles(const FilePath& store_path) {
+  base::subtle::NoBarrier_AtomicIncrement(&g_store_sync_count, 1);
+
+  // The files of the store are named like |store_path| without its
+  // extension, for example RlzStore.db and RlzStore.db-wal, or the RlzStore
+  // directory of RlzValueStoreLinux. The lock, generation and sync lock files
+  // and the broker socket next to them hold no store data.
+  FilePath directory = store_path.DirName();
+  bool result = true;
+  file_util::FileEnumerator files(
+      directory, false,
+      file_util::FileEnumerator::FILES | file_util::FileEnumerator::DIRECTORIES,
+      store_path.BaseName().RemoveExtension().value() + "*");
+  for (FilePath path = files.Next(); !path.empty(); path = files.Next()) {
+    if (file_util::DirectoryExists(path))
+      result &= SyncDirectoryTree(path);
+    else
+      result &= SyncPath(path);
+  }
+
+  // The directory last, so that it records the renames of the files above.
+  result &= SyncPath(directory);
+  return result;
+}
+
+bool GroupSyncStoreFiles(const FilePath& store_path,
+                         const FilePath& sync_lock_file,
+                         uint32 generation) {
+  int fd = HANDLE_EINTR(
+      open(sync_lock_file.value().c_str(), O_RDWR | O_CREAT, 0666));
+  if (fd == -1)
+    return SyncStoreFiles(store_path);
+
+  // Wait for more writers before taking the flock() lock, so that the delay
+  // doesn't hold up the writers that queue behind it.
+  uint32 current = generation;
+  uint32 synced;
+  if (g_max_commit_delay_ms > 0 &&
+      (!ReadStoreGeneration(&current) ||
+       !ReadSyncedGenerationFromFd(fd, &synced) ||
+       !IsCovered(synced, generation, current))) {
+    usleep(g_max_commit_delay_ms * 1000);
+  }
+
+  // flock() locks belong to the open file, unlike the fcntl() locks of the
+  // store lock, so this also queues up threads of this process. Writers that
+  // arrive while another process syncs wait here, and are then covered by
+  // the next sync together.
+  if (HANDLE_EINTR(flock(fd, LOCK_EX)) != 0) {
+    ignore_result(HANDLE_EINTR(close(fd)));
+    return SyncStoreFiles(store_path);
+  }
+
+  current = generation;
+  bool result = true;
+  if (!ReadStoreGeneration(&current) ||
+      !ReadSyncedGenerationFromFd(fd, &synced) ||
+      !IsCovered(synced, generation, current)) {
+    // Everything up to the generation read here is in the page cache, so the
+    // sync below covers it.
+    if (!ReadStoreGeneration(&current))
+      current = generation;
+    result = SyncStoreFiles(store_path);
+    if (result &&
+        HANDLE_EINTR(pwrite(fd, &current, sizeof(current), 0)) !=
+            static_cast<ssize_t>(sizeof(current))) {
+      LOG(WARNING) << "Could not record synced rlz store generation";
+    }
+  }
+
+  // Closing the file releases the flock() lock.
+  if (HANDLE_EINTR(close(fd)) != 0)
+    result = false;
+  return result;
+}
+
+bool ReadSyncedGeneration(const FilePath& sync_lock_file, uint32* generation) {
+  int fd = HANDLE_EINTR(open(sync_lock_file.value().c_str(), O_RDONLY));
+  if (fd == -1)
+    return false;
+
+  bool result = ReadSyncedGenerationFromFd(fd, generation);
+  ignore_result(HANDLE_EINTR(close(fd)));
+  return result;
+}
+
+namespace testing {
+
+int GetStoreSyncCount() {
+  return base::subtle::NoBarrier_Load(&g_store_sync_count);
+}
+
+}  // namespace testing
+
+}  // namespace rlz_lib
@@ -0,0 +1,54 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Makes the writes of ScopedRlzValueStoreLock scopes durable on linux, see
+// SetStoreSyncMode() in rlz_lib.h. The stores only write to the page cache;
+// this fsync()s the files of the store.
+
+#ifndef RLZ_LINUX_LIB_RLZ_STORE_SYNC_LINUX_H_
+#define RLZ_LINUX_LIB_RLZ_STORE_SYNC_LINUX_H_
+
+#include "base/basictypes.h"
+#include "rlz/lib/rlz_lib.h"
+
+class FilePath;
+
+namespace rlz_lib {
+
+// Returns the mode and delay set with SetStoreSyncMode().
+StoreSyncMode GetStoreSyncMode();
+int GetMaxCommitDelayMs();
+
+// Flushes the files of the store at |store_path|: the regular files and
+// directory trees next to it that are named like it without its extension.
+// Also flushes the directories themselves so that renames are durable too.
+bool SyncStoreFiles(const FilePath& store_path);
+
+// Returns once the store writes up to |generation|, see ReadStoreGeneration(),
+// are on disk. Must be called without the cross-process store lock, so that
+// other processes keep writing while this one waits.
+//
+// One process syncs at a time, holding an exclusive lock on |sync_lock_file|.
+// The file also records the store generation the last sync covered: a process
+// that gets the lock after another one synced its writes returns without
+// syncing. Otherwise it reads the current generation and syncs the store files,
+// which covers the writes of all processes that queued up behind it in the
+// meantime. A process whose writes aren't synced yet waits
+// GetMaxCommitDelayMs() before it takes the lock, so that more writes join
+// the next sync without the lock being held for the delay.
+bool GroupSyncStoreFiles(const FilePath& store_path,
+                         const FilePath& sync_lock_file,
+                         uint32 generation);
+
+// Reads the store generation the last GroupSyncStoreFiles() covered.
+bool ReadSyncedGeneration(const FilePath& sync_lock_file, uint32* generation);
+
+namespace testing {
+// Returns the number of times this process synced the store files.
+int GetStoreSyncCount();
+}  // namespace testing
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_STORE_SYNC_LINUX_H_
@@ -0,0 +1,211 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for syncing the linux rlz store. They run with whichever store the
+// library is built with.
+
+#include "rlz/linux/lib/rlz_store_sync_linux.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace rlz_lib {
+
+// With a SupplementaryBranding on the stack, the store is only written when
+// the branding goes out of scope, so these tests only run in the first pass.
+class RlzStoreSyncTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void TearDown() OVERRIDE {
+    SetStoreSyncMode(STORE_SYNC_NONE, 0);
+    RlzLibTestNoMachineState::TearDown();
+  }
+
+  FilePath SyncLockPath() {
+    return temp_dir_.path().Append("synclock");
+  }
+
+  // Only the base name of the store matters for syncing its files.
+  FilePath StorePath() {
+    return temp_dir_.path().Append("RlzStore.json");
+  }
+
+  // Pretends that other processes moved the store to |generation|.
+  void WriteStoreGeneration(uint32 generation) {
+    ASSERT_EQ(static_cast<int>(sizeof(generation)),
+              file_util::WriteFile(temp_dir_.path().Append("generation"),
+                                   reinterpret_cast<const char*>(&generation),
+                                   sizeof(generation)));
+  }
+};
+
+TEST_F(RlzStoreSyncTest, NoSyncByDefault) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  int sync_count = testing::GetStoreSyncCount();
+  EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                 SET_TO_GOOGLE));
+  EXPECT_EQ(sync_count, testing::GetStoreSyncCount());
+}
+
+TEST_F(RlzStoreSyncTest, EachCommitSyncsWrites) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  SetStoreSyncMode(STORE_SYNC_EACH_COMMIT, 0);
+  int sync_count = testing::GetStoreSyncCount();
+  EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                 SET_TO_GOOGLE));
+  EXPECT_EQ(sync_count + 1, testing::GetStoreSyncCount());
+
+  // Reads aren't synced.
+  char cgi[50];
+  EXPECT_TRUE(GetProductEventsAsCgi(TOOLBAR_NOTIFIER, cgi, arraysize(cgi)));
+  EXPECT_EQ(sync_count + 1, testing::GetStoreSyncCount());
+}
+
+TEST_F(RlzStoreSyncTest, SyncSkipsSockets) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // A socket next to the store, like the one of the rlz broker, can't be
+  // opened for syncing.
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_NE(-1, fd);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  FilePath socket_path = temp_dir_.path().Append("RlzStore.sock");
+  ASSERT_LT(socket_path.value().size(), sizeof(address.sun_path));
+  strcpy(address.sun_path, socket_path.value().c_str());
+  ASSERT_EQ(0, bind(fd, reinterpret_cast<struct sockaddr*>(&address),
+                    sizeof(address)));
+
+  SetStoreSyncMode(STORE_SYNC_EACH_COMMIT, 0);
+  EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                 SET_TO_GOOGLE));
+  EXPECT_TRUE(SyncStoreFiles(StorePath()));
+  close(fd);
+}
+
+TEST_F(RlzStoreSyncTest, GroupCommitRecordsSyncedGeneration) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  SetStoreSyncMode(STORE_SYNC_GROUP_COMMIT, 0);
+  int sync_count = testing::GetStoreSyncCount();
+  EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                 SET_TO_GOOGLE));
+  EXPECT_EQ(sync_count + 1, testing::GetStoreSyncCount());
+
+  uint32 generation = 0;
+  uint32 synced = 0;
+  ASSERT_TRUE(ReadStoreGeneration(&generation));
+  ASSERT_TRUE(ReadSyncedGeneration(SyncLockPath(), &synced));
+  EXPECT_EQ(generation, synced);
+}
+
+TEST_F(RlzStoreSyncTest, GroupSyncSkipsCoveredGenerations) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // A sync covers everything written before it started.
+  WriteStoreGeneration(5);
+  int sync_count = testing::GetStoreSyncCount();
+  EXPECT_TRUE(GroupSyncStoreFiles(StorePath(), SyncLockPath(), 3));
+  EXPECT_EQ(sync_count + 1, testing::GetStoreSyncCount());
+  uint32 synced = 0;
+  ASSERT_TRUE(ReadSyncedGeneration(SyncLockPath(), &synced));
+  EXPECT_EQ(5u, synced);
+
+  // A writer that queued up behind that sync doesn't sync again.
+  EXPECT_TRUE(GroupSyncStoreFiles(StorePath(), SyncLockPath(), 5));
+  EXPECT_EQ(sync_count + 1, testing::GetStoreSyncCount());
+
+  // Later writes do.
+  WriteStoreGeneration(6);
+  EXPECT_TRUE(GroupSyncStoreFiles(StorePath(), SyncLockPath(), 6));
+  EXPECT_EQ(sync_count + 2, testing::GetStoreSyncCount());
+
+  // If the generation file was recreated, the recorded generation is stale.
+  WriteStoreGeneration(2);
+  EXPECT_TRUE(GroupSyncStoreFiles(StorePath(), SyncLockPath(), 2));
+  EXPECT_EQ(sync_count + 3, testing::GetStoreSyncCount());
+}
+
+// Measures how many events per second several writer processes record
+// together, with each sync mode. Run with --gtest_also_run_disabled_tests,
+// with the temporary directory on a disk where fsync() isn't free.
+TEST_F(RlzStoreSyncTest, DISABLED_BenchmarkWriterProcesses) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const int kEventsPerWriter = 200;
+  const int kWriters[] = { 1, 2, 4, 8 };
+  const struct {
+    StoreSyncMode mode;
+    int max_commit_delay_ms;
+    const char* name;
+  } kModes[] = {
+    { STORE_SYNC_NONE, 0, "none" },
+    { STORE_SYNC_EACH_COMMIT, 0, "each" },
+    { STORE_SYNC_GROUP_COMMIT, 0, "group" },
+    { STORE_SYNC_GROUP_COMMIT, 1, "group+1ms" },
+  };
+
+  printf("writers");
+  for (size_t m = 0; m < arraysize(kModes); ++m)
+    printf(" %12s", kModes[m].name);
+  printf("   (events/s)\n");
+
+  for (size_t w = 0; w < arraysize(kWriters); ++w) {
+    printf("%7d", kWriters[w]);
+    for (size_t m = 0; m < arraysize(kModes); ++m) {
+      SetStoreSyncMode(kModes[m].mode, kModes[m].max_commit_delay_ms);
+
+      base::TimeTicks start = base::TimeTicks::Now();
+      for (int i = 0; i < kWriters[w]; ++i) {
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+          // Each writer uses its own product, and every call changes the
+          // store.
+          Product product = static_cast<Product>(IE_TOOLBAR + i % 10);
+          bool ok = true;
+          for (int event = 0; event < kEventsPerWriter; ++event) {
+            if (event % 2 == 0)
+              ok &= RecordProductEvent(product, IE_DEFAULT_SEARCH, INSTALL);
+            else
+              ok &= ClearProductEvent(product, IE_DEFAULT_SEARCH, INSTALL);
+          }
+          _exit(ok ? 0 : 1);
+        }
+      }
+
+      for (int i = 0; i < kWriters[w]; ++i) {
+        int status = 0;
+        ASSERT_NE(-1, wait(&status));
+        EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      }
+      base::TimeDelta elapsed = base::TimeTicks::Now() - start;
+      printf(" %12.0f", kWriters[w] * kEventsPerWriter / elapsed.InSecondsF());
+    }
+    printf("\n");
+  }
+}
+
+}  // namespace rlz_lib
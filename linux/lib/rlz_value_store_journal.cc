@@ -0,0 +1,663 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_journal.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <set>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/crc32.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+namespace journal_store {
+
+// The format below is written to disk. Bump kJournalVersion when changing it.
+// Logs with a different version are dropped and rewritten.
+const uint32 kJournalMagic = 0x4a5a4c52;  // "RLZJ"
+const uint32 kJournalVersion = 1;
+
+struct JournalHeader {
+  uint32 magic;
+  uint32 version;
+};
+
+enum RecordType {
+  kWriteAccessPointRlz = 1,
+  kClearAccessPointRlz,
+  kWritePingTime,
+  kClearPingTime,
+  kAddProductEvent,
+  kClearProductEvent,
+  kClearAllProductEvents,
+  kAddStatefulEvent,
+  kClearAllStatefulEvents,
+};
+
+// |value| holds the rlz or the event, depending on |type|. |crc| is the
+// CRC-32 of all members before it, so that a record torn by a crash is
+// detected during replay.
+struct JournalRecord {
+  uint32 type;
+  int32 product;
+  int32 access_point;
+  uint32 reserved;
+  int64 time;
+  char value[kMaxRlzLength + 1];
+  char padding[3];
+  uint32 crc;
+};
+
+struct ProductState {
+  ProductState() : has_ping_time(false), ping_time(0) {}
+
+  bool has_ping_time;
+  int64 ping_time;
+  std::set<std::string> product_events;
+  std::set<std::string> stateful_events;
+};
+
+// The log of one supplementary brand, and the state it replays to.
+struct Journal {
+  Journal() : valid(false), needs_rewrite(false), size(0), inode(0) {}
+
+  FilePath path;
+
+  // False if the log couldn't be read.
+  bool valid;
+
+  // Set if the file contains data that can't be appended to, such as a torn
+  // last record or an unknown version.
+  bool needs_rewrite;
+
+  // The size of the valid part of the log on disk.
+  int64 size;
+
+  // The inode of the log that was replayed or last compacted. Compacting
+  // replaces the file, appending doesn't.
+  ino_t inode;
+
+  // Serialized records that haven't been written yet.
+  std::string pending;
+
+  std::map<int, std::string> rlzs;  // By AccessPoint.
+  std::map<int, ProductState> products;  // By Product.
+};
+
+}  // namespace journal_store
+
+using journal_store::Journal;
+using journal_store::JournalHeader;
+using journal_store::JournalRecord;
+using journal_store::ProductState;
+
+const int RlzValueStoreJournal::kCompactionThreshold = 4 * 1024;
+const int RlzValueStoreJournal::kMaxJournalSize = 16 * 1024;
+
+namespace {
+
+uint32 RecordCrc(const JournalRecord& record) {
+  return static_cast<uint32>(Crc32(
+      reinterpret_cast<const unsigned char*>(&record),
+      offsetof(JournalRecord, crc)));
+}
+
+ino_t GetInode(const FilePath& path) {
+  struct stat info;
+  return stat(path.value().c_str(), &info) == 0 ? info.st_ino : 0;
+}
+
+void InitializeHeader(JournalHeader* header) {
+  header->magic = journal_store::kJournalMagic;
+  header->version = journal_store::kJournalVersion;
+}
+
+// Appends a record of |type| to |records|. Unused fields are zero.
+void SerializeRecord(journal_store::RecordType type,
+                     int product,
+                     int access_point,
+                     int64 time,
+                     const std::string& value,
+                     std::string* records) {
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.type = type;
+  record.product = product;
+  record.access_point = access_point;
+  record.time = time;
+  strncpy(record.value, value.c_str(), kMaxRlzLength);
+  record.crc = RecordCrc(record);
+  records->append(reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+// Applies |record| to the state in |journal|. Returns false for unknown
+// record types.
+bool ApplyRecord(const JournalRecord& record, Journal* journal) {
+  std::string value(record.value, strnlen(record.value, kMaxRlzLength));
+  ProductState* product = NULL;
+  if (record.type != journal_store::kWriteAccessPointRlz &&
+      record.type != journal_store::kClearAccessPointRlz) {
+    product = &journal->products[record.product];
+  }
+
+  switch (record.type) {
+    case journal_store::kWriteAccessPointRlz:
+      journal->rlzs[record.access_point] = value;
+      return true;
+    case journal_store::kClearAccessPointRlz:
+      journal->rlzs.erase(record.access_point);
+      return true;
+    case journal_store::kWritePingTime:
+      product->has_ping_time = true;
+      product->ping_time = record.time;
+      return true;
+    case journal_store::kClearPingTime:
+      product->has_ping_time = false;
+      product->ping_time = 0;
+      return true;
+    case journal_store::kAddProductEvent:
+      product->product_events.insert(value);
+      return true;
+    case journal_store::kClearProductEvent:
+      product->product_events.erase(value);
+      return true;
+    case journal_store::kClearAllProductEvents:
+      product->product_events.clear();
+      return true;
+    case journal_store::kAddStatefulEvent:
+      product->stateful_events.insert(value);
+      return true;
+    case journal_store::kClearAllStatefulEvents:
+      product->stateful_events.clear();
+      return true;
+  }
+  return false;
+}
+
+// Applies the records of |data| from |offset| on, and returns the offset after
+// the last good one.
+size_t ApplyRecords(const std::string& data, size_t offset, Journal* journal) {
+  while (offset + sizeof(JournalRecord) <= data.size()) {
+    JournalRecord record;
+    memcpy(&record, data.data() + offset, sizeof(record));
+    if (record.crc != RecordCrc(record) || !ApplyRecord(record, journal))
+      break;
+    offset += sizeof(record);
+  }
+
+  // Anything after the last good record was torn by a crash during an append.
+  // Keep the records before it, but don't append behind the garbage.
+  if (offset != data.size()) {
+    LOG(ERROR) << "Ignoring " << data.size() - offset << " bytes at the end "
+               << "of rlz store " << journal->path.value();
+    journal->needs_rewrite = true;
+  }
+  return offset;
+}
+
+// Reads the log at |journal->path| and replays it. Creates an empty log if
+// none exists, so that HasAccess() works.
+void ReplayJournal(Journal* journal) {
+  if (!file_util::PathExists(journal->path)) {
+    JournalHeader header;
+    InitializeHeader(&header);
+    if (file_util::WriteFile(journal->path,
+                             reinterpret_cast<const char*>(&header),
+                             sizeof(header)) != sizeof(header)) {
+      return;
+    }
+  }
+
+  std::string data;
+  if (!file_util::ReadFileToString(journal->path, &data))
+    return;
+  journal->valid = true;
+
+  const JournalHeader* header =
+      reinterpret_cast<const JournalHeader*>(data.data());
+  if (data.size() < sizeof(JournalHeader) ||
+      header->magic != journal_store::kJournalMagic ||
+      header->version != journal_store::kJournalVersion) {
+    // Like a corrupt JSON store, an unreadable log is treated like an empty
+    // one and overwritten by the next write.
+    LOG(ERROR) << "Ignoring invalid rlz store " << journal->path.value();
+    journal->needs_rewrite = true;
+    return;
+  }
+
+  journal->inode = GetInode(journal->path);
+  journal->size = ApplyRecords(data, sizeof(JournalHeader), journal);
+}
+
+// Applies the records that other processes appended to the log of |journal|
+// since it was replayed or last written. Returns false if the log was
+// compacted or truncated since instead, so that it has to be replayed again.
+bool CatchUpJournal(Journal* journal) {
+  if (!journal->valid || journal->needs_rewrite || !journal->pending.empty())
+    return false;
+
+  int fd = HANDLE_EINTR(open(journal->path.value().c_str(), O_RDONLY));
+  if (fd == -1)
+    return false;
+
+  bool result = false;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_ino == journal->inode &&
+      info.st_size >= journal->size) {
+    std::string data(info.st_size - journal->size, 0);
+    if (data.empty()) {
+      result = true;
+    } else if (lseek(fd, journal->size, SEEK_SET) == journal->size &&
+               file_util::ReadFromFD(fd, &data[0], data.size())) {
+      journal->size += ApplyRecords(data, 0, journal);
+      result = true;
+    }
+  }
+  ignore_result(HANDLE_EINTR(close(fd)));
+  return result;
+}
+
+// Rewrites the log of |journal| with one record per value that is currently
+// stored, including the pending records.
+bool CompactJournal(Journal* journal) {
+  JournalHeader header;
+  InitializeHeader(&header);
+  std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  for (std::map<int, std::string>::const_iterator i = journal->rlzs.begin();
+       i != journal->rlzs.end(); ++i) {
+    SerializeRecord(journal_store::kWriteAccessPointRlz, 0, i->first, 0,
+                    i->second, &data);
+  }
+  for (std::map<int, ProductState>::const_iterator i =
+           journal->products.begin(); i != journal->products.end(); ++i) {
+    const ProductState& product = i->second;
+    if (product.has_ping_time) {
+      SerializeRecord(journal_store::kWritePingTime, i->first, 0,
+                      product.ping_time, std::string(), &data);
+    }
+    for (std::set<std::string>::const_iterator j =
+             product.product_events.begin();
+         j != product.product_events.end(); ++j) {
+      SerializeRecord(journal_store::kAddProductEvent, i->first, 0, 0, *j,
+                      &data);
+    }
+    for (std::set<std::string>::const_iterator j =
+             product.stateful_events.begin();
+         j != product.stateful_events.end(); ++j) {
+      SerializeRecord(journal_store::kAddStatefulEvent, i->first, 0, 0, *j,
+                      &data);
+    }
+  }
+
+  // Write to a temporary file in the same directory and rename it over the
+  // log, so that a crash never leaves a partially compacted log behind.
+  FilePath temp_path;
+  if (!file_util::CreateTemporaryFileInDir(journal->path.DirName(),
+                                           &temp_path)) {
+    return false;
+  }
+  if (file_util::WriteFile(temp_path, data.data(), data.size()) !=
+          static_cast<int>(data.size()) ||
+      !file_util::ReplaceFile(temp_path, journal->path)) {
+    file_util::Delete(temp_path, false);
+    return false;
+  }
+
+  journal->size = data.size();
+  journal->inode = GetInode(journal->path);
+  journal->needs_rewrite = false;
+  journal->pending.clear();
+  return true;
+}
+
+// Appends the pending records of |journal| to its log.
+bool AppendPendingRecords(Journal* journal) {
+  int fd = HANDLE_EINTR(open(journal->path.value().c_str(),
+                             O_WRONLY | O_APPEND));
+  if (fd == -1)
+    return false;
+
+  bool result = file_util::WriteFileDescriptor(
+      fd, journal->pending.data(), journal->pending.size()) ==
+      static_cast<int>(journal->pending.size());
+  if (HANDLE_EINTR(close(fd)) != 0)
+    result = false;
+
+  if (result) {
+    journal->size += journal->pending.size();
+    journal->pending.clear();
+  } else {
+    // The append might have been partial. Rewrite the log next time.
+    journal->needs_rewrite = true;
+  }
+  return result;
+}
+
+bool IsValueInRange(const char* value) {
+  if (value && strlen(value) <= static_cast<size_t>(kMaxRlzLength))
+    return true;
+  ASSERT_STRING("RlzValueStoreJournal: Value too long for the store");
+  return false;
+}
+
+}  // namespace
+
+RlzValueStoreJournal::RlzValueStoreJournal(const FilePath& store_path)
+    : store_path_(store_path) {
+  // Replay the default log right away, that's the one almost all calls use.
+  linked_ptr<Journal>& journal = journals_[std::string()];
+  journal.reset(new Journal);
+  journal->path = store_path_;
+  ReplayJournal(journal.get());
+}
+
+RlzValueStoreJournal::~RlzValueStoreJournal() {
+}
+
+// static
+bool RlzValueStoreJournal::CanOpenForSharedReads(const FilePath& store_path) {
+  // Replaying a log never changes it, only creating a missing one does.
+  std::string brand(SupplementaryBranding::GetBrand());
+  return file_util::PathExists(store_path) &&
+         (brand.empty() || file_util::PathExists(
+              store_path.InsertBeforeExtension("_" + brand)));
+}
+
+bool RlzValueStoreJournal::HasAccess(AccessType type) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  switch (type) {
+    case kReadAccess:
+      return access(journal->path.value().c_str(), R_OK) == 0;
+    case kWriteAccess:
+      return access(journal->path.value().c_str(), W_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreJournal::WritePingTime(Product product, int64 time) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  ProductState* state = &journal->products[product];
+  if (state->has_ping_time && state->ping_time == time)
+    return true;
+  state->has_ping_time = true;
+  state->ping_time = time;
+  SerializeRecord(journal_store::kWritePingTime, product, 0, time,
+                  std::string(), &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::ReadPingTime(Product product, int64* time) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::const_iterator i =
+      journal->products.find(product);
+  if (i == journal->products.end() || !i->second.has_ping_time)
+    return false;
+  *time = i->second.ping_time;
+  return true;
+}
+
+bool RlzValueStoreJournal::ClearPingTime(Product product) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::iterator i = journal->products.find(product);
+  if (i == journal->products.end() || !i->second.has_ping_time)
+    return true;
+  i->second.has_ping_time = false;
+  i->second.ping_time = 0;
+  SerializeRecord(journal_store::kClearPingTime, product, 0, 0, std::string(),
+                  &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::WriteAccessPointRlz(AccessPoint access_point,
+                                               const char* new_rlz) {
+  Journal* journal = CurrentJournal();
+  if (!journal || !IsValueInRange(new_rlz))
+    return false;
+
+  std::string& rlz = journal->rlzs[access_point];
+  if (rlz == new_rlz)
+    return true;
+  rlz = new_rlz;
+  SerializeRecord(journal_store::kWriteAccessPointRlz, 0, access_point, 0,
+                  rlz, &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::ReadAccessPointRlz(AccessPoint access_point,
+                                              char* rlz,
+                                              size_t rlz_size) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  // Reading a non-existent access point counts as success.
+  std::map<int, std::string>::const_iterator i =
+      journal->rlzs.find(access_point);
+  if (i == journal->rlzs.end()) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  if (i->second.size() >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strncpy(rlz, i->second.c_str(), rlz_size);
+  return true;
+}
+
+bool RlzValueStoreJournal::ClearAccessPointRlz(AccessPoint access_point) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  if (journal->rlzs.erase(access_point) == 0)
+    return true;
+  SerializeRecord(journal_store::kClearAccessPointRlz, 0, access_point, 0,
+                  std::string(), &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  for (std::map<int, std::string>::const_iterator i = journal->rlzs.begin();
+       i != journal->rlzs.end(); ++i) {
+    if (!i->second.empty())
+      visitor->Visit(static_cast<AccessPoint>(i->first), i->second.c_str());
+  }
+  return true;
+}
+
+bool RlzValueStoreJournal::AddProductEvent(Product product,
+                                           const char* event_rlz) {
+  Journal* journal = CurrentJournal();
+  if (!journal || !IsValueInRange(event_rlz))
+    return false;
+
+  if (!journal->products[product].product_events.insert(event_rlz).second)
+    return true;
+  SerializeRecord(journal_store::kAddProductEvent, product, 0, 0, event_rlz,
+                  &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::ReadProductEvents(
+    Product product,
+    std::vector<std::string>* events) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::const_iterator i =
+      journal->products.find(product);
+  if (i != journal->products.end()) {
+    events->insert(events->end(), i->second.product_events.begin(),
+                   i->second.product_events.end());
+  }
+  return true;
+}
+
+bool RlzValueStoreJournal::ClearProductEvent(Product product,
+                                             const char* event_rlz) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::iterator i = journal->products.find(product);
+  if (i == journal->products.end() ||
+      i->second.product_events.erase(event_rlz) == 0) {
+    return true;
+  }
+  SerializeRecord(journal_store::kClearProductEvent, product, 0, 0, event_rlz,
+                  &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::ClearAllProductEvents(Product product) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::iterator i = journal->products.find(product);
+  if (i == journal->products.end() || i->second.product_events.empty())
+    return true;
+  i->second.product_events.clear();
+  SerializeRecord(journal_store::kClearAllProductEvents, product, 0, 0,
+                  std::string(), &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::AddStatefulEvent(Product product,
+                                            const char* event_rlz) {
+  Journal* journal = CurrentJournal();
+  if (!journal || !IsValueInRange(event_rlz))
+    return false;
+
+  if (!journal->products[product].stateful_events.insert(event_rlz).second)
+    return true;
+  SerializeRecord(journal_store::kAddStatefulEvent, product, 0, 0, event_rlz,
+                  &journal->pending);
+  return true;
+}
+
+bool RlzValueStoreJournal::IsStatefulEvent(Product product,
+                                           const char* event_rlz) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::const_iterator i =
+      journal->products.find(product);
+  return i != journal->products.end() &&
+         i->second.stateful_events.count(event_rlz) != 0;
+}
+
+bool RlzValueStoreJournal::ClearAllStatefulEvents(Product product) {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return false;
+
+  std::map<int, ProductState>::iterator i = journal->products.find(product);
+  if (i == journal->products.end() || i->second.stateful_events.empty())
+    return true;
+  i->second.stateful_events.clear();
+  SerializeRecord(journal_store::kClearAllStatefulEvents, product, 0, 0,
+                  std::string(), &journal->pending);
+  return true;
+}
+
+void RlzValueStoreJournal::CollectGarbage() {
+  Journal* journal = CurrentJournal();
+  if (!journal)
+    return;
+
+  if (journal->size + static_cast<int64>(journal->pending.size()) >
+      kCompactionThreshold) {
+    journal->needs_rewrite = true;
+  }
+}
+
+void RlzValueStoreJournal::Revalidate() {
+  JournalMap::iterator i = journals_.begin();
+  while (i != journals_.end()) {
+    Journal* journal = i->second.get();
+    if (CatchUpJournal(journal)) {
+      ++i;
+    } else if (i->first.empty()) {
+      // is_valid() expects the default log.
+      FilePath path = journal->path;
+      i->second.reset(new Journal);
+      i->second->path = path;
+      ReplayJournal(i->second.get());
+      ++i;
+    } else {
+      journals_.erase(i++);
+    }
+  }
+}
+
+bool RlzValueStoreJournal::is_valid() {
+  return journals_[std::string()]->valid;
+}
+
+bool RlzValueStoreJournal::WriteStoreIfDirty() {
+  bool result = true;
+  for (JournalMap::iterator i = journals_.begin(); i != journals_.end(); ++i) {
+    Journal* journal = i->second.get();
+    if (!journal->valid)
+      continue;
+
+    if (journal->needs_rewrite ||
+        journal->size + static_cast<int64>(journal->pending.size()) >
+            kMaxJournalSize) {
+      result &= CompactJournal(journal);
+    } else if (!journal->pending.empty()) {
+      result &= AppendPendingRecords(journal);
+    }
+  }
+  return result;
+}
+
+Journal* RlzValueStoreJournal::CurrentJournal() {
+  std::string brand(SupplementaryBranding::GetBrand());
+  linked_ptr<Journal>& journal = journals_[brand];
+  if (!journal.get()) {
+    journal.reset(new Journal);
+    journal->path = brand.empty() ?
+        store_path_ : store_path_.InsertBeforeExtension("_" + brand);
+    ReplayJournal(journal.get());
+  }
+  return journal->valid ? journal.get() : NULL;
+}
+
+}  // namespace rlz_lib
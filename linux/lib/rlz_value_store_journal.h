@@ -0,0 +1,115 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_JOURNAL_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_JOURNAL_H_
+
+#include <map>
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "base/memory/linked_ptr.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+namespace journal_store {
+struct Journal;
+}  // namespace journal_store
+
+// An implementation of RlzValueStore for linux that keeps the store as an
+// append-only log of fixed-size records. The log is replayed into memory the
+// first time a store object needs it. Every change that actually modifies the
+// state appends one record, and the records of a lock scope are written with a
+// single append when the outermost ScopedRlzValueStoreLock is released, so the
+// cost of recording an event doesn't grow with the size of the store.
+//
+// The log is compacted, by rewriting it with one record per live value, when
+// it grows past a size threshold. Data for supplementary brands lives in
+// separate logs next to the default one.
+class RlzValueStoreJournal : public RlzValueStore {
+ public:
+  // |store_path| is the path of the log for the default brand. It is replayed
+  // right away, and created if it doesn't exist.
+  explicit RlzValueStoreJournal(const FilePath& store_path);
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  // Schedules compaction of the log of the current brand if it is larger than
+  // kCompactionThreshold. The log is rewritten by WriteStoreIfDirty().
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Returns true if the log for the default brand could be read.
+  bool is_valid();
+
+  // Appends the records added since the last call to the logs, compacting
+  // logs that would grow past kMaxJournalSize instead. Returns false if
+  // writing failed.
+  bool WriteStoreIfDirty();
+
+  // Prepares this object for another lock scope: replays the records that
+  // other processes appended to the logs since, and drops the logs that were
+  // compacted, so that they are replayed again.
+  void Revalidate();
+
+  // Returns true if the logs at |store_path| for the default and the current
+  // supplementary brand exist, so that a store object only reads them until
+  // it is written to.
+  static bool CanOpenForSharedReads(const FilePath& store_path);
+
+  // CollectGarbage() compacts logs larger than this many bytes.
+  static const int kCompactionThreshold;
+
+  // Logs are compacted when they'd grow larger than this many bytes, even if
+  // CollectGarbage() isn't called.
+  static const int kMaxJournalSize;
+
+ private:
+  virtual ~RlzValueStoreJournal();
+  friend class ScopedRlzValueStoreLock;
+
+  // Returns the log for the current supplementary brand, replaying it first
+  // if needed. Returns NULL if the log can't be read.
+  journal_store::Journal* CurrentJournal();
+
+  FilePath store_path_;
+
+  // Logs that were replayed by this store object, by supplementary brand.
+  typedef std::map<std::string, linked_ptr<journal_store::Journal> >
+      JournalMap;
+  JournalMap journals_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreJournal);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_JOURNAL_H_
@@ -0,0 +1,242 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for the append-only linux rlz store. The store objects are created
+// directly, so these run whichever store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_journal.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/time.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace rlz_lib {
+
+class RlzValueStoreJournalTest : public RlzLibTestNoMachineState {
+ protected:
+  // The store keeps data for supplementary brands in separate logs.
+  FilePath JournalPath() {
+    FilePath path = temp_dir_.path().Append("RlzStore.log");
+    const std::string& brand = SupplementaryBranding::GetBrand();
+    return brand.empty() ? path : path.InsertBeforeExtension("_" + brand);
+  }
+
+  int64 JournalSize() {
+    int64 size = -1;
+    file_util::GetFileSize(JournalPath(), &size);
+    return size;
+  }
+
+  // The stores' destructors are private, so they are owned through the
+  // RlzValueStore interface.
+  RlzValueStoreJournal* OpenJournal() {
+    RlzValueStoreJournal* journal = new RlzValueStoreJournal(
+        temp_dir_.path().Append("RlzStore.log"));
+    store_.reset(journal);
+    return journal;
+  }
+
+  scoped_ptr<RlzValueStore> store_;
+};
+
+TEST_F(RlzValueStoreJournalTest, ReplaysRecords) {
+  RlzValueStoreJournal* journal = OpenJournal();
+  ASSERT_TRUE(journal->is_valid());
+  EXPECT_TRUE(journal->WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(journal->WritePingTime(TOOLBAR_NOTIFIER, 1234));
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "W1I"));
+  EXPECT_TRUE(journal->ClearProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(journal->AddStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+
+  journal = OpenJournal();
+  char rlz_50[50];
+  EXPECT_TRUE(journal->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+
+  int64 ping_time = 0;
+  EXPECT_TRUE(journal->ReadPingTime(TOOLBAR_NOTIFIER, &ping_time));
+  EXPECT_EQ(1234, ping_time);
+
+  std::vector<std::string> events;
+  EXPECT_TRUE(journal->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("W1I", events[0]);
+  EXPECT_TRUE(journal->IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+}
+
+TEST_F(RlzValueStoreJournalTest, UnchangedValuesAreNotLogged) {
+  RlzValueStoreJournal* journal = OpenJournal();
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+  int64 size = JournalSize();
+
+  journal = OpenJournal();
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(journal->ClearProductEvent(TOOLBAR_NOTIFIER, "W1I"));
+  EXPECT_TRUE(journal->ClearAccessPointRlz(IETB_SEARCH_BOX));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+  EXPECT_EQ(size, JournalSize());
+}
+
+TEST_F(RlzValueStoreJournalTest, IgnoresTornRecord) {
+  RlzValueStoreJournal* journal = OpenJournal();
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+
+  // Simulate a crash in the middle of appending a record.
+  FILE* file = fopen(JournalPath().value().c_str(), "ab");
+  ASSERT_TRUE(file);
+  fputs("torn", file);
+  fclose(file);
+
+  journal = OpenJournal();
+  std::vector<std::string> events;
+  EXPECT_TRUE(journal->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("I7S", events[0]);
+
+  // The next write drops the garbage instead of appending behind it.
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "W1I"));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+  std::string data;
+  EXPECT_TRUE(file_util::ReadFileToString(JournalPath(), &data));
+  EXPECT_EQ(std::string::npos, data.find("torn"));
+
+  journal = OpenJournal();
+  events.clear();
+  EXPECT_TRUE(journal->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  EXPECT_EQ(2u, events.size());
+}
+
+TEST_F(RlzValueStoreJournalTest, CollectGarbageCompacts) {
+  RlzValueStoreJournal* journal = OpenJournal();
+  EXPECT_TRUE(journal->AddStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+  int64 compact_size = JournalSize();
+
+  // Churn until the log is larger than the compaction threshold.
+  journal = OpenJournal();
+  while (JournalSize() <= RlzValueStoreJournal::kCompactionThreshold) {
+    EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+    EXPECT_TRUE(journal->ClearProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+    EXPECT_TRUE(journal->WriteStoreIfDirty());
+  }
+
+  journal = OpenJournal();
+  journal->CollectGarbage();
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+  EXPECT_EQ(compact_size, JournalSize());
+
+  journal = OpenJournal();
+  EXPECT_TRUE(journal->IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+}
+
+TEST_F(RlzValueStoreJournalTest, RevalidateSeesOtherWriters) {
+  RlzValueStoreJournal* journal = OpenJournal();
+  EXPECT_TRUE(journal->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+
+  // Another store object, like another process, appends to the log.
+  RlzValueStoreJournal* other =
+      new RlzValueStoreJournal(temp_dir_.path().Append("RlzStore.log"));
+  scoped_ptr<RlzValueStore> other_owner(other);
+  EXPECT_TRUE(other->AddProductEvent(TOOLBAR_NOTIFIER, "W1I"));
+  EXPECT_TRUE(other->WriteStoreIfDirty());
+
+  journal->Revalidate();
+  std::vector<std::string> events;
+  EXPECT_TRUE(journal->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  EXPECT_EQ(2u, events.size());
+
+  // The log is replaced, by a compaction for example.
+  ASSERT_TRUE(file_util::Delete(JournalPath(), false));
+  other = new RlzValueStoreJournal(temp_dir_.path().Append("RlzStore.log"));
+  other_owner.reset(other);
+  EXPECT_TRUE(other->AddStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+  EXPECT_TRUE(other->WriteStoreIfDirty());
+
+  journal->Revalidate();
+  events.clear();
+  EXPECT_TRUE(journal->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  EXPECT_TRUE(events.empty());
+  EXPECT_TRUE(journal->IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+}
+
+// Compares the cost of recording events with the journal against the JSON
+// store, which rewrites the whole file at the end of every lock scope. Run
+// with --gtest_also_run_disabled_tests.
+TEST_F(RlzValueStoreJournalTest, DISABLED_BenchmarkAgainstJsonStore) {
+  // Fill both stores with some unrelated data, so that the JSON store has a
+  // realistic amount to rewrite.
+  const FilePath json_path = temp_dir_.path().Append("RlzStore.json");
+  RlzValueStoreJournal* journal = OpenJournal();
+  RlzValueStoreLinux* json = new RlzValueStoreLinux(json_path);
+  scoped_ptr<RlzValueStore> json_owner(json);
+  for (int point = NO_ACCESS_POINT + 1; point < LAST_ACCESS_POINT; ++point) {
+    AccessPoint access_point = static_cast<AccessPoint>(point);
+    journal->WriteAccessPointRlz(access_point, "1T4_____en__252");
+    json->WriteAccessPointRlz(access_point, "1T4_____en__252");
+  }
+  EXPECT_TRUE(journal->WriteStoreIfDirty());
+  EXPECT_TRUE(json->WriteStoreIfDirty());
+
+  const int kEventsPerLock[] = { 1, 10, 1000 };
+  const int kTotalEvents = 10000;
+  for (size_t i = 0; i < arraysize(kEventsPerLock); ++i) {
+    const int events_per_lock = kEventsPerLock[i];
+    const int locks = kTotalEvents / events_per_lock;
+
+    base::TimeDelta times[2];
+    for (int backend = 0; backend < 2; ++backend) {
+      base::TimeTicks start = base::TimeTicks::Now();
+      for (int lock = 0; lock < locks; ++lock) {
+        // Like ScopedRlzValueStoreLock, create a store per lock scope.
+        RlzValueStore* store;
+        if (backend == 0) {
+          journal = OpenJournal();
+          store = journal;
+        } else {
+          json = new RlzValueStoreLinux(json_path);
+          json_owner.reset(json);
+          store = json;
+        }
+
+        for (int event = 0; event < events_per_lock; ++event) {
+          // Alternate between recording and clearing, so that every call
+          // changes the store.
+          if (event % 2 == 0)
+            store->AddProductEvent(TOOLBAR_NOTIFIER, "I7S");
+          else
+            store->ClearProductEvent(TOOLBAR_NOTIFIER, "I7S");
+        }
+
+        if (backend == 0)
+          EXPECT_TRUE(journal->WriteStoreIfDirty());
+        else
+          EXPECT_TRUE(json->WriteStoreIfDirty());
+      }
+      times[backend] = base::TimeTicks::Now() - start;
+    }
+
+    printf("%4d events per lock: journal %.2f us, json %.2f us per event\n",
+           events_per_lock,
+           times[0].InSecondsF() * 1e6 / kTotalEvents,
+           times[1].InSecondsF() * 1e6 / kTotalEvents);
+  }
+}
+
+}  // namespace rlz_lib
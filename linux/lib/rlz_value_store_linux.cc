@@ -0,0 +1,397 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/file_util.h"
+#include "base/json/json_reader.h"
+#include "base/json/json_writer.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/string_number_conversions.h"
+#include "base/string_util.h"
+#include "base/stringprintf.h"
+#include "base/values.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// These are written to disk and should not be changed. They match the keys
+// used by the mac plist store.
+const char kPingTimeKey[] = "pingTime";
+const char kAccessPointKey[] = "accessPoints";
+const char kProductEventKey[] = "productEvents";
+const char kStatefulEventKey[] = "statefulEvents";
+
+namespace json_store {
+
+// Identifies the contents of a shard file. Shards are replaced by renaming,
+// so a file that another process wrote has a different inode, and usually a
+// different size and modification time as well. All 0 if there is no file.
+struct FileVersion {
+  FileVersion() : inode(0), size(0), mtime_ns(0) {}
+
+  static FileVersion Read(const FilePath& path) {
+    FileVersion version;
+    struct stat info;
+    if (stat(path.value().c_str(), &info) == 0) {
+      version.inode = info.st_ino;
+      version.size = info.st_size;
+      version.mtime_ns = info.st_mtim.tv_sec * 1000000000LL +
+                         info.st_mtim.tv_nsec;
+    }
+    return version;
+  }
+
+  bool Equals(const FileVersion& other) const {
+    return inode == other.inode && size == other.size &&
+           mtime_ns == other.mtime_ns;
+  }
+
+  ino_t inode;
+  off_t size;
+  int64 mtime_ns;
+};
+
+// A file of the store, see RlzValueStoreLinux. Its dictionary holds either
+// the access point RLZs, by access point name, or the ping time and events
+// of one product under the keys above.
+struct Shard {
+  Shard() : dirty(false) {}
+
+  scoped_ptr<base::DictionaryValue> dict;
+
+  // Set by every mutating method, cleared when the shard is written.
+  bool dirty;
+
+  // The file |dict| was read from or last written to.
+  FileVersion version;
+};
+
+}  // namespace json_store
+
+namespace {
+
+using json_store::FileVersion;
+using json_store::Shard;
+
+// The file name prefix of product shards.
+const char kProductShardPrefix[] = "product_";
+
+// Retrieves a subdictionary in |p| for key |k|, creating it if necessary.
+// If the dictionary contains an object for |k| that is not a dictionary, that
+// object is replaced with an empty dictionary.
+base::DictionaryValue* GetOrCreateDict(base::DictionaryValue* p,
+                                       const std::string& k) {
+  base::DictionaryValue* d = NULL;
+  if (!p->GetDictionaryWithoutPathExpansion(k, &d)) {
+    d = new base::DictionaryValue;
+    p->SetWithoutPathExpansion(k, d);
+  }
+  return d;
+}
+
+// Returns the file name of the shard |name| of |brand|. Brand codes are
+// supplied by the caller of the library, so characters that could change the
+// meaning of the path are escaped.
+std::string GetShardName(const std::string& name, const std::string& brand) {
+  std::string shard_name(name);
+  if (!brand.empty()) {
+    shard_name += '_';
+    for (size_t i = 0; i < brand.size(); ++i) {
+      char c = brand[i];
+      if (IsAsciiAlpha(c) || IsAsciiDigit(c) || c == '-')
+        shard_name += c;
+      else
+        base::StringAppendF(&shard_name, "%%%02X", static_cast<uint8>(c));
+    }
+  }
+  return shard_name + ".json";
+}
+
+// Reads the shard file at |path|. A missing file is an empty shard.
+base::DictionaryValue* ReadShardFile(const FilePath& path) {
+  std::string json;
+  if (!file_util::ReadFileToString(path, &json))
+    return new base::DictionaryValue;
+
+  scoped_ptr<base::Value> value(base::JSONReader::Read(json, false));
+  if (!value.get() || !value->IsType(base::Value::TYPE_DICTIONARY)) {
+    // A corrupt shard is treated like an empty one and overwritten by the
+    // next write.
+    LOG(ERROR) << "Ignoring invalid rlz store file " << path.value();
+    return new base::DictionaryValue;
+  }
+  return static_cast<base::DictionaryValue*>(value.release());
+}
+
+// Writes |dict| to the shard file at |path|. An empty shard is deleted.
+bool WriteShardFile(const FilePath& path, const base::DictionaryValue& dict) {
+  if (dict.empty())
+    return !file_util::PathExists(path) || file_util::Delete(path, false);
+
+  std::string json;
+  base::JSONWriter::Write(&dict, false, &json);
+
+  // Write to a temporary file in the same directory and rename it over the
+  // shard, so that readers never see a partially written file.
+  FilePath temp_path;
+  if (!file_util::CreateTemporaryFileInDir(path.DirName(), &temp_path))
+    return false;
+  if (file_util::WriteFile(temp_path, json.data(), json.size()) !=
+          static_cast<int>(json.size()) ||
+      !file_util::ReplaceFile(temp_path, path)) {
+    file_util::Delete(temp_path, false);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+RlzValueStoreLinux::RlzValueStoreLinux(const FilePath& store_path)
+    : shard_dir_(store_path.RemoveExtension()),
+      valid_(false),
+      shards_read_(0) {
+  valid_ = file_util::CreateDirectory(shard_dir_);
+}
+
+RlzValueStoreLinux::~RlzValueStoreLinux() {
+}
+
+bool RlzValueStoreLinux::HasAccess(AccessType type) {
+  switch (type) {
+    case kReadAccess:
+      return access(shard_dir_.value().c_str(), R_OK | X_OK) == 0;
+    case kWriteAccess:
+      return access(shard_dir_.value().c_str(), W_OK | X_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreLinux::WritePingTime(Product product, int64 time) {
+  // DictionaryValue has no 64 bit integers, so store the time as string.
+  Shard* shard = ProductShard(product);
+  shard->dict->SetStringWithoutPathExpansion(kPingTimeKey,
+                                             base::Int64ToString(time));
+  shard->dirty = true;
+  return true;
+}
+
+bool RlzValueStoreLinux::ReadPingTime(Product product, int64* time) {
+  std::string ping_time;
+  return ProductShard(product)->dict->GetStringWithoutPathExpansion(
+      kPingTimeKey, &ping_time) && base::StringToInt64(ping_time, time);
+}
+
+bool RlzValueStoreLinux::ClearPingTime(Product product) {
+  Shard* shard = ProductShard(product);
+  if (shard->dict->RemoveWithoutPathExpansion(kPingTimeKey, NULL))
+    shard->dirty = true;
+  return true;
+}
+
+bool RlzValueStoreLinux::WriteAccessPointRlz(AccessPoint access_point,
+                                             const char* new_rlz) {
+  Shard* shard = AccessPointShard();
+  shard->dict->SetStringWithoutPathExpansion(GetAccessPointName(access_point),
+                                             new_rlz);
+  shard->dirty = true;
+  return true;
+}
+
+bool RlzValueStoreLinux::ReadAccessPointRlz(AccessPoint access_point,
+                                            char* rlz,
+                                            size_t rlz_size) {
+  // Reading a non-existent access point counts as success.
+  std::string s;
+  if (!AccessPointShard()->dict->GetStringWithoutPathExpansion(
+          GetAccessPointName(access_point), &s)) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  if (s.size() >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strncpy(rlz, s.c_str(), rlz_size);
+  return true;
+}
+
+bool RlzValueStoreLinux::ClearAccessPointRlz(AccessPoint access_point) {
+  Shard* shard = AccessPointShard();
+  if (shard->dict->RemoveWithoutPathExpansion(GetAccessPointName(access_point),
+                                              NULL)) {
+    shard->dirty = true;
+  }
+  return true;
+}
+
+bool RlzValueStoreLinux::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  const base::DictionaryValue* dict = AccessPointShard()->dict.get();
+  for (base::DictionaryValue::key_iterator i = dict->begin_keys();
+       i != dict->end_keys(); ++i) {
+    AccessPoint point;
+    std::string rlz;
+    if (GetAccessPointFromName((*i).c_str(), &point) &&
+        dict->GetStringWithoutPathExpansion(*i, &rlz) && !rlz.empty() &&
+        rlz.size() <= static_cast<size_t>(kMaxRlzLength)) {
+      visitor->Visit(point, rlz.c_str());
+    }
+  }
+  return true;
+}
+
+bool RlzValueStoreLinux::AddProductEvent(Product product,
+                                         const char* event_rlz) {
+  Shard* shard = ProductShard(product);
+  GetOrCreateDict(shard->dict.get(), kProductEventKey)->
+      SetBooleanWithoutPathExpansion(event_rlz, true);
+  shard->dirty = true;
+  return true;
+}
+
+bool RlzValueStoreLinux::ReadProductEvents(Product product,
+                                           std::vector<std::string>* events) {
+  base::DictionaryValue* d = NULL;
+  if (ProductShard(product)->dict->GetDictionaryWithoutPathExpansion(
+          kProductEventKey, &d)) {
+    for (base::DictionaryValue::key_iterator i = d->begin_keys();
+         i != d->end_keys(); ++i) {
+      events->push_back(*i);
+    }
+  }
+  return true;
+}
+
+bool RlzValueStoreLinux::ClearProductEvent(Product product,
+                                           const char* event_rlz) {
+  Shard* shard = ProductShard(product);
+  base::DictionaryValue* d = NULL;
+  if (shard->dict->GetDictionaryWithoutPathExpansion(kProductEventKey, &d) &&
+      d->RemoveWithoutPathExpansion(event_rlz, NULL)) {
+    shard->dirty = true;
+  }
+  return true;
+}
+
+bool RlzValueStoreLinux::ClearAllProductEvents(Product product) {
+  Shard* shard = ProductShard(product);
+  if (shard->dict->RemoveWithoutPathExpansion(kProductEventKey, NULL))
+    shard->dirty = true;
+  return true;
+}
+
+bool RlzValueStoreLinux::AddStatefulEvent(Product product,
+                                          const char* event_rlz) {
+  Shard* shard = ProductShard(product);
+  GetOrCreateDict(shard->dict.get(), kStatefulEventKey)->
+      SetBooleanWithoutPathExpansion(event_rlz, true);
+  shard->dirty = true;
+  return true;
+}
+
+bool RlzValueStoreLinux::IsStatefulEvent(Product product,
+                                         const char* event_rlz) {
+  base::DictionaryValue* d = NULL;
+  return ProductShard(product)->dict->GetDictionaryWithoutPathExpansion(
+      kStatefulEventKey, &d) && d->HasKey(event_rlz);
+}
+
+bool RlzValueStoreLinux::ClearAllStatefulEvents(Product product) {
+  Shard* shard = ProductShard(product);
+  if (shard->dict->RemoveWithoutPathExpansion(kStatefulEventKey, NULL))
+    shard->dirty = true;
+  return true;
+}
+
+void RlzValueStoreLinux::CollectGarbage() {
+  // Drop event dictionaries that were emptied by the Clear*() calls, so that
+  // they don't accumulate in the files. Shards that end up empty are deleted
+  // when they are written.
+  for (ShardMap::iterator i = shards_.begin(); i != shards_.end(); ++i) {
+    base::DictionaryValue* dict = i->second->dict.get();
+    std::vector<std::string> empty_keys;
+    for (base::DictionaryValue::key_iterator k = dict->begin_keys();
+         k != dict->end_keys(); ++k) {
+      base::DictionaryValue* d = NULL;
+      if (dict->GetDictionaryWithoutPathExpansion(*k, &d) && d->empty())
+        empty_keys.push_back(*k);
+    }
+
+    for (size_t k = 0; k < empty_keys.size(); ++k)
+      dict->RemoveWithoutPathExpansion(empty_keys[k], NULL);
+    if (!empty_keys.empty())
+      i->second->dirty = true;
+  }
+}
+
+bool RlzValueStoreLinux::WriteStoreIfDirty() {
+  bool result = true;
+  for (ShardMap::iterator i = shards_.begin(); i != shards_.end(); ++i) {
+    Shard* shard = i->second.get();
+    if (!shard->dirty)
+      continue;
+    FilePath path = shard_dir_.Append(i->first);
+    if (WriteShardFile(path, *shard->dict)) {
+      shard->dirty = false;
+      shard->version = FileVersion::Read(path);
+    } else {
+      result = false;
+    }
+  }
+  return result;
+}
+
+void RlzValueStoreLinux::Revalidate() {
+  // One stat() per shard, instead of reading and parsing all of them again.
+  ShardMap::iterator i = shards_.begin();
+  while (i != shards_.end()) {
+    Shard* shard = i->second.get();
+    FileVersion version = FileVersion::Read(shard_dir_.Append(i->first));
+    if (shard->dirty || !shard->version.Equals(version)) {
+      shards_.erase(i++);
+    } else {
+      ++i;
+    }
+  }
+}
+
+// static
+bool RlzValueStoreLinux::CanOpenForSharedReads(const FilePath& store_path) {
+  return file_util::DirectoryExists(store_path.RemoveExtension());
+}
+
+Shard* RlzValueStoreLinux::GetShard(const std::string& name) {
+  linked_ptr<Shard>& shard = shards_[name];
+  if (!shard.get()) {
+    shard.reset(new Shard);
+    FilePath path = shard_dir_.Append(name);
+    shard->dict.reset(ReadShardFile(path));
+    shard->version = FileVersion::Read(path);
+    ++shards_read_;
+  }
+  return shard.get();
+}
+
+Shard* RlzValueStoreLinux::AccessPointShard() {
+  return GetShard(GetShardName(kAccessPointKey,
+                               SupplementaryBranding::GetBrand()));
+}
+
+Shard* RlzValueStoreLinux::ProductShard(Product p) {
+  return GetShard(GetShardName(kProductShardPrefix + std::string(
+      GetProductName(p)), SupplementaryBranding::GetBrand()));
+}
+
+}  // namespace rlz_lib
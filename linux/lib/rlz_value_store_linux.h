@@ -0,0 +1,113 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_LINUX_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_LINUX_H_
+
+#include <map>
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "base/memory/linked_ptr.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+namespace json_store {
+struct Shard;
+}  // namespace json_store
+
+// An implementation of RlzValueStore for linux. The store is a directory of
+// small JSON files in the user's data directory: one per brand for the access
+// point RLZs, and one per brand and product for the product's ping time and
+// events. A file is read when the store object first touches it, and only
+// written back, atomically, if something in it changed. A lock scope that
+// records an event for one product therefore reads and writes one small file,
+// no matter how many brands and products the store holds.
+class RlzValueStoreLinux : public RlzValueStore {
+ public:
+  // The files are kept in the directory named like |store_path| without its
+  // extension, which is created if it doesn't exist.
+  explicit RlzValueStoreLinux(const FilePath& store_path);
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Returns true if the store directory could be set up in the constructor.
+  bool is_valid() const { return valid_; }
+
+  // Writes the files that were modified since they were read or last written
+  // back to disk. Returns false if writing any of them failed.
+  bool WriteStoreIfDirty();
+
+  // Prepares this object for another lock scope, after other processes may
+  // have written to the store: drops the shards whose files changed since
+  // they were read or written, so that they are read again.
+  void Revalidate();
+
+  // Returns the number of files this object read so far, for tests.
+  int shards_read() const { return shards_read_; }
+
+  // Returns true if a store object for |store_path| only reads from disk until
+  // it is written to: the directory exists.
+  static bool CanOpenForSharedReads(const FilePath& store_path);
+
+ private:
+  virtual ~RlzValueStoreLinux();
+  friend class ScopedRlzValueStoreLock;
+
+  typedef std::map<std::string, linked_ptr<json_store::Shard> > ShardMap;
+
+  // Returns the shard with the file name |name|, reading it if needed.
+  json_store::Shard* GetShard(const std::string& name);
+
+  // Returns the shard of the current supplementary brand that holds the
+  // access point RLZs.
+  json_store::Shard* AccessPointShard();
+
+  // Returns the shard of the current supplementary brand that holds the data
+  // for product p.
+  json_store::Shard* ProductShard(Product p);
+
+  FilePath shard_dir_;
+  bool valid_;
+
+  // The shards read so far, by file name.
+  ShardMap shards_;
+  int shards_read_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreLinux);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_LINUX_H_
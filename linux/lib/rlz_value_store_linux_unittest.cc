@@ -0,0 +1,168 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for the JSON linux rlz store. The store objects are created directly,
+// so these run whichever store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/stringprintf.h"
+#include "base/time.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace rlz_lib {
+
+class RlzValueStoreLinuxTest : public RlzLibTestNoMachineState {
+ protected:
+  FilePath StorePath() {
+    return temp_dir_.path().Append("RlzStore.json");
+  }
+
+  // The store keeps data for supplementary brands in separate files.
+  FilePath ShardPath(const std::string& name) {
+    FilePath path = temp_dir_.path().Append("RlzStore").Append(name + ".json");
+    const std::string& brand = SupplementaryBranding::GetBrand();
+    return brand.empty() ? path : path.InsertBeforeExtension("_" + brand);
+  }
+
+  FilePath ProductShardPath(Product product) {
+    return ShardPath(std::string("product_") + GetProductName(product));
+  }
+
+  // Returns the inode of |path|, which changes whenever the file is written
+  // since writes go through a temporary file and a rename.
+  ino_t GetInode(const FilePath& path) {
+    struct stat info;
+    if (stat(path.value().c_str(), &info) != 0)
+      return 0;
+    return info.st_ino;
+  }
+
+  // The stores' destructors are private, so they are owned through the
+  // RlzValueStore interface.
+  RlzValueStoreLinux* OpenStore() {
+    RlzValueStoreLinux* store = new RlzValueStoreLinux(StorePath());
+    store_.reset(store);
+    return store;
+  }
+
+  scoped_ptr<RlzValueStore> store_;
+};
+
+TEST_F(RlzValueStoreLinuxTest, OnlyTouchedShardsAreReadAndWritten) {
+  RlzValueStoreLinux* store = OpenStore();
+  ASSERT_TRUE(store->is_valid());
+  EXPECT_TRUE(store->WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(store->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(store->AddProductEvent(PINYIN_IME, "W1I"));
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+
+  ino_t access_point_inode = GetInode(ShardPath("accessPoints"));
+  ino_t pinyin_inode = GetInode(ProductShardPath(PINYIN_IME));
+  EXPECT_NE(0u, access_point_inode);
+  EXPECT_NE(0u, pinyin_inode);
+
+  store = OpenStore();
+  EXPECT_TRUE(store->ClearProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_EQ(1, store->shards_read());
+  store->CollectGarbage();
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+
+  // The emptied product file is deleted, the others are left alone.
+  EXPECT_FALSE(file_util::PathExists(ProductShardPath(TOOLBAR_NOTIFIER)));
+  EXPECT_EQ(access_point_inode, GetInode(ShardPath("accessPoints")));
+  EXPECT_EQ(pinyin_inode, GetInode(ProductShardPath(PINYIN_IME)));
+
+  // Reading doesn't write anything.
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(PINYIN_IME, &events));
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+  EXPECT_EQ(2, store->shards_read());
+  EXPECT_EQ(pinyin_inode, GetInode(ProductShardPath(PINYIN_IME)));
+}
+
+TEST_F(RlzValueStoreLinuxTest, RevalidateOnlyRereadsChangedShards) {
+  RlzValueStoreLinux* store = OpenStore();
+  EXPECT_TRUE(store->WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(store->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+  EXPECT_EQ(2, store->shards_read());
+
+  // Nothing changed, the parsed shards are kept.
+  store->Revalidate();
+  char rlz[50];
+  EXPECT_TRUE(store->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("IeTbRlz", rlz);
+  EXPECT_FALSE(store->IsStatefulEvent(TOOLBAR_NOTIFIER, "W1I"));
+  EXPECT_EQ(2, store->shards_read());
+
+  // Another store object, like another process, writes one shard.
+  RlzValueStoreLinux* other = new RlzValueStoreLinux(StorePath());
+  scoped_ptr<RlzValueStore> other_owner(other);
+  EXPECT_TRUE(other->WriteAccessPointRlz(IETB_SEARCH_BOX, "NewRlz"));
+  EXPECT_TRUE(other->WriteStoreIfDirty());
+
+  store->Revalidate();
+  EXPECT_TRUE(store->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+  EXPECT_STREQ("NewRlz", rlz);
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  EXPECT_EQ(1u, events.size());
+  EXPECT_EQ(3, store->shards_read());
+}
+
+// Measures the time a call takes in a store that holds data for many
+// supplementary brands. Run with --gtest_also_run_disabled_tests.
+TEST_F(RlzValueStoreLinuxTest, DISABLED_BenchmarkBrandCount) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const int kBrandCounts[] = { 1, 10, 100, 1000 };
+  const int kCalls = 200;
+
+  printf("brands   record+clear (us)   get rlz (us)\n");
+  int brands = 0;
+  for (size_t b = 0; b < arraysize(kBrandCounts); ++b) {
+    for (; brands < kBrandCounts[b]; ++brands) {
+      std::string brand = base::StringPrintf("B%03d", brands);
+      SupplementaryBranding branding(brand.c_str());
+      ASSERT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+      ASSERT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                     SET_TO_GOOGLE));
+    }
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    for (int i = 0; i < kCalls; ++i) {
+      EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                     INSTALL));
+      EXPECT_TRUE(ClearProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                    INSTALL));
+    }
+    base::TimeDelta write_time = base::TimeTicks::Now() - start;
+
+    start = base::TimeTicks::Now();
+    char rlz[50];
+    for (int i = 0; i < kCalls; ++i)
+      EXPECT_TRUE(GetAccessPointRlz(IETB_SEARCH_BOX, rlz, arraysize(rlz)));
+    base::TimeDelta read_time = base::TimeTicks::Now() - start;
+
+    printf("%6d %20.1f %14.1f\n", kBrandCounts[b],
+           write_time.InMicroseconds() / (2.0 * kCalls),
+           read_time.InMicroseconds() / static_cast<double>(kCalls));
+  }
+}
+
+}  // namespace rlz_lib
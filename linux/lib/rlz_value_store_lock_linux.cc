@@ -0,0 +1,1085 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The linux implementation of ScopedRlzValueStoreLock. The store backend is
+// chosen at build time, see RLZ_STORE_IMPLEMENTATION_* in rlz_value_store.h.
+
+#include "rlz/lib/rlz_value_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/atomicops.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/synchronization/lock.h"
+#include "base/time.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lock_stats.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store_cache.h"
+#include "rlz/linux/lib/rlz_broker_linux.h"
+#include "rlz/linux/lib/rlz_store_sync_linux.h"
+
+#if defined(RLZ_STORE_IMPLEMENTATION_MMAP)
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+#elif defined(RLZ_STORE_IMPLEMENTATION_JOURNAL)
+#include "rlz/linux/lib/rlz_value_store_journal.h"
+#elif defined(RLZ_STORE_IMPLEMENTATION_SQLITE)
+#include "rlz/linux/lib/rlz_value_store_sqlite.h"
+#else
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+#endif
+
+namespace rlz_lib {
+
+namespace {
+
+// Set if the store keeps the StoreStripes in separate files, so that lock
+// scopes for different stripes can write at the same time. The other stores
+// lock the whole store for every scope.
+#if defined(RLZ_STORE_IMPLEMENTATION_MMAP)
+typedef RlzValueStoreMmap StoreType;
+const bool kStoreHasStripes = false;
+#elif defined(RLZ_STORE_IMPLEMENTATION_JOURNAL)
+typedef RlzValueStoreJournal StoreType;
+const bool kStoreHasStripes = false;
+#elif defined(RLZ_STORE_IMPLEMENTATION_SQLITE)
+typedef RlzValueStoreSqlite StoreType;
+const bool kStoreHasStripes = false;
+#else
+typedef RlzValueStoreLinux StoreType;
+const bool kStoreHasStripes = true;
+#endif
+
+// Like on mac, the recursive cross-process lock is emulated by an in-process
+// mutex to get the recursive part, followed by a fcntl() lock on a lock file
+// for the cross-process part. fcntl() locks are owned by the process, so they
+// can't provide the in-process exclusion by themselves. They are released by
+// the kernel when the holder exits, so a crashed holder doesn't block others.
+
+// The bytes of the lock file that fcntl() locks, see LockFile(). kInitByte
+// serializes setting up the LockFileHeader. Bit n of StoreStripes::mask() is
+// byte kFirstStripeByte + n.
+const off_t kLockByte = 0;
+const off_t kGateByte = 1;
+const off_t kInitByte = 2;
+const off_t kFirstStripeByte = 8;
+const int kStripeCount = 32;
+
+// fcntl() can't wait with a timeout, so waiters sleep on a condition variable
+// in the lock file instead, which holders signal after releasing a lock byte.
+// The mutex is robust: if a process dies while holding it, the next one to
+// lock it recovers it. Holders that crashed don't signal, so waiters still
+// retry every kMaxWaitPerTryMS.
+const base::subtle::Atomic32 kLockFileMagic = 0x524c5a4c;  // 'RLZL'
+
+struct LockFileHeader {
+  // Set to kLockFileMagic once |mutex| and |released| are initialized.
+  volatile base::subtle::Atomic32 magic;
+  // The number of waiters, so that holders only signal if there are any.
+  // Changed with |mutex| held. A waiter that dies leaves it too high, which
+  // only costs a needless signal.
+  volatile base::subtle::Atomic32 waiters;
+  pthread_mutex_t mutex;
+  pthread_cond_t released;
+  // The process that took the lock last and the public function it took it
+  // for, so that waiters that time out can tell who held it. Changed with
+  // |mutex| held; cleared by that process when it releases the lock.
+  pid_t owner_pid;
+  char owner_entry_point[kMaxEntryPointLength];
+};
+
+// Returns the time |delay_us| microseconds from now on |clock|, for the
+// pthread functions that wait until an absolute time.
+struct timespec TimespecFromNow(clockid_t clock, int64 delay_us) {
+  struct timespec result;
+  clock_gettime(clock, &result);
+  int64 nanoseconds = result.tv_nsec + delay_us * 1000;
+  result.tv_sec += nanoseconds / base::Time::kNanosecondsPerSecond;
+  result.tv_nsec = nanoseconds % base::Time::kNanosecondsPerSecond;
+  return result;
+}
+
+// This is a struct so that it doesn't need a static initializer.
+struct RecursiveCrossProcessLock {
+  // Acquires the in-process lock, which is recursive. Sets |outermost| if
+  // this thread didn't hold it yet. Returns false if other threads held it
+  // for |timeout_ms| milliseconds; a negative |timeout_ms| waits for as long
+  // as it takes.
+  bool LockInProcess(int timeout_ms, bool* outermost);
+
+  // Tries to acquire the cross-process lock for the outermost lock of this
+  // thread, waiting for other processes until |deadline|. The in-process lock
+  // must be held. The parent directory of |lock_file| must exist. If |shared|
+  // is set, other processes can take a shared lock at the same time. Only
+  // the stripes in |stripe_mask| are locked, see StoreStripes. Sets |busy| if
+  // other processes held the lock until |deadline|.
+  bool TryGetCrossProcessLock(const FilePath& lock_filename, bool shared,
+                              uint32 stripe_mask, base::TimeTicks deadline,
+                              bool* busy);
+
+  // Turns the shared or striped lock of the outermost lock into an exclusive
+  // lock of the whole store. The lock is released in between, so others may
+  // have written in the meantime.
+  bool UpgradeCrossProcessLock(base::TimeTicks deadline);
+
+  // Releases the lock. Should always be called if LockInProcess() returned
+  // true, even if TryGetCrossProcessLock() returns false.
+  void ReleaseLock();
+
+  // Locks the lock byte of |file_lock_| for reading if |shared| is set, or
+  // for writing otherwise. Writers hold the gate byte for writing while they
+  // wait, which keeps new readers out, so that a steady stream of readers
+  // can't starve them; readers only pass the gate. If |stripe_mask| isn't
+  // the whole store, the lock byte is locked for reading, which only keeps
+  // out writers of the whole store, and the bytes of the stripes are locked
+  // like the lock byte would be. Readers of the whole store lock all stripe
+  // bytes for reading, to keep out writers of stripes.
+  bool LockFile(bool shared, uint32 stripe_mask, base::TimeTicks deadline);
+
+  // Sets the fcntl() lock on |length| bytes of |file_lock_| from |offset| on
+  // to |type|, waiting for other processes until |deadline|.
+  bool SetFileLock(short type, off_t offset, off_t length,
+                   base::TimeTicks deadline);
+
+  // Unlocks |length| bytes of |file_lock_| from |offset| on and wakes up
+  // processes waiting for them.
+  void UnlockFile(off_t offset, off_t length);
+
+  // Maps the LockFileHeader of |file_lock_| to |header_|, setting it up if
+  // this is the first process to use it. Without it, waiters poll.
+  bool MapHeader(base::TimeTicks deadline);
+  void UnmapHeader();
+
+  // Locks |header_->mutex|, recovering it if its owner died.
+  bool LockHeader();
+
+  // Wakes up the processes waiting in SetFileLock(), if there are any.
+  void NotifyWaiters();
+
+  // Records this process and |entry_point| in the header as the holder of
+  // the cross-process lock.
+  void SetOwner(const char* entry_point);
+  // Clears the holder in the header if it is this process.
+  void ClearOwner();
+  // Reads the holder from the header into |busy_owner_pid_| and
+  // |busy_owner_|, after waiting for the lock timed out.
+  void ReadOwner();
+
+  pthread_mutex_t recursive_lock_;
+  pthread_t locking_thread_;
+
+  int file_lock_;
+
+  // The mapped start of |file_lock_|, or NULL.
+  LockFileHeader* header_;
+
+  // Set if the outermost lock is shared. Threads of this process still take
+  // turns, since they share one store object.
+  bool shared_;
+
+  // The StoreStripes::mask() of the stripes the outermost lock holds.
+  uint32 stripe_mask_;
+
+  // Set by ReadOwner().
+  pid_t busy_owner_pid_;
+  char busy_owner_[kMaxEntryPointLength];
+} g_recursive_lock = {
+  // PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP is a GNU extension, so emulate
+  // recursive locking with a normal non-recursive mutex like mac does.
+  PTHREAD_MUTEX_INITIALIZER,
+  0,
+  -1,
+  NULL,
+  false,
+  0,
+  0,
+  ""
+};
+
+bool RecursiveCrossProcessLock::LockInProcess(int timeout_ms,
+                                              bool* outermost) {
+  *outermost = false;
+
+  // Emulate a recursive mutex with a non-recursive one.
+  if (pthread_mutex_trylock(&recursive_lock_) == EBUSY) {
+    if (pthread_equal(pthread_self(), locking_thread_) == 0) {
+      // Some other thread has the lock, wait for it.
+      if (timeout_ms < 0) {
+        pthread_mutex_lock(&recursive_lock_);
+      } else {
+        // pthread_mutex_timedlock() only waits on the realtime clock.
+        struct timespec until = TimespecFromNow(
+            CLOCK_REALTIME,
+            timeout_ms * base::Time::kMicrosecondsPerMillisecond);
+        if (timeout_ms == 0 ||
+            pthread_mutex_timedlock(&recursive_lock_, &until) != 0) {
+          return false;
+        }
+      }
+      CHECK(locking_thread_ == 0);
+      *outermost = true;
+    }
+  } else {
+    *outermost = true;
+  }
+
+  locking_thread_ = pthread_self();
+  return true;
+}
+
+bool RecursiveCrossProcessLock::TryGetCrossProcessLock(
+    const FilePath& lock_filename, bool shared, uint32 stripe_mask,
+    base::TimeTicks deadline, bool* busy) {
+  CHECK(file_lock_ == -1);
+  file_lock_ = HANDLE_EINTR(
+      open(lock_filename.value().c_str(), O_RDWR | O_CREAT, 0666));
+  if (file_lock_ == -1)
+    return false;
+
+  // Waiting still works without the header, just with more latency.
+  ignore_result(MapHeader(deadline));
+
+  shared_ = shared;
+  stripe_mask_ = stripe_mask;
+  if (!LockFile(shared, stripe_mask, deadline)) {
+    *busy = base::TimeTicks::Now() >= deadline;
+    if (*busy)
+      ReadOwner();
+    ignore_result(HANDLE_EINTR(close(file_lock_)));
+    file_lock_ = -1;
+    UnmapHeader();
+    return false;
+  }
+  return true;
+}
+
+bool RecursiveCrossProcessLock::UpgradeCrossProcessLock(
+    base::TimeTicks deadline) {
+  CHECK(file_lock_ != -1);
+  // Converting the lock in place could deadlock with another process that
+  // upgrades, since neither gives up its shared lock.
+  UnlockFile(kFirstStripeByte, kStripeCount);
+  UnlockFile(kLockByte, 1);
+  shared_ = false;
+  stripe_mask_ = StoreStripes().mask();
+  return LockFile(false, stripe_mask_, deadline);
+}
+
+bool RecursiveCrossProcessLock::LockFile(bool shared, uint32 stripe_mask,
+                                         base::TimeTicks deadline) {
+  bool striped = stripe_mask != StoreStripes().mask();
+  short store_type = shared || striped ? F_RDLCK : F_WRLCK;
+  if (!SetFileLock(store_type, kGateByte, 1, deadline))
+    return false;
+  bool result = SetFileLock(store_type, kLockByte, 1, deadline);
+  UnlockFile(kGateByte, 1);
+
+  // Readers of the whole store wait for writers of any stripe.
+  if (!striped) {
+    return result && (!shared || SetFileLock(F_RDLCK, kFirstStripeByte,
+                                             kStripeCount, deadline));
+  }
+
+  // Stripes are locked in order, so that scopes with overlapping stripes
+  // don't deadlock. The caller closes the file if this fails, which unlocks
+  // the stripes locked so far.
+  short stripe_type = shared ? F_RDLCK : F_WRLCK;
+  for (int i = 0; result && i < kStripeCount; ++i) {
+    if (stripe_mask & (1u << i))
+      result = SetFileLock(stripe_type, kFirstStripeByte + i, 1, deadline);
+  }
+  return result;
+}
+
+bool RecursiveCrossProcessLock::SetFileLock(short type, off_t offset,
+                                            off_t length,
+                                            base::TimeTicks deadline) {
+  const int kMaxWaitPerTryMS = 200;
+
+  struct flock lock_info = {};
+  lock_info.l_type = type;
+  lock_info.l_whence = SEEK_SET;
+  lock_info.l_start = offset;
+  lock_info.l_len = length;
+
+  if (fcntl(file_lock_, F_SETLK, &lock_info) != -1)
+    return true;
+
+  // A holder signals |released| with |header_->mutex| held, and this process
+  // holds it from before it retries until it waits, so a release can't slip
+  // through in between.
+  bool have_header = header_ && LockHeader();
+  if (have_header)
+    base::subtle::NoBarrier_AtomicIncrement(&header_->waiters, 1);
+
+  bool got_file_lock;
+  while (!(got_file_lock = fcntl(file_lock_, F_SETLK, &lock_info) != -1)) {
+    base::TimeDelta remaining = deadline - base::TimeTicks::Now();
+    if (remaining <= base::TimeDelta())
+      break;
+    int64 wait_us = std::min(remaining.InMicroseconds(),
+                             kMaxWaitPerTryMS * static_cast<int64>(1000));
+    if (!have_header) {
+      usleep(wait_us);
+      continue;
+    }
+
+    struct timespec until = TimespecFromNow(CLOCK_MONOTONIC, wait_us);
+    if (pthread_cond_timedwait(&header_->released, &header_->mutex,
+                               &until) == EOWNERDEAD) {
+      pthread_mutex_consistent(&header_->mutex);
+    }
+  }
+
+  if (have_header) {
+    base::subtle::NoBarrier_AtomicIncrement(&header_->waiters, -1);
+    pthread_mutex_unlock(&header_->mutex);
+  }
+  return got_file_lock;
+}
+
+void RecursiveCrossProcessLock::UnlockFile(off_t offset, off_t length) {
+  struct flock lock_info = {};
+  lock_info.l_type = F_UNLCK;
+  lock_info.l_whence = SEEK_SET;
+  lock_info.l_start = offset;
+  lock_info.l_len = length;
+  fcntl(file_lock_, F_SETLK, &lock_info);
+  NotifyWaiters();
+}
+
+bool RecursiveCrossProcessLock::MapHeader(base::TimeTicks deadline) {
+  CHECK(!header_);
+  struct stat info;
+  if (fstat(file_lock_, &info) != 0)
+    return false;
+
+  void* memory = MAP_FAILED;
+  if (info.st_size >= static_cast<off_t>(sizeof(LockFileHeader))) {
+    memory = mmap(NULL, sizeof(LockFileHeader), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, file_lock_, 0);
+    if (memory != MAP_FAILED &&
+        base::subtle::Acquire_Load(
+            &static_cast<LockFileHeader*>(memory)->magic) == kLockFileMagic) {
+      header_ = static_cast<LockFileHeader*>(memory);
+      return true;
+    }
+  }
+
+  // First use of the lock file, set the header up. |header_| isn't set yet,
+  // so this polls.
+  if (!SetFileLock(F_WRLCK, kInitByte, 1, deadline)) {
+    if (memory != MAP_FAILED)
+      munmap(memory, sizeof(LockFileHeader));
+    return false;
+  }
+
+  // Growing the file zero-fills it. Another process may have done that since.
+  if (memory == MAP_FAILED &&
+      fstat(file_lock_, &info) == 0 &&
+      (info.st_size >= static_cast<off_t>(sizeof(LockFileHeader)) ||
+       HANDLE_EINTR(ftruncate(file_lock_, sizeof(LockFileHeader))) == 0)) {
+    memory = mmap(NULL, sizeof(LockFileHeader), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, file_lock_, 0);
+  }
+
+  if (memory != MAP_FAILED) {
+    LockFileHeader* header = static_cast<LockFileHeader*>(memory);
+    if (base::subtle::Acquire_Load(&header->magic) != kLockFileMagic) {
+      pthread_mutexattr_t mutex_attr;
+      pthread_mutexattr_init(&mutex_attr);
+      pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+      pthread_condattr_t cond_attr;
+      pthread_condattr_init(&cond_attr);
+      pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+      pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+      header->waiters = 0;
+      bool initialized =
+          pthread_mutex_init(&header->mutex, &mutex_attr) == 0 &&
+          pthread_cond_init(&header->released, &cond_attr) == 0;
+      pthread_condattr_destroy(&cond_attr);
+      pthread_mutexattr_destroy(&mutex_attr);
+      if (initialized)
+        base::subtle::Release_Store(&header->magic, kLockFileMagic);
+    }
+    if (base::subtle::NoBarrier_Load(&header->magic) == kLockFileMagic)
+      header_ = header;
+    else
+      munmap(memory, sizeof(LockFileHeader));
+  }
+
+  UnlockFile(kInitByte, 1);
+  return header_ != NULL;
+}
+
+void RecursiveCrossProcessLock::UnmapHeader() {
+  if (header_) {
+    munmap(header_, sizeof(LockFileHeader));
+    header_ = NULL;
+  }
+}
+
+bool RecursiveCrossProcessLock::LockHeader() {
+  int result = pthread_mutex_lock(&header_->mutex);
+  if (result == EOWNERDEAD) {
+    // The owner died while waiting or signaling. |waiters| is only a hint, so
+    // there is nothing to repair.
+    result = pthread_mutex_consistent(&header_->mutex);
+  }
+  return result == 0;
+}
+
+void RecursiveCrossProcessLock::NotifyWaiters() {
+  if (!header_ || base::subtle::Acquire_Load(&header_->waiters) == 0)
+    return;
+  if (!LockHeader())
+    return;
+  pthread_cond_broadcast(&header_->released);
+  pthread_mutex_unlock(&header_->mutex);
+}
+
+void RecursiveCrossProcessLock::SetOwner(const char* entry_point) {
+  if (!header_ || !LockHeader())
+    return;
+  header_->owner_pid = getpid();
+  strncpy(header_->owner_entry_point, entry_point, kMaxEntryPointLength);
+  header_->owner_entry_point[kMaxEntryPointLength - 1] = 0;
+  pthread_mutex_unlock(&header_->mutex);
+}
+
+void RecursiveCrossProcessLock::ClearOwner() {
+  if (!header_ || !LockHeader())
+    return;
+  // A reader that shares the lock may have replaced this process.
+  if (header_->owner_pid == getpid()) {
+    header_->owner_pid = 0;
+    header_->owner_entry_point[0] = 0;
+  }
+  pthread_mutex_unlock(&header_->mutex);
+}
+
+void RecursiveCrossProcessLock::ReadOwner() {
+  busy_owner_pid_ = 0;
+  busy_owner_[0] = 0;
+  if (!header_ || !LockHeader())
+    return;
+  busy_owner_pid_ = header_->owner_pid;
+  memcpy(busy_owner_, header_->owner_entry_point, kMaxEntryPointLength);
+  busy_owner_[kMaxEntryPointLength - 1] = 0;
+  pthread_mutex_unlock(&header_->mutex);
+}
+
+void RecursiveCrossProcessLock::ReleaseLock() {
+  if (file_lock_ != -1) {
+    ClearOwner();
+    // Closing the file releases the fcntl() lock.
+    ignore_result(HANDLE_EINTR(close(file_lock_)));
+    file_lock_ = -1;
+  }
+  NotifyWaiters();
+  UnmapHeader();
+
+  shared_ = false;
+  stripe_mask_ = 0;
+  locking_thread_ = 0;
+  pthread_mutex_unlock(&recursive_lock_);
+}
+
+
+// This is set during test execution, to write RLZ files into a temporary
+// directory instead of the user's data directory.
+FilePath* g_test_folder;
+
+// The store object buffers changes and only writes them to disk when the
+// outermost ScopedRlzValueStoreLock goes out of scope. Hence, if several
+// ScopedRlzValueStoreLocks are nested, they all need to use the same store
+// object.
+
+// This counts the nesting depth.
+int g_lock_depth = 0;
+
+// This is the store object that might be shared. Only set if g_lock_depth > 0.
+StoreType* g_store_object = NULL;
+
+// The cache around |g_store_object|, which is what GetStore() returns. Set
+// together with |g_store_object|.
+RlzValueStoreCache* g_cache_object = NULL;
+
+// Set if the store generation could be read when the outermost lock was
+// acquired. If it couldn't, the cache can't tell when other processes write to
+// the store, so it is only used within the lock scope.
+bool g_have_generation = false;
+
+// The store generation that |g_store_object| is up to date with. In a striped
+// lock scope, only its stripes are guaranteed to be.
+uint32 g_store_object_generation = 0;
+
+// The store object of the last lock scope, kept for the next one so that the
+// files it read aren't read and parsed again. If the store generation still
+// is |g_idle_store_generation| when the next scope starts, no process wrote
+// to the store in between; otherwise, Revalidate() drops what changed. Only
+// kept if the scope ended with everything written and the generation known.
+StoreType* g_idle_store = NULL;
+uint32 g_idle_store_generation = 0;
+
+// The number of times a lock scope wrote the store, for tests.
+int g_store_flush_count = 0;
+
+// Set in STORE_SYNC_GROUP_COMMIT mode if the outermost lock wrote the store.
+// The destructor then syncs up to |g_sync_generation| after releasing the
+// cross-process lock.
+bool g_sync_pending = false;
+uint32 g_sync_generation = 0;
+
+// The connection to the rlz broker, see rlz_broker_linux.h. Created by the
+// first lock scope that looks for a broker.
+RlzBrokerClient* g_broker_client = NULL;
+
+// The store of a lock scope that the broker runs, instead of |g_store_object|
+// and |g_cache_object|. Values aren't cached for these scopes: the cache would
+// need the generation the broker's writes lead to, but cached values still
+// notice these writes. Only set if g_lock_depth > 0.
+RlzValueStoreBrokerProxy* g_broker_store = NULL;
+bool g_broker_shared = false;
+
+
+FilePath CreateRlzDirectory() {
+  FilePath folder;
+  if (g_test_folder) {
+    folder = *g_test_folder;
+  } else {
+    folder = file_util::GetHomeDir().Append(".local/share/google/rlz");
+  }
+  file_util::CreateDirectory(folder);
+  return folder;
+}
+
+// Returns the path of the rlz store, also creates the parent directory
+// path if it doesn't exist.
+FilePath RlzStoreFilename() {
+#if defined(RLZ_STORE_IMPLEMENTATION_MMAP)
+  const char kRlzFile[] = "RlzStore.dat";
+#elif defined(RLZ_STORE_IMPLEMENTATION_JOURNAL)
+  const char kRlzFile[] = "RlzStore.log";
+#elif defined(RLZ_STORE_IMPLEMENTATION_SQLITE)
+  const char kRlzFile[] = "RlzStore.db";
+#else
+  const char kRlzFile[] = "RlzStore.json";
+#endif
+  return CreateRlzDirectory().Append(kRlzFile);
+}
+
+// Returns the path of the rlz lock file, also creates the parent directory
+// path if it doesn't exist.
+FilePath RlzLockFilename() {
+  const char kRlzFile[] = "lockfile";
+  return CreateRlzDirectory().Append(kRlzFile);
+}
+
+// Returns the path of the store generation file, also creates the parent
+// directory path if it doesn't exist.
+FilePath RlzGenerationFilename() {
+  const char kRlzFile[] = "generation";
+  return CreateRlzDirectory().Append(kRlzFile);
+}
+
+// Returns the path of the file that serializes group syncs, also creates the
+// parent directory path if it doesn't exist.
+FilePath RlzSyncLockFilename() {
+  const char kRlzFile[] = "synclock";
+  return CreateRlzDirectory().Append(kRlzFile);
+}
+
+// The store generation is a 32 bit counter in a file next to the lock file.
+// The file is mapped into memory for the lifetime of the process, so that
+// reading the generation without the lock is a single load.
+class StoreGenerationFile {
+ public:
+  StoreGenerationFile()
+      : fd_(-1), counter_(NULL), writable_(false), device_(0), inode_(0) {}
+
+  // Reads the current generation, mapping the file first if needed.
+  bool Read(uint32* generation);
+
+  // Like Read(), but first maps the file again if it was replaced since it
+  // was mapped. Must be called with the cross-process lock held.
+  bool ReadChecked(uint32* generation);
+
+  // Increments the generation and returns the new value in |generation|.
+  // Must be called with the cross-process lock held. Lock scopes for
+  // different stripes can increment it at the same time.
+  bool Increment(uint32* generation);
+
+  // Unmaps the file, for tests that change the rlz directory.
+  void Reset();
+
+ private:
+  // |lock_| must be held for these.
+  bool MapLocked();
+  void UnmapLocked();
+
+  base::Lock lock_;
+  int fd_;
+  volatile base::subtle::Atomic32* counter_;
+  bool writable_;
+  dev_t device_;
+  ino_t inode_;
+
+  DISALLOW_COPY_AND_ASSIGN(StoreGenerationFile);
+};
+
+bool StoreGenerationFile::Read(uint32* generation) {
+  base::AutoLock lock(lock_);
+  if (!counter_ && !MapLocked())
+    return false;
+  *generation = base::subtle::Acquire_Load(counter_);
+  return true;
+}
+
+bool StoreGenerationFile::ReadChecked(uint32* generation) {
+  {
+    base::AutoLock lock(lock_);
+    struct stat info;
+    if (counter_ &&
+        (stat(RlzGenerationFilename().value().c_str(), &info) != 0 ||
+         info.st_dev != device_ || info.st_ino != inode_)) {
+      UnmapLocked();
+    }
+  }
+  return Read(generation);
+}
+
+bool StoreGenerationFile::Increment(uint32* generation) {
+  base::AutoLock lock(lock_);
+  if ((!counter_ && !MapLocked()) || !writable_)
+    return false;
+
+  *generation = base::subtle::Barrier_AtomicIncrement(counter_, 1);
+  return true;
+}
+
+void StoreGenerationFile::Reset() {
+  base::AutoLock lock(lock_);
+  UnmapLocked();
+}
+
+bool StoreGenerationFile::MapLocked() {
+  FilePath path = RlzGenerationFilename();
+  writable_ = true;
+  fd_ = HANDLE_EINTR(open(path.value().c_str(), O_RDWR | O_CREAT, 0666));
+  if (fd_ == -1) {
+    writable_ = false;
+    fd_ = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+    if (fd_ == -1)
+      return false;
+  }
+
+  // Growing the file zero-fills it, so racing processes agree on the value.
+  struct stat info;
+  if (fstat(fd_, &info) != 0 ||
+      (info.st_size < static_cast<off_t>(sizeof(*counter_)) &&
+       (!writable_ ||
+        HANDLE_EINTR(ftruncate(fd_, sizeof(*counter_))) != 0))) {
+    UnmapLocked();
+    return false;
+  }
+  device_ = info.st_dev;
+  inode_ = info.st_ino;
+
+  void* memory = mmap(NULL, sizeof(*counter_),
+                      writable_ ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd_, 0);
+  if (memory == MAP_FAILED) {
+    UnmapLocked();
+    return false;
+  }
+  counter_ = static_cast<volatile base::subtle::Atomic32*>(memory);
+  return true;
+}
+
+void StoreGenerationFile::UnmapLocked() {
+  if (counter_) {
+    munmap(const_cast<base::subtle::Atomic32*>(counter_), sizeof(*counter_));
+    counter_ = NULL;
+  }
+  if (fd_ != -1) {
+    ignore_result(HANDLE_EINTR(close(fd_)));
+    fd_ = -1;
+  }
+}
+
+base::LazyInstance<StoreGenerationFile>::Leaky g_store_generation =
+    LAZY_INSTANCE_INITIALIZER;
+
+// Writes |g_store_object| if anything changed since it was last written, and
+// tells other processes that the values they cached are stale. Only called
+// with the outermost lock.
+bool CommitStore() {
+  // Unlike mac, only write the store if something changed. Read-only calls
+  // such as GetAccessPointRlz() don't touch the disk at all.
+  bool written = g_store_object->WriteStoreIfDirty();
+  if (!g_cache_object->dirty())
+    return written;
+
+  if (written)
+    ++g_store_flush_count;
+  uint32 generation;
+  bool have_generation = written && g_have_generation &&
+      g_store_generation.Get().Increment(&generation);
+
+  // Group syncs need the generation to tell whether another process's sync
+  // covered this write; without it, sync right away.
+  StoreSyncMode sync_mode = GetStoreSyncMode();
+  if (written && (sync_mode == STORE_SYNC_EACH_COMMIT ||
+                  (sync_mode == STORE_SYNC_GROUP_COMMIT && !have_generation))) {
+    written = SyncStoreFiles(RlzStoreFilename());
+  } else if (have_generation && sync_mode == STORE_SYNC_GROUP_COMMIT) {
+    g_sync_pending = true;
+    g_sync_generation = generation;
+  }
+
+  // Lock scopes for other stripes may have written since this one started.
+  // Then the cached values and |g_store_object| aren't current for their
+  // stripes.
+  if (written && have_generation &&
+      generation == g_store_object_generation + 1) {
+    g_cache_object->Commit(generation);
+    g_store_object_generation = generation;
+  } else {
+    RlzValueStoreCache::Invalidate();
+    // Other processes' store objects won't notice this write.
+    g_have_generation = false;
+  }
+  return written;
+}
+
+}  // namespace
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
+  Acquire(RlzValueStore::kWriteAccess, -1);
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access) {
+  Acquire(access, -1);
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, int timeout_ms) {
+  Acquire(access, std::max(timeout_ms, 0));
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, StoreStripes stripes)
+    : stripes_(stripes) {
+  Acquire(access, -1);
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, StoreStripes stripes, int timeout_ms)
+    : stripes_(stripes) {
+  Acquire(access, std::max(timeout_ms, 0));
+}
+
+void ScopedRlzValueStoreLock::Acquire(RlzValueStore::AccessType access,
+                                      int timeout_ms) {
+  const int kDefaultTimeoutMS = 5000;  // Matches windows.
+
+  busy_ = false;
+  base::TimeTicks start = base::TimeTicks::Now();
+  bool outermost = false;
+  locked_ = g_recursive_lock.LockInProcess(timeout_ms, &outermost);
+  if (!locked_) {
+    busy_ = true;
+    stats_timer_.Failed(true, 0, NULL);
+    return;
+  }
+
+  // Other processes get the time that is left after waiting for threads,
+  // unless there is no timeout.
+  base::TimeTicks deadline = timeout_ms < 0 ?
+      base::TimeTicks::Now() +
+          base::TimeDelta::FromMilliseconds(kDefaultTimeoutMS) :
+      start + base::TimeDelta::FromMilliseconds(timeout_ms);
+
+  bool shared = access == RlzValueStore::kReadAccess;
+  if (outermost && IsRlzBrokerEnabled()) {
+    if (!g_broker_client)
+      g_broker_client = new RlzBrokerClient;
+    bool started = g_broker_client->Begin(
+        access, SupplementaryBranding::GetBrand(), deadline, &busy_);
+    if (started || busy_) {
+      ++g_lock_depth;
+      if (started) {
+        g_broker_store = new RlzValueStoreBrokerProxy(g_broker_client);
+        g_broker_shared = shared;
+        store_.reset(g_broker_store);
+        stats_timer_.Acquired();
+      } else {
+        // The broker doesn't say which of its clients holds the lock.
+        stats_timer_.Failed(true, 0, NULL);
+      }
+      return;
+    }
+    // There is no broker, use the files.
+  } else if (g_broker_store) {
+    ++g_lock_depth;
+    if (g_broker_shared && !shared) {
+      ASSERT_STRING("ScopedRlzValueStoreLock: can't write under a read lock");
+      return;
+    }
+    // A SupplementaryBranding sets its brand after its own lock began the
+    // scope, so the brand is passed on by the locks it nests.
+    if (g_broker_client->SetBrand(SupplementaryBranding::GetBrand()))
+      store_.reset(g_broker_store);
+    return;
+  }
+
+  // The broker and stores that keep everything together lock the whole store.
+  uint32 stripe_mask =
+      kStoreHasStripes ? stripes_.mask() : StoreStripes().mask();
+  bool got_cross_process_lock = outermost ?
+      g_recursive_lock.TryGetCrossProcessLock(RlzLockFilename(), shared,
+                                              stripe_mask, deadline, &busy_) :
+      g_recursive_lock.file_lock_ != -1;
+  if (outermost && got_cross_process_lock)
+    g_recursive_lock.SetOwner(ScopedRlzEntryPoint::Current());
+  // At this point, we hold the in-process lock, no matter the value of
+  // |got_cross_process_lock|.
+
+  ++g_lock_depth;
+
+  if (!got_cross_process_lock) {
+    // Give up. |store_| isn't set, which signals to callers that acquiring
+    // the lock failed. |g_recursive_lock| will be released by the
+    // destructor.
+    CHECK(!g_store_object);
+    if (outermost) {
+      stats_timer_.Failed(busy_, g_recursive_lock.busy_owner_pid_,
+                          g_recursive_lock.busy_owner_);
+    }
+    return;
+  }
+
+  if (g_lock_depth > 1) {
+    // Other processes may be reading the store too, so it can't be written.
+    if (g_recursive_lock.shared_ && !shared) {
+      ASSERT_STRING("ScopedRlzValueStoreLock: can't write under a read lock");
+      return;
+    }
+    // Nor can other processes' writes to other stripes be seen.
+    if ((g_recursive_lock.stripe_mask_ & stripe_mask) != stripe_mask) {
+      ASSERT_STRING("ScopedRlzValueStoreLock: stripes not held by the "
+                    "outermost lock");
+      return;
+    }
+
+    // Reuse the already existing store object. There is none if the
+    // outermost lock got the lock file but couldn't set the store up; then
+    // this lock fails too.
+    if (g_cache_object)
+      store_.reset(g_cache_object);
+    return;
+  }
+
+  CHECK(!g_store_object);
+
+  // The first lock scope sets the store up, which writes to it; after that,
+  // reading it doesn't, and neither does writing only some stripes.
+  if ((shared || stripe_mask != StoreStripes().mask()) &&
+      !StoreType::CanOpenForSharedReads(RlzStoreFilename()) &&
+      !g_recursive_lock.UpgradeCrossProcessLock(deadline)) {
+    busy_ = base::TimeTicks::Now() >= deadline;
+    if (busy_)
+      g_recursive_lock.ReadOwner();
+    stats_timer_.Failed(busy_, g_recursive_lock.busy_owner_pid_,
+                        g_recursive_lock.busy_owner_);
+    return;
+  }
+
+  // Values cached by earlier lock scopes, and the store object of the last
+  // one, are kept if no process wrote to the store since.
+  uint32 generation = 0;
+  g_have_generation = g_store_generation.Get().ReadChecked(&generation);
+  if (!g_have_generation)
+    RlzValueStoreCache::Invalidate();
+
+  StoreType* store = g_idle_store;
+  g_idle_store = NULL;
+  if (!store)
+    store = new StoreType(RlzStoreFilename());
+  else if (!g_have_generation || generation != g_idle_store_generation)
+    store->Revalidate();
+  scoped_ptr<RlzValueStore> store_owner(store);
+  VERIFY(store->is_valid());
+  if (!store->is_valid()) {
+    stats_timer_.Failed(false, 0, NULL);
+    return;
+  }
+  g_store_object = store;
+  g_store_object_generation = generation;
+  ignore_result(store_owner.release());
+
+  g_cache_object = new RlzValueStoreCache(store, generation);
+  store_.reset(g_cache_object);
+  stats_timer_.Acquired();
+}
+
+ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
+  if (!locked_)
+    return;
+
+  --g_lock_depth;
+  CHECK(g_lock_depth >= 0);
+
+  if (g_lock_depth > 0) {
+    // Other locks are still using store_, don't free it yet.
+    ignore_result(store_.release());
+    return;
+  }
+
+  if (g_broker_store) {
+    VERIFY(g_broker_client->End());
+    store_.reset();
+    g_broker_store = NULL;
+    g_recursive_lock.ReleaseLock();
+    return;
+  }
+
+  // Check that "store_ set" => "file_lock acquired". The converse isn't true,
+  // for example if the rlz data file can't be read.
+  if (store_.get())
+    CHECK(g_recursive_lock.file_lock_ != -1);
+  if (g_recursive_lock.file_lock_ == -1)
+    CHECK(!store_.get());
+
+  if (store_.get()) {
+    bool consistent = true;
+    if (!g_recursive_lock.shared_) {
+      consistent = CommitStore();
+      VERIFY(consistent);
+    } else if (g_cache_object->dirty()) {
+      ASSERT_STRING("ScopedRlzValueStoreLock: dropping writes under a read "
+                    "lock");
+      RlzValueStoreCache::Invalidate();
+      consistent = false;
+    }
+    if (!g_have_generation)
+      RlzValueStoreCache::Invalidate();
+
+    // The cache must go away before the lock is released, so that it doesn't
+    // overlap with the next lock scope.
+    store_.reset();
+    if (consistent && g_have_generation) {
+      g_idle_store = g_store_object;
+      g_idle_store_generation = g_store_object_generation;
+    } else {
+      delete static_cast<RlzValueStore*>(g_store_object);
+    }
+    g_cache_object = NULL;
+    g_store_object = NULL;
+  }
+
+  bool sync_pending = g_sync_pending;
+  uint32 sync_generation = g_sync_generation;
+  g_sync_pending = false;
+  g_recursive_lock.ReleaseLock();
+
+  // Other processes can write again while this one waits for the disk.
+  if (sync_pending) {
+    VERIFY(GroupSyncStoreFiles(RlzStoreFilename(), RlzSyncLockFilename(),
+                               sync_generation));
+  }
+}
+
+RlzValueStore* ScopedRlzValueStoreLock::GetStore() {
+  return store_.get();
+}
+
+bool ScopedRlzValueStoreLock::Commit() {
+  if (!store_.get())
+    return false;
+  if (g_broker_store) {
+    return g_broker_shared || g_lock_depth > 1 ||
+           g_broker_client->Commit();
+  }
+  if (g_recursive_lock.shared_)
+    return !g_cache_object->dirty();
+  return g_lock_depth > 1 || CommitStore();
+}
+
+FilePath RlzBrokerSocketFilename() {
+  const char kRlzFile[] = "broker";
+  return CreateRlzDirectory().Append(kRlzFile);
+}
+
+FilePath RlzBrokerLockFilename() {
+  const char kRlzFile[] = "brokerlock";
+  return CreateRlzDirectory().Append(kRlzFile);
+}
+
+bool ReadStoreGeneration(uint32* generation) {
+  return g_store_generation.Get().Read(generation);
+}
+
+bool ReadAccessPointRlzWithoutLock(AccessPoint point,
+                                   char* rlz,
+                                   size_t rlz_size) {
+#if defined(RLZ_STORE_IMPLEMENTATION_MMAP)
+  // A thread that holds the lock might have a supplementary brand active.
+  // Other threads' brands don't matter: waiting for the lock would return the
+  // default brand's RLZ after they are done.
+  if (pthread_equal(pthread_self(), g_recursive_lock.locking_thread_))
+    return false;
+  return RlzValueStoreMmap::ReadAccessPointRlzWithoutLock(
+      RlzStoreFilename(), point, rlz, rlz_size);
+#else
+  return false;
+#endif
+}
+
+namespace testing {
+
+void SetRlzStoreDirectory(const FilePath& directory) {
+#if defined(RLZ_STORE_IMPLEMENTATION_MMAP)
+  // Mappings and connections outlive lock scopes, drop the ones of the old
+  // directory.
+  RlzValueStoreMmap::UnmapAll();
+#elif defined(RLZ_STORE_IMPLEMENTATION_SQLITE)
+  RlzValueStoreSqlite::CloseAll();
+#endif
+  RlzValueStoreCache::Invalidate();
+  g_store_generation.Get().Reset();
+  delete static_cast<RlzValueStore*>(g_idle_store);
+  g_idle_store = NULL;
+
+  delete g_test_folder;
+  if (directory.empty())
+    g_test_folder = NULL;
+  else
+    g_test_folder = new FilePath(directory);
+}
+
+int GetStoreFlushCount() {
+  return g_store_flush_count;
+}
+
+}  // namespace testing
+
+}  // namespace rlz_lib
@@ -0,0 +1,600 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for the linux ScopedRlzValueStoreLock. They run with whichever store
+// the library is built with.
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "base/time.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lock_stats.h"
+#include "rlz/lib/pending_events.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace rlz_lib {
+
+// With a SupplementaryBranding on the stack, every lock is nested in its lock
+// for writing, so these tests only run in the first pass.
+class RlzValueStoreLockTest : public RlzLibTestNoMachineState {
+ protected:
+  // Forks a process that holds the lock for |access| until the returned pipe
+  // is written to or closed, or for |hold_ms| if that's positive. Returns
+  // once the child has the lock. If |release_time| is set, the child stores
+  // the time at which it releases the lock there; it must be shared memory.
+  pid_t ForkLockHolder(RlzValueStore::AccessType access, int hold_ms,
+                       int* release_fd, volatile int64* release_time) {
+    return ForkLockHolder(access, StoreStripes(), hold_ms, release_fd,
+                          release_time);
+  }
+
+  // Like above, but only locks |stripes|.
+  pid_t ForkLockHolder(RlzValueStore::AccessType access, StoreStripes stripes,
+                       int hold_ms, int* release_fd,
+                       volatile int64* release_time) {
+    int ready[2];
+    int release[2];
+    if (pipe(ready) != 0 || pipe(release) != 0)
+      return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(ready[0]);
+      close(release[1]);
+      bool ok;
+      {
+        ScopedRlzEntryPoint entry_point("LockHolder");
+        ScopedRlzValueStoreLock lock(access, stripes);
+        ok = lock.GetStore() != NULL;
+        char c = ok;
+        ok &= write(ready[1], &c, 1) == 1;
+        if (hold_ms > 0)
+          usleep(hold_ms * 1000);
+        else
+          ok &= read(release[0], &c, 1) >= 0;
+        if (release_time)
+          *release_time = base::TimeTicks::Now().ToInternalValue();
+      }
+      _exit(ok ? 0 : 1);
+    }
+
+    close(ready[1]);
+    close(release[0]);
+    char c = 0;
+    if (pid == -1 || read(ready[0], &c, 1) != 1 || !c) {
+      close(ready[0]);
+      close(release[1]);
+      return -1;
+    }
+    close(ready[0]);
+    *release_fd = release[1];
+    return pid;
+  }
+
+  bool WaitForChild(pid_t pid) {
+    int status = 0;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+  }
+};
+
+TEST_F(RlzValueStoreLockTest, ReadLockSetsUpStore) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // Nothing was written to the temporary directory yet.
+  ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess);
+  ASSERT_TRUE(lock.GetStore());
+  EXPECT_TRUE(lock.GetStore()->HasAccess(RlzValueStore::kReadAccess));
+
+  std::vector<std::string> events;
+  EXPECT_TRUE(lock.GetStore()->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  EXPECT_TRUE(events.empty());
+}
+
+TEST_F(RlzValueStoreLockTest, ReadersShareTheLock) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kReadAccess, 0, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  // Waiting for the other reader would take at least one retry interval.
+  base::TimeTicks start = base::TimeTicks::Now();
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess);
+    ASSERT_TRUE(lock.GetStore());
+    char rlz[50];
+    EXPECT_TRUE(lock.GetStore()->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz,
+                                                    arraysize(rlz)));
+    EXPECT_STREQ("IeTbRlz", rlz);
+  }
+  EXPECT_LT((base::TimeTicks::Now() - start).InMilliseconds(), 100);
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+}
+
+TEST_F(RlzValueStoreLockTest, WritersWaitForReaders) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kReadAccess, 300, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "NewRlz"));
+  EXPECT_GE((base::TimeTicks::Now() - start).InMilliseconds(), 200);
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+}
+
+TEST_F(RlzValueStoreLockTest, WaitersWakeUpOnRelease) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kWriteAccess, 50, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  // Polling would only notice the release after a full retry interval.
+  base::TimeTicks start = base::TimeTicks::Now();
+  {
+    ScopedRlzValueStoreLock lock;
+    EXPECT_TRUE(lock.GetStore());
+  }
+  EXPECT_LT((base::TimeTicks::Now() - start).InMilliseconds(), 150);
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+}
+
+TEST_F(RlzValueStoreLockTest, CrashedHolderDoesNotBlock) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  int ready[2];
+  ASSERT_EQ(0, pipe(ready));
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    // Exits with the lock held, without releasing it.
+    ScopedRlzValueStoreLock lock;
+    char c = lock.GetStore() != NULL;
+    if (write(ready[1], &c, 1) == 1)
+      usleep(50 * 1000);
+    _exit(0);
+  }
+
+  char c = 0;
+  ASSERT_EQ(1, read(ready[0], &c, 1));
+  ASSERT_TRUE(c);
+  close(ready[0]);
+  close(ready[1]);
+
+  // The lock is free once the holder is gone, well before the deadline.
+  base::TimeTicks start = base::TimeTicks::Now();
+  {
+    ScopedRlzValueStoreLock lock;
+    EXPECT_TRUE(lock.GetStore());
+  }
+  EXPECT_LT((base::TimeTicks::Now() - start).InMilliseconds(), 1000);
+  EXPECT_TRUE(WaitForChild(pid));
+}
+
+TEST_F(RlzValueStoreLockTest, TimeoutReportsBusy) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kWriteAccess, 0, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess, 0);
+    EXPECT_TRUE(lock.busy());
+    EXPECT_FALSE(lock.GetStore());
+  }
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess, 50);
+    EXPECT_TRUE(lock.busy());
+    EXPECT_FALSE(lock.GetStore());
+  }
+  EXPECT_LT((base::TimeTicks::Now() - start).InMilliseconds(), 150);
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess, 0);
+  EXPECT_FALSE(lock.busy());
+  EXPECT_TRUE(lock.GetStore());
+}
+
+TEST_F(RlzValueStoreLockTest, TimeoutStatsNameHolder) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  ResetLockStats();
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kWriteAccess, 0, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  {
+    ScopedRlzEntryPoint entry_point("Waiter");
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess, 0);
+    EXPECT_TRUE(lock.busy());
+  }
+  LockStats stats;
+  EXPECT_TRUE(GetLockStats("Waiter", &stats));
+  EXPECT_EQ(0, stats.acquired);
+  EXPECT_EQ(1, stats.timeouts);
+  EXPECT_EQ(pid, stats.last_timeout_holder_pid);
+  EXPECT_STREQ("LockHolder", stats.last_timeout_holder);
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+
+  // Once released, the lock is acquired without a timeout.
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(GetLockStats("SetAccessPointRlz", &stats));
+  EXPECT_EQ(1, stats.acquired);
+  EXPECT_EQ(0, stats.timeouts);
+}
+
+TEST_F(RlzValueStoreLockTest, TryFunctionsQueueWhenBusy) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kWriteAccess, 0, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  EXPECT_EQ(TRY_QUEUED, TryRecordProductEvent(TOOLBAR_NOTIFIER,
+                                              IE_DEFAULT_SEARCH,
+                                              SET_TO_GOOGLE));
+  EXPECT_EQ(TRY_QUEUED, TryRecordProductEvent(TOOLBAR_NOTIFIER,
+                                              IE_HOME_PAGE, INSTALL));
+  EXPECT_EQ(TRY_QUEUED, TryClearProductEvent(TOOLBAR_NOTIFIER,
+                                             IE_HOME_PAGE, INSTALL));
+  EXPECT_LT((base::TimeTicks::Now() - start).InMilliseconds(), 100);
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+
+  // Once the lock is released, the flusher thread makes the queued changes, in
+  // order.
+  base::TimeTicks deadline =
+      base::TimeTicks::Now() + base::TimeDelta::FromSeconds(10);
+  while (HasPendingEvents() && base::TimeTicks::Now() < deadline)
+    usleep(10 * 1000);
+  EXPECT_FALSE(HasPendingEvents());
+  char cgi[50];
+  EXPECT_TRUE(GetProductEventsAsCgi(TOOLBAR_NOTIFIER, cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S", cgi);
+
+  EXPECT_EQ(TRY_OK, TryRecordProductEvent(TOOLBAR_NOTIFIER, IE_HOME_PAGE,
+                                          INSTALL));
+  EXPECT_EQ(TRY_OK, TryGetProductEventsAsCgi(TOOLBAR_NOTIFIER, cgi,
+                                             arraysize(cgi)));
+  EXPECT_STREQ("events=I7S,W1I", cgi);
+}
+
+TEST_F(RlzValueStoreLockTest, NoWritesUnderReadLock) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // Otherwise, the read lock sets up the store and keeps the lock for writing.
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  ScopedRlzValueStoreLock read_lock(RlzValueStore::kReadAccess);
+  ASSERT_TRUE(read_lock.GetStore());
+
+  SetExpectedAssertion(
+      "ScopedRlzValueStoreLock: can't write under a read lock");
+  {
+    ScopedRlzValueStoreLock write_lock;
+    EXPECT_FALSE(write_lock.GetStore());
+  }
+  SetExpectedAssertion("");
+
+  // Nested readers share the store.
+  ScopedRlzValueStoreLock nested_lock(RlzValueStore::kReadAccess);
+  EXPECT_EQ(read_lock.GetStore(), nested_lock.GetStore());
+}
+
+#if defined(RLZ_STORE_IMPLEMENTATION_JSON)
+TEST_F(RlzValueStoreLockTest, StripesOfOtherProductsDontWait) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  // Otherwise, the first lock sets up the store and locks all of it.
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  int release_fd = -1;
+  pid_t pid = ForkLockHolder(RlzValueStore::kWriteAccess,
+                             StoreStripes::ForProduct(CHROME), 0, &release_fd,
+                             NULL);
+  ASSERT_NE(-1, pid);
+
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                                 StoreStripes::ForProduct(DESKTOP), 0);
+    ASSERT_TRUE(lock.GetStore());
+    EXPECT_TRUE(lock.GetStore()->AddProductEvent(DESKTOP, "I7S"));
+  }
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                                 StoreStripes::AccessPoints(), 0);
+    EXPECT_TRUE(lock.GetStore());
+  }
+  EXPECT_TRUE(RecordProductEvent(DESKTOP, IE_HOME_PAGE, INSTALL));
+
+  // Locks for the same product, or for the whole store, wait.
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess,
+                                 StoreStripes::ForProduct(CHROME), 0);
+    EXPECT_TRUE(lock.busy());
+  }
+  {
+    ScopedRlzValueStoreLock lock(RlzValueStore::kReadAccess, 0);
+    EXPECT_TRUE(lock.busy());
+  }
+
+  close(release_fd);
+  EXPECT_TRUE(WaitForChild(pid));
+
+  char cgi[50];
+  EXPECT_TRUE(GetProductEventsAsCgi(DESKTOP, cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S,W1I", cgi);
+}
+
+TEST_F(RlzValueStoreLockTest, NestedLocksOnlyUseHeldStripes) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                               StoreStripes::ForProduct(DESKTOP) |
+                                   StoreStripes::AccessPoints());
+  ASSERT_TRUE(lock.GetStore());
+  {
+    ScopedRlzValueStoreLock nested_lock(RlzValueStore::kWriteAccess,
+                                        StoreStripes::ForProduct(DESKTOP));
+    EXPECT_EQ(lock.GetStore(), nested_lock.GetStore());
+  }
+
+  SetExpectedAssertion(
+      "ScopedRlzValueStoreLock: stripes not held by the outermost lock");
+  {
+    ScopedRlzValueStoreLock nested_lock(RlzValueStore::kWriteAccess,
+                                        StoreStripes::ForProduct(CHROME));
+    EXPECT_FALSE(nested_lock.GetStore());
+  }
+  {
+    ScopedRlzValueStoreLock nested_lock;
+    EXPECT_FALSE(nested_lock.GetStore());
+  }
+  SetExpectedAssertion("");
+}
+#endif  // defined(RLZ_STORE_IMPLEMENTATION_JSON)
+
+// Measures how long a process that waits for the lock takes to get it after
+// another process released it. Run with --gtest_also_run_disabled_tests.
+TEST_F(RlzValueStoreLockTest, DISABLED_BenchmarkLockHandoff) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const int kHandoffs = 50;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  volatile int64* release_time = static_cast<volatile int64*>(
+      mmap(NULL, sizeof(int64), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(MAP_FAILED, release_time);
+
+  std::vector<int64> latencies_us;
+  for (int i = 0; i < kHandoffs; ++i) {
+    // Vary how long the lock is held, so that waiters start at different
+    // points of their wait.
+    int release_fd = -1;
+    pid_t pid = ForkLockHolder(RlzValueStore::kWriteAccess,
+                               10 + (i * 37) % 180, &release_fd,
+                               release_time);
+    ASSERT_NE(-1, pid);
+    {
+      ScopedRlzValueStoreLock lock;
+      EXPECT_TRUE(lock.GetStore());
+      latencies_us.push_back(base::TimeTicks::Now().ToInternalValue() -
+                             *release_time);
+    }
+    close(release_fd);
+    EXPECT_TRUE(WaitForChild(pid));
+  }
+  munmap(const_cast<int64*>(release_time), sizeof(int64));
+
+  std::sort(latencies_us.begin(), latencies_us.end());
+  printf("handoff latency (ms): median %.3f, 90%% %.3f, max %.3f\n",
+         latencies_us[kHandoffs / 2] / 1000.0,
+         latencies_us[kHandoffs * 9 / 10] / 1000.0,
+         latencies_us.back() / 1000.0);
+}
+
+// Measures how many lock scopes per second N reader processes and one writer
+// process get through, with readers taking the lock for reading or for
+// writing. Run with --gtest_also_run_disabled_tests.
+TEST_F(RlzValueStoreLockTest, DISABLED_BenchmarkReadersAndWriter) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const int kReaders[] = { 1, 2, 4, 8 };
+  const int kRunMs = 2000;
+  const struct {
+    RlzValueStore::AccessType access;
+    const char* name;
+  } kModes[] = {
+    { RlzValueStore::kWriteAccess, "exclusive" },
+    { RlzValueStore::kReadAccess, "shared" },
+  };
+
+  EXPECT_TRUE(RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                 SET_TO_GOOGLE));
+
+  printf("readers        mode      reads/s   writes/s\n");
+  for (size_t r = 0; r < arraysize(kReaders); ++r) {
+    for (size_t m = 0; m < arraysize(kModes); ++m) {
+      // Each child writes whether it is the writer and the number of scopes
+      // it completed to the pipe.
+      int results[2];
+      ASSERT_EQ(0, pipe(results));
+      base::TimeTicks end =
+          base::TimeTicks::Now() + base::TimeDelta::FromMilliseconds(kRunMs);
+
+      std::vector<pid_t> pids;
+      for (int i = 0; i <= kReaders[r]; ++i) {
+        int writer = i == kReaders[r];
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+          int count = 0;
+          while (base::TimeTicks::Now() < end) {
+            if (writer) {
+              if (RecordProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                     INSTALL) &&
+                  ClearProductEvent(TOOLBAR_NOTIFIER, IE_DEFAULT_SEARCH,
+                                    INSTALL)) {
+                count += 2;
+              }
+            } else {
+              ScopedRlzValueStoreLock lock(kModes[m].access);
+              std::vector<std::string> events;
+              if (lock.GetStore() &&
+                  lock.GetStore()->ReadProductEvents(TOOLBAR_NOTIFIER,
+                                                     &events)) {
+                ++count;
+              }
+            }
+          }
+          int result[2] = { writer, count };
+          _exit(write(results[1], result, sizeof(result)) == sizeof(result) ?
+                0 : 1);
+        }
+        pids.push_back(pid);
+      }
+
+      int reads = 0;
+      int writes = 0;
+      for (size_t i = 0; i < pids.size(); ++i) {
+        EXPECT_TRUE(WaitForChild(pids[i]));
+        int result[2];
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(result)),
+                  read(results[0], result, sizeof(result)));
+        (result[0] ? writes : reads) += result[1];
+      }
+      close(results[0]);
+      close(results[1]);
+      printf("%7d %11s %12.0f %10.0f\n", kReaders[r], kModes[m].name,
+             reads * 1000.0 / kRunMs, writes * 1000.0 / kRunMs);
+    }
+  }
+}
+
+// Measures how many events per second N processes record and clear, each for
+// its own product, with locks for their product's stripe and for the whole
+// store. Only the JSON store locks stripes separately. Run with
+// --gtest_also_run_disabled_tests.
+TEST_F(RlzValueStoreLockTest, DISABLED_BenchmarkStripes) {
+  if (!SupplementaryBranding::GetBrand().empty())
+    return;
+
+  const int kProcesses[] = { 1, 2, 4, 8 };
+  const Product kProducts[] = {
+    IE_TOOLBAR, TOOLBAR_NOTIFIER, PACK, DESKTOP, CHROME, FF_TOOLBAR, QSB_WIN,
+    WEBAPPS,
+  };
+  const int kRunMs = 2000;
+
+  EXPECT_TRUE(SetAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+
+  printf("processes     whole/s   striped/s\n");
+  for (size_t p = 0; p < arraysize(kProcesses); ++p) {
+    double rates[2];
+    for (int striped = 0; striped < 2; ++striped) {
+      // Each child writes the number of scopes it completed to the pipe.
+      int results[2];
+      ASSERT_EQ(0, pipe(results));
+      base::TimeTicks end =
+          base::TimeTicks::Now() + base::TimeDelta::FromMilliseconds(kRunMs);
+
+      std::vector<pid_t> pids;
+      for (int i = 0; i < kProcesses[p]; ++i) {
+        Product product = kProducts[i % arraysize(kProducts)];
+        StoreStripes stripes = striped ?
+            StoreStripes::ForProduct(product) : StoreStripes();
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0) {
+          int count = 0;
+          while (base::TimeTicks::Now() < end) {
+            ScopedRlzValueStoreLock lock(RlzValueStore::kWriteAccess,
+                                         stripes);
+            RlzValueStore* store = lock.GetStore();
+            if (store && store->AddProductEvent(product, "I7S") &&
+                store->ClearProductEvent(product, "I7S") && lock.Commit()) {
+              ++count;
+            }
+          }
+          _exit(write(results[1], &count, sizeof(count)) == sizeof(count) ?
+                0 : 1);
+        }
+        pids.push_back(pid);
+      }
+
+      int scopes = 0;
+      for (size_t i = 0; i < pids.size(); ++i) {
+        EXPECT_TRUE(WaitForChild(pids[i]));
+        int count = 0;
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(count)),
+                  read(results[0], &count, sizeof(count)));
+        scopes += count;
+      }
+      close(results[0]);
+      close(results[1]);
+      rates[striped] = scopes * 1000.0 / kRunMs;
+    }
+    printf("%9d %11.0f %11.0f\n", kProcesses[p], rates[0], rates[1]);
+  }
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,783 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+
+#include "base/atomicops.h"
+#include "base/eintr_wrapper.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/memory/linked_ptr.h"
+#include "base/synchronization/lock.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/crc32.h"
+#include "rlz/lib/event_bitmap.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+namespace mmap_store {
+
+// The layout below is written to disk. Bump kStoreVersion when changing it.
+// Files with a different version are reinitialized, which drops their data.
+const uint32 kStoreMagic = 0x4d5a4c52;  // "RLZM"
+const uint32 kStoreVersion = 2;
+
+// The number of slots reserved for each enum. These leave room for new enum
+// values, so that adding one doesn't change the layout.
+const int kAccessPointSlots = 128;
+const int kProductSlots = 32;
+
+COMPILE_ASSERT(LAST_ACCESS_POINT <= kAccessPointSlots,
+               too_many_access_points_for_store_layout);
+
+struct StoreHeader {
+  uint32 magic;
+  uint32 version;
+  uint32 size;
+  // A seqlock for readers that don't hold the ScopedRlzValueStoreLock, see
+  // ScopedSequenceWrite.
+  base::subtle::Atomic32 sequence;
+};
+
+// In all slots, |crc| is the CRC-32 of all members before it.
+struct RlzSlot {
+  char rlz[kMaxRlzLength + 1];
+  char padding[3];
+  uint32 crc;
+};
+
+struct PingTimeSlot {
+  int64 time;
+  uint32 valid;
+  uint32 crc;
+};
+
+struct EventsSlot {
+  EventBitmap events;
+  uint32 crc;
+};
+
+struct ProductSlots {
+  PingTimeSlot ping_time;
+  EventsSlot product_events;
+  EventsSlot stateful_events;
+};
+
+struct StoreLayout {
+  StoreHeader header;
+  RlzSlot rlzs[kAccessPointSlots];
+  // Indexed by Product. Slot 0 is unused, products start at 1.
+  ProductSlots products[kProductSlots];
+};
+
+}  // namespace mmap_store
+
+using mmap_store::EventsSlot;
+using mmap_store::PingTimeSlot;
+using mmap_store::RlzSlot;
+using mmap_store::StoreHeader;
+using mmap_store::StoreLayout;
+
+namespace {
+
+// Writers hold the ScopedRlzValueStoreLock, so there is only ever one. It makes
+// the sequence odd while it changes slots and increments it again after, so
+// a reader that saw the same even sequence before and after copying a slot
+// knows that the copy isn't torn.
+class ScopedSequenceWrite {
+ public:
+  explicit ScopedSequenceWrite(StoreLayout* layout) : layout_(layout) {
+    // The sequence is odd already if a writer crashed in the middle of a
+    // write. Move it on anyway, so that readers that copied a slot since
+    // retry.
+    base::subtle::NoBarrier_Store(
+        &layout_->header.sequence, (layout_->header.sequence + 1) | 1);
+    base::subtle::MemoryBarrier();
+  }
+
+  ~ScopedSequenceWrite() {
+    base::subtle::Release_Store(&layout_->header.sequence,
+                                layout_->header.sequence + 1);
+  }
+
+ private:
+  StoreLayout* layout_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedSequenceWrite);
+};
+
+template <class Slot>
+uint32 SlotCrc(const Slot& slot) {
+  return static_cast<uint32>(Crc32(
+      reinterpret_cast<const unsigned char*>(&slot), offsetof(Slot, crc)));
+}
+
+// Returns true if the checksum of |slot| matches its contents. Logs corrupted
+// slots, which are then treated as empty by the callers.
+template <class Slot>
+bool IsSlotValid(const Slot& slot) {
+  if (slot.crc == SlotCrc(slot))
+    return true;
+  LOG(ERROR) << "Ignoring rlz store slot with bad checksum";
+  return false;
+}
+
+// Updates the checksum of |slot| after it was modified.
+template <class Slot>
+void SealSlot(Slot* slot) {
+  slot->crc = SlotCrc(*slot);
+}
+
+// Resets |slot| to an empty, valid slot.
+template <class Slot>
+void ClearSlot(Slot* slot) {
+  memset(slot, 0, sizeof(*slot));
+  SealSlot(slot);
+}
+
+void InitializeLayout(StoreLayout* layout) {
+  // Readers might have the file mapped already, keep the sequence.
+  ScopedSequenceWrite write(layout);
+  memset(&layout->rlzs, 0, sizeof(*layout) - offsetof(StoreLayout, rlzs));
+  for (int i = 0; i < mmap_store::kAccessPointSlots; ++i)
+    SealSlot(&layout->rlzs[i]);
+  for (int i = 0; i < mmap_store::kProductSlots; ++i) {
+    SealSlot(&layout->products[i].ping_time);
+    SealSlot(&layout->products[i].product_events);
+    SealSlot(&layout->products[i].stateful_events);
+  }
+
+  layout->header.magic = mmap_store::kStoreMagic;
+  layout->header.version = mmap_store::kStoreVersion;
+  layout->header.size = sizeof(*layout);
+}
+
+bool IsHeaderValid(const StoreHeader& header) {
+  return header.magic == mmap_store::kStoreMagic &&
+         header.version == mmap_store::kStoreVersion &&
+         header.size == sizeof(StoreLayout);
+}
+
+// Returns true if the file at |path| has the size and header of a store, so
+// that mapping it doesn't initialize it.
+bool IsFileInitialized(const FilePath& path) {
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+  if (fd == -1)
+    return false;
+
+  struct stat info;
+  StoreHeader header;
+  bool result =
+      fstat(fd, &info) == 0 &&
+      info.st_size >= static_cast<off_t>(sizeof(StoreLayout)) &&
+      HANDLE_EINTR(pread(fd, &header, sizeof(header), 0)) ==
+          static_cast<ssize_t>(sizeof(header)) &&
+      IsHeaderValid(header);
+  ignore_result(HANDLE_EINTR(close(fd)));
+  return result;
+}
+
+bool IsProductInRange(Product product) {
+  if (product > 0 && product < mmap_store::kProductSlots)
+    return true;
+  ASSERT_STRING("RlzValueStoreMmap: Product out of range");
+  return false;
+}
+
+// A store file mapped into memory.
+class MappedStoreFile {
+ public:
+  MappedStoreFile()
+      : fd_(-1), layout_(NULL), writable_(false), device_(0), inode_(0) {}
+  ~MappedStoreFile() { Unmap(); }
+
+  // Opens and maps |path|, creating and initializing it if needed. Falls back
+  // to a read-only mapping if the file isn't writable. With |for_reading|,
+  // maps the file read-only and fails if it doesn't exist yet, for readers
+  // that don't hold the lock.
+  bool Map(const FilePath& path, bool for_reading);
+
+  // Returns true if |path| doesn't refer to the mapped file anymore, for
+  // example because another process deleted it, or if the file was truncated
+  // and the mapping can't be accessed anymore.
+  bool IsStale(const FilePath& path) const;
+
+  StoreLayout* layout() { return layout_; }
+  bool writable() const { return writable_; }
+
+  // Schedules write-back of the mapping.
+  bool Sync();
+
+  void Unmap();
+
+ private:
+
+  int fd_;
+  StoreLayout* layout_;
+  bool writable_;
+  dev_t device_;
+  ino_t inode_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedStoreFile);
+};
+
+bool MappedStoreFile::Map(const FilePath& path, bool for_reading) {
+  Unmap();
+
+  writable_ = !for_reading;
+  if (writable_)
+    fd_ = HANDLE_EINTR(open(path.value().c_str(), O_RDWR | O_CREAT, 0666));
+  if (fd_ == -1) {
+    writable_ = false;
+    fd_ = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+    if (fd_ == -1)
+      return false;
+  }
+
+  struct stat info;
+  if (fstat(fd_, &info) != 0) {
+    Unmap();
+    return false;
+  }
+  device_ = info.st_dev;
+  inode_ = info.st_ino;
+
+  bool needs_init = info.st_size < static_cast<off_t>(sizeof(StoreLayout));
+  if (needs_init &&
+      (!writable_ || HANDLE_EINTR(ftruncate(fd_, sizeof(StoreLayout))) != 0)) {
+    Unmap();
+    return false;
+  }
+
+  void* memory = mmap(NULL, sizeof(StoreLayout),
+                      writable_ ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd_, 0);
+  if (memory == MAP_FAILED) {
+    Unmap();
+    return false;
+  }
+  layout_ = static_cast<StoreLayout*>(memory);
+
+  // This runs with the cross-process lock held, so nobody else is using the
+  // file while it is initialized.
+  if (needs_init || !IsHeaderValid(layout_->header)) {
+    if (!writable_) {
+      Unmap();
+      return false;
+    }
+    if (!needs_init)
+      LOG(ERROR) << "Reinitializing rlz store " << path.value();
+    InitializeLayout(layout_);
+  }
+  return true;
+}
+
+bool MappedStoreFile::IsStale(const FilePath& path) const {
+  struct stat info;
+  return stat(path.value().c_str(), &info) != 0 ||
+         info.st_dev != device_ || info.st_ino != inode_ ||
+         info.st_size < static_cast<off_t>(sizeof(StoreLayout));
+}
+
+bool MappedStoreFile::Sync() {
+  // The page cache is shared, so other processes see the writes already. Like
+  // the JSON store, which doesn't fsync() either, only start the write-back.
+  return !layout_ || msync(layout_, sizeof(StoreLayout), MS_ASYNC) == 0;
+}
+
+void MappedStoreFile::Unmap() {
+  if (layout_) {
+    munmap(layout_, sizeof(StoreLayout));
+    layout_ = NULL;
+  }
+  if (fd_ != -1) {
+    ignore_result(HANDLE_EINTR(close(fd_)));
+    fd_ = -1;
+  }
+}
+
+// All mapped files, by path. Only accessed with the ScopedRlzValueStoreLock
+// held, which also serializes the threads of this process.
+typedef std::map<std::string, linked_ptr<MappedStoreFile> > MappedFileMap;
+base::LazyInstance<MappedFileMap>::Leaky g_mapped_files =
+    LAZY_INSTANCE_INITIALIZER;
+
+// Incremented by UnmapAll(), so that store objects drop their cached mapping.
+int g_unmap_generation = 0;
+
+// The read-only mapping of the default brand's file used by
+// ReadAccessPointRlzWithoutLock(). It is separate from |g_mapped_files|,
+// which is only accessed with the ScopedRlzValueStoreLock held.
+struct ReaderMapping {
+  base::Lock lock;
+  MappedStoreFile file;
+};
+base::LazyInstance<ReaderMapping>::Leaky g_reader_mapping =
+    LAZY_INSTANCE_INITIALIZER;
+
+// How often a reader without the lock retries when its copy of a slot is torn.
+// A write changes one slot and is over quickly, so this is only reached if a
+// writer crashed or keeps writing; the caller then waits for the lock.
+const int kMaxReadAttempts = 100;
+
+}  // namespace
+
+RlzValueStoreMmap::RlzValueStoreMmap(const FilePath& store_path)
+    : store_path_(store_path),
+      layout_(NULL),
+      layout_writable_(false),
+      layout_generation_(g_unmap_generation),
+      dirty_(false) {
+}
+
+RlzValueStoreMmap::~RlzValueStoreMmap() {
+}
+
+bool RlzValueStoreMmap::HasAccess(AccessType type) {
+  // Make sure the file exists.
+  if (!Layout())
+    return false;
+
+  switch (type) {
+    case kReadAccess:
+      return access(BrandStorePath().value().c_str(), R_OK) == 0;
+    case kWriteAccess:
+      return layout_writable_ &&
+             access(BrandStorePath().value().c_str(), W_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreMmap::WritePingTime(Product product, int64 time) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product))
+    return false;
+
+  ScopedSequenceWrite write(layout);
+  PingTimeSlot* slot = &layout->products[product].ping_time;
+  slot->time = time;
+  slot->valid = 1;
+  SealSlot(slot);
+  dirty_ = true;
+  return true;
+}
+
+bool RlzValueStoreMmap::ReadPingTime(Product product, int64* time) {
+  StoreLayout* layout = Layout();
+  if (!layout || !IsProductInRange(product))
+    return false;
+
+  const PingTimeSlot& slot = layout->products[product].ping_time;
+  if (!IsSlotValid(slot) || !slot.valid)
+    return false;
+  *time = slot.time;
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearPingTime(Product product) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product))
+    return false;
+
+  ScopedSequenceWrite write(layout);
+  ClearSlot(&layout->products[product].ping_time);
+  dirty_ = true;
+  return true;
+}
+
+bool RlzValueStoreMmap::WriteAccessPointRlz(AccessPoint access_point,
+                                            const char* new_rlz) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || access_point <= NO_ACCESS_POINT ||
+      access_point >= LAST_ACCESS_POINT) {
+    return false;
+  }
+
+  if (strlen(new_rlz) > static_cast<size_t>(kMaxRlzLength)) {
+    ASSERT_STRING("WriteAccessPointRlz: RLZ too long for the store");
+    return false;
+  }
+
+  ScopedSequenceWrite write(layout);
+  RlzSlot* slot = &layout->rlzs[access_point];
+  memset(slot, 0, sizeof(*slot));
+  strncpy(slot->rlz, new_rlz, kMaxRlzLength);
+  SealSlot(slot);
+  dirty_ = true;
+  return true;
+}
+
+bool RlzValueStoreMmap::ReadAccessPointRlz(AccessPoint access_point,
+                                           char* rlz,
+                                           size_t rlz_size) {
+  StoreLayout* layout = Layout();
+  if (!layout || access_point <= NO_ACCESS_POINT ||
+      access_point >= LAST_ACCESS_POINT) {
+    return false;
+  }
+
+  // Reading a non-existent access point counts as success.
+  const RlzSlot& slot = layout->rlzs[access_point];
+  if (!IsSlotValid(slot) || !slot.rlz[0]) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  size_t length = strnlen(slot.rlz, kMaxRlzLength);
+  if (length >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  memcpy(rlz, slot.rlz, length);
+  rlz[length] = '\0';
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearAccessPointRlz(AccessPoint access_point) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || access_point <= NO_ACCESS_POINT ||
+      access_point >= LAST_ACCESS_POINT) {
+    return false;
+  }
+
+  ScopedSequenceWrite write(layout);
+  ClearSlot(&layout->rlzs[access_point]);
+  dirty_ = true;
+  return true;
+}
+
+bool RlzValueStoreMmap::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  StoreLayout* layout = Layout();
+  if (!layout)
+    return false;
+
+  for (int i = NO_ACCESS_POINT + 1; i < LAST_ACCESS_POINT; ++i) {
+    const RlzSlot& slot = layout->rlzs[i];
+    if (!IsSlotValid(slot) || !slot.rlz[0])
+      continue;
+    char rlz[kMaxRlzLength + 1];
+    size_t length = strnlen(slot.rlz, kMaxRlzLength);
+    memcpy(rlz, slot.rlz, length);
+    rlz[length] = '\0';
+    visitor->Visit(static_cast<AccessPoint>(i), rlz);
+  }
+  return true;
+}
+
+bool RlzValueStoreMmap::AddProductEvent(Product product,
+                                        const char* event_rlz) {
+  AccessPoint point;
+  Event event;
+  return ParseEventRlz(event_rlz, &point, &event) &&
+         AddProductEventById(product, point, event);
+}
+
+bool RlzValueStoreMmap::ReadProductEvents(Product product,
+                                          std::vector<std::string>* events) {
+  StoreLayout* layout = Layout();
+  if (!layout || !IsProductInRange(product))
+    return false;
+
+  const EventsSlot& slot = layout->products[product].product_events;
+  if (IsSlotValid(slot))
+    slot.events.AppendEventRlzs(events);
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearProductEvent(Product product,
+                                          const char* event_rlz) {
+  AccessPoint point;
+  Event event;
+  return ParseEventRlz(event_rlz, &point, &event) &&
+         ClearProductEventById(product, point, event);
+}
+
+bool RlzValueStoreMmap::ClearAllProductEvents(Product product) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product))
+    return false;
+
+  ScopedSequenceWrite write(layout);
+  ClearSlot(&layout->products[product].product_events);
+  dirty_ = true;
+  return true;
+}
+
+bool RlzValueStoreMmap::AddStatefulEvent(Product product,
+                                         const char* event_rlz) {
+  AccessPoint point;
+  Event event;
+  return ParseEventRlz(event_rlz, &point, &event) &&
+         AddStatefulEventById(product, point, event);
+}
+
+bool RlzValueStoreMmap::IsStatefulEvent(Product product,
+                                        const char* event_rlz) {
+  AccessPoint point;
+  Event event;
+  return ParseEventRlz(event_rlz, &point, &event) &&
+         IsStatefulEventById(product, point, event);
+}
+
+bool RlzValueStoreMmap::ClearAllStatefulEvents(Product product) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product))
+    return false;
+
+  ScopedSequenceWrite write(layout);
+  ClearSlot(&layout->products[product].stateful_events);
+  dirty_ = true;
+  return true;
+}
+
+bool RlzValueStoreMmap::AddProductEventById(Product product,
+                                            AccessPoint point,
+                                            Event event) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product) ||
+      !EventBitmap::IsValidEvent(point, event)) {
+    return false;
+  }
+
+  ScopedSequenceWrite write(layout);
+  EventsSlot* slot = &layout->products[product].product_events;
+  if (!IsSlotValid(*slot))
+    ClearSlot(slot);
+  if (!slot->events.Contains(point, event)) {
+    slot->events.Add(point, event);
+    SealSlot(slot);
+    dirty_ = true;
+  }
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearProductEventById(Product product,
+                                              AccessPoint point,
+                                              Event event) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product) ||
+      !EventBitmap::IsValidEvent(point, event)) {
+    return false;
+  }
+
+  ScopedSequenceWrite write(layout);
+  EventsSlot* slot = &layout->products[product].product_events;
+  if (!IsSlotValid(*slot)) {
+    ClearSlot(slot);
+    dirty_ = true;
+  } else if (slot->events.Contains(point, event)) {
+    slot->events.Remove(point, event);
+    SealSlot(slot);
+    dirty_ = true;
+  }
+  return true;
+}
+
+bool RlzValueStoreMmap::AddStatefulEventById(Product product,
+                                             AccessPoint point,
+                                             Event event) {
+  StoreLayout* layout = WritableLayout();
+  if (!layout || !IsProductInRange(product) ||
+      !EventBitmap::IsValidEvent(point, event)) {
+    return false;
+  }
+
+  ScopedSequenceWrite write(layout);
+  EventsSlot* slot = &layout->products[product].stateful_events;
+  if (!IsSlotValid(*slot))
+    ClearSlot(slot);
+  if (!slot->events.Contains(point, event)) {
+    slot->events.Add(point, event);
+    SealSlot(slot);
+    dirty_ = true;
+  }
+  return true;
+}
+
+bool RlzValueStoreMmap::IsStatefulEventById(Product product,
+                                            AccessPoint point,
+                                            Event event) {
+  StoreLayout* layout = Layout();
+  if (!layout || !IsProductInRange(product) ||
+      !EventBitmap::IsValidEvent(point, event)) {
+    return false;
+  }
+
+  const EventsSlot& slot = layout->products[product].stateful_events;
+  return IsSlotValid(slot) && slot.events.Contains(point, event);
+}
+
+void RlzValueStoreMmap::CollectGarbage() {
+  // There are no empty containers to remove in a fixed layout. Instead, reset
+  // slots with bad checksums, so that they stop being reported as corrupt.
+  StoreLayout* layout = WritableLayout();
+  if (!layout)
+    return;
+
+  ScopedSequenceWrite write(layout);
+  for (int i = 0; i < mmap_store::kAccessPointSlots; ++i) {
+    if (layout->rlzs[i].crc != SlotCrc(layout->rlzs[i]))
+      ClearSlot(&layout->rlzs[i]);
+  }
+  for (int i = 0; i < mmap_store::kProductSlots; ++i) {
+    mmap_store::ProductSlots* product = &layout->products[i];
+    if (product->ping_time.crc != SlotCrc(product->ping_time))
+      ClearSlot(&product->ping_time);
+    if (product->product_events.crc != SlotCrc(product->product_events))
+      ClearSlot(&product->product_events);
+    if (product->stateful_events.crc != SlotCrc(product->stateful_events))
+      ClearSlot(&product->stateful_events);
+  }
+  dirty_ = true;
+}
+
+bool RlzValueStoreMmap::is_valid() {
+  return Layout() != NULL;
+}
+
+bool RlzValueStoreMmap::WriteStoreIfDirty() {
+  if (!dirty_)
+    return true;
+
+  bool result = true;
+  MappedFileMap& files = g_mapped_files.Get();
+  for (MappedFileMap::iterator i = files.begin(); i != files.end(); ++i)
+    result &= i->second->Sync();
+
+  dirty_ = false;
+  return result;
+}
+
+// static
+bool RlzValueStoreMmap::ReadAccessPointRlzWithoutLock(
+    const FilePath& store_path,
+    AccessPoint access_point,
+    char* rlz,
+    size_t rlz_size) {
+  if (access_point <= NO_ACCESS_POINT || access_point >= LAST_ACCESS_POINT ||
+      rlz_size == 0) {
+    return false;
+  }
+
+  ReaderMapping& reader = g_reader_mapping.Get();
+  base::AutoLock lock(reader.lock);
+  if (!reader.file.layout() || reader.file.IsStale(store_path)) {
+    if (!reader.file.Map(store_path, true))
+      return false;
+  }
+
+  const StoreLayout* layout = reader.file.layout();
+  volatile const base::subtle::Atomic32* sequence = &layout->header.sequence;
+  for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+    base::subtle::Atomic32 begin = base::subtle::Acquire_Load(sequence);
+    if (begin & 1) {
+      sched_yield();
+      continue;
+    }
+
+    RlzSlot slot;
+    memcpy(&slot, &layout->rlzs[access_point], sizeof(slot));
+    bool header_valid = IsHeaderValid(layout->header);
+    base::subtle::MemoryBarrier();
+    if (base::subtle::NoBarrier_Load(sequence) != begin)
+      continue;
+
+    // A slot that is corrupt on disk is left to the locked read, which
+    // reports it.
+    if (!header_valid || slot.crc != SlotCrc(slot))
+      return false;
+
+    size_t length = strnlen(slot.rlz, kMaxRlzLength);
+    if (length >= rlz_size)
+      return false;
+    memcpy(rlz, slot.rlz, length);
+    rlz[length] = '\0';
+    return true;
+  }
+  return false;
+}
+
+// static
+bool RlzValueStoreMmap::CanOpenForSharedReads(const FilePath& store_path) {
+  std::string brand(SupplementaryBranding::GetBrand());
+  return IsFileInitialized(store_path) &&
+         (brand.empty() ||
+          IsFileInitialized(store_path.InsertBeforeExtension("_" + brand)));
+}
+
+// static
+void RlzValueStoreMmap::UnmapAll() {
+  g_mapped_files.Get().clear();
+  ++g_unmap_generation;
+
+  ReaderMapping& reader = g_reader_mapping.Get();
+  base::AutoLock lock(reader.lock);
+  reader.file.Unmap();
+}
+
+FilePath RlzValueStoreMmap::BrandStorePath() const {
+  std::string brand(SupplementaryBranding::GetBrand());
+  if (brand.empty())
+    return store_path_;
+  return store_path_.InsertBeforeExtension("_" + brand);
+}
+
+void RlzValueStoreMmap::Revalidate() {
+  layout_ = NULL;
+}
+
+StoreLayout* RlzValueStoreMmap::Layout() {
+  const std::string& brand = SupplementaryBranding::GetBrand();
+  if (layout_ && brand == layout_brand_ &&
+      layout_generation_ == g_unmap_generation) {
+    return layout_;
+  }
+
+  FilePath path = BrandStorePath();
+  linked_ptr<MappedStoreFile>& file = g_mapped_files.Get()[path.value()];
+  if (!file.get() || !file->layout() || file->IsStale(path)) {
+    file.reset(new MappedStoreFile);
+    if (!file->Map(path, false)) {
+      file.reset();
+      layout_ = NULL;
+      return NULL;
+    }
+  }
+
+  layout_ = file->layout();
+  layout_brand_ = brand;
+  layout_generation_ = g_unmap_generation;
+  layout_writable_ = file->writable();
+
+  // This runs once per lock scope. An odd sequence means that a writer
+  // crashed in the middle of a write; readers without the lock would retry
+  // until the next write, so make it even again. A torn slot has a bad
+  // checksum and reads as empty.
+  if (layout_writable_ && (layout_->header.sequence & 1)) {
+    LOG(ERROR) << "Recovering from interrupted write to rlz store";
+    ScopedSequenceWrite write(layout_);
+  }
+  return layout_;
+}
+
+StoreLayout* RlzValueStoreMmap::WritableLayout() {
+  StoreLayout* layout = Layout();
+  return layout_writable_ ? layout : NULL;
+}
+
+}  // namespace rlz_lib
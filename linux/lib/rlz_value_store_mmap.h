@@ -0,0 +1,137 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_MMAP_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_MMAP_H_
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+namespace mmap_store {
+struct StoreLayout;
+}  // namespace mmap_store
+
+// An implementation of RlzValueStore for linux that keeps all values in
+// fixed-size slots of a binary file, which is mapped into memory with
+// MAP_SHARED. Slots are indexed directly by the AccessPoint and Product enums,
+// and events are kept as an EventBitmap per product, so reads and writes are an
+// offset computation and a copy or a bit operation, without parsing or
+// allocation. Every slot carries a CRC-32 that is checked on read;
+// a slot with a bad checksum reads as empty. RLZs can also be read without the
+// lock, see ReadAccessPointRlzWithoutLock().
+//
+// Mappings are kept for the lifetime of the process, so creating a store at
+// every outermost ScopedRlzValueStoreLock is cheap. Data for supplementary
+// brands lives in separate files next to the default one.
+class RlzValueStoreMmap : public RlzValueStore {
+ public:
+  // |store_path| is the path of the file for the default brand.
+  explicit RlzValueStoreMmap(const FilePath& store_path);
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual bool AddProductEventById(Product product, AccessPoint point,
+                                   Event event) OVERRIDE;
+  virtual bool ClearProductEventById(Product product, AccessPoint point,
+                                     Event event) OVERRIDE;
+  virtual bool AddStatefulEventById(Product product, AccessPoint point,
+                                    Event event) OVERRIDE;
+  virtual bool IsStatefulEventById(Product product, AccessPoint point,
+                                   Event event) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Returns true if the file for the default brand could be mapped.
+  bool is_valid();
+
+  // Syncs modified mappings to disk. Other processes see writes as soon as
+  // they are made, this only matters for durability.
+  bool WriteStoreIfDirty();
+
+  // Prepares this object for another lock scope: the next call checks again
+  // that the mapped file wasn't replaced. Other writes are seen anyway.
+  void Revalidate();
+
+  // Reads the RLZ of |access_point| from the file at |store_path| without the
+  // ScopedRlzValueStoreLock. Writers change a slot while readers copy it, so
+  // the copy is checked against the sequence number in the file header and
+  // retried if it is torn. Returns false if the file can't be mapped, the
+  // slot is corrupt, the RLZ doesn't fit into |rlz|, or no consistent copy
+  // could be made; callers then read it with the lock.
+  static bool ReadAccessPointRlzWithoutLock(const FilePath& store_path,
+                                            AccessPoint access_point,
+                                            char* rlz,
+                                            size_t rlz_size);
+
+  // Returns true if the files at |store_path| for the default and the current
+  // supplementary brand are initialized, so that a store object only reads
+  // them until it is written to.
+  static bool CanOpenForSharedReads(const FilePath& store_path);
+
+  // Unmaps all files mapped by any RlzValueStoreMmap, for tests. Existing
+  // store objects map their files again on next use.
+  static void UnmapAll();
+
+ private:
+  virtual ~RlzValueStoreMmap();
+  friend class ScopedRlzValueStoreLock;
+
+  // Returns the path of the file for the current supplementary brand.
+  FilePath BrandStorePath() const;
+
+  // Returns the mapped store for the current supplementary brand, mapping it
+  // first if needed. Returns NULL if the file can't be mapped.
+  mmap_store::StoreLayout* Layout();
+
+  // Like Layout(), but returns NULL if the file is mapped read-only.
+  mmap_store::StoreLayout* WritableLayout();
+
+  FilePath store_path_;
+
+  // The mapping returned by Layout(), for the brand |layout_brand_|. Checking
+  // the mapping is done once per store object, later calls for the same brand
+  // just return it unless UnmapAll() was called since.
+  mmap_store::StoreLayout* layout_;
+  std::string layout_brand_;
+  bool layout_writable_;
+  int layout_generation_;
+
+  // Set by every mutating method, cleared when the store is synced.
+  bool dirty_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreMmap);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_MMAP_H_
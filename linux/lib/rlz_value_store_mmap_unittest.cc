@@ -0,0 +1,238 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for the memory-mapped linux rlz store, through the public rlz_lib API.
+
+#include "rlz/lib/rlz_value_store.h"
+
+#if defined(RLZ_STORE_IMPLEMENTATION_MMAP)
+
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store_cache.h"
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+// With a SupplementaryBranding on the stack, the store object was created
+// before the test changed the rlz directory, so the tests below only run in
+// the first pass, like ReadonlyRlzDirectoryTest.
+class RlzValueStoreMmapTest : public RlzLibTestNoMachineState {
+ protected:
+  FilePath StorePath(const char* name) {
+    return temp_dir_.path().Append(name);
+  }
+
+  // Overwrites the first occurrence of |text| in the file at |path| with
+  // garbage, without replacing the file, so that mappings see the change.
+  bool CorruptString(const FilePath& path, const std::string& text) {
+    std::string contents;
+    if (!file_util::ReadFileToString(path, &contents))
+      return false;
+    size_t offset = contents.find(text);
+    if (offset == std::string::npos)
+      return false;
+
+    FILE* file = fopen(path.value().c_str(), "r+b");
+    if (!file)
+      return false;
+    bool result = fseek(file, offset, SEEK_SET) == 0 && fputc('#', file) != EOF;
+    return fclose(file) == 0 && result;
+  }
+
+  // Reads and writes the sequence number in the header of the default
+  // store file.
+  bool ReadSequence(uint32* sequence) {
+    return AccessSequence(sequence, false);
+  }
+  bool WriteSequence(uint32 sequence) {
+    return AccessSequence(&sequence, true);
+  }
+
+ private:
+  bool AccessSequence(uint32* sequence, bool write) {
+    const long kSequenceOffset = 12;
+    FILE* file = fopen(StorePath("RlzStore.dat").value().c_str(), "r+b");
+    if (!file)
+      return false;
+    bool result = fseek(file, kSequenceOffset, SEEK_SET) == 0 &&
+        (write ? fwrite(sequence, sizeof(*sequence), 1, file) :
+                 fread(sequence, sizeof(*sequence), 1, file)) == 1;
+    return fclose(file) == 0 && result;
+  }
+};
+
+TEST_F(RlzValueStoreMmapTest, ValuesRoundTrip) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(file_util::PathExists(StorePath("RlzStore.dat")));
+
+  // Drop the mappings, so that the values are read back from the file.
+  rlz_lib::testing::SetRlzStoreDirectory(temp_dir_.path());
+
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+
+  char cgi_50[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S,W1I", cgi_50);
+
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=W1I", cgi_50);
+}
+
+TEST_F(RlzValueStoreMmapTest, CorruptSlotReadsAsEmpty) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "HpRlz"));
+  ASSERT_TRUE(CorruptString(StorePath("RlzStore.dat"), "IeTbRlz"));
+  // The corruption doesn't bump the store generation, so drop the values that
+  // this process cached.
+  rlz_lib::RlzValueStoreCache::Invalidate();
+
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("", rlz_50);
+
+  // Other slots are not affected.
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, rlz_50, 50));
+  EXPECT_STREQ("HpRlz", rlz_50);
+
+  // The slot can be written again.
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+}
+
+TEST_F(RlzValueStoreMmapTest, InvalidHeaderResetsStore) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  rlz_lib::testing::SetRlzStoreDirectory(temp_dir_.path());
+
+  const char kGarbage[] = "not an rlz store";
+  ASSERT_EQ(static_cast<int>(arraysize(kGarbage)),
+            file_util::WriteFile(StorePath("RlzStore.dat"), kGarbage,
+                                 arraysize(kGarbage)));
+
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("", rlz_50);
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+}
+
+TEST_F(RlzValueStoreMmapTest, SupplementaryBrandUsesSeparateFile) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+
+  {
+    rlz_lib::SupplementaryBranding branding("TEST");
+    EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           "BrandRlz"));
+    EXPECT_TRUE(file_util::PathExists(StorePath("RlzStore_TEST.dat")));
+  }
+
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+}
+
+TEST_F(RlzValueStoreMmapTest, ReadsWithoutLock) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  uint32 sequence = 1;
+  ASSERT_TRUE(ReadSequence(&sequence));
+  EXPECT_NE(0u, sequence);
+  EXPECT_EQ(0u, sequence % 2);
+
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::RlzValueStoreMmap::ReadAccessPointRlzWithoutLock(
+      StorePath("RlzStore.dat"), rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+
+  // RLZs that don't fit are left to the locked read, which reports the error.
+  char rlz_5[5];
+  EXPECT_FALSE(rlz_lib::RlzValueStoreMmap::ReadAccessPointRlzWithoutLock(
+      StorePath("RlzStore.dat"), rlz_lib::IETB_SEARCH_BOX, rlz_5, 5));
+
+  // A writer crashed in the middle of a write.
+  ASSERT_TRUE(WriteSequence(sequence + 1));
+  EXPECT_FALSE(rlz_lib::RlzValueStoreMmap::ReadAccessPointRlzWithoutLock(
+      StorePath("RlzStore.dat"), rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+
+  // The next lock scope recovers.
+  rlz_lib::RlzValueStoreCache::Invalidate();
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+  ASSERT_TRUE(ReadSequence(&sequence));
+  EXPECT_EQ(0u, sequence % 2);
+  EXPECT_TRUE(rlz_lib::RlzValueStoreMmap::ReadAccessPointRlzWithoutLock(
+      StorePath("RlzStore.dat"), rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+}
+
+TEST_F(RlzValueStoreMmapTest, ReadsDontWaitForOtherProcesses) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  rlz_lib::RlzValueStoreCache::Invalidate();
+
+  // Another process holds the lock until it is told to stop.
+  int locked[2], done[2];
+  ASSERT_EQ(0, pipe(locked));
+  ASSERT_EQ(0, pipe(done));
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    rlz_lib::ScopedRlzValueStoreLock lock;
+    char c = lock.GetStore() ? 'y' : 'n';
+    bool ok = write(locked[1], &c, 1) == 1 && read(done[0], &c, 1) == 1;
+    _exit(ok ? 0 : 1);
+  }
+
+  char c = 0;
+  ASSERT_EQ(1, read(locked[0], &c, 1));
+  EXPECT_EQ('y', c);
+
+  // Waiting for the lock would time out and fail.
+  char rlz_50[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+
+  EXPECT_EQ(1, write(done[1], &c, 1));
+  int status = 0;
+  EXPECT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  close(locked[0]);
+  close(locked[1]);
+  close(done[0]);
+  close(done[1]);
+}
+
+#endif  // defined(RLZ_STORE_IMPLEMENTATION_MMAP)
@@ -0,0 +1,514 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_sqlite.h"
+
+#include <unistd.h>
+
+#include <map>
+
+#include "base/file_util.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/stringprintf.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "third_party/sqlite/sqlite3.h"
+
+namespace rlz_lib {
+
+namespace sqlite_store {
+
+// The schema is written to disk. Bump kSchemaVersion and add a migration to
+// Database::Open() when changing it.
+const int kSchemaVersion = 1;
+
+const char kCreateSchema[] =
+    "CREATE TABLE IF NOT EXISTS access_point_rlzs ("
+    "  brand TEXT NOT NULL,"
+    "  access_point INTEGER NOT NULL,"
+    "  rlz TEXT NOT NULL,"
+    "  PRIMARY KEY (brand, access_point));"
+    "CREATE TABLE IF NOT EXISTS ping_times ("
+    "  brand TEXT NOT NULL,"
+    "  product INTEGER NOT NULL,"
+    "  time INTEGER NOT NULL,"
+    "  PRIMARY KEY (brand, product));"
+    "CREATE TABLE IF NOT EXISTS product_events ("
+    "  brand TEXT NOT NULL,"
+    "  product INTEGER NOT NULL,"
+    "  event TEXT NOT NULL,"
+    "  PRIMARY KEY (brand, product, event));"
+    "CREATE TABLE IF NOT EXISTS stateful_events ("
+    "  brand TEXT NOT NULL,"
+    "  product INTEGER NOT NULL,"
+    "  event TEXT NOT NULL,"
+    "  PRIMARY KEY (brand, product, event));";
+
+// A database connection with its prepared statements.
+class Database {
+ public:
+  // The statements used by RlzValueStoreSqlite, in the order of kStatements.
+  enum StatementId {
+    kBegin,
+    kCommit,
+    kRollback,
+    kWritePingTime,
+    kReadPingTime,
+    kClearPingTime,
+    kWriteAccessPointRlz,
+    kReadAccessPointRlz,
+    kClearAccessPointRlz,
+    kReadAccessPointRlzs,
+    kAddProductEvent,
+    kReadProductEvents,
+    kClearProductEvent,
+    kClearAllProductEvents,
+    kAddStatefulEvent,
+    kIsStatefulEvent,
+    kClearAllStatefulEvents,
+    kIncrementalVacuum,
+    kStatementCount,
+  };
+
+  Database();
+  ~Database();
+
+  // Opens the database at |path| and creates the schema if needed.
+  bool Open(const FilePath& path);
+
+  // Returns the statement |id|, preparing it on first use. Returns NULL if
+  // preparing failed.
+  sqlite3_stmt* GetStatement(StatementId id);
+
+ private:
+  bool Execute(const char* sql);
+
+  sqlite3* db_;
+  sqlite3_stmt* statements_[kStatementCount];
+
+  DISALLOW_COPY_AND_ASSIGN(Database);
+};
+
+// Statements that access data bind the current supplementary brand as ?1.
+const char* const kStatements[] = {
+  // kBegin. Takes the write lock right away, so that a busy database fails
+  // the first write instead of the commit.
+  "BEGIN IMMEDIATE",
+  // kCommit
+  "COMMIT",
+  // kRollback
+  "ROLLBACK",
+  // kWritePingTime
+  "INSERT OR REPLACE INTO ping_times (brand, product, time) "
+  "VALUES (?1, ?2, ?3)",
+  // kReadPingTime
+  "SELECT time FROM ping_times WHERE brand = ?1 AND product = ?2",
+  // kClearPingTime
+  "DELETE FROM ping_times WHERE brand = ?1 AND product = ?2",
+  // kWriteAccessPointRlz
+  "INSERT OR REPLACE INTO access_point_rlzs (brand, access_point, rlz) "
+  "VALUES (?1, ?2, ?3)",
+  // kReadAccessPointRlz
+  "SELECT rlz FROM access_point_rlzs WHERE brand = ?1 AND access_point = ?2",
+  // kClearAccessPointRlz
+  "DELETE FROM access_point_rlzs WHERE brand = ?1 AND access_point = ?2",
+  // kReadAccessPointRlzs
+  "SELECT access_point, rlz FROM access_point_rlzs WHERE brand = ?1",
+  // kAddProductEvent
+  "INSERT OR IGNORE INTO product_events (brand, product, event) "
+  "VALUES (?1, ?2, ?3)",
+  // kReadProductEvents
+  "SELECT event FROM product_events WHERE brand = ?1 AND product = ?2 "
+  "ORDER BY event",
+  // kClearProductEvent
+  "DELETE FROM product_events WHERE brand = ?1 AND product = ?2 AND "
+  "event = ?3",
+  // kClearAllProductEvents
+  "DELETE FROM product_events WHERE brand = ?1 AND product = ?2",
+  // kAddStatefulEvent
+  "INSERT OR IGNORE INTO stateful_events (brand, product, event) "
+  "VALUES (?1, ?2, ?3)",
+  // kIsStatefulEvent
+  "SELECT 1 FROM stateful_events WHERE brand = ?1 AND product = ?2 AND "
+  "event = ?3",
+  // kClearAllStatefulEvents
+  "DELETE FROM stateful_events WHERE brand = ?1 AND product = ?2",
+  // kIncrementalVacuum
+  "PRAGMA incremental_vacuum",
+};
+
+COMPILE_ASSERT(arraysize(kStatements) == Database::kStatementCount,
+               statements_dont_match_statement_ids);
+
+Database::Database() : db_(NULL) {
+  memset(statements_, 0, sizeof(statements_));
+}
+
+Database::~Database() {
+  for (int i = 0; i < kStatementCount; ++i)
+    sqlite3_finalize(statements_[i]);
+  sqlite3_close(db_);
+}
+
+bool Database::Open(const FilePath& path) {
+  if (sqlite3_open_v2(path.value().c_str(), &db_,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                      NULL) != SQLITE_OK) {
+    LOG(ERROR) << "Can't open rlz store " << path.value() << ": "
+               << sqlite3_errmsg(db_);
+    return false;
+  }
+
+  // Wait as long as ScopedRlzValueStoreLock does for other writers.
+  sqlite3_busy_timeout(db_, 5000);
+
+  // auto_vacuum only takes effect if it's set before the tables are created.
+  // synchronous=NORMAL only syncs at checkpoints in WAL mode. Like the other
+  // linux stores, that can lose the last writes on power loss, but never
+  // corrupts the database.
+  return Execute("PRAGMA auto_vacuum = INCREMENTAL") &&
+         Execute("PRAGMA journal_mode = WAL") &&
+         Execute("PRAGMA synchronous = NORMAL") &&
+         Execute(kCreateSchema) &&
+         Execute(base::StringPrintf("PRAGMA user_version = %d",
+                                    kSchemaVersion).c_str());
+}
+
+sqlite3_stmt* Database::GetStatement(StatementId id) {
+  if (!statements_[id] &&
+      sqlite3_prepare_v2(db_, kStatements[id], -1, &statements_[id],
+                         NULL) != SQLITE_OK) {
+    LOG(ERROR) << "Can't prepare " << kStatements[id] << ": "
+               << sqlite3_errmsg(db_);
+    return NULL;
+  }
+  return statements_[id];
+}
+
+bool Database::Execute(const char* sql) {
+  if (sqlite3_exec(db_, sql, NULL, NULL, NULL) == SQLITE_OK)
+    return true;
+  LOG(ERROR) << "Can't execute " << sql << ": " << sqlite3_errmsg(db_);
+  return false;
+}
+
+}  // namespace sqlite_store
+
+using sqlite_store::Database;
+
+namespace {
+
+// Open database connections, by path. Only accessed with the
+// ScopedRlzValueStoreLock held, which also serializes the threads of this
+// process.
+typedef std::map<std::string, linked_ptr<Database> > DatabaseMap;
+base::LazyInstance<DatabaseMap>::Leaky g_databases = LAZY_INSTANCE_INITIALIZER;
+
+// Binds the current supplementary brand to a cached statement, if the
+// statement has parameters, and resets the statement when going out of scope,
+// so that it can be reused.
+class ScopedStatement {
+ public:
+  ScopedStatement(Database* database, Database::StatementId id)
+      : statement_(database->GetStatement(id)) {
+    if (statement_ && sqlite3_bind_parameter_count(statement_) > 0) {
+      const std::string& brand = SupplementaryBranding::GetBrand();
+      sqlite3_bind_text(statement_, 1, brand.data(), brand.size(),
+                        SQLITE_TRANSIENT);
+    }
+  }
+
+  ~ScopedStatement() {
+    if (statement_) {
+      sqlite3_reset(statement_);
+      sqlite3_clear_bindings(statement_);
+    }
+  }
+
+  bool is_valid() const { return statement_ != NULL; }
+
+  void BindInt(int index, int value) {
+    sqlite3_bind_int(statement_, index, value);
+  }
+  void BindInt64(int index, int64 value) {
+    sqlite3_bind_int64(statement_, index, value);
+  }
+  void BindText(int index, const char* value) {
+    sqlite3_bind_text(statement_, index, value, -1, SQLITE_TRANSIENT);
+  }
+
+  // Returns true if the statement produced a row.
+  bool StepRow() { return sqlite3_step(statement_) == SQLITE_ROW; }
+
+  // Runs a statement that doesn't return rows. Returns true on success.
+  bool Run() {
+    int result = sqlite3_step(statement_);
+    if (result == SQLITE_DONE || result == SQLITE_ROW)
+      return true;
+    LOG(ERROR) << "rlz store statement failed: "
+               << sqlite3_errmsg(sqlite3_db_handle(statement_));
+    return false;
+  }
+
+  int64 ColumnInt64(int index) {
+    return sqlite3_column_int64(statement_, index);
+  }
+  std::string ColumnText(int index) {
+    const char* text = reinterpret_cast<const char*>(
+        sqlite3_column_text(statement_, index));
+    return text ? text : "";
+  }
+
+ private:
+  sqlite3_stmt* statement_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedStatement);
+};
+
+}  // namespace
+
+RlzValueStoreSqlite::RlzValueStoreSqlite(const FilePath& store_path)
+    : store_path_(store_path),
+      in_transaction_(false) {
+  linked_ptr<Database>& database = g_databases.Get()[store_path_.value()];
+  if (!database.get()) {
+    scoped_ptr<Database> new_database(new Database);
+    if (!new_database->Open(store_path_)) {
+      g_databases.Get().erase(store_path_.value());
+      return;
+    }
+    database.reset(new_database.release());
+  }
+  database_ = database;
+}
+
+RlzValueStoreSqlite::~RlzValueStoreSqlite() {
+  // ScopedRlzValueStoreLock always commits, this only catches failures.
+  if (in_transaction_)
+    ScopedStatement(database_.get(), Database::kRollback).Run();
+}
+
+bool RlzValueStoreSqlite::HasAccess(AccessType type) {
+  switch (type) {
+    case kReadAccess:  return access(store_path_.value().c_str(), R_OK) == 0;
+    case kWriteAccess: return access(store_path_.value().c_str(), W_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreSqlite::WritePingTime(Product product, int64 time) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kWritePingTime);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  statement.BindInt64(3, time);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::ReadPingTime(Product product, int64* time) {
+  ScopedStatement statement(database_.get(), Database::kReadPingTime);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  if (!statement.StepRow())
+    return false;
+  *time = statement.ColumnInt64(0);
+  return true;
+}
+
+bool RlzValueStoreSqlite::ClearPingTime(Product product) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kClearPingTime);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::WriteAccessPointRlz(AccessPoint access_point,
+                                              const char* new_rlz) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kWriteAccessPointRlz);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, access_point);
+  statement.BindText(3, new_rlz);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::ReadAccessPointRlz(AccessPoint access_point,
+                                             char* rlz,
+                                             size_t rlz_size) {
+  ScopedStatement statement(database_.get(), Database::kReadAccessPointRlz);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, access_point);
+
+  // Reading a non-existent access point counts as success.
+  if (!statement.StepRow()) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  std::string s(statement.ColumnText(0));
+  if (s.size() >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strncpy(rlz, s.c_str(), rlz_size);
+  return true;
+}
+
+bool RlzValueStoreSqlite::ClearAccessPointRlz(AccessPoint access_point) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kClearAccessPointRlz);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, access_point);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  ScopedStatement statement(database_.get(), Database::kReadAccessPointRlzs);
+  if (!statement.is_valid())
+    return false;
+  while (statement.StepRow()) {
+    int64 point = statement.ColumnInt64(0);
+    std::string rlz(statement.ColumnText(1));
+    if (point > NO_ACCESS_POINT && point < LAST_ACCESS_POINT && !rlz.empty())
+      visitor->Visit(static_cast<AccessPoint>(point), rlz.c_str());
+  }
+  return true;
+}
+
+bool RlzValueStoreSqlite::AddProductEvent(Product product,
+                                          const char* event_rlz) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kAddProductEvent);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  statement.BindText(3, event_rlz);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::ReadProductEvents(Product product,
+                                            std::vector<std::string>* events) {
+  ScopedStatement statement(database_.get(), Database::kReadProductEvents);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  while (statement.StepRow())
+    events->push_back(statement.ColumnText(0));
+  return true;
+}
+
+bool RlzValueStoreSqlite::ClearProductEvent(Product product,
+                                            const char* event_rlz) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kClearProductEvent);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  statement.BindText(3, event_rlz);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::ClearAllProductEvents(Product product) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(),
+                            Database::kClearAllProductEvents);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::AddStatefulEvent(Product product,
+                                           const char* event_rlz) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(), Database::kAddStatefulEvent);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  statement.BindText(3, event_rlz);
+  return statement.Run();
+}
+
+bool RlzValueStoreSqlite::IsStatefulEvent(Product product,
+                                          const char* event_rlz) {
+  ScopedStatement statement(database_.get(), Database::kIsStatefulEvent);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  statement.BindText(3, event_rlz);
+  return statement.StepRow();
+}
+
+bool RlzValueStoreSqlite::ClearAllStatefulEvents(Product product) {
+  if (!BeginWrite())
+    return false;
+  ScopedStatement statement(database_.get(),
+                            Database::kClearAllStatefulEvents);
+  if (!statement.is_valid())
+    return false;
+  statement.BindInt(2, product);
+  return statement.Run();
+}
+
+void RlzValueStoreSqlite::CollectGarbage() {
+  if (!BeginWrite())
+    return;
+
+  // Each step frees one page, run until all free pages are gone.
+  ScopedStatement statement(database_.get(), Database::kIncrementalVacuum);
+  if (statement.is_valid()) {
+    while (statement.StepRow()) {
+    }
+  }
+}
+
+bool RlzValueStoreSqlite::WriteStoreIfDirty() {
+  if (!in_transaction_)
+    return true;
+
+  in_transaction_ = false;
+  if (ScopedStatement(database_.get(), Database::kCommit).Run())
+    return true;
+  ScopedStatement(database_.get(), Database::kRollback).Run();
+  return false;
+}
+
+// static
+bool RlzValueStoreSqlite::CanOpenForSharedReads(const FilePath& store_path) {
+  return file_util::PathExists(store_path);
+}
+
+// static
+void RlzValueStoreSqlite::CloseAll() {
+  g_databases.Get().clear();
+}
+
+bool RlzValueStoreSqlite::BeginWrite() {
+  if (in_transaction_)
+    return true;
+
+  in_transaction_ = ScopedStatement(database_.get(), Database::kBegin).Run();
+  return in_transaction_;
+}
+
+}  // namespace rlz_lib
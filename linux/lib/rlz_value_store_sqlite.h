@@ -0,0 +1,104 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_SQLITE_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_SQLITE_H_
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "base/memory/linked_ptr.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+namespace sqlite_store {
+class Database;
+}  // namespace sqlite_store
+
+// An implementation of RlzValueStore for linux on top of SQLite. The database
+// runs in WAL mode, so a process reading the store never waits for a process
+// writing it, and the other way around. Each method runs one cached prepared
+// statement. All writes made while a ScopedRlzValueStoreLock is held are
+// committed in a single transaction when the outermost lock is released.
+//
+// Database connections are kept for the lifetime of the process, so creating
+// a store at every outermost ScopedRlzValueStoreLock is cheap. Data for
+// supplementary brands is kept in the same tables, keyed by brand.
+class RlzValueStoreSqlite : public RlzValueStore {
+ public:
+  // |store_path| is the path of the database file, which is created if it
+  // doesn't exist.
+  explicit RlzValueStoreSqlite(const FilePath& store_path);
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  // Returns the pages freed by the Clear*() calls to the file system with an
+  // incremental vacuum.
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Returns true if the database could be opened.
+  bool is_valid() const { return database_.get() != NULL; }
+
+  // Commits the writes made through this store. Returns false if the commit
+  // failed, in which case the writes are rolled back.
+  bool WriteStoreIfDirty();
+
+  // Prepares this object for another lock scope. Nothing is cached, every
+  // call reads the database.
+  void Revalidate() {}
+
+  // Returns true if the database at |store_path| exists. Opening an existing
+  // database only writes in SQLite transactions, which wait for each other.
+  static bool CanOpenForSharedReads(const FilePath& store_path);
+
+  // Closes all database connections, for tests. Existing store objects keep
+  // their connection until they are destroyed.
+  static void CloseAll();
+
+ private:
+  virtual ~RlzValueStoreSqlite();
+  friend class ScopedRlzValueStoreLock;
+
+  // Starts the write transaction if it isn't started yet. Returns false if
+  // the database is locked by another writer for too long.
+  bool BeginWrite();
+
+  FilePath store_path_;
+  linked_ptr<sqlite_store::Database> database_;
+
+  // Set while a write transaction is open.
+  bool in_transaction_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreSqlite);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_SQLITE_H_
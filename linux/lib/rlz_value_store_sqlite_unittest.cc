@@ -0,0 +1,162 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Tests for the SQLite linux rlz store. The store objects are created
+// directly, and a second connection to the database stands in for another
+// process.
+
+#include "rlz/linux/lib/rlz_value_store_sqlite.h"
+
+#include <string>
+#include <vector>
+
+#include "base/file_path.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/stringprintf.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/sqlite/sqlite3.h"
+
+namespace rlz_lib {
+
+class RlzValueStoreSqliteTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    RlzLibTestNoMachineState::SetUp();
+    other_process_db_ = NULL;
+  }
+
+  virtual void TearDown() OVERRIDE {
+    sqlite3_close(other_process_db_);
+    RlzValueStoreSqlite::CloseAll();
+    RlzLibTestNoMachineState::TearDown();
+  }
+
+  FilePath StorePath() {
+    return temp_dir_.path().Append("RlzStore.db");
+  }
+
+  // The stores' destructors are private, so they are owned through the
+  // RlzValueStore interface.
+  RlzValueStoreSqlite* OpenStore() {
+    RlzValueStoreSqlite* store = new RlzValueStoreSqlite(StorePath());
+    store_.reset(store);
+    return store;
+  }
+
+  // Runs |sql| on a separate connection, like another process would, and
+  // returns the first column of the first row, or "" if there is none.
+  std::string QueryFromOtherProcess(const std::string& sql) {
+    if (!other_process_db_) {
+      EXPECT_EQ(SQLITE_OK, sqlite3_open(StorePath().value().c_str(),
+                                        &other_process_db_));
+    }
+
+    sqlite3_stmt* statement = NULL;
+    EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(other_process_db_, sql.c_str(),
+                                            -1, &statement, NULL));
+    std::string result;
+    int step = sqlite3_step(statement);
+    EXPECT_TRUE(step == SQLITE_ROW || step == SQLITE_DONE) << step;
+    if (step == SQLITE_ROW) {
+      const unsigned char* text = sqlite3_column_text(statement, 0);
+      if (text)
+        result = reinterpret_cast<const char*>(text);
+    }
+    sqlite3_finalize(statement);
+    return result;
+  }
+
+  std::string ReadRlzFromOtherProcess(AccessPoint point) {
+    return QueryFromOtherProcess(base::StringPrintf(
+        "SELECT rlz FROM access_point_rlzs WHERE brand = '%s' AND "
+        "access_point = %d",
+        SupplementaryBranding::GetBrand().c_str(), point));
+  }
+
+  scoped_ptr<RlzValueStore> store_;
+  sqlite3* other_process_db_;
+};
+
+TEST_F(RlzValueStoreSqliteTest, ValuesRoundTrip) {
+  RlzValueStoreSqlite* store = OpenStore();
+  ASSERT_TRUE(store->is_valid());
+  EXPECT_TRUE(store->WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(store->WritePingTime(TOOLBAR_NOTIFIER, 1234));
+  EXPECT_TRUE(store->AddProductEvent(TOOLBAR_NOTIFIER, "W1I"));
+  EXPECT_TRUE(store->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(store->AddProductEvent(TOOLBAR_NOTIFIER, "I7S"));
+  EXPECT_TRUE(store->AddStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+
+  // Drop the connection, so that the values are read back from the file.
+  RlzValueStoreSqlite::CloseAll();
+  store = OpenStore();
+
+  char rlz_50[50];
+  EXPECT_TRUE(store->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("IeTbRlz", rlz_50);
+
+  int64 ping_time = 0;
+  EXPECT_TRUE(store->ReadPingTime(TOOLBAR_NOTIFIER, &ping_time));
+  EXPECT_EQ(1234, ping_time);
+
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(TOOLBAR_NOTIFIER, &events));
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ("I7S", events[0]);
+  EXPECT_EQ("W1I", events[1]);
+
+  EXPECT_TRUE(store->IsStatefulEvent(TOOLBAR_NOTIFIER, "I7F"));
+  EXPECT_FALSE(store->IsStatefulEvent(TOOLBAR_NOTIFIER, "I7S"));
+}
+
+TEST_F(RlzValueStoreSqliteTest, UsesWalMode) {
+  ASSERT_TRUE(OpenStore()->is_valid());
+  EXPECT_EQ("wal", QueryFromOtherProcess("PRAGMA journal_mode"));
+}
+
+TEST_F(RlzValueStoreSqliteTest, ReadersDontWaitForWriter) {
+  RlzValueStoreSqlite* store = OpenStore();
+  EXPECT_TRUE(store->WriteAccessPointRlz(IETB_SEARCH_BOX, "OldRlz"));
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+
+  // While the write transaction is open, other connections read the last
+  // committed value right away.
+  EXPECT_TRUE(store->WriteAccessPointRlz(IETB_SEARCH_BOX, "NewRlz"));
+  EXPECT_EQ("OldRlz", ReadRlzFromOtherProcess(IETB_SEARCH_BOX));
+
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+  EXPECT_EQ("NewRlz", ReadRlzFromOtherProcess(IETB_SEARCH_BOX));
+}
+
+TEST_F(RlzValueStoreSqliteTest, UncommittedWritesAreRolledBack) {
+  RlzValueStoreSqlite* store = OpenStore();
+  EXPECT_TRUE(store->WriteAccessPointRlz(IETB_SEARCH_BOX, "IeTbRlz"));
+  store_.reset();
+
+  store = OpenStore();
+  char rlz_50[50];
+  EXPECT_TRUE(store->ReadAccessPointRlz(IETB_SEARCH_BOX, rlz_50, 50));
+  EXPECT_STREQ("", rlz_50);
+}
+
+TEST_F(RlzValueStoreSqliteTest, CollectGarbageFreesPages) {
+  RlzValueStoreSqlite* store = OpenStore();
+  for (int i = 0; i < 2000; ++i) {
+    EXPECT_TRUE(store->AddProductEvent(TOOLBAR_NOTIFIER,
+                                       base::StringPrintf("%04d", i).c_str()));
+  }
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+  EXPECT_TRUE(store->ClearAllProductEvents(TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+  EXPECT_NE("0", QueryFromOtherProcess("PRAGMA freelist_count"));
+
+  store->CollectGarbage();
+  EXPECT_TRUE(store->WriteStoreIfDirty());
+  EXPECT_EQ("0", QueryFromOtherProcess("PRAGMA freelist_count"));
+}
+
+}  // namespace rlz_lib
@@ -15,6 +15,8 @@
 #import <Foundation/Foundation.h>
 #include <pthread.h>
 
+#include <algorithm>
+
 using base::mac::ObjCCast;
 
 namespace rlz_lib {
@@ -223,13 +225,19 @@ namespace {
 
 // This is a struct so that it doesn't need a static initializer.
 struct RecursiveCrossProcessLock {
-  // Tries to acquire a recursive cross-process lock. Note that this _always_
-  // acquires the in-process lock (if it wasn't already acquired). The parent
-  // directory of |lock_file| must exist.
-  bool TryGetCrossProcessLock(NSString* lock_filename);
-
-  // Releases the lock. Should always be called, even if
-  // TryGetCrossProcessLock() returns false.
+  // Tries to acquire a recursive cross-process lock, waiting for other
+  // threads and processes for |timeout_ms| milliseconds. A negative
+  // |timeout_ms| waits for other threads for as long as it takes, and for
+  // other processes for 5 seconds. Sets |locked| if this acquires the
+  // in-process lock (or already held it), which it does unless other threads
+  // held it until the timeout. Sets |busy| if other threads or processes held
+  // the lock until the timeout. The parent directory of |lock_file| must
+  // exist.
+  bool TryGetCrossProcessLock(NSString* lock_filename, int timeout_ms,
+                              bool* locked, bool* busy);
+
+  // Releases the lock. Should always be called if TryGetCrossProcessLock()
+  // set |locked|, even if it returns false.
   void ReleaseLock();
 
   pthread_mutex_t recursive_lock_;
@@ -244,14 +252,29 @@ struct RecursiveCrossProcessLock {
 };
 
 bool RecursiveCrossProcessLock::TryGetCrossProcessLock(
-    NSString* lock_filename) {
+    NSString* lock_filename, int timeout_ms, bool* locked, bool* busy) {
   bool just_got_lock = false;
+  *locked = true;
 
   // Emulate a recursive mutex with a non-recursive one.
   if (pthread_mutex_trylock(&recursive_lock_) == EBUSY) {
     if (pthread_equal(pthread_self(), locking_thread_) == 0) {
       // Some other thread has the lock, wait for it.
-      pthread_mutex_lock(&recursive_lock_);
+      if (timeout_ms < 0) {
+        pthread_mutex_lock(&recursive_lock_);
+      } else {
+        // There is no pthread_mutex_timedlock() on mac.
+        const int kSleepPerTryMS = 1;
+        while (pthread_mutex_trylock(&recursive_lock_) == EBUSY) {
+          if (timeout_ms <= 0) {
+            *locked = false;
+            *busy = true;
+            return false;
+          }
+          usleep(kSleepPerTryMS * 1000);
+          timeout_ms -= kSleepPerTryMS;
+        }
+      }
       CHECK(locking_thread_ == 0);
       just_got_lock = true;
     }
@@ -265,6 +288,7 @@ bool RecursiveCrossProcessLock::TryGetCrossProcessLock(
   if (just_got_lock) {
     const int kMaxTimeoutMS = 5000;  // Matches windows.
     const int kSleepPerTryMS = 200;
+    int max_timeout_ms = timeout_ms < 0 ? kMaxTimeoutMS : timeout_ms;
 
     CHECK(!file_lock_);
     file_lock_ = [[NSDistributedLock alloc] initWithPath:lock_filename];
@@ -272,12 +296,14 @@ bool RecursiveCrossProcessLock::TryGetCrossProcessLock(
     BOOL got_file_lock = NO;
     int elapsedMS = 0;
     while (!(got_file_lock = [file_lock_ tryLock]) &&
-           elapsedMS < kMaxTimeoutMS) {
-      usleep(kSleepPerTryMS * 1000);
-      elapsedMS += kSleepPerTryMS;
+           elapsedMS < max_timeout_ms) {
+      int sleep_ms = std::min(kSleepPerTryMS, max_timeout_ms - elapsedMS);
+      usleep(sleep_ms * 1000);
+      elapsedMS += sleep_ms;
     }
 
     if (!got_file_lock) {
+      *busy = true;
       [file_lock_ release];
       file_lock_ = nil;
       return false;
@@ -315,6 +341,13 @@ int g_lock_depth = 0;
 // This is the store object that might be shared. Only set if g_lock_depth > 0.
 RlzValueStoreMac* g_store_object = NULL;
 
+// The number of times the store was written to disk, for tests.
+int g_store_flush_count = 0;
+
+// The serialized store as Commit() last wrote it, so that the outermost lock
+// doesn't write it again if nothing changed since. Only set if g_lock_depth > 0.
+NSData* g_committed_store = nil;
+
 
 NSString* CreateRlzDirectory() {
   NSFileManager* manager = [NSFileManager defaultManager];
@@ -351,11 +384,65 @@ NSString* RlzLockFilename() {
   return [CreateRlzDirectory() stringByAppendingPathComponent:kRlzFile];
 }
 
+// Writes the store of the outermost lock to disk, unless it is unchanged since
+// Commit() wrote it.
+bool WriteStore(RlzValueStoreMac* store) {
+  NSDictionary* dict = store->dictionary();
+  NSData* data = [NSPropertyListSerialization
+      dataWithPropertyList:dict
+                    format:NSPropertyListBinaryFormat_v1_0
+                   options:0
+                     error:NULL];
+  if (data && [data isEqualToData:g_committed_store])
+    return true;
+
+  ++g_store_flush_count;
+  if (![dict writeToFile:RlzPlistFilename() atomically:YES])
+    return false;
+  [g_committed_store release];
+  g_committed_store = [data retain];
+  return true;
+}
+
 }  // namespace
 
 ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
-  bool got_distributed_lock =
-      g_recursive_lock.TryGetCrossProcessLock(RlzLockFilename());
+  Acquire(RlzValueStore::kWriteAccess, -1);
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access) {
+  Acquire(access, -1);
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, int timeout_ms) {
+  Acquire(access, std::max(timeout_ms, 0));
+}
+
+// The plist holds the whole store, so the stripes don't change the lock.
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, StoreStripes stripes)
+    : stripes_(stripes) {
+  Acquire(access, -1);
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, StoreStripes stripes, int timeout_ms)
+    : stripes_(stripes) {
+  Acquire(access, std::max(timeout_ms, 0));
+}
+
+void ScopedRlzValueStoreLock::Acquire(RlzValueStore::AccessType access,
+                                      int timeout_ms) {
+  // NSDistributedLock has no shared mode, readers take the lock like writers.
+  busy_ = false;
+  bool got_distributed_lock = g_recursive_lock.TryGetCrossProcessLock(
+      RlzLockFilename(), timeout_ms, &locked_, &busy_);
+  if (!locked_) {
+    stats_timer_.Failed(busy_, 0, NULL);
+    return;
+  }
   // At this point, we hold the in-process lock, no matter the value of
   // |got_distributed_lock|.
 
@@ -366,6 +453,7 @@ ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
     // the lock failed. |g_recursive_lock| will be released by the
     // destructor.
     CHECK(!g_store_object);
+    stats_timer_.Failed(busy_, 0, NULL);
     return;
   }
 
@@ -392,10 +480,16 @@ ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
   if (dict) {
     store_.reset(new RlzValueStoreMac(dict, plist));
     g_store_object = (RlzValueStoreMac*)store_.get();
+    stats_timer_.Acquired();
+  } else {
+    stats_timer_.Failed(false, 0, NULL);
   }
 }
 
 ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
+  if (!locked_)
+    return;
+
   --g_lock_depth;
   CHECK(g_lock_depth >= 0);
 
@@ -407,10 +501,9 @@ ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
 
   if (store_.get()) {
     g_store_object = NULL;
-
-    NSDictionary* dict =
-        static_cast<RlzValueStoreMac*>(store_.get())->dictionary();
-    VERIFY([dict writeToFile:RlzPlistFilename() atomically:YES]);
+    VERIFY(WriteStore(static_cast<RlzValueStoreMac*>(store_.get())));
+    [g_committed_store release];
+    g_committed_store = nil;
   }
 
   // Check that "store_ set" => "file_lock acquired". The converse isn't true,
@@ -427,6 +520,23 @@ RlzValueStore* ScopedRlzValueStoreLock::GetStore() {
   return store_.get();
 }
 
+bool ScopedRlzValueStoreLock::Commit() {
+  if (!store_.get())
+    return false;
+  return g_lock_depth > 1 || WriteStore(g_store_object);
+}
+
+bool ReadStoreGeneration(uint32* generation) {
+  // The plist store isn't cached across lock scopes.
+  return false;
+}
+
+bool ReadAccessPointRlzWithoutLock(AccessPoint point,
+                                   char* rlz,
+                                   size_t rlz_size) {
+  return false;
+}
+
 namespace testing {
 
 void SetRlzStoreDirectory(const FilePath& directory) {
@@ -442,6 +552,10 @@ void SetRlzStoreDirectory(const FilePath& directory) {
   }
 }
 
+int GetStoreFlushCount() {
+  return g_store_flush_count;
+}
+
 }  // namespace testing
 
 }  // namespace rlz_lib
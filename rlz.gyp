@@ -9,9 +9,15 @@
       # Set force_rlz_use_chrome_net to 1 to use chrome's network stack instead
       # of win inet.
       'force_rlz_use_chrome_net%': 0,
+
+      # The format of the rlz data file on linux: 'json', 'mmap', 'journal' or
+      # 'sqlite'.
+      # Changing it makes existing data files unreadable.
+      'rlz_store_implementation%': 'json',
     },
+    'rlz_store_implementation%': '<(rlz_store_implementation)',
     'conditions': [
-      ['force_rlz_use_chrome_net or OS=="mac"', {
+      ['force_rlz_use_chrome_net or OS!="win"', {
         'rlz_use_chrome_net%': 1,
       }, {
         'rlz_use_chrome_net%': 0,
@@ -39,19 +45,41 @@
         'lib/crc32_wrapper.cc',
         'lib/crc8.h',
         'lib/crc8.cc',
+        'lib/event_bitmap.cc',
+        'lib/event_bitmap.h',
         'lib/financial_ping.cc',
         'lib/financial_ping.h',
         'lib/lib_values.cc',
+        'lib/lock_stats.cc',
+        'lib/lock_stats.h',
         'lib/machine_id.cc',
         'lib/machine_id.h',
+        'lib/pending_events.cc',
+        'lib/pending_events.h',
         'lib/rlz_enums.h',
         'lib/rlz_lib.cc',
         'lib/rlz_lib.h',
         'lib/rlz_lib_clear.cc',
+        'lib/rlz_lib_locked.h',
         'lib/lib_values.h',
+        'lib/rlz_value_store.cc',
         'lib/rlz_value_store.h',
+        'lib/rlz_value_store_cache.cc',
+        'lib/rlz_value_store_cache.h',
         'lib/string_utils.cc',
         'lib/string_utils.h',
+        'linux/lib/machine_id_linux.cc',
+        'linux/lib/rlz_broker_linux.cc',
+        'linux/lib/rlz_broker_linux.h',
+        'linux/lib/rlz_store_sync_linux.cc',
+        'linux/lib/rlz_store_sync_linux.h',
+        'linux/lib/rlz_value_store_journal.cc',
+        'linux/lib/rlz_value_store_journal.h',
+        'linux/lib/rlz_value_store_linux.cc',
+        'linux/lib/rlz_value_store_linux.h',
+        'linux/lib/rlz_value_store_lock_linux.cc',
+        'linux/lib/rlz_value_store_mmap.cc',
+        'linux/lib/rlz_value_store_mmap.h',
         'mac/lib/machine_id_mac.cc',
         'mac/lib/rlz_value_store_mac.mm',
         'mac/lib/rlz_value_store_mac.h',
@@ -94,6 +122,43 @@
             ],
           },
         }],
+        ['OS=="linux" and rlz_store_implementation=="journal"', {
+          'defines': [
+            'RLZ_STORE_IMPLEMENTATION_JOURNAL',
+          ],
+          'direct_dependent_settings': {
+            'defines': [
+              'RLZ_STORE_IMPLEMENTATION_JOURNAL',
+            ],
+          },
+        }],
+        ['OS=="linux" and rlz_store_implementation=="sqlite"', {
+          'defines': [
+            'RLZ_STORE_IMPLEMENTATION_SQLITE',
+          ],
+          'direct_dependent_settings': {
+            'defines': [
+              'RLZ_STORE_IMPLEMENTATION_SQLITE',
+            ],
+          },
+          'dependencies': [
+            '../third_party/sqlite/sqlite.gyp:sqlite',
+          ],
+          'sources': [
+            'linux/lib/rlz_value_store_sqlite.cc',
+            'linux/lib/rlz_value_store_sqlite.h',
+          ],
+        }],
+        ['OS=="linux" and rlz_store_implementation=="mmap"', {
+          'defines': [
+            'RLZ_STORE_IMPLEMENTATION_MMAP',
+          ],
+          'direct_dependent_settings': {
+            'defines': [
+              'RLZ_STORE_IMPLEMENTATION_MMAP',
+            ],
+          },
+        }],
       ],
     },
     {
@@ -110,11 +175,19 @@
       'sources': [
         'lib/crc32_unittest.cc',
         'lib/crc8_unittest.cc',
+        'lib/event_bitmap_unittest.cc',
         'lib/financial_ping_test.cc',
         'lib/lib_values_unittest.cc',
         'lib/machine_id_unittest.cc',
         'lib/rlz_lib_test.cc',
+        'lib/rlz_value_store_cache_unittest.cc',
         'lib/string_utils_unittest.cc',
+        'linux/lib/rlz_broker_linux_unittest.cc',
+        'linux/lib/rlz_store_sync_linux_unittest.cc',
+        'linux/lib/rlz_value_store_journal_unittest.cc',
+        'linux/lib/rlz_value_store_linux_unittest.cc',
+        'linux/lib/rlz_value_store_lock_linux_unittest.cc',
+        'linux/lib/rlz_value_store_mmap_unittest.cc',
         'test/rlz_test_helpers.cc',
         'test/rlz_test_helpers.h',
         'test/rlz_unittest_main.cc',
@@ -125,11 +198,35 @@
           'dependencies': [
             '../net/net.gyp:net_test_support',
           ],
-        }]
+        }],
+        ['OS=="linux" and rlz_store_implementation=="sqlite"', {
+          'dependencies': [
+            '../third_party/sqlite/sqlite.gyp:sqlite',
+          ],
+          'sources': [
+            'linux/lib/rlz_value_store_sqlite_unittest.cc',
+          ],
+        }],
       ],
     },
   ],
   'conditions': [
+    ['OS=="linux"', {
+      'targets': [
+        {
+          'target_name': 'rlz_broker',
+          'type': 'executable',
+          'include_dirs': [],
+          'sources': [
+            'linux/broker/rlz_broker_main.cc',
+          ],
+          'dependencies': [
+            ':rlz_lib',
+            '../base/base.gyp:base',
+          ],
+        },
+      ],
+    }],
     ['OS=="win"', {
       'targets': [
         {
@@ -30,6 +30,22 @@ RLZ_DLL_EXPORT bool ClearProductEvent(rlz_lib::Product product,
   return rlz_lib::ClearProductEvent(product, point, event_id);
 }
 
+RLZ_DLL_EXPORT bool RecordProductEvents(
+    rlz_lib::Product product,
+    const std::pair<rlz_lib::AccessPoint, rlz_lib::Event>* events,
+    size_t count,
+    bool* results) {
+  return rlz_lib::RecordProductEvents(product, events, count, results);
+}
+
+RLZ_DLL_EXPORT bool ClearProductEvents(
+    rlz_lib::Product product,
+    const std::pair<rlz_lib::AccessPoint, rlz_lib::Event>* events,
+    size_t count,
+    bool* results) {
+  return rlz_lib::ClearProductEvents(product, events, count, results);
+}
+
 RLZ_DLL_EXPORT bool GetAccessPointRlz(rlz_lib::AccessPoint point,
                                       char* rlz,
                                       size_t rlz_size) {
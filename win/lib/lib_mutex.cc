@@ -51,11 +51,22 @@ static bool SetObjectToLowIntegrity(HANDLE object,
   return result;
 }
 
-LibMutex::LibMutex() : acquired_(false), mutex_(NULL) {
+LibMutex::LibMutex() : acquired_(false), timed_out_(false), mutex_(NULL) {
+  Acquire(5000);
+}
+
+LibMutex::LibMutex(int timeout_ms)
+    : acquired_(false), timed_out_(false), mutex_(NULL) {
+  Acquire(timeout_ms);
+}
+
+void LibMutex::Acquire(int timeout_ms) {
   mutex_ = CreateMutex(NULL, false, kMutexName);
   bool result = SetObjectToLowIntegrity(mutex_);
   if (result) {
-    acquired_ = (WAIT_OBJECT_0 == WaitForSingleObject(mutex_, 5000L));
+    DWORD wait_result = WaitForSingleObject(mutex_, timeout_ms);
+    acquired_ = (WAIT_OBJECT_0 == wait_result);
+    timed_out_ = (WAIT_TIMEOUT == wait_result);
   }
 }
 
@@ -13,13 +13,23 @@ namespace rlz_lib {
 
 class LibMutex {
  public:
+  // Waits for up to 5 seconds for other processes to release the mutex.
   LibMutex();
+  // Waits for up to |timeout_ms| milliseconds, or not at all if it's 0.
+  explicit LibMutex(int timeout_ms);
   ~LibMutex();
 
   bool failed(void) { return !acquired_; }
 
+  // True if the mutex wasn't acquired because others held it until the
+  // timeout.
+  bool timed_out(void) { return timed_out_; }
+
  private:
+  void Acquire(int timeout_ms);
+
   bool acquired_;
+  bool timed_out_;
   HANDLE mutex_;
 };
 
@@ -4,6 +4,8 @@
 
 #include "rlz/win/lib/rlz_value_store_registry.h"
 
+#include <algorithm>
+
 #include "base/win/registry.h"
 #include "base/stringprintf.h"
 #include "base/utf_string_conversions.h"
@@ -258,6 +260,28 @@ bool RlzValueStoreRegistry::ClearAccessPointRlz(AccessPoint access_point) {
   return true;
 }
 
+bool RlzValueStoreRegistry::EnumerateAccessPointRlzs(
+    AccessPointRlzVisitor* visitor) {
+  // Opens the key once, instead of once per access point.
+  base::win::RegKey key;
+  if (!GetAccessPointRlzsRegKey(KEY_READ, &key))
+    return true;  // No RLZs were written yet.
+
+  for (int i = NO_ACCESS_POINT + 1; i < LAST_ACCESS_POINT; ++i) {
+    AccessPoint point = static_cast<AccessPoint>(i);
+    const char* access_point_name = GetAccessPointName(point);
+    if (!access_point_name)
+      continue;
+    char rlz[kMaxRlzLength + 1];
+    size_t size = arraysize(rlz);
+    if (RegKeyReadValue(key, ASCIIToWide(access_point_name).c_str(),
+                        rlz, &size) && rlz[0]) {
+      visitor->Visit(point, rlz);
+    }
+  }
+  return true;
+}
+
 bool RlzValueStoreRegistry::AddProductEvent(Product product,
                                             const char* event_rlz) {
   std::wstring event_rlz_wide(ASCIIToWide(event_rlz));
@@ -369,9 +393,43 @@ void RlzValueStoreRegistry::CollectGarbage() {
   VERIFY(DeleteKeyIfEmpty(HKEY_CURRENT_USER, kGoogleKeyName));
 }
 
-ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
-  if (!lock_.failed())
-    store_.reset(new RlzValueStoreRegistry);
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() : busy_(false) {
+  SetUpStore();
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access) : busy_(false) {
+  // The mutex has no shared mode.
+  SetUpStore();
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, int timeout_ms)
+    : busy_(false), lock_(std::max(timeout_ms, 0)) {
+  SetUpStore();
+}
+
+// The mutex guards the whole registry, stripes aren't locked separately.
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, StoreStripes stripes)
+    : busy_(false), stripes_(stripes) {
+  SetUpStore();
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    RlzValueStore::AccessType access, StoreStripes stripes, int timeout_ms)
+    : busy_(false), stripes_(stripes), lock_(std::max(timeout_ms, 0)) {
+  SetUpStore();
+}
+
+void ScopedRlzValueStoreLock::SetUpStore() {
+  busy_ = lock_.timed_out();
+  if (lock_.failed()) {
+    stats_timer_.Failed(busy_, 0, NULL);
+    return;
+  }
+  store_.reset(new RlzValueStoreRegistry);
+  stats_timer_.Acquired();
 }
 
 ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
@@ -381,4 +439,20 @@ RlzValueStore* ScopedRlzValueStoreLock::GetStore() {
   return store_.get();
 }
 
+bool ScopedRlzValueStoreLock::Commit() {
+  // Registry writes take effect immediately.
+  return store_.get() != NULL;
+}
+
+bool ReadStoreGeneration(uint32* generation) {
+  // The registry store isn't cached across lock scopes.
+  return false;
+}
+
+bool ReadAccessPointRlzWithoutLock(AccessPoint point,
+                                   char* rlz,
+                                   size_t rlz_size) {
+  return false;
+}
+
 }  // namespace rlz_lib
@@ -27,6 +27,8 @@ class RlzValueStoreRegistry : public RlzValueStore {
                                   char* rlz,
                                   size_t rlz_size) OVERRIDE;
   virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+  virtual bool EnumerateAccessPointRlzs(
+      AccessPointRlzVisitor* visitor) OVERRIDE;
 
   virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
   virtual bool ReadProductEvents(Product product,